@@ -9,11 +9,14 @@
 #define _KTF_H
 
 #include <linux/completion.h>
+#include <linux/jump_label.h>
+#include <linux/log2.h>
 #include <linux/kprobes.h>
 #include <linux/kthread.h>
 #include <linux/ptrace.h>
 #include "ktf_test.h"
 #include "ktf_override.h"
+#include "ktf_bench.h"
 #include "ktf_map.h"
 #include "ktf_unlproto.h"
 
@@ -37,6 +40,7 @@ struct ktf_context {
 	ktf_context_cb cleanup;	   /* Optional callback upon context release */
 	int config_errno;	   /* If config_cb set: state of configuration */
 	struct ktf_context_type *type; /* Associated type, must be set */
+	u32 id;			   /* Numeric id used by the protocol (KTF_A_ID) */
 };
 
 typedef struct ktf_context* (*ktf_context_alloc)(struct ktf_context_type *ct);
@@ -90,6 +94,7 @@ int ktf_context_set_config(struct ktf_context *ctx, const void* data, size_t dat
 
 struct ktf_context *ktf_find_create_context(struct ktf_handle *handle, const char *name,
 					    const char *type_name);
+struct ktf_context *ktf_find_context_id(struct ktf_handle *handle, u32 id);
 int ktf_handle_add_ctx_type(struct ktf_handle *handle, struct ktf_context_type *ct);
 struct ktf_context_type *ktf_handle_get_ctx_type(struct ktf_handle *handle,
 						 const char *type_name);
@@ -283,7 +288,7 @@ static inline int ktf_no_probe_support(void)
 
 #define	KTF_UNREGISTER_OVERRIDE(func, probehandler) \
 	do { \
-		unregister_kprobe(&__ktf_override_##probehandler); \
+		ktf_unregister_override(&__ktf_override_##probehandler); \
 		memset(&__ktf_override_##probehandler, 0, \
 		       sizeof(struct kprobe)); \
 		__ktf_override_##probehandler.symbol_name = #func; \
@@ -348,7 +353,12 @@ static inline int ktf_no_probe_support(void)
 #define	KTF_THREAD_WAIT_STARTED(t)	(wait_for_completion(&((t)->started)))
 #define	KTF_THREAD_WAIT_COMPLETED(t)	(wait_for_completion(&((t)->completed)))
 
-u32 ktf_get_assertion_count(void);
+u32 ktf_test_assertion_count(struct ktf_test *self);
+
+/* Number of successful assertions so far in the current test, not yet
+ * reported to user space. Tests may run concurrently, so this is per test:
+ */
+#define ktf_get_assertion_count() ktf_test_assertion_count(self)
 
 /**
  * ASSERT_TRUE() - fail and return if @C evaluates to false
@@ -555,9 +565,22 @@ extern ulong ktf_debug_mask;
 #define T_TRACE	   0x100000
 #define T_DEBUG_V  0x200000
 
+/* Each debug class bit is backed by a static key which is kept in sync
+ * with ktf_debug_mask, so that a disabled log statement is just a NOP.
+ * The class must be a compile time constant with a single bit set.
+ */
+#if (KERNEL_VERSION(4, 3, 0) <= LINUX_VERSION_CODE)
+extern struct static_key_false ktf_debug_keys[BITS_PER_LONG];
+
+#define ktf_debug_enabled(class) \
+	static_branch_unlikely(&ktf_debug_keys[ilog2(class)])
+#else
+#define ktf_debug_enabled(class) unlikely((ktf_debug_mask) & (class))
+#endif
+
 #define tlog(class, format, arg...)	\
 	do { \
-		if (unlikely((ktf_debug_mask) & (class)))	\
+		if (ktf_debug_enabled(class))	\
 			printk(KERN_INFO \
 				   "ktf pid [%d] " "%s: " format "\n", \
 				   current->pid, __func__, \
@@ -579,7 +602,7 @@ extern ulong ktf_debug_mask;
 	} while (0)
 #define tlogs(class, stmt_list) \
 	do { \
-		if (unlikely((ktf_debug_mask) & (class))) { \
+		if (ktf_debug_enabled(class)) { \
 			stmt_list;\
 		} \
 	} while (0)
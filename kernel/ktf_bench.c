@@ -0,0 +1,87 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_bench.c: Micro-benchmark tests for KTF.
+ */
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/sched.h>
+#include <linux/sort.h>
+#include "ktf.h"
+#include "ktf_bench.h"
+#include "ktf_nl.h"
+#include "ktf_perf.h"
+#include "ktf_compat.h"
+
+static u64 ktf_bench_batch(struct ktf_test *self, struct ktf_context *ctx, int _i,
+			   u32 _value, ktf_bench_fun fun, u64 n)
+{
+	u64 start = ktime_get_ns();
+
+	fun(self, ctx, _i, _value, n);
+	return ktime_get_ns() - start;
+}
+
+static int ktf_bench_cmp(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+int ktf_bench_run(struct ktf_test *self, struct ktf_context *ctx, int _i, u32 _value,
+		  ktf_bench_fun fun, struct ktf_bench_stats *stats)
+{
+	u64 *ps = stats->samples_ps;
+	u64 n = 1, ns, warm = 0, total_ns = 0;
+	int b;
+
+	memset(stats, 0, sizeof(*stats));
+
+	/* Warm up, and find the number of operations to time */
+	for (;;) {
+		ns = ktf_bench_batch(self, ctx, _i, _value, fun, n);
+		warm += ns;
+		if (warm >= KTF_BENCH_WARMUP_NS &&
+		    (ns >= KTF_BENCH_BATCH_NS / 2 || n >= KTF_BENCH_MAX_N))
+			break;
+		if (ns < KTF_BENCH_BATCH_NS / 2 && n < KTF_BENCH_MAX_N)
+			n *= 2;
+		if (fatal_signal_pending(current))
+			return -EINTR;
+		cond_resched();
+	}
+	n = clamp_t(u64, div64_u64(n * KTF_BENCH_BATCH_NS, max_t(u64, ns, 1)),
+		    1, KTF_BENCH_MAX_N);
+
+	/* Leave the warmup out of the performance counter totals */
+	if (self->perf)
+		ktf_perf_begin(self->perf);
+
+	for (b = 0; b < KTF_BENCH_BATCHES; b++) {
+		ns = ktf_bench_batch(self, ctx, _i, _value, fun, n);
+		total_ns += ns;
+		ps[b] = div64_u64(ns * 1000, n);
+		if (fatal_signal_pending(current))
+			return -EINTR;
+		cond_resched();
+	}
+	sort(ps, KTF_BENCH_BATCHES, sizeof(u64), ktf_bench_cmp, NULL);
+
+	stats->iterations = n;
+	stats->batches = KTF_BENCH_BATCHES;
+	stats->min_ps = ps[0];
+	stats->median_ps = ps[KTF_BENCH_BATCHES / 2];
+	stats->p99_ps = ps[DIV_ROUND_UP(KTF_BENCH_BATCHES * 99, 100) - 1];
+	stats->mean_ps = max_t(u64, div64_u64(total_ns * 1000, n * KTF_BENCH_BATCHES), 1);
+	stats->ops_per_sec = div64_u64(NSEC_PER_SEC * 1000ULL, stats->mean_ps);
+
+	tlog(T_DEBUG, "%s.%s: %llu x %llu ops, mean %llu ps/op",
+	     self->tclass, self->name, stats->batches, stats->iterations, stats->mean_ps);
+	if (self->stream)
+		ktf_stream_put_bench(self->stream, stats);
+	return 0;
+}
+EXPORT_SYMBOL(ktf_bench_run);
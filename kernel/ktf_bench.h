@@ -0,0 +1,70 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_bench.h: Micro-benchmark tests for KTF.
+ *
+ * A BENCH() test body runs the code to measure _n times. The framework
+ * first warms up, doubling _n until a run takes a measurable time, then
+ * calibrates _n so that a run (a batch) takes about KTF_BENCH_BATCH_NS,
+ * and times KTF_BENCH_BATCHES such batches with the monotonic clock.
+ * The statistics of the time per operation over the batches are reported
+ * to user space along with the test results.
+ */
+#ifndef KTF_BENCH_H
+#define KTF_BENCH_H
+#include "ktf_test.h"
+
+#define KTF_BENCH_WARMUP_NS	(20 * NSEC_PER_MSEC)
+#define KTF_BENCH_BATCH_NS	NSEC_PER_MSEC
+#define KTF_BENCH_BATCHES	32
+#define KTF_BENCH_MAX_N		(1ULL << 32)
+
+/* Times are per operation, in picoseconds */
+struct ktf_bench_stats {
+	u64 iterations;		/* Operations per batch */
+	u64 batches;
+	u64 min_ps;
+	u64 median_ps;
+	u64 mean_ps;
+	u64 p99_ps;
+	u64 ops_per_sec;
+	u64 samples_ps[KTF_BENCH_BATCHES]; /* Per batch, ascending */
+};
+
+typedef void (*ktf_bench_fun)(struct ktf_test *, struct ktf_context *, int, u32, u64);
+
+/* Run a benchmark body as described above and report the statistics as
+ * a result of the test self. Returns 0, or -EINTR if interrupted.
+ */
+int ktf_bench_run(struct ktf_test *self, struct ktf_context *ctx, int _i, u32 _value,
+		  ktf_bench_fun fun, struct ktf_bench_stats *stats);
+
+/* Start a benchmark with BENCH(suite_name,unit_name) and add it with
+ * ADD_TEST like any other test. The body must run the operation _n times:
+ *
+ *	BENCH(suite, name)
+ *	{
+ *		u64 n;
+ *
+ *		for (n = 0; n < _n; n++)
+ *			<operation>
+ *	}
+ */
+#define BENCH(__testsuite, __testname) \
+	static void __testname##_body(struct ktf_test *, struct ktf_context *, \
+				      int, u32, u64); \
+	static void __testname(struct ktf_test *self, struct ktf_context *ctx, \
+			       int _i, u32 _value) \
+	{ \
+		struct ktf_bench_stats stats; \
+		ktf_bench_run(self, ctx, _i, _value, __testname##_body, &stats); \
+	} \
+	struct __test_desc __testname##_setup = \
+	{ .tclass = "" # __testsuite "", .name = "" # __testname "", \
+	  .fun = __testname, .file = __FILE__ }; \
+	\
+	static void __testname##_body(struct ktf_test *self, struct ktf_context *ctx, \
+				      int _i, u32 _value, u64 _n)
+
+#endif
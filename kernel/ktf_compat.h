@@ -27,8 +27,13 @@
 #define refcount_read atomic_read
 #endif
 
+#if (KERNEL_VERSION(4, 2, 0) > LINUX_VERSION_CODE)
+#define rb_link_node_rcu rb_link_node
+#endif
+
 #if (KERNEL_VERSION(4, 6, 0) > LINUX_VERSION_CODE)
 #define nla_put_u64_64bit(m, c, v, x) nla_put_u64(m, c, v)
+#define nla_total_size_64bit(s) nla_total_size(s)
 #endif
 
 #if (KERNEL_VERSION(4, 10, 0) > LINUX_VERSION_CODE)
@@ -38,6 +43,19 @@ static inline void *nla_memdup(const struct nlattr *src, gfp_t gfp)
 }
 #endif
 
+#if (KERNEL_VERSION(3, 17, 0) > LINUX_VERSION_CODE)
+#define ktime_get_ns() ktime_to_ns(ktime_get())
+#endif
+
+#if (KERNEL_VERSION(4, 2, 0) > LINUX_VERSION_CODE)
+#define sock_create_kern(net, family, type, proto, res) \
+	sock_create_kern(family, type, proto, res)
+#endif
+
+#if (KERNEL_VERSION(4, 12, 0) > LINUX_VERSION_CODE)
+#define kvzalloc(size, flags) vzalloc(size)
+#endif
+
 #if (KERNEL_VERSION(5, 2, 0) > LINUX_VERSION_CODE)
 static inline unsigned int stack_trace_save(unsigned long *store, unsigned int size,
 					    unsigned int skipnr)
@@ -11,6 +11,7 @@
 
 #include <linux/module.h>
 #include <linux/kallsyms.h>
+#include <linux/idr.h>
 #include <rdma/ib_verbs.h>
 #include "ktf.h"
 #include "ktf_test.h"
@@ -22,26 +23,72 @@ MODULE_LICENSE("GPL");
 ulong ktf_debug_mask = T_INFO;
 EXPORT_SYMBOL(ktf_debug_mask);
 
-static unsigned int ktf_context_maxid;
+#if (KERNEL_VERSION(4, 3, 0) <= LINUX_VERSION_CODE)
+struct static_key_false ktf_debug_keys[BITS_PER_LONG] = {
+	[0 ... BITS_PER_LONG - 1] = STATIC_KEY_FALSE_INIT
+};
+EXPORT_SYMBOL(ktf_debug_keys);
+
+/* Set when ktf_init() has synced the keys with the initial mask */
+static bool ktf_debug_keys_ready;
+
+static void ktf_debug_keys_update(void)
+{
+	int i;
+
+	for (i = 0; i < BITS_PER_LONG; i++) {
+		if (ktf_debug_mask & (1UL << i))
+			static_branch_enable(&ktf_debug_keys[i]);
+		else
+			static_branch_disable(&ktf_debug_keys[i]);
+	}
+	ktf_debug_keys_ready = true;
+}
 
-/* The role of context_lock is to synchronize modifications to
- * the global list of context handles (handles that have contexts
- * associated with them) and the context map.
- * The map object has it's own locking, but must be kept in sync
- * with changes to the global context list:
+static int ktf_debug_mask_set(const char *val, const struct kernel_param *kp)
+{
+	int ret = param_set_ulong(val, kp);
+
+	/* Values given at load time are applied by ktf_init() */
+	if (!ret && ktf_debug_keys_ready)
+		ktf_debug_keys_update();
+	return ret;
+}
+
+static const struct kernel_param_ops ktf_debug_mask_ops = {
+	.set = ktf_debug_mask_set,
+	.get = param_get_ulong,
+};
+
+module_param_cb(debug_mask, &ktf_debug_mask_ops, &ktf_debug_mask, 0644);
+#else
+static inline void ktf_debug_keys_update(void) {}
+
+module_param_named(debug_mask, ktf_debug_mask, ulong, 0644);
+#endif
+
+/* Changes to the contexts and context types of a handle are serialized
+ * by the handle's ctx_lock, so that the handle is entered in handle_idr
+ * with its first context and removed with its last.  context_lock only
+ * protects updates of the two global indexes below, and is never held
+ * for more than an idr operation, so handles do not contend with each
+ * other while their contexts are configured.
  */
 static DEFINE_SPINLOCK(context_lock);
 
-/* global linked list of all ktf_handle objects that have contexts */
-LIST_HEAD(context_handles);
+/* Index of all ktf_handle objects that have contexts, by handle id.
+ * Handles are module static data that is removed from the index before
+ * the module goes away, so lookups only need rcu_read_lock():
+ */
+static DEFINE_IDR(handle_idr);
 
-module_param_named(debug_mask, ktf_debug_mask, ulong, 0644);
+/* Index of contexts by numeric id */
+static DEFINE_IDR(context_idr);
 
 static int __ktf_handle_add_ctx_type(struct ktf_handle *handle,
 				     struct ktf_context_type *ct,
 				     bool generic)
 {
-	unsigned long flags;
 	int ret;
 
 	if (generic && !(ct->alloc && ct->config_cb)) {
@@ -50,11 +97,13 @@ static int __ktf_handle_add_ctx_type(struct ktf_handle *handle,
 	}
 
 	ct->handle = handle;
-	ktf_map_elem_init(&ct->elem, ct->name);
+	ktf_map_elem_init_key(&ct->elem, ct->name, 0);
 
-	spin_lock_irqsave(&context_lock, flags);
+	mutex_lock(&handle->ctx_lock);
 	ret = ktf_map_insert(&handle->ctx_type_map, &ct->elem);
-	spin_unlock_irqrestore(&context_lock, flags);
+	mutex_unlock(&handle->ctx_lock);
+	if (!ret)
+		ktf_registry_changed();
 	return ret;
 }
 
@@ -62,30 +111,56 @@ static int __ktf_context_add(struct ktf_handle *handle, struct ktf_context *ctx,
 			     const char *name, ktf_config_cb cfg_cb,
 			     struct ktf_context_type *ct)
 {
-	unsigned long flags;
 	int ret;
 
-	ktf_map_elem_init(&ctx->elem, name);
 	strncpy(ctx->name, name, KTF_MAX_NAME);
+	ctx->name[KTF_MAX_NAME] = '\0';
+	ktf_map_elem_init_key(&ctx->elem, ctx->name, 0);
 	ctx->config_cb = cfg_cb;
 	ctx->config_errno = ENOENT; /* 0 here means configuration is ok */
 	ctx->type = ct;
 	ctx->cleanup = ct->cleanup;
 
-	spin_lock_irqsave(&context_lock, flags);
+	mutex_lock(&handle->ctx_lock);
+	if (!ktf_has_contexts(handle)) {
+		/* Ids are not reused right away, so that a client with a stale
+		 * handle id is not directed to another module's handle:
+		 */
+		idr_preload(GFP_KERNEL);
+		spin_lock(&context_lock);
+		ret = idr_alloc_cyclic(&handle_idr, handle, 1, 0, GFP_NOWAIT);
+		spin_unlock(&context_lock);
+		idr_preload_end();
+		if (ret < 0)
+			goto out;
+		handle->id = ret;
+	}
+	ctx->handle = handle;
 	ret = ktf_map_insert(&handle->ctx_map, &ctx->elem);
 	if (!ret) {
-		ctx->handle = handle;
-		if (ktf_map_size(&handle->ctx_map) == 1) {
-			handle->id = ++ktf_context_maxid;
-			INIT_LIST_HEAD(&handle->handle_list);
-			list_add(&handle->handle_list, &context_handles);
-		}
+		int id;
+
+		idr_preload(GFP_KERNEL);
+		spin_lock(&context_lock);
+		id = idr_alloc(&context_idr, ctx, 1, KTF_ID_CTX_MAX + 1, GFP_NOWAIT);
+		spin_unlock(&context_lock);
+		idr_preload_end();
+
+		/* Without an id the context can still be used by name */
+		ctx->id = id > 0 ? id : 0;
+	} else if (!ktf_has_contexts(handle)) {
+		spin_lock(&context_lock);
+		idr_remove(&handle_idr, handle->id);
+		spin_unlock(&context_lock);
+		handle->id = 0;
 	}
-	spin_unlock_irqrestore(&context_lock, flags);
-	if (!ret)
+out:
+	mutex_unlock(&handle->ctx_lock);
+	if (!ret) {
+		ktf_registry_changed();
 		tlog(T_DEBUG, "added %scontext %s with type %s",
 		     (cfg_cb ? "configurable " : ""), name, ct->name);
+	}
 	return ret;
 }
 
@@ -157,7 +232,6 @@ EXPORT_SYMBOL(ktf_context_name);
 void ktf_context_remove(struct ktf_context *ctx)
 {
 	struct ktf_handle *handle;
-	unsigned long flags = 0;
 
 	if (!ctx) {
 		terr("A test case tried to remove an invalid context!");
@@ -165,11 +239,20 @@ void ktf_context_remove(struct ktf_context *ctx)
 	}
 	handle = ctx->handle;
 
-	spin_lock_irqsave(&context_lock, flags);
+	mutex_lock(&handle->ctx_lock);
+	spin_lock(&context_lock);
+	if (ctx->id)
+		idr_remove(&context_idr, ctx->id);
+	spin_unlock(&context_lock);
 	ktf_map_remove(&handle->ctx_map, ctx->elem.key);
-	if (!ktf_has_contexts(handle))
-		list_del(&handle->handle_list);
-	spin_unlock_irqrestore(&context_lock, flags);
+	if (!ktf_has_contexts(handle)) {
+		spin_lock(&context_lock);
+		idr_remove(&handle_idr, handle->id);
+		spin_unlock(&context_lock);
+		handle->id = 0;
+	}
+	mutex_unlock(&handle->ctx_lock);
+	ktf_registry_changed();
 
 	tlog(T_DEBUG, "removed context %s at %p", ctx->elem.key, ctx);
 
@@ -201,6 +284,19 @@ struct ktf_context *ktf_find_context(struct ktf_handle *handle, const char *name
 }
 EXPORT_SYMBOL(ktf_find_context);
 
+/* Find a context of handle from its numeric id */
+struct ktf_context *ktf_find_context_id(struct ktf_handle *handle, u32 id)
+{
+	struct ktf_context *ctx;
+
+	spin_lock(&context_lock);
+	ctx = idr_find(&context_idr, id);
+	if (ctx && ctx->handle != handle)
+		ctx = NULL;
+	spin_unlock(&context_lock);
+	return ctx;
+}
+
 struct ktf_context *ktf_find_create_context(struct ktf_handle *handle, const char *name,
 					    const char *type_name)
 {
@@ -248,12 +344,26 @@ EXPORT_SYMBOL(ktf_context_remove_all);
 /* Find the handle associated with handle id hid */
 struct ktf_handle *ktf_handle_find(int hid)
 {
-	struct ktf_handle *handle = NULL;
+	struct ktf_handle *handle;
 
-	list_for_each_entry(handle, &context_handles, handle_list) {
-		if (handle->id == hid)
-			break;
-	}
+	if (hid <= 0)
+		return NULL;
+	rcu_read_lock();
+	handle = idr_find(&handle_idr, hid);
+	rcu_read_unlock();
+	return handle;
+}
+
+/* Find the handle with contexts with the lowest id >= *hid, and set *hid to it */
+struct ktf_handle *ktf_handle_next(int *hid)
+{
+	struct ktf_handle *handle;
+
+	if (*hid < 0)
+		return NULL;
+	rcu_read_lock();
+	handle = idr_get_next(&handle_idr, hid);
+	rcu_read_unlock();
 	return handle;
 }
 
@@ -285,19 +395,18 @@ struct ktf_context_type *ktf_handle_get_ctx_type(struct ktf_handle *handle,
 void ktf_handle_cleanup_check(struct ktf_handle *handle)
 {
 	struct ktf_context *curr;
-	unsigned long flags;
 
 	if (!ktf_has_contexts(handle))
 		return;
 
-	spin_lock_irqsave(&context_lock, flags);
+	mutex_lock(&handle->ctx_lock);
 
 	for (curr = ktf_find_first_context(handle);
 	     curr;
 	     curr = ktf_find_next_context(curr)) {
 		twarn("context %s found during handle %p cleanup", curr->elem.key, handle);
 	}
-	spin_unlock_irqrestore(&context_lock, flags);
+	mutex_unlock(&handle->ctx_lock);
 }
 EXPORT_SYMBOL(ktf_handle_cleanup_check);
 
@@ -317,6 +426,8 @@ static int __init ktf_init(void)
 	int ret;
 	char *ks = "module_kallsyms_lookup_name";
 
+	ktf_debug_keys_update();
+
 	/* We rely on being able to resolve this symbol for looking up module
 	 * specific internal symbols (multiple modules may define the same symbol):
 	 */
@@ -334,11 +445,15 @@ static int __init ktf_init(void)
 		return -EINVAL;
 	}
 
+	ret = ktf_test_init();
+	if (ret)
+		goto failure;
+
 	ktf_debugfs_init();
 	ret = ktf_nl_register();
 	if (ret) {
 		terr("Unable to register protocol with netlink");
-		ktf_debugfs_cleanup();
+		ktf_cleanup();
 		goto failure;
 	}
 
@@ -351,6 +466,9 @@ static void __exit ktf_exit(void)
 {
 	ktf_nl_unregister();
 	ktf_cleanup();
+	ktf_map_cleanup();
+	idr_destroy(&context_idr);
+	idr_destroy(&handle_idr);
 }
 
 /* Generic setup function for client modules */
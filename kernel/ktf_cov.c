@@ -5,12 +5,19 @@
  *
  * ktf_cov.c: Code coverage support implementation for KTF.
  */
+#include <linux/ctype.h>
 #include <linux/kallsyms.h>
+#include <linux/ktime.h>
 #include <linux/debugfs.h>
+#include <linux/jhash.h>
+#include <linux/math64.h>
 #include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
 #include <linux/stacktrace.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #ifdef CONFIG_SLUB
 #include <linux/slub_def.h>
 #endif /* CONFIG_SLUB */
@@ -38,8 +45,13 @@ static void ktf_cov_entry_free(struct ktf_map_elem *elem)
 {
 	struct ktf_cov_entry *entry = container_of(elem, struct ktf_cov_entry,
 						   kmap);
-	if (entry->refcnt > 0)
-		unregister_kprobe(&entry->kprobe);
+
+	/* Called from RCU callback context - probes are unregistered by
+	 * ktf_cov_cleanup() before the entries are removed.
+	 */
+	free_percpu(entry->hits);
+	free_percpu(entry->alloc);
+	kfree(entry->cold);
 	kfree(entry);
 }
 
@@ -83,9 +95,10 @@ void ktf_cov_entry_put(struct ktf_cov_entry *entry)
 
 /* Global map for address-> symbol/module mapping.  Sort via symbol address
  * and size combination, see ktf_cov_obj_compare() above for comparison
- * logic.
+ * logic.  Looked up from probe context, so readers must not take the lock.
  */
-static DEFINE_KTF_MAP(cov_entry_map, ktf_cov_obj_compare, ktf_cov_entry_free);
+static DEFINE_KTF_MAP_FLAGS(cov_entry_map, ktf_cov_obj_compare, ktf_cov_entry_free,
+			    KTF_MAP_RCU);
 
 struct ktf_cov_entry *ktf_cov_entry_find(unsigned long addr, unsigned long size)
 {
@@ -98,10 +111,112 @@ struct ktf_cov_entry *ktf_cov_entry_find(unsigned long addr, unsigned long size)
 				  struct ktf_cov_entry, kmap);
 }
 
+/* Immutable sorted array of the function address ranges of all covered
+ * modules, for attributing stack frames to entries on every allocation
+ * without taking references or locks.  Rebuilt whenever entries are
+ * added or move, and replaced via RCU.
+ */
+struct ktf_cov_range {
+	unsigned long start;
+	unsigned long end;
+	struct ktf_cov_entry *entry;
+};
+
+struct ktf_cov_index {
+	struct rcu_head rcu;
+	int nr_ranges;
+	struct ktf_cov_range ranges[];
+};
+
+static struct ktf_cov_index __rcu *cov_index;
+
+static void ktf_cov_index_free(struct rcu_head *rcu)
+{
+	kvfree(container_of(rcu, struct ktf_cov_index, rcu));
+}
+
+static void ktf_cov_index_replace(struct ktf_cov_index *idx)
+{
+	struct ktf_cov_index *old = rcu_dereference_protected(cov_index, 1);
+
+	rcu_assign_pointer(cov_index, idx);
+	if (old)
+		call_rcu(&old->rcu, ktf_cov_index_free);
+}
+
+static void ktf_cov_index_rebuild(void)
+{
+	size_t n = ktf_map_size(&cov_entry_map);
+	struct ktf_cov_entry *entry;
+	struct ktf_cov_index *idx;
+
+	idx = kvzalloc(sizeof(*idx) + n * sizeof(idx->ranges[0]), GFP_KERNEL);
+	if (!idx) {
+		/* Lookups fall back to the entry map */
+		ktf_cov_index_replace(NULL);
+		return;
+	}
+	/* The entry map is sorted by address already */
+	ktf_map_for_each_entry(entry, &cov_entry_map, kmap) {
+		struct ktf_cov_range *r = &idx->ranges[idx->nr_ranges];
+
+		if (idx->nr_ranges == n) {
+			ktf_cov_entry_put(entry);
+			break;
+		}
+		r->start = entry->key.address;
+		r->end = entry->key.address + entry->key.size;
+		r->entry = entry;
+		idx->nr_ranges++;
+	}
+	ktf_cov_index_replace(idx);
+}
+
+/* Find the entry for the function containing addr, if covered. Callable from
+ * probe context; no reference is taken as entries are only freed after an
+ * RCU grace period once coverage is cleaned up.
+ */
+static struct ktf_cov_entry *ktf_cov_index_find(unsigned long addr)
+{
+	struct ktf_cov_entry *entry = NULL;
+	struct ktf_cov_index *idx;
+	int lo, hi;
+
+	rcu_read_lock();
+	idx = rcu_dereference(cov_index);
+	if (!idx) {
+		rcu_read_unlock();
+		entry = ktf_cov_entry_find(addr, 0);
+		if (entry)
+			ktf_cov_entry_put(entry);
+		return entry;
+	}
+	lo = 0;
+	hi = idx->nr_ranges - 1;
+	while (lo <= hi) {
+		int mid = lo + (hi - lo) / 2;
+		struct ktf_cov_range *r = &idx->ranges[mid];
+
+		if (addr < r->start) {
+			hi = mid - 1;
+		} else if (addr >= r->end) {
+			lo = mid + 1;
+		} else {
+			entry = r->entry;
+			break;
+		}
+	}
+	rcu_read_unlock();
+	return entry;
+}
+
 static void ktf_cov_free(struct ktf_map_elem *elem)
 {
 	struct ktf_cov *cov = container_of(elem, struct ktf_cov, kmap);
 
+#ifdef KTF_COV_FTRACE
+	kfree(cov->fentries);
+#endif
 	kfree(cov);
 }
 
@@ -111,7 +226,7 @@ void ktf_cov_put(struct ktf_cov *cov)
 }
 
 /* Coverage object map. Just modules supported for now, sort by name. */
-static DEFINE_KTF_MAP(cov_map, NULL, ktf_cov_free);
+static DEFINE_KTF_HASHED_MAP(cov_map, ktf_cov_free);
 
 struct ktf_cov *ktf_cov_find(const char *module)
 {
@@ -121,16 +236,142 @@ struct ktf_cov *ktf_cov_find(const char *module)
 /* cache for memory objects used to track allocations */
 static struct kmem_cache *cov_mem_cache;
 
+/* Objects for tracking allocations are needed in kmalloc probe context,
+ * so they are taken from per-CPU pools which are refilled from the cache
+ * by a work item.  Freed objects go back to the pool of the CPU.
+ */
+#define KTF_COV_MEM_POOL_SIZE	256
+#define KTF_COV_MEM_POOL_LOW	64
+
+struct ktf_cov_mem_pool {
+	struct ktf_cov_mem *free[KTF_COV_MEM_POOL_SIZE];
+	unsigned int nr_free;
+	bool refilling;
+	struct work_struct refill;
+	unsigned long dropped;	/* Allocations not tracked, pool was empty */
+};
+
+static struct ktf_cov_mem_pool __percpu *cov_mem_pools;
+
+/* Allocations not tracked as kretprobes missed them (maxactive exceeded) */
+static unsigned long cov_mem_missed;
+
+static void ktf_cov_mem_pool_fill(struct ktf_cov_mem_pool *pool, bool any_cpu)
+{
+	struct ktf_cov_mem *m;
+	unsigned long flags;
+
+	for (;;) {
+		m = kmem_cache_alloc(cov_mem_cache, GFP_KERNEL);
+		if (!m)
+			return;
+		local_irq_save(flags);
+		/* The work may end up on another CPU if this one went away */
+		if (pool->nr_free < KTF_COV_MEM_POOL_SIZE &&
+		    (any_cpu || pool == this_cpu_ptr(cov_mem_pools))) {
+			pool->free[pool->nr_free++] = m;
+			m = NULL;
+		}
+		local_irq_restore(flags);
+		if (m) {
+			kmem_cache_free(cov_mem_cache, m);
+			return;
+		}
+	}
+}
+
+static void ktf_cov_mem_pool_refill(struct work_struct *work)
+{
+	struct ktf_cov_mem_pool *pool =
+		container_of(work, struct ktf_cov_mem_pool, refill);
+
+	ktf_cov_mem_pool_fill(pool, false);
+	WRITE_ONCE(pool->refilling, false);
+}
+
+static int ktf_cov_mem_pools_init(void)
+{
+	int cpu;
+
+	cov_mem_pools = alloc_percpu(struct ktf_cov_mem_pool);
+	if (!cov_mem_pools)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		struct ktf_cov_mem_pool *pool = per_cpu_ptr(cov_mem_pools, cpu);
+
+		INIT_WORK(&pool->refill, ktf_cov_mem_pool_refill);
+		/* Probes are not registered yet, so no need to be careful */
+		ktf_cov_mem_pool_fill(pool, true);
+	}
+	return 0;
+}
+
+/* Only called once nothing can allocate or free objects any more */
+static void ktf_cov_mem_pools_destroy(void)
+{
+	int cpu;
+
+	if (!cov_mem_pools)
+		return;
+	for_each_possible_cpu(cpu) {
+		struct ktf_cov_mem_pool *pool = per_cpu_ptr(cov_mem_pools, cpu);
+
+		cancel_work_sync(&pool->refill);
+		while (pool->nr_free)
+			kmem_cache_free(cov_mem_cache, pool->free[--pool->nr_free]);
+	}
+	free_percpu(cov_mem_pools);
+	cov_mem_pools = NULL;
+}
+
+static struct ktf_cov_mem *ktf_cov_mem_alloc(void)
+{
+	struct ktf_cov_mem_pool *pool;
+	struct ktf_cov_mem *m = NULL;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	pool = this_cpu_ptr(cov_mem_pools);
+	if (pool->nr_free)
+		m = pool->free[--pool->nr_free];
+	else
+		pool->dropped++;
+	if (pool->nr_free < KTF_COV_MEM_POOL_LOW && !pool->refilling) {
+		pool->refilling = true;
+		queue_work_on(smp_processor_id(), system_highpri_wq,
+			      &pool->refill);
+	}
+	local_irq_restore(flags);
+	return m;
+}
+
+static void ktf_cov_mem_release(struct ktf_cov_mem *m)
+{
+	struct ktf_cov_mem_pool *pool;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	pool = this_cpu_ptr(cov_mem_pools);
+	if (pool->nr_free < KTF_COV_MEM_POOL_SIZE) {
+		pool->free[pool->nr_free++] = m;
+		m = NULL;
+	}
+	local_irq_restore(flags);
+	if (m)
+		kmem_cache_free(cov_mem_cache, m);
+}
+
 static void ktf_cov_mem_free(struct ktf_map_elem *elem)
 {
 	struct ktf_cov_mem *m = container_of(elem, struct ktf_cov_mem,
 					     kmap);
 
-	kmem_cache_free(cov_mem_cache, m);
+	ktf_cov_mem_release(m);
 }
 
-/* Global map for tracking memory allocations */
-DEFINE_KTF_MAP(cov_mem_map, ktf_cov_obj_compare, ktf_cov_mem_free);
+/* Global map for tracking memory allocations, looked up on every kfree() */
+DEFINE_KTF_MAP_FLAGS(cov_mem_map, ktf_cov_obj_compare, ktf_cov_mem_free,
+		     KTF_MAP_RCU);
 EXPORT_SYMBOL(cov_mem_map);
 
 struct ktf_cov_mem *ktf_cov_mem_find(unsigned long addr, unsigned long size)
@@ -159,44 +400,590 @@ static void ktf_cov_mem_remove(struct ktf_cov_mem *m)
 	ktf_map_remove_elem(&cov_mem_map, &m->kmap);
 }
 
+/* Table of allocation stacks, saved from the allocation probes.  Stacks
+ * are carved out of pools of pages and taken from there by a 32 bit handle
+ * of pool number and offset, so that tracking an allocation costs 4 bytes
+ * for its stack.  Stacks are never freed until coverage is cleaned up, so
+ * lookups need no locking.
+ */
+struct ktf_cov_stack_rec {
+	struct ktf_cov_stack_rec *next;	/* Next in hash chain */
+	u32 hash;
+	u32 handle;
+	unsigned int nr_entries;
+	unsigned long entries[];
+};
+
+#define KTF_COV_STACK_HASH_BITS		12
+#define KTF_COV_STACK_POOL_ORDER	2
+#define KTF_COV_STACK_POOL_SIZE		(PAGE_SIZE << KTF_COV_STACK_POOL_ORDER)
+#define KTF_COV_STACK_MAX_POOLS		1024
+#define KTF_COV_STACK_ALIGN		8
+
+static struct ktf_cov_stack_rec *cov_stack_table[1 << KTF_COV_STACK_HASH_BITS];
+static void *cov_stack_pools[KTF_COV_STACK_MAX_POOLS];
+static int cov_stack_pool;		/* Pool to allocate from */
+static size_t cov_stack_offset;		/* Free space in that pool */
+static DEFINE_RAW_SPINLOCK(cov_stack_lock);
+
+static struct ktf_cov_stack_rec *ktf_cov_stack_lookup(u32 hash,
+						      unsigned long *entries,
+						      unsigned int nr)
+{
+	struct ktf_cov_stack_rec *rec;
+
+	rec = smp_load_acquire(&cov_stack_table[hash & ((1 << KTF_COV_STACK_HASH_BITS) - 1)]);
+	for (; rec; rec = rec->next)
+		if (rec->hash == hash && rec->nr_entries == nr &&
+		    memcmp(rec->entries, entries, nr * sizeof(*entries)) == 0)
+			return rec;
+	return NULL;
+}
+
+/* Returns a handle for the stack, or 0 if we're out of memory */
+static u32 ktf_cov_stack_save(unsigned long *entries, unsigned int nr)
+{
+	size_t size = ALIGN(sizeof(struct ktf_cov_stack_rec) +
+			    nr * sizeof(*entries), KTF_COV_STACK_ALIGN);
+	u32 hash = jhash(entries, nr * sizeof(*entries), 0);
+	struct ktf_cov_stack_rec *rec, **bucket;
+	unsigned long flags;
+
+	rec = ktf_cov_stack_lookup(hash, entries, nr);
+	if (rec)
+		return rec->handle;
+
+	raw_spin_lock_irqsave(&cov_stack_lock, flags);
+	/* Someone else may have added it in the meantime */
+	rec = ktf_cov_stack_lookup(hash, entries, nr);
+	if (rec)
+		goto out;
+	if (!cov_stack_pools[cov_stack_pool] ||
+	    cov_stack_offset + size > KTF_COV_STACK_POOL_SIZE) {
+		int pool = cov_stack_pools[cov_stack_pool] ? cov_stack_pool + 1 : 0;
+
+		if (pool == KTF_COV_STACK_MAX_POOLS)
+			goto out;
+		cov_stack_pools[pool] = (void *)
+			__get_free_pages(GFP_NOWAIT | __GFP_NOWARN,
+					 KTF_COV_STACK_POOL_ORDER);
+		if (!cov_stack_pools[pool])
+			goto out;
+		cov_stack_pool = pool;
+		cov_stack_offset = 0;
+	}
+	rec = cov_stack_pools[cov_stack_pool] + cov_stack_offset;
+	rec->hash = hash;
+	rec->handle = ((cov_stack_pool + 1) << 16) |
+		(cov_stack_offset / KTF_COV_STACK_ALIGN);
+	rec->nr_entries = nr;
+	memcpy(rec->entries, entries, nr * sizeof(*entries));
+	cov_stack_offset += size;
+
+	bucket = &cov_stack_table[hash & ((1 << KTF_COV_STACK_HASH_BITS) - 1)];
+	rec->next = *bucket;
+	/* Publish a complete record to lockless lookups */
+	smp_store_release(bucket, rec);
+out:
+	raw_spin_unlock_irqrestore(&cov_stack_lock, flags);
+	return rec ? rec->handle : 0;
+}
+
+unsigned int ktf_cov_stack(u32 handle, unsigned long **entries)
+{
+	unsigned int pool = (handle >> 16) - 1;
+	struct ktf_cov_stack_rec *rec;
+
+	if (!handle || pool >= KTF_COV_STACK_MAX_POOLS || !cov_stack_pools[pool])
+		return 0;
+	rec = cov_stack_pools[pool] + (handle & 0xffff) * KTF_COV_STACK_ALIGN;
+	*entries = rec->entries;
+	return rec->nr_entries;
+}
+EXPORT_SYMBOL(ktf_cov_stack);
+
+/* Only called once nothing can look up stacks any more */
+static void ktf_cov_stack_cleanup(void)
+{
+	int i;
+
+	for (i = 0; i < KTF_COV_STACK_MAX_POOLS && cov_stack_pools[i]; i++) {
+		free_pages((unsigned long)cov_stack_pools[i],
+			   KTF_COV_STACK_POOL_ORDER);
+		cov_stack_pools[i] = NULL;
+	}
+	memset(cov_stack_table, 0, sizeof(cov_stack_table));
+	cov_stack_pool = 0;
+	cov_stack_offset = 0;
+}
+
+/* Count a call to an entry - calls are counted per CPU to avoid
+ * bouncing the counter between CPUs calling the same function:
+ */
+static __always_inline void ktf_cov_hit(struct ktf_cov_entry *entry)
+{
+	this_cpu_inc(*entry->hits);
+	if (unlikely(!READ_ONCE(entry->called)) && !xchg(&entry->called, 1) &&
+	    entry->cov)
+		atomic_inc(&entry->cov->count);
+}
+
+static unsigned int ktf_cov_entry_hits(struct ktf_cov_entry *entry)
+{
+	unsigned int count = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		count += *per_cpu_ptr(entry->hits, cpu);
+	return count;
+}
+
+/* Counters are never written from outside the probes; a reset just moves
+ * the base, so it does not race with calls on other CPUs.
+ */
+unsigned int ktf_cov_entry_count(struct ktf_cov_entry *entry)
+{
+	return ktf_cov_entry_hits(entry) - READ_ONCE(entry->base);
+}
+EXPORT_SYMBOL(ktf_cov_entry_count);
+
 /* Do not use ktf_cov_entry_find() here as we can get entry directly
- * from probe address (as probe is first field in struct ktf_cov_entry).
+ * from probe address (as probe is first field in struct ktf_cov_entry_cold).
  * No reference counting issues should apply as when entry refcnt drops
  * to 0 we unregister the kprobe prior to freeing the entry.
  */
 static int ktf_cov_handler(struct kprobe *p, struct pt_regs *regs)
 {
-	struct ktf_cov_entry *entry = (struct ktf_cov_entry *)p;
+	struct ktf_cov_entry_cold *cold = (struct ktf_cov_entry_cold *)p;
 
 	/* Make sure probe is ours... */
-	if (!entry || entry->magic != KTF_COV_ENTRY_MAGIC)
+	if (!cold || cold->magic != KTF_COV_ENTRY_MAGIC)
 		return 0;
-	entry->count++;
-	if (entry->count == 1 && entry->cov)
-		entry->cov->count++;
+	ktf_cov_hit(cold->entry);
+	return 0;
+}
+
+static void ktf_cov_kprobe_init(struct ktf_cov_entry *entry)
+{
+	/* reset kprobe in case we're re-registering */
+	memset(&entry->cold->kprobe, 0, sizeof(entry->cold->kprobe));
+	entry->cold->kprobe.pre_handler = ktf_cov_handler;
+	entry->cold->kprobe.symbol_name = entry->cold->name;
+	entry->ftrace = false;
+}
+
+static int ktf_cov_kprobe_register(struct ktf_cov_entry *entry)
+{
+	ktf_cov_kprobe_init(entry);
+	return register_kprobe(&entry->cold->kprobe);
+}
+
+/* Register the kprobes of a list of entries in one go. If any of them
+ * fails, register_kprobes() unregisters all of them again, so then fall
+ * back to one at a time to find the ones to move to the failed list.
+ */
+static void ktf_cov_kprobes_register(struct list_head *entries,
+				     struct list_head *failed)
+{
+	struct ktf_cov_entry *entry, *tmp;
+	struct kprobe **kps;
+	int n = 0;
+
+	list_for_each_entry(entry, entries, batch)
+		n++;
+	if (!n)
+		return;
+	kps = kcalloc(n, sizeof(*kps), GFP_KERNEL);
+	if (kps) {
+		n = 0;
+		list_for_each_entry(entry, entries, batch) {
+			ktf_cov_kprobe_init(entry);
+			kps[n++] = &entry->cold->kprobe;
+		}
+		if (!register_kprobes(kps, n))
+			goto out;
+	}
+	list_for_each_entry_safe(entry, tmp, entries, batch)
+		if (ktf_cov_kprobe_register(entry) < 0)
+			list_move_tail(&entry->batch, failed);
+out:
+	kfree(kps);
+}
+
+/* Unregistering waits for probe handlers to finish; do it once for all */
+static void ktf_cov_kprobes_unregister(struct list_head *entries)
+{
+	struct ktf_cov_entry *entry;
+	struct kprobe **kps;
+	int n = 0;
+
+	list_for_each_entry(entry, entries, batch)
+		n++;
+	if (!n)
+		return;
+	kps = kcalloc(n, sizeof(*kps), GFP_KERNEL);
+	if (!kps) {
+		list_for_each_entry(entry, entries, batch)
+			unregister_kprobe(&entry->cold->kprobe);
+		return;
+	}
+	n = 0;
+	list_for_each_entry(entry, entries, batch)
+		kps[n++] = &entry->cold->kprobe;
+	unregister_kprobes(kps, n);
+	kfree(kps);
+}
+
+/* Current address of the function of an entry */
+static unsigned long ktf_cov_entry_addr(struct ktf_cov_entry *entry)
+{
+	return entry->ftrace ? entry->ip : (unsigned long)entry->cold->kprobe.addr;
+}
+
+#ifdef KTF_COV_FTRACE
+#if (KERNEL_VERSION(5, 11, 0) > LINUX_VERSION_CODE)
+#define ftrace_regs pt_regs
+#endif
+
+/* Look up the entry containing ip in the cov's sorted array of ftraced
+ * entries. The array only changes while the ftrace_ops is unregistered,
+ * so no locking is needed here:
+ */
+static notrace struct ktf_cov_entry *ktf_cov_ftrace_find(struct ktf_cov *cov,
+							 unsigned long ip)
+{
+	int lo = 0, hi = cov->nr_fentries - 1;
+
+	while (lo <= hi) {
+		int mid = lo + (hi - lo) / 2;
+		struct ktf_cov_entry *entry = cov->fentries[mid];
+
+		if (ip < entry->ip)
+			hi = mid - 1;
+		else if (ip >= entry->ip + max(entry->key.size, 1UL))
+			lo = mid + 1;
+		else
+			return entry;
+	}
+	return NULL;
+}
+
+static notrace void ktf_cov_ftrace_handler(unsigned long ip, unsigned long parent_ip,
+					  struct ftrace_ops *op, struct ftrace_regs *fregs)
+{
+	struct ktf_cov *cov = container_of(op, struct ktf_cov, fops);
+	struct ktf_cov_entry *entry = ktf_cov_ftrace_find(cov, ip);
+
+	if (entry)
+		ktf_cov_hit(entry);
+}
+
+/* Not exported, but tells if a function is traceable without changing
+ * any ftrace filter:
+ */
+static unsigned long (*cov_ftrace_location)(unsigned long ip);
+
+/* Select ftrace for counting calls to entry, if possible. The filter of
+ * the cov is only set up when it is started, for all its entries at once.
+ */
+static int ktf_cov_ftrace_add(struct ktf_cov *cov, struct ktf_cov_entry *entry,
+			      unsigned long addr)
+{
+	if (cov->opts & KTF_COV_OPT_KPROBE)
+		return -EINVAL;
+
+	if (!cov_ftrace_location)
+		cov_ftrace_location = ktf_find_symbol(NULL, "ftrace_location");
+	if (!cov_ftrace_location)
+		return -ENOTSUPP;
+	if (!cov_ftrace_location(addr))
+		return -EINVAL;
+	entry->ftrace = true;
+	entry->ip = addr;
 	return 0;
 }
 
+/* Set the filter of cov to the functions of its ftrace entries. Adding them
+ * one at a time copies the filter each time, so use a single update where
+ * the kernel supports it:
+ */
+static int ktf_cov_ftrace_filter(struct ktf_cov *cov)
+{
+	int i, ret;
+#if (KERNEL_VERSION(5, 18, 0) <= LINUX_VERSION_CODE)
+	unsigned long *ips = kcalloc(cov->nr_fentries, sizeof(*ips), GFP_KERNEL);
+
+	if (ips) {
+		for (i = 0; i < cov->nr_fentries; i++)
+			ips[i] = cov->fentries[i]->ip;
+		ret = ftrace_set_filter_ips(&cov->fops, ips, cov->nr_fentries, 0, 0);
+		kfree(ips);
+		return ret;
+	}
+#endif
+	for (i = 0; i < cov->nr_fentries; i++) {
+		ret = ftrace_set_filter_ip(&cov->fops, cov->fentries[i]->ip, 0, 0);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int ktf_cov_entry_cmp(const void *a, const void *b)
+{
+	const struct ktf_cov_entry *ea = *(const struct ktf_cov_entry **)a;
+	const struct ktf_cov_entry *eb = *(const struct ktf_cov_entry **)b;
+
+	if (ea->ip < eb->ip)
+		return -1;
+	return ea->ip > eb->ip;
+}
+
+/* Index the enabled ftrace entries of cov and start counting calls to them.
+ * If the ftrace_ops cannot be registered, fall back to kprobes:
+ */
+static void ktf_cov_ftrace_start(struct ktf_cov *cov)
+{
+	struct ktf_cov_entry *entry;
+	int n = 0, ret = -ENOMEM;
+
+	if (cov->fops_registered)
+		return;
+	ktf_map_for_each_entry(entry, &cov_entry_map, kmap)
+		if (entry->cov == cov && entry->ftrace && entry->refcnt > 0)
+			n++;
+	/* An empty filter would trace all functions! */
+	if (!n)
+		return;
+
+	kfree(cov->fentries);
+	cov->nr_fentries = 0;
+	cov->fentries = kcalloc(n, sizeof(*cov->fentries), GFP_KERNEL);
+	if (cov->fentries) {
+		ktf_map_for_each_entry(entry, &cov_entry_map, kmap)
+			if (entry->cov == cov && entry->ftrace && entry->refcnt > 0 &&
+			    cov->nr_fentries < n)
+				cov->fentries[cov->nr_fentries++] = entry;
+		sort(cov->fentries, cov->nr_fentries, sizeof(*cov->fentries),
+		     ktf_cov_entry_cmp, NULL);
+		ret = ktf_cov_ftrace_filter(cov);
+		if (!ret)
+			ret = register_ftrace_function(&cov->fops);
+	}
+	if (!ret) {
+		cov->fops_registered = true;
+		tlog(T_DEBUG, "Counting calls to %d functions in %s via ftrace",
+		     cov->nr_fentries, cov->kmap.key);
+		return;
+	}
+
+	twarn("Unable to use ftrace for coverage of %s (%d) - using kprobes",
+	      cov->kmap.key, ret);
+	ktf_map_for_each_entry(entry, &cov_entry_map, kmap) {
+		if (entry->cov != cov || !entry->ftrace || entry->refcnt <= 0)
+			continue;
+		if (ktf_cov_kprobe_register(entry))
+			entry->refcnt--;
+	}
+	ftrace_free_filter(&cov->fops);
+}
+
+static void ktf_cov_ftrace_stop(struct ktf_cov *cov)
+{
+	if (!cov->fops_registered)
+		return;
+	unregister_ftrace_function(&cov->fops);
+	cov->fops_registered = false;
+	/* Free the filter - function addresses may change before next enable */
+	ftrace_free_filter(&cov->fops);
+}
+
+/* The ftrace entries share one ftrace_ops, stop it with the last one */
+static void ktf_cov_ftrace_disable(struct ktf_cov *cov)
+{
+	int i;
+
+	for (i = 0; i < cov->nr_fentries; i++)
+		if (cov->fentries[i]->refcnt > 0)
+			return;
+	ktf_cov_ftrace_stop(cov);
+}
+#else
+static int ktf_cov_ftrace_add(struct ktf_cov *cov, struct ktf_cov_entry *entry,
+			      unsigned long addr)
+{
+	return -ENOTSUPP;
+}
+
+static void ktf_cov_ftrace_start(struct ktf_cov *cov)
+{
+}
+
+static void ktf_cov_ftrace_stop(struct ktf_cov *cov)
+{
+}
+
+static void ktf_cov_ftrace_disable(struct ktf_cov *cov)
+{
+}
+#endif
+
+/* Modules to cover are given as a comma separated list of names that may
+ * contain the '*' and '?' wildcards.
+ */
+static bool ktf_cov_glob(const char *pat, size_t plen, const char *str)
+{
+	const char *sback = NULL;
+	size_t p = 0, pback = 0;
+
+	while (*str) {
+		if (p < plen && pat[p] == '*') {
+			pback = ++p;
+			sback = str;
+		} else if (p < plen && (pat[p] == '?' || pat[p] == *str)) {
+			p++;
+			str++;
+		} else if (sback) {
+			p = pback;
+			str = ++sback;
+		} else {
+			return false;
+		}
+	}
+	while (p < plen && pat[p] == '*')
+		p++;
+	return p == plen;
+}
+
+static bool ktf_cov_match(const char *spec, const char *module)
+{
+	while (*spec) {
+		size_t len;
+
+		spec = skip_spaces(spec);
+		len = strcspn(spec, ",");
+		while (len && isspace(spec[len - 1]))
+			len--;
+		if (len && ktf_cov_glob(spec, len, module))
+			return true;
+		spec += strcspn(spec, ",");
+		if (*spec)
+			spec++;
+	}
+	return false;
+}
+
+static struct ktf_cov *ktf_cov_create(const char *name, unsigned int opts)
+{
+	struct ktf_cov *cov = kzalloc(sizeof(*cov), GFP_KERNEL);
+
+	if (!cov)
+		return NULL;
+
+	cov->type = KTF_COV_TYPE_MODULE;
+	cov->opts = opts;
+	INIT_LIST_HEAD(&cov->batch);
+#ifdef KTF_COV_FTRACE
+	cov->fops.func = ktf_cov_ftrace_handler;
+#endif
+	if (ktf_map_elem_init(&cov->kmap, name) < 0 ||
+	    ktf_map_insert(&cov_map, &cov->kmap) < 0) {
+		tlog(T_DEBUG, "cov %s already present", name);
+		ktf_map_elem_put(&cov->kmap); /* Releases the key */
+		kfree(cov);
+		return NULL;
+	}
+	return cov;
+}
+
+static void ktf_cov_entry_destroy(struct ktf_cov_entry *entry)
+{
+	free_percpu(entry->hits);
+	free_percpu(entry->alloc);
+	kfree(entry->cold);
+	kfree(entry);
+}
+
+/* Add a new entry, with its function already being counted, to the map */
+static void ktf_cov_entry_insert(struct ktf_cov_entry *entry)
+{
+	struct ktf_cov *cov = entry->cov;
+	char buf[256];
+
+	(void)sprint_symbol(buf, entry->key.address);
+	if (ktf_map_elem_init_key(&entry->kmap, &entry->key, sizeof(entry->key)) < 0 ||
+	    ktf_map_insert(&cov_entry_map, &entry->kmap) < 0) {
+		if (!entry->ftrace)
+			unregister_kprobe(&entry->cold->kprobe);
+		ktf_cov_entry_destroy(entry);
+		return;
+	}
+	tlog(T_DEBUG, "Added %s/%s (%p, size %lu, %s) to coverage: %s",
+	     cov->kmap.key, entry->cold->name, (void *)ktf_cov_entry_addr(entry),
+	     entry->key.size, entry->ftrace ? "ftrace" : "kprobe", buf);
+
+	cov->total++;
+	ktf_cov_entry_put(entry);
+}
+
+/* State of the walk over all symbols when enabling coverage */
+struct ktf_cov_walk {
+	const char *spec;		/* Modules to enable coverage for */
+	unsigned int opts;
+	struct module *mod;		/* Module of the previous symbol... */
+	struct ktf_cov *cov;		/* ...and its new cov, if covered */
+	struct list_head covs;		/* New covs created by the walk */
+	struct list_head probes;	/* New entries needing a kprobe */
+};
+
+static struct ktf_cov *ktf_cov_walk_cov(struct ktf_cov_walk *w, const char *name)
+{
+	struct ktf_cov *cov;
+
+	list_for_each_entry(cov, &w->covs, batch)
+		if (strcmp(cov->kmap.key, name) == 0)
+			return cov;
+	if (!ktf_cov_match(w->spec, name))
+		return NULL;
+	/* Coverage has been enabled before - entries are already there */
+	cov = ktf_cov_find(name);
+	if (cov) {
+		ktf_cov_put(cov);
+		return NULL;
+	}
+	cov = ktf_cov_create(name, w->opts);
+	if (cov)
+		list_add_tail(&cov->batch, &w->covs);
+	return cov;
+}
+
 static int ktf_cov_init_symbol(void *data, const char *name,
 			       struct module *mod, unsigned long addr)
 {
+	struct ktf_cov_walk *w = data;
 	struct ktf_cov_entry *entry;
-	struct ktf_cov *cov = data;
-	char buf[256];
+	struct ktf_cov *cov;
 
-	if (!mod || !cov)
+	if (!mod)
+		return 0;
+
+	/* We only care about symbols for cov-specified modules; symbols
+	 * of a module are visited in sequence.
+	 */
+	if (mod != w->mod) {
+		w->mod = mod;
+		w->cov = ktf_cov_walk_cov(w, mod->name);
+	}
+	cov = w->cov;
+	if (!cov)
 		return 0;
 
 	if (!try_module_get(mod))
 		return 0;
 
-	/* module_mutex is grabbed by register_kprobe() */
+	/* Don't hold module_mutex across ftrace and allocations */
 	mutex_unlock(&module_mutex);
 
-	/* We only care about symbols for cov-specified module. */
-	if (strcmp(mod->name, cov->kmap.key))
-		goto out;
-
 	/* We don't probe ourselves and functions called within probe ctxt. */
 	if (strncmp(name, "ktf_cov", strlen("ktf_cov")) == 0 ||
 	    strcmp(name, "ktf_map_find") == 0)
@@ -206,63 +993,68 @@ static int ktf_cov_init_symbol(void *data, const char *name,
 	entry = ktf_cov_entry_find(addr, 0);
 	if (entry) {
 		tlog(T_DEBUG, "%s already present in coverage: %s",
-		     name, entry->name);
+		     name, entry->cold->name);
 		ktf_cov_entry_put(entry);
 		goto out;
 	}
 	entry = kzalloc(sizeof(*entry), GFP_KERNEL);
-	(void)strlcpy(entry->name, name, sizeof(entry->name));
-	entry->magic = KTF_COV_ENTRY_MAGIC;
-	entry->cov = cov;
-	entry->refcnt = 1;
-
-	entry->kprobe.pre_handler = ktf_cov_handler;
-	entry->kprobe.symbol_name = entry->name;
-
-	/* Ugh - we try to register a kprobe as a means of determining
-	 * if the symbol is a function.
-	 */
-	if (register_kprobe(&entry->kprobe) < 0) {
-		/* not a probe-able function */
-		kfree(entry);
+	if (!entry)
+		goto out;
+	entry->cold = kzalloc(sizeof(*entry->cold), GFP_KERNEL);
+	entry->hits = alloc_percpu(unsigned int);
+	if (cov->opts & KTF_COV_OPT_ALLOC)
+		entry->alloc = alloc_percpu(struct ktf_cov_alloc_stats);
+	if (!entry->cold || !entry->hits ||
+	    (cov->opts & KTF_COV_OPT_ALLOC && !entry->alloc)) {
+		ktf_cov_entry_destroy(entry);
 		goto out;
 	}
+	(void)strlcpy(entry->cold->name, name, sizeof(entry->cold->name));
+	entry->cold->magic = KTF_COV_ENTRY_MAGIC;
+	entry->cold->entry = entry;
+	entry->cov = cov;
+	entry->refcnt = 1;
 	entry->key.address = addr;
 	entry->key.size = ktf_symbol_size(addr);
-	(void)sprint_symbol(buf, entry->key.address);
-	if (ktf_map_elem_init(&entry->kmap, (char *)&entry->key) < 0 ||
-	    ktf_map_insert(&cov_entry_map, &entry->kmap) < 0) {
-		unregister_kprobe(&entry->kprobe);
-		kfree(entry);
-		goto out;
-	}
-	tlog(T_DEBUG, "Added %s/%s (%p, size %lu) to coverage: %s",
-	     mod->name, entry->name, (void *)entry->kprobe.addr,
-	     entry->key.size, buf);
-
-	cov->total++;
-	ktf_cov_entry_put(entry);
 
+	/* Ugh - we check for an ftrace location or try to register a kprobe
+	 * as a means of determining if the symbol is a function. Kprobes are
+	 * registered in one go once all symbols are visited.
+	 */
+	if (ktf_cov_ftrace_add(cov, entry, addr))
+		list_add_tail(&entry->batch, &w->probes);
+	else
+		ktf_cov_entry_insert(entry);
 out:
 	mutex_lock(&module_mutex);
 	module_put(mod);
 	return 0;
 }
 
-static int ktf_cov_kmem_cache_alloc_handler(struct kretprobe_instance *,
-					    struct pt_regs *);
-
 static unsigned long register_kretprobe_size;
 
+/* Per kretprobe instance data, passing the allocation from the entry
+ * handler to the return handler.
+ */
+struct ktf_cov_mem_data {
+	struct ktf_cov_entry *entry;	/* Function the allocation is from */
+	u64 start;			/* Time of the call, if profiled */
+	unsigned long size;
+	unsigned int nr_entries;
+	unsigned long stack_entries[KTF_COV_MAX_STACK_DEPTH];
+};
+
 /* Handler tracking allocations.  Determine if any functions we are
  * tracking coverage for (coverage entries) are on the stack; if so
  * we track the allocation.
  */
-static int ktf_cov_kmem_alloc_entry(struct ktf_cov_mem *m, unsigned long bytes)
+static int ktf_cov_kmem_alloc_entry(struct ktf_cov_mem_data *m, unsigned long bytes)
 {
 	struct ktf_cov_entry *entry = NULL;
 	int n;
 
+	m->entry = NULL;
+	m->nr_entries = 0;
 	/* We don't care about 0-length allocations. */
 	if (!bytes)
 		return 0;
@@ -272,17 +1064,13 @@ static int ktf_cov_kmem_alloc_entry(struct ktf_cov_mem *m, unsigned long bytes)
 	 */
 	m->nr_entries = stack_trace_save(m->stack_entries, KTF_COV_MAX_STACK_DEPTH, 1);
 	for (n = 0; n < m->nr_entries; n++) {
-		/* avoid recursive enter when allocating cov mem */
-		if (m->stack_entries[n] ==
-		    (unsigned long)ktf_cov_kmem_cache_alloc_handler)
-			break;
 		/* ignore allocs as a result of registering probes */
 		if (m->stack_entries[n] >
 		    (unsigned long)register_kretprobe &&
 		    m->stack_entries[n] < ((unsigned long)register_kretprobe +
 		    register_kretprobe_size))
 			break;
-		entry = ktf_cov_entry_find(m->stack_entries[n], 0);
+		entry = ktf_cov_index_find(m->stack_entries[n]);
 		if (entry)
 			break;
 	}
@@ -290,11 +1078,11 @@ static int ktf_cov_kmem_alloc_entry(struct ktf_cov_mem *m, unsigned long bytes)
 		m->nr_entries = 0;
 		return 0;
 	}
-	ktf_cov_entry_put(entry);
-
-	m->key.size = bytes;
-	/* Have to wait until alloc returns to get key.address */
 
+	m->entry = entry;
+	m->size = bytes;
+	/* Have to wait until alloc returns to get the address */
+	m->start = READ_ONCE(entry->alloc) ? ktime_get_ns() : 0;
 	return 0;
 }
 
@@ -302,7 +1090,7 @@ static int ktf_cov_kmem_alloc_entry(struct ktf_cov_mem *m, unsigned long bytes)
 static int ktf_cov_kmalloc_entry_handler(struct kretprobe_instance *ri,
 					 struct pt_regs *regs)
 {
-	struct ktf_cov_mem *m = (struct ktf_cov_mem *)ri->data;
+	struct ktf_cov_mem_data *m = (struct ktf_cov_mem_data *)ri->data;
 	unsigned long bytes = (unsigned long)KTF_ENTRY_PROBE_ARG0;
 
 	return ktf_cov_kmem_alloc_entry(m, bytes);
@@ -313,29 +1101,82 @@ static int ktf_cov_kmem_cache_alloc_entry_handler(struct kretprobe_instance *ri,
 {
 	struct kmem_cache *cache =
 		(struct kmem_cache *)KTF_ENTRY_PROBE_ARG0;
-	struct ktf_cov_mem *m = (struct ktf_cov_mem *)ri->data;
+	struct ktf_cov_mem_data *m = (struct ktf_cov_mem_data *)ri->data;
 	unsigned long bytes;
 
+	m->entry = NULL;
 	if (!cache)
 		return 0;
 
+	m->nr_entries = 0;
 	bytes = cache->object_size;
 	if (cache == cov_mem_cache)
 		return 0;
 	return ktf_cov_kmem_alloc_entry(m, bytes);
 }
 
-static int ktf_cov_kmem_alloc_return(struct ktf_cov_mem *m,
+/* Probe handlers run with preemption disabled and do not nest */
+static void ktf_cov_alloc_account(struct ktf_cov_mem_data *m,
+				  unsigned long ret)
+{
+	struct ktf_cov_alloc_stats *s = this_cpu_ptr(m->entry->alloc);
+	u64 latency = ktime_get_ns() - m->start;
+
+	s->count++;
+	if (ret)
+		s->bytes += m->size;
+	else
+		s->failed++;
+	s->hist[min_t(unsigned int, ilog2(m->size),
+		      KTF_COV_ALLOC_HIST_SIZE - 1)]++;
+	s->latency_ns += latency;
+	if (latency > s->max_latency_ns)
+		s->max_latency_ns = latency;
+}
+
+bool ktf_cov_entry_alloc_stats(struct ktf_cov_entry *entry,
+			       struct ktf_cov_alloc_stats *stats)
+{
+	struct ktf_cov_alloc_stats *s;
+	int cpu, i;
+
+	memset(stats, 0, sizeof(*stats));
+	if (!entry->alloc)
+		return false;
+	for_each_possible_cpu(cpu) {
+		s = per_cpu_ptr(entry->alloc, cpu);
+		stats->count += s->count;
+		stats->failed += s->failed;
+		stats->bytes += s->bytes;
+		stats->latency_ns += s->latency_ns;
+		stats->max_latency_ns = max(stats->max_latency_ns,
+					    s->max_latency_ns);
+		for (i = 0; i < KTF_COV_ALLOC_HIST_SIZE; i++)
+			stats->hist[i] += s->hist[i];
+	}
+	return true;
+}
+EXPORT_SYMBOL(ktf_cov_entry_alloc_stats);
+
+static int ktf_cov_kmem_alloc_return(struct ktf_cov_mem_data *m,
 				     unsigned long ret)
 {
 	struct ktf_cov_mem *mm;
 
-	m->key.address = ret;
-	mm = kmem_cache_alloc(cov_mem_cache, GFP_NOWAIT);
+	if (m->start)
+		ktf_cov_alloc_account(m, ret);
+	/* Leaks are only tracked for modules covered with KTF_COV_OPT_MEM */
+	if (!ret || !(m->entry->cov->opts & KTF_COV_OPT_MEM))
+		goto out;
+
+	mm = ktf_cov_mem_alloc();
 	if (!mm)
-		return 0;
-	memcpy(mm, m, sizeof(*mm));
-	if (ktf_map_elem_init(&mm->kmap, (char *)&mm->key) < 0 ||
+		goto out;
+	mm->key.address = ret;
+	mm->key.size = m->size;
+	mm->flags = 0;
+	mm->stack = ktf_cov_stack_save(m->stack_entries, m->nr_entries);
+	if (ktf_map_elem_init_key(&mm->kmap, &mm->key, sizeof(mm->key)) < 0 ||
 	    ktf_map_insert(&cov_mem_map, &mm->kmap) < 0) {
 		/* This can happen as inexplicably the same probe
 		 * can fire twice for _kmalloc; this results in
@@ -345,9 +1186,11 @@ static int ktf_cov_kmem_alloc_return(struct ktf_cov_mem *m,
 		 * we track the allocation once, which is what we want.
 		 */
 		terr("Failed to insert cov_mem %p", (void *)ret);
-		kmem_cache_free(cov_mem_cache, mm);
+		ktf_cov_mem_release(mm);
 	}
-	tlog(T_DEBUG, "cov_mem: tracking allocation %p", (void *)m->key.address);
+	tlog(T_DEBUG, "cov_mem: tracking allocation %p", (void *)ret);
+out:
+	m->entry = NULL;
 	m->nr_entries = 0;
 	return 0;
 }
@@ -355,10 +1198,10 @@ static int ktf_cov_kmem_alloc_return(struct ktf_cov_mem *m,
 static int ktf_cov_kmalloc_handler(struct kretprobe_instance *ri,
 				   struct pt_regs *regs)
 {
-	struct ktf_cov_mem *m = (struct ktf_cov_mem *)ri->data;
+	struct ktf_cov_mem_data *m = (struct ktf_cov_mem_data *)ri->data;
 	unsigned long ret = regs_return_value(regs);
 
-	if (m->nr_entries)
+	if (m->entry)
 		return ktf_cov_kmem_alloc_return(m, ret);
 	return 0;
 }
@@ -368,13 +1211,13 @@ static int ktf_cov_kmem_cache_alloc_handler(struct kretprobe_instance *ri,
 {
 	struct kmem_cache *cache =
 		(struct kmem_cache *)KTF_ENTRY_PROBE_ARG0;
-	struct ktf_cov_mem *m = (struct ktf_cov_mem *)ri->data;
+	struct ktf_cov_mem_data *m = (struct ktf_cov_mem_data *)ri->data;
 	unsigned long ret = regs_return_value(regs);
 
 	if (cache == cov_mem_cache)
 		return 0;
 
-	if (m->nr_entries)
+	if (m->entry)
 		return ktf_cov_kmem_alloc_return(m, ret);
 	return 0;
 }
@@ -424,13 +1267,13 @@ static struct kretprobe cov_mem_probes[] = {
 	{	.kp = { .symbol_name = "__kmalloc" },
 		.handler = ktf_cov_kmalloc_handler,
 		.entry_handler = ktf_cov_kmalloc_entry_handler,
-		.data_size = sizeof(struct ktf_cov_mem),
+		.data_size = sizeof(struct ktf_cov_mem_data),
 		.maxactive = 0, /* assumes default value */
 	},
 	{	.kp = { .symbol_name = "kmem_cache_alloc" },
 		.handler = ktf_cov_kmem_cache_alloc_handler,
 		.entry_handler = ktf_cov_kmem_cache_alloc_entry_handler,
-		.data_size = sizeof(struct ktf_cov_mem),
+		.data_size = sizeof(struct ktf_cov_mem_data),
 		.maxactive = 0, /* assumes default value */
 	},
 	{	.kp = { .symbol_name = "kfree" },
@@ -447,13 +1290,21 @@ static struct kretprobe cov_mem_probes[] = {
 	}
 };
 
+/* Options that need the allocation probes */
+#define KTF_COV_OPTS_MEM	(KTF_COV_OPT_MEM | KTF_COV_OPT_ALLOC)
+
 static int cov_opt_mem_cnt;
+static int cov_opt_test_cnt;
 
 static int ktf_cov_init_opts(struct ktf_cov *cov)
 {
 	int i, ret = 0;
 
-	if (cov->opts & KTF_COV_OPT_MEM && ++cov_opt_mem_cnt == 1) {
+	cov->enabled++;
+	if (cov->opts & KTF_COV_OPT_TEST)
+		WRITE_ONCE(cov_opt_test_cnt, cov_opt_test_cnt + 1);
+
+	if (cov->opts & KTF_COV_OPTS_MEM && ++cov_opt_mem_cnt == 1) {
 		if (!cov_mem_cache) {
 			cov_mem_cache =
 				kmem_cache_create("ktf_cov_mem_cache",
@@ -464,11 +1315,21 @@ static int ktf_cov_init_opts(struct ktf_cov *cov)
 			if (!cov_mem_cache)
 				return -ENOMEM;
 		}
+		if (!cov_mem_pools) {
+			ret = ktf_cov_mem_pools_init();
+			if (ret)
+				return ret;
+		}
 
 		for (i = 0; i < ARRAY_SIZE(cov_mem_probes); i++) {
 			/* reset in case we're re-registering */
 			cov_mem_probes[i].kp.addr = NULL;
 			cov_mem_probes[i].kp.flags = 0;
+			/* Allocations may sleep; allow for more than one
+			 * instance in flight per CPU.
+			 */
+			cov_mem_probes[i].maxactive =
+				max_t(int, 64, 4 * num_possible_cpus());
 			ret = register_kretprobe(&cov_mem_probes[i]);
 			if (ret) {
 				tlog(T_DEBUG,
@@ -486,12 +1347,19 @@ static void ktf_cov_cleanup_opts(struct ktf_cov *cov)
 {
 	int i;
 
-	if (cov->opts & KTF_COV_OPT_MEM && --cov_opt_mem_cnt == 0) {
+	if (!cov->enabled)
+		return;
+	cov->enabled--;
+	if (cov->opts & KTF_COV_OPT_TEST)
+		WRITE_ONCE(cov_opt_test_cnt, cov_opt_test_cnt - 1);
+
+	if (cov->opts & KTF_COV_OPTS_MEM && --cov_opt_mem_cnt == 0) {
 		for (i = 0; i < ARRAY_SIZE(cov_mem_probes); i++) {
 			if (cov_mem_probes[i].nmissed > 0) {
 				tlog(T_INFO, "%s: retprobe missed %d.",
 				     cov_mem_probes[i].kp.symbol_name,
 				     cov_mem_probes[i].nmissed);
+				cov_mem_missed += cov_mem_probes[i].nmissed;
 			}
 			if (cov_mem_probes[i].kp.addr)
 				unregister_kretprobe(&cov_mem_probes[i]);
@@ -518,7 +1386,7 @@ static void ktf_cov_update_entries(const char *name, struct ktf_cov *cov)
 
 	while (entry) {
 		if (entry->cov != cov ||
-		    (unsigned long)entry->kprobe.addr == entry->key.address) {
+		    ktf_cov_entry_addr(entry) == entry->key.address) {
 			entry = ktf_map_next_entry(entry, kmap);
 			continue;
 		}
@@ -528,17 +1396,18 @@ static void ktf_cov_update_entries(const char *name, struct ktf_cov *cov)
 		 * changed if module was re-compiled).
 		 */
 		ktf_map_remove_elem(&cov_entry_map, &entry->kmap);
-		entry->key.address = (unsigned long)entry->kprobe.addr;
+		entry->key.address = ktf_cov_entry_addr(entry);
 		entry->key.size = ktf_symbol_size(entry->key.address);
-		if (ktf_map_elem_init(&entry->kmap, (char *)&entry->key) < 0 ||
+		if (ktf_map_elem_init_key(&entry->kmap, &entry->key, sizeof(entry->key)) < 0 ||
 		    ktf_map_insert(&cov_entry_map, &entry->kmap) < 0) {
-			tlog(T_DEBUG, "Failed to add %s/%s", name, entry->name);
-			unregister_kprobe(&entry->kprobe);
+			tlog(T_DEBUG, "Failed to add %s/%s", name, entry->cold->name);
+			if (!entry->ftrace)
+				unregister_kprobe(&entry->cold->kprobe);
 			entry->refcnt--;
 			entry = ktf_map_next_entry(entry, kmap);
 		} else {
 			tlog(T_DEBUG, "Added %s/%s (%p, size %lu) to coverage",
-			     name, entry->name, (void *)entry->key.address,
+			     name, entry->cold->name, (void *)entry->key.address,
 			     entry->key.size);
 			/* Map has changed, reset to root. */
 			entry = ktf_map_first_entry(&cov_entry_map,
@@ -547,102 +1416,452 @@ static void ktf_cov_update_entries(const char *name, struct ktf_cov *cov)
 	}
 }
 
-int ktf_cov_enable(const char *name, unsigned int opts)
+/* Re-enable the entries of the covs on a batch list, adding the ones with
+ * kprobes to register to the probes list.
+ */
+static void ktf_cov_entries_enable(struct list_head *probes)
 {
-	struct ktf_cov *cov = ktf_cov_find(name);
 	struct ktf_cov_entry *entry;
-	int ret = 0;
+	unsigned long addr;
+
+	ktf_map_for_each_entry(entry, &cov_entry_map, kmap) {
+		if (!entry->cov || list_empty(&entry->cov->batch))
+			continue;
+		/* Profiling enabled after the entry was created */
+		if (entry->cov->opts & KTF_COV_OPT_ALLOC && !entry->alloc)
+			WRITE_ONCE(entry->alloc,
+				   alloc_percpu(struct ktf_cov_alloc_stats));
+		if (++entry->refcnt != 1)
+			continue;
+		if (!entry->ftrace) {
+			list_add_tail(&entry->batch, probes);
+			continue;
+		}
+		addr = (unsigned long)ktf_find_symbol(entry->cov->kmap.key,
+						      entry->cold->name);
+		/* As when the entry was created, try a kprobe if ftrace fails */
+		if (!addr || ktf_cov_ftrace_add(entry->cov, entry, addr)) {
+			tlog(T_DEBUG, "Cannot trace %s/%s - trying a kprobe",
+			     entry->cov->kmap.key, entry->cold->name);
+			entry->ftrace = false;
+			list_add_tail(&entry->batch, probes);
+		}
+	}
+}
+
+int ktf_cov_enable(const char *spec, unsigned int opts)
+{
+	struct ktf_cov_walk w = { .spec = spec, .opts = opts };
+	struct ktf_cov_entry *entry, *etmp;
+	struct ktf_cov *cov, *tmp;
+	LIST_HEAD(failed);
+	LIST_HEAD(covs);
+	int ret = 0, err;
 
 #ifndef KTF_PROBE_SUPPORT
 	return -ENOTSUPP;
 #endif
-	if (!cov) {
-		cov = kzalloc(sizeof(*cov), GFP_KERNEL);
-		if (!cov)
-			return -ENOMEM;
-
-		cov->type = KTF_COV_TYPE_MODULE;
-		cov->opts = opts;
-		if (ktf_map_elem_init(&cov->kmap, name) < 0 ||
-		    ktf_map_insert(&cov_map, &cov->kmap) < 0) {
-			tlog(T_DEBUG, "cov %s already present", cov->kmap.key);
-			kfree(cov);
-			return -EEXIST;
-		}
-		register_kretprobe_size =
-			ktf_symbol_size((unsigned long)register_kretprobe);
-		mutex_lock(&module_mutex);
-		kallsyms_on_each_symbol(ktf_cov_init_symbol, cov);
-		mutex_unlock(&module_mutex);
-	} else {
-		ktf_map_for_each_entry(entry, &cov_entry_map, kmap) {
-			if (entry->cov != cov)
-				continue;
-			if (++entry->refcnt == 1) {
-				/* reset kprobe as we're re-registering */
-				memset(&entry->kprobe, 0,
-				       sizeof(entry->kprobe));
-				entry->kprobe.pre_handler = ktf_cov_handler;
-				entry->kprobe.symbol_name = entry->name;
-				ret = register_kprobe(&entry->kprobe);
-				if (ret) {
-					tlog(T_DEBUG, "Failed to add %s/%s",
-					     name, entry->name);
-					entry->refcnt--;
-				}
-			}
+	INIT_LIST_HEAD(&w.covs);
+	INIT_LIST_HEAD(&w.probes);
+
+	/* Coverage enabled before for a module just re-enables its entries */
+	ktf_map_for_each_entry(cov, &cov_map, kmap) {
+		if (!ktf_cov_match(spec, cov->kmap.key))
+			continue;
+		ktf_map_elem_get(&cov->kmap);
+		list_add_tail(&cov->batch, &covs);
+		/* The options of a disabled module can be changed */
+		if (!cov->enabled)
+			cov->opts = opts;
+	}
+	if (!list_empty(&covs)) {
+		ktf_cov_entries_enable(&w.probes);
+		ktf_cov_kprobes_register(&w.probes, &failed);
+		list_for_each_entry_safe(entry, etmp, &failed, batch) {
+			tlog(T_DEBUG, "Failed to add %s/%s",
+			     entry->cov->kmap.key, entry->cold->name);
+			list_del(&entry->batch);
+			entry->refcnt--;
 		}
+		INIT_LIST_HEAD(&w.probes);
 		/* Probe addresses/function sizes for functions may have
 		 * changed if module was unloaded/reloaded - entry map
 		 * needs to be updated to use new address/size as key.
 		 */
-		ktf_cov_update_entries(name, cov);
+		list_for_each_entry(cov, &covs, batch)
+			ktf_cov_update_entries(cov->kmap.key, cov);
 	}
 
-	ret = ktf_cov_init_opts(cov);
+	/* Visit all symbols once to add entries for newly covered modules */
+	if (list_empty(&covs) || strpbrk(spec, "*?,")) {
+		register_kretprobe_size =
+			ktf_symbol_size((unsigned long)register_kretprobe);
+		mutex_lock(&module_mutex);
+		kallsyms_on_each_symbol(ktf_cov_init_symbol, &w);
+		mutex_unlock(&module_mutex);
+	}
+
+	ktf_cov_kprobes_register(&w.probes, &failed);
+	list_for_each_entry_safe(entry, etmp, &w.probes, batch) {
+		list_del(&entry->batch);
+		ktf_cov_entry_insert(entry);
+	}
+	list_for_each_entry_safe(entry, etmp, &failed, batch) {
+		/* not a probe-able function */
+		list_del(&entry->batch);
+		ktf_cov_entry_destroy(entry);
+	}
 
-	ktf_cov_put(cov);
+	/* New entries or new addresses of existing ones */
+	ktf_cov_index_rebuild();
 
+	list_splice_tail_init(&w.covs, &covs);
+	if (list_empty(&covs)) {
+		tlog(T_DEBUG, "No modules matching %s to cover", spec);
+		return -ENOENT;
+	}
+	list_for_each_entry_safe(cov, tmp, &covs, batch) {
+		ktf_cov_ftrace_start(cov);
+		err = ktf_cov_init_opts(cov);
+		if (err && !ret)
+			ret = err;
+		list_del_init(&cov->batch);
+		ktf_cov_put(cov);
+	}
 	return ret;
 }
 
-void ktf_cov_disable(const char *module)
+void ktf_cov_disable(const char *spec)
 {
-	struct ktf_cov *cov = ktf_cov_find(module);
 	struct ktf_cov_entry *entry;
+	struct ktf_cov *cov, *tmp;
+	LIST_HEAD(probes);
+	LIST_HEAD(covs);
 
 #ifndef	KTF_PROBE_SUPPORT
 	return;
 #endif
 
-	if (!cov)
+	ktf_map_for_each_entry(cov, &cov_map, kmap) {
+		if (!ktf_cov_match(spec, cov->kmap.key))
+			continue;
+		ktf_map_elem_get(&cov->kmap);
+		list_add_tail(&cov->batch, &covs);
+	}
+	if (list_empty(&covs))
 		return;
 
 	ktf_map_for_each_entry(entry, &cov_entry_map, kmap) {
-		if (entry->cov == cov) {
-			if (--entry->refcnt == 0) {
-				unregister_kprobe(&entry->kprobe);
-				tlog(T_DEBUG, "Removed coverage %s/%s",
-				     cov->kmap.key, entry->name);
-			}
+		if (!entry->cov || list_empty(&entry->cov->batch) ||
+		    entry->refcnt <= 0)
+			continue;
+		if (--entry->refcnt == 0) {
+			if (!entry->ftrace)
+				list_add_tail(&entry->batch, &probes);
+			tlog(T_DEBUG, "Removed coverage %s/%s",
+			     entry->cov->kmap.key, entry->cold->name);
+		}
+	}
+	ktf_cov_kprobes_unregister(&probes);
+
+	list_for_each_entry_safe(cov, tmp, &covs, batch) {
+		ktf_cov_ftrace_disable(cov);
+		ktf_cov_cleanup_opts(cov);
+		list_del_init(&cov->batch);
+		ktf_cov_put(cov);
+	}
+}
+
+unsigned long ktf_cov_mem_dropped(void)
+{
+	unsigned long dropped = 0;
+	int cpu;
+
+	if (!cov_mem_pools)
+		return 0;
+	for_each_possible_cpu(cpu)
+		dropped += per_cpu_ptr(cov_mem_pools, cpu)->dropped;
+	return dropped;
+}
+EXPORT_SYMBOL(ktf_cov_mem_dropped);
+
+unsigned long ktf_cov_mem_missed(void)
+{
+	unsigned long missed = cov_mem_missed;
+	int i;
+
+	if (cov_opt_mem_cnt)
+		for (i = 0; i < ARRAY_SIZE(cov_mem_probes); i++)
+			missed += cov_mem_probes[i].nmissed;
+	return missed;
+}
+EXPORT_SYMBOL(ktf_cov_mem_missed);
+
+/* Counts per test run, see ktf_cov_test_start() */
+struct ktf_cov_hit {
+	struct ktf_cov_entry *entry;
+	unsigned int hits;
+};
+
+struct ktf_cov_hits {
+	struct list_head list;
+	u32 test_id;
+	int nr_hits;
+	struct ktf_cov_hit hits[];
+};
+
+static LIST_HEAD(cov_test_hits);	/* Completed test runs */
+static DEFINE_MUTEX(cov_test_lock);
+
+static void ktf_cov_test_hits_clear(void)
+{
+	struct ktf_cov_hits *h, *tmp;
+
+	mutex_lock(&cov_test_lock);
+	list_for_each_entry_safe(h, tmp, &cov_test_hits, list) {
+		list_del(&h->list);
+		kvfree(h);
+	}
+	mutex_unlock(&cov_test_lock);
+}
+
+/* Record the counts of the entries counted per test before the test runs.
+ * The hits in the test are the difference when it is done, so tests that
+ * run at the same time get the hits of each other too.
+ */
+struct ktf_cov_hits *ktf_cov_test_start(u32 test_id)
+{
+	struct ktf_cov_entry *entry;
+	struct ktf_cov_hits *h;
+	size_t n;
+
+	if (!READ_ONCE(cov_opt_test_cnt) || !test_id)
+		return NULL;
+
+	n = ktf_map_size(&cov_entry_map);
+	h = kvzalloc(sizeof(*h) + n * sizeof(h->hits[0]), GFP_KERNEL);
+	if (!h)
+		return NULL;
+	h->test_id = test_id;
+	ktf_map_for_each_entry(entry, &cov_entry_map, kmap) {
+		if (h->nr_hits == n) {
+			ktf_cov_entry_put(entry);
+			break;
+		}
+		if (!entry->cov || !(entry->cov->opts & KTF_COV_OPT_TEST) ||
+		    entry->refcnt <= 0)
+			continue;
+		h->hits[h->nr_hits].entry = entry;
+		h->hits[h->nr_hits].hits = ktf_cov_entry_hits(entry);
+		h->nr_hits++;
+	}
+	return h;
+}
+EXPORT_SYMBOL(ktf_cov_test_start);
+
+void ktf_cov_test_end(struct ktf_cov_hits *h)
+{
+	unsigned int hits;
+	int i, n = 0;
+
+	if (!h)
+		return;
+	/* Only keep the functions that were called */
+	for (i = 0; i < h->nr_hits; i++) {
+		hits = ktf_cov_entry_hits(h->hits[i].entry) - h->hits[i].hits;
+		if (!hits)
+			continue;
+		h->hits[n].entry = h->hits[i].entry;
+		h->hits[n].hits = hits;
+		n++;
+	}
+	if (!n) {
+		kvfree(h);
+		return;
+	}
+	h->nr_hits = n;
+	mutex_lock(&cov_test_lock);
+	list_add_tail(&h->list, &cov_test_hits);
+	mutex_unlock(&cov_test_lock);
+}
+EXPORT_SYMBOL(ktf_cov_test_end);
+
+void ktf_cov_reset(const char *spec)
+{
+	struct ktf_cov_entry *entry;
+	struct ktf_cov *cov;
+
+	/* Clear the number of functions called before the called flags,
+	 * so that a function called during the reset is not counted twice:
+	 */
+	ktf_map_for_each_entry(cov, &cov_map, kmap)
+		if (ktf_cov_match(spec, cov->kmap.key))
+			atomic_set(&cov->count, 0);
+	ktf_map_for_each_entry(entry, &cov_entry_map, kmap) {
+		if (!entry->cov || !ktf_cov_match(spec, entry->cov->kmap.key))
+			continue;
+		WRITE_ONCE(entry->base, ktf_cov_entry_hits(entry));
+		WRITE_ONCE(entry->called, 0);
+	}
+	ktf_cov_test_hits_clear();
+}
+EXPORT_SYMBOL(ktf_cov_reset);
+
+int ktf_cov_snapshot(const char *spec, ktf_cov_hit_fn fn, void *data)
+{
+	struct ktf_cov_entry *entry;
+	struct ktf_cov_hits *h;
+	unsigned int hits;
+	int i, ret = 0;
+
+	ktf_map_for_each_entry(entry, &cov_entry_map, kmap) {
+		if (ret || !entry->cov ||
+		    !ktf_cov_match(spec, entry->cov->kmap.key))
+			continue;
+		hits = ktf_cov_entry_count(entry);
+		ret = fn(data, entry->cov->kmap.key, entry->cold->name, hits, 0);
+	}
+
+	mutex_lock(&cov_test_lock);
+	list_for_each_entry(h, &cov_test_hits, list) {
+		for (i = 0; i < h->nr_hits && !ret; i++) {
+			entry = h->hits[i].entry;
+			if (ktf_cov_match(spec, entry->cov->kmap.key))
+				ret = fn(data, entry->cov->kmap.key, entry->cold->name,
+					 h->hits[i].hits, h->test_id);
+		}
+	}
+	mutex_unlock(&cov_test_lock);
+	return ret;
+}
+EXPORT_SYMBOL(ktf_cov_snapshot);
+
+/* The maps may change between counting and filling in the records, so what
+ * does not fit is left out, and the sizes in the header are the ones used.
+ */
+void *ktf_cov_export(size_t *size)
+{
+	size_t strtab_size = 0, strtab_used = 0, len;
+	struct ktf_cov_export_function *f, *functions;
+	struct ktf_cov_export_module *m, *modules;
+	u32 nr_modules = 0, nr_functions = 0, nr_functions_max, i;
+	struct ktf_cov *cov, *last = NULL, **covs;
+	struct ktf_cov_export_hdr *hdr;
+	struct ktf_cov_entry *entry;
+	u32 last_idx = 0;
+	char *strtab;
+	void *buf;
+
+	ktf_map_for_each_entry(cov, &cov_map, kmap) {
+		nr_modules++;
+		strtab_size += strlen(cov->kmap.key) + 1;
+	}
+	ktf_map_for_each_entry(entry, &cov_entry_map, kmap) {
+		nr_functions++;
+		strtab_size += strlen(entry->cold->name) + 1;
+	}
+
+	covs = kcalloc(max_t(u32, nr_modules, 1), sizeof(*covs), GFP_KERNEL);
+	if (!covs)
+		return NULL;
+	*size = sizeof(*hdr) + nr_modules * sizeof(*m) +
+		nr_functions * sizeof(*f) + strtab_size;
+	buf = vmalloc_user(*size);
+	if (!buf) {
+		kfree(covs);
+		return NULL;
+	}
+	hdr = buf;
+	modules = (void *)(hdr + 1);
+	functions = (void *)(modules + nr_modules);
+	strtab = (char *)(functions + nr_functions);
+
+	i = 0;
+	ktf_map_for_each_entry(cov, &cov_map, kmap) {
+		len = strlen(cov->kmap.key) + 1;
+		if (i == nr_modules || strtab_used + len > strtab_size) {
+			ktf_cov_put(cov);
+			break;
 		}
+		/* Only used to find the module index of the entries below */
+		covs[i] = cov;
+		m = &modules[i++];
+		memcpy(strtab + strtab_used, cov->kmap.key, len);
+		m->name = strtab_used;
+		strtab_used += len;
+		m->opts = cov->opts;
+		m->nr_called = atomic_read(&cov->count);
 	}
-	ktf_cov_cleanup_opts(cov);
-	ktf_cov_put(cov);
+
+	nr_functions_max = nr_functions;
+	nr_functions = 0;
+	ktf_map_for_each_entry(entry, &cov_entry_map, kmap) {
+		len = strlen(entry->cold->name) + 1;
+		if (nr_functions == nr_functions_max ||
+		    strtab_used + len > strtab_size) {
+			ktf_cov_entry_put(entry);
+			break;
+		}
+		if (!entry->cov)
+			continue;
+		/* Entries are sorted by address, so mostly from the same module */
+		if (entry->cov != last) {
+			for (last_idx = 0; last_idx < i; last_idx++)
+				if (covs[last_idx] == entry->cov)
+					break;
+			last = entry->cov;
+		}
+		if (last_idx == i)
+			continue;
+		f = &functions[nr_functions++];
+		f->address = entry->key.address;
+		f->size = entry->key.size;
+		memcpy(strtab + strtab_used, entry->cold->name, len);
+		f->name = strtab_used;
+		strtab_used += len;
+		f->module = last_idx;
+		f->hits = ktf_cov_entry_count(entry);
+		modules[last_idx].nr_functions++;
+	}
+	kfree(covs);
+
+	/* Close the gaps left by records that were not filled in */
+	if (i < nr_modules)
+		memmove(modules + i, functions, nr_functions * sizeof(*f));
+	if (i < nr_modules || nr_functions < nr_functions_max)
+		memmove((char *)(modules + i) + nr_functions * sizeof(*f),
+			strtab, strtab_used);
+
+	hdr->magic = KTF_COV_EXPORT_MAGIC;
+	hdr->version = KTF_COV_EXPORT_VERSION;
+	hdr->nr_modules = i;
+	hdr->nr_functions = nr_functions;
+	hdr->strtab_size = strtab_used;
+	*size = sizeof(*hdr) + i * sizeof(*m) + nr_functions * sizeof(*f) +
+		strtab_used;
+	return buf;
 }
+EXPORT_SYMBOL(ktf_cov_export);
 
 static void ktf_cov_mem_seq_print(struct seq_file *seq)
 {
+	unsigned int n, nr_entries;
+	unsigned long *entries;
 	struct ktf_cov_mem *m;
 	char buf[256];
-	int n;
 
 	seq_puts(seq, "\nMemory in use allocated by covered functions:\n\n");
+	seq_printf(seq, "Allocations not tracked: %lu (no free record) %lu (probe missed)\n\n",
+		   ktf_cov_mem_dropped(), ktf_cov_mem_missed());
 	seq_printf(seq, "%44s %16s %10s\n", "ALLOCATION STACK", "ADDRESS",
 		   "SIZE");
 	ktf_for_each_cov_mem(m) {
-		for (n = 0; n < m->nr_entries; n++) {
-			sprint_symbol(buf, m->stack_entries[n]);
+		nr_entries = ktf_cov_stack(m->stack, &entries);
+		if (!nr_entries)
+			seq_printf(seq, "%44s %16p %10lu\n", "-",
+				   (void *)m->key.address, m->key.size);
+		for (n = 0; n < nr_entries; n++) {
+			sprint_symbol(buf, entries[n]);
 			seq_printf(seq, "%44s", buf);
 			if (n == 0)
 				seq_printf(seq, " %16p %10lu",
@@ -654,6 +1873,76 @@ static void ktf_cov_mem_seq_print(struct seq_file *seq)
 	}
 }
 
+static DEFINE_MUTEX(cov_gen_lock);
+static u32 cov_gen;		/* Generation of the last delta query */
+
+/* Each query starts a new generation.  Unless it has been seen before,
+ * a change of the count of an entry is recorded with the generation of
+ * the query that notices it, so each later query from a caller that has
+ * not seen the change yet has a lower generation.
+ */
+int ktf_cov_delta(const char *spec, u32 since, u32 *gen, ktf_cov_hit_fn fn,
+		  void *data)
+{
+	struct ktf_cov_entry *entry;
+	unsigned int hits;
+	int ret = 0;
+
+	mutex_lock(&cov_gen_lock);
+	*gen = ++cov_gen;
+	ktf_map_for_each_entry(entry, &cov_entry_map, kmap) {
+		if (ret || !entry->cov ||
+		    !ktf_cov_match(spec, entry->cov->kmap.key))
+			continue;
+		hits = ktf_cov_entry_count(entry);
+		if (hits != entry->seen) {
+			entry->seen = hits;
+			entry->gen = *gen;
+		}
+		if (entry->gen > since)
+			ret = fn(data, entry->cov->kmap.key, entry->cold->name, hits, 0);
+	}
+	mutex_unlock(&cov_gen_lock);
+	return ret;
+}
+EXPORT_SYMBOL(ktf_cov_delta);
+
+static void ktf_cov_alloc_seq_print(struct seq_file *seq)
+{
+	struct ktf_cov_alloc_stats s;
+	struct ktf_cov_entry *entry;
+	bool header = false;
+	char buf[64];
+	int i;
+
+	ktf_map_for_each_entry(entry, &cov_entry_map, kmap) {
+		if (!ktf_cov_entry_alloc_stats(entry, &s) || !s.count)
+			continue;
+		if (!header) {
+			seq_puts(seq, "\nAllocations by covered functions:\n\n");
+			seq_printf(seq, "%10s %44s %10s %12s %8s %10s %10s\n",
+				   "MODULE", "FUNCTION", "COUNT", "BYTES",
+				   "FAILED", "AVG_NS", "MAX_NS");
+			header = true;
+		}
+		seq_printf(seq, "%10s %44s %10lu %12lu %8lu %10llu %10llu\n",
+			   entry->cov->kmap.key, entry->cold->name, s.count, s.bytes,
+			   s.failed,
+			   (unsigned long long)div64_u64(s.latency_ns, s.count),
+			   (unsigned long long)s.max_latency_ns);
+		for (i = 0; i < KTF_COV_ALLOC_HIST_SIZE; i++) {
+			if (!s.hist[i])
+				continue;
+			if (i == KTF_COV_ALLOC_HIST_SIZE - 1)
+				snprintf(buf, sizeof(buf), "%lu- bytes", 1UL << i);
+			else
+				snprintf(buf, sizeof(buf), "%lu-%lu bytes",
+					 1UL << i, (2UL << i) - 1);
+			seq_printf(seq, "%10s %44s %10lu\n", "", buf, s.hist[i]);
+		}
+	}
+}
+
 void ktf_cov_seq_print(struct seq_file *seq)
 {
 	struct ktf_cov_entry *entry;
@@ -663,14 +1952,15 @@ void ktf_cov_seq_print(struct seq_file *seq)
 		   "#CALLED");
 	ktf_map_for_each_entry(cov, &cov_map, kmap)
 		seq_printf(seq, "%10s %44d %10d\n",
-			   cov->kmap.key, cov->total, cov->count);
+			   cov->kmap.key, cov->total, atomic_read(&cov->count));
 
 	seq_printf(seq, "\n%10s %44s %10s\n", "MODULE", "FUNCTION", "COUNT");
 	ktf_map_for_each_entry(entry, &cov_entry_map, kmap)
-		seq_printf(seq, "%10s %44s %10d\n",
+		seq_printf(seq, "%10s %44s %10u\n",
 			   entry->cov ? entry->cov->kmap.key : "-",
-			   entry->name, entry->count);
+			   entry->cold->name, ktf_cov_entry_count(entry));
 
+	ktf_cov_alloc_seq_print(seq);
 	ktf_cov_mem_seq_print(seq);
 }
 
@@ -686,14 +1976,30 @@ inline void __kmem_cache_destroy_safe(struct kmem_cache *c)
 
 void ktf_cov_cleanup(void)
 {
+	struct ktf_cov_entry *entry;
 	struct ktf_cov *cov;
-	char name[KTF_MAX_KEY];
+	LIST_HEAD(probes);
 
-	ktf_map_for_each_entry(cov, &cov_map, kmap) {
-		ktf_cov_disable(ktf_map_elem_name(&cov->kmap, name));
+	ktf_cov_disable("*");
+	/* Coverage may have been enabled more than once for a module */
+	ktf_map_for_each_entry(entry, &cov_entry_map, kmap) {
+		if (entry->refcnt > 0) {
+			if (!entry->ftrace)
+				list_add_tail(&entry->batch, &probes);
+			entry->refcnt = 0;
+		}
 	}
+	ktf_cov_kprobes_unregister(&probes);
+	ktf_map_for_each_entry(cov, &cov_map, kmap)
+		ktf_cov_ftrace_stop(cov);
+	ktf_cov_index_replace(NULL);
+	ktf_cov_test_hits_clear();
 	ktf_map_delete_all(&cov_map);
 	ktf_map_delete_all(&cov_entry_map);
 	ktf_map_delete_all(&cov_mem_map);
+	/* Wait for deferred frees of entries and tracked allocations */
+	rcu_barrier();
+	ktf_cov_mem_pools_destroy();
 	kmem_cache_destroy(cov_mem_cache);
+	ktf_cov_stack_cleanup();
 }
@@ -12,20 +12,38 @@
 #include <linux/debugfs.h>
 #include <linux/module.h>
 #include <linux/kprobes.h>
+#include <linux/ftrace.h>
 #include "ktf.h"
 #include "ktf_map.h"
 
+/* Count function calls via a single ftrace_ops per covered module where
+ * possible, falling back to one kprobe per function otherwise:
+ */
+#if defined(CONFIG_DYNAMIC_FTRACE) && (KERNEL_VERSION(3, 7, 0) <= LINUX_VERSION_CODE)
+#define KTF_COV_FTRACE
+#endif
+
 enum ktf_cov_type {
 	KTF_COV_TYPE_MODULE,
 	KTF_COV_TYPE_MAX,
 };
 
+struct ktf_cov_entry;
+
 struct ktf_cov {
 	struct ktf_map_elem kmap;
 	enum ktf_cov_type type;		/* only modules supported for now. */
-	int count;			/* number of unique functions called */
+	atomic_t count;			/* number of unique functions called */
 	int total;			/* total number of functions */
 	unsigned int opts;
+	int enabled;			/* Enables not yet disabled */
+#ifdef KTF_COV_FTRACE
+	struct ftrace_ops fops;		/* Counts calls to the ftrace entries */
+	struct ktf_cov_entry **fentries; /* Enabled ftrace entries by address */
+	int nr_fentries;
+	bool fops_registered;
+#endif
+	struct list_head batch;		/* For enable/disable of many modules */
 };
 
 /* Key for coverage entries (functions) consists in function address _and_
@@ -38,29 +56,79 @@ struct ktf_cov_obj_key {
 };
 
 #define	KTF_COV_ENTRY_MAGIC		0xc07e8a5e
-struct ktf_cov_entry {
-	struct kprobe kprobe;
+
+/* The parts of a coverage entry only used when coverage is set up and
+ * reported, kept apart so that the entries looked up and counted on every
+ * call of a covered function stay small:
+ */
+struct ktf_cov_entry_cold {
+	struct kprobe kprobe;		/* Unless counted via ftrace */
 	int magic;			/* magic number identifying entry */
-	struct ktf_map_elem kmap;
-	char name[KTF_MAX_KEY];
-	struct ktf_cov_obj_key key;
+	struct ktf_cov_entry *entry;
+	char name[KTF_MAX_KEY];		/* Of the function */
+};
+
+struct ktf_cov_entry {
+	/* Used by the probes and by lookups of addresses: */
+	struct ktf_cov_obj_key key;	/* Address range of the function */
+	unsigned int __percpu *hits;	/* Number of calls per CPU */
+	int called;			/* Set at the first call */
+	bool ftrace;			/* Counted via cov's ftrace_ops */
+	unsigned long ip;		/* Current address, if ftrace */
 	struct ktf_cov *cov;
-	struct ktf_map cov_mem;
+	struct ktf_cov_alloc_stats __percpu *alloc; /* If KTF_COV_OPT_ALLOC */
+	struct ktf_map_elem kmap;	/* Refers to key in place */
+	/* Used for setup and reporting: */
+	struct ktf_cov_entry_cold *cold;
 	int refcnt;
-	int count;
+	unsigned int base;		/* Number of calls at last reset */
+	unsigned int seen;		/* Count at the last delta query... */
+	u32 gen;			/* ...that saw it change */
+	struct list_head batch;		/* Pending kprobe (un)registration */
 };
 
+/* Number of calls to the function of a coverage entry since last reset */
+unsigned int ktf_cov_entry_count(struct ktf_cov_entry *entry);
+
+/* Allocations via kmalloc()/kmem_cache_alloc() attributed to a function,
+ * since coverage was first enabled with KTF_COV_OPT_ALLOC.  Bucket n of
+ * the size histogram counts sizes from 2^n up to 2^(n+1) - 1 bytes,
+ * the last bucket also all larger sizes.
+ */
+#define KTF_COV_ALLOC_HIST_SIZE		24
+
+struct ktf_cov_alloc_stats {
+	unsigned long count;
+	unsigned long failed;		/* Allocations that returned NULL */
+	unsigned long bytes;		/* Bytes successfully allocated */
+	u64 latency_ns;			/* Total time spent in the allocator */
+	u64 max_latency_ns;
+	unsigned long hist[KTF_COV_ALLOC_HIST_SIZE];
+};
+
+/* Sum of the per-CPU allocation statistics of an entry.
+ * Returns false if allocations are not profiled for the entry.
+ */
+bool ktf_cov_entry_alloc_stats(struct ktf_cov_entry *entry,
+			       struct ktf_cov_alloc_stats *stats);
+
 #define KTF_COV_MAX_STACK_DEPTH		32
 
 struct ktf_cov_mem {
 	struct ktf_map_elem kmap;
 	struct ktf_cov_obj_key key;
 	unsigned long flags;
-	unsigned int nr_entries;
-	unsigned long stack_entries[KTF_COV_MAX_STACK_DEPTH];
+	u32 stack;			/* Allocation stack, see ktf_cov_stack() */
 };
 
-#define	KTF_COV_MEM_IGNORE	0x1	/* avoid recursive enter */
+/* Allocation stacks are stored once and shared by all allocations with the
+ * same stack. Returns the number of entries of the stack with the handle.
+ */
+unsigned int ktf_cov_stack(u32 handle, unsigned long **entries);
+
+/* Number of allocations from covered functions that were not tracked */
+unsigned long ktf_cov_mem_dropped(void);	/* No tracking object free */
+unsigned long ktf_cov_mem_missed(void);		/* Missed by the kretprobes */
 
 struct ktf_cov_mem_probe {
 	const char *name;
@@ -85,9 +153,43 @@ void ktf_cov_mem_put(struct ktf_cov_mem *);
 void ktf_cov_mem_get(struct ktf_cov_mem *);
 
 void ktf_cov_seq_print(struct seq_file *);
+
+/* Snapshot of the coverage in the binary format of ktf_cov_export_hdr,
+ * in a buffer from vmalloc_user() to be freed with vfree():
+ */
+void *ktf_cov_export(size_t *size);
 void ktf_cov_cleanup(void);
 
+/* Modules are given as a comma separated list of names; names may
+ * contain the '*' and '?' wildcards.
+ */
 int ktf_cov_enable(const char *, unsigned int);
 void ktf_cov_disable(const char *);
 
+/* Reset the counts of the modules, and all per test counts */
+void ktf_cov_reset(const char *);
+
+/* Report the functions called since the last reset through fn: The counts
+ * per function, followed by the counts per test run (test_id != 0) of
+ * modules with coverage enabled with KTF_COV_OPT_TEST.  Stops at the first
+ * error returned from fn.
+ */
+typedef int (*ktf_cov_hit_fn)(void *data, const char *module,
+			      const char *function, u32 hits, u32 test_id);
+int ktf_cov_snapshot(const char *, ktf_cov_hit_fn fn, void *data);
+
+/* Report through fn only the counts of functions that changed since the
+ * generation since, as returned in *gen from an earlier call.  Any number
+ * of callers can follow the counts this way, each with its own generation.
+ */
+int ktf_cov_delta(const char *, u32 since, u32 *gen, ktf_cov_hit_fn fn,
+		  void *data);
+
+/* Count the hits of the test run with id test_id (see KTF_ID()) separately.
+ * Returns NULL if no coverage is counted per test.
+ */
+struct ktf_cov_hits;
+struct ktf_cov_hits *ktf_cov_test_start(u32 test_id);
+void ktf_cov_test_end(struct ktf_cov_hits *hits);
+
 #endif
@@ -7,10 +7,17 @@
 #include <asm/unistd.h>
 #include <linux/module.h>
 #include <linux/time.h>
+#include <linux/ktime.h>
+#include <linux/version.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include "ktf_debugfs.h"
 #include "ktf.h"
 #include "ktf_test.h"
 #include "ktf_cov.h"
+#include "ktf_shm.h"
+#include "ktf_compat.h"
 
 /* Create a debugfs representation of test sets/tests.  Hierarchy looks like
  * this:
@@ -25,23 +32,40 @@
  *						Show results of last run for
  *						test
  *
+ * The files of individual tests are created in the background by
+ * ktf_debugfs_work, to keep module load time independent of
+ * the number of tests it adds.
  */
 
 static struct dentry *ktf_debugfs_rootdir;
 static struct dentry *ktf_debugfs_rundir;
 static struct dentry *ktf_debugfs_resultsdir;
 static struct dentry *ktf_debugfs_cov_file;
+static struct dentry *ktf_debugfs_cov_bin_file;
+static struct dentry *ktf_debugfs_shm_file;
+
+/* Tests added but without debugfs files yet, protected by ktf_debugfs_lock */
+static LIST_HEAD(ktf_debugfs_pending);
+static DEFINE_MUTEX(ktf_debugfs_lock);
+static void ktf_debugfs_populate(struct work_struct *work);
+static DECLARE_WORK(ktf_debugfs_work, ktf_debugfs_populate);
 
 static void ktf_debugfs_print_result(struct seq_file *seq, struct ktf_test *t)
 {
-	struct timespec now;
+	unsigned long flags;
 
-	if (t && strlen(t->log) > 0) {
-		getnstimeofday(&now);
-		seq_printf(seq, "[%s/%s, %ld seconds ago] %s\n",
+	if (!t)
+		return;
+	/* The log may be reallocated by a failing assertion */
+	spin_lock_irqsave(&t->log_lock, flags);
+	if (t->log_len > 0) {
+		seq_printf(seq, "[%s/%s, %llu seconds ago, %llu ns, %u iterations, max %llu ns] %s\n",
 			   t->tclass, t->name,
-			   now.tv_sec - t->lastrun.tv_sec, t->log);
+			   div_u64(ktime_get_ns() - t->lastrun, NSEC_PER_SEC),
+			   t->time.run_ns, t->time.iterations, t->time.iter_max_ns,
+			   t->log);
 	}
+	spin_unlock_irqrestore(&t->log_lock, flags);
 }
 
 /* /sys/kernel/debug/ktf/results/<testset>-tests/<test> shows specific result */
@@ -157,7 +181,8 @@ static void _ktf_debugfs_destroy_test(struct ktf_test *t)
 	memset(&t->debugfs, 0, sizeof(t->debugfs));
 }
 
-void ktf_debugfs_create_test(struct ktf_test *t)
+/* Called with ktf_debugfs_lock held */
+static void _ktf_debugfs_create_test(struct ktf_test *t)
 {
 	struct ktf_case *testset = ktf_case_find(t->tclass);
 
@@ -176,20 +201,57 @@ void ktf_debugfs_create_test(struct ktf_test *t)
 			debugfs_create_file(t->name, S_IFREG | 0444,
 					    testset->debugfs.debugfs_run_test,
 				 t, &ktf_run_test_fops);
-		if (!t->debugfs.debugfs_run_test) {
+		if (!t->debugfs.debugfs_run_test)
 			_ktf_debugfs_destroy_test(t);
-		} else {
-			/* Take reference for test for debugfs */
-			ktf_test_get(t);
-		}
 	}
 	/* Drop reference to testset from ktf_case_find(). */
 	ktf_case_put(testset);
 }
 
+static void ktf_debugfs_populate(struct work_struct *work)
+{
+	struct ktf_test *t;
+	unsigned int n = 0;
+
+	mutex_lock(&ktf_debugfs_lock);
+	while (!list_empty(&ktf_debugfs_pending)) {
+		t = list_first_entry(&ktf_debugfs_pending, struct ktf_test,
+				     debugfs_pending);
+		list_del_init(&t->debugfs_pending);
+		_ktf_debugfs_create_test(t);
+		n++;
+		cond_resched();
+	}
+	mutex_unlock(&ktf_debugfs_lock);
+	tlog(T_DEBUG, "Created debugfs files for %u tests", n);
+}
+
+/* Queue the test for creation of its debugfs files */
+void ktf_debugfs_create_test(struct ktf_test *t)
+{
+	/* Take reference for test for debugfs, pending or not */
+	ktf_test_get(t);
+	mutex_lock(&ktf_debugfs_lock);
+	list_add_tail(&t->debugfs_pending, &ktf_debugfs_pending);
+	mutex_unlock(&ktf_debugfs_lock);
+	schedule_work(&ktf_debugfs_work);
+}
+
+void ktf_debugfs_flush(void)
+{
+	flush_work(&ktf_debugfs_work);
+}
+EXPORT_SYMBOL(ktf_debugfs_flush);
+
 void ktf_debugfs_destroy_test(struct ktf_test *t)
 {
-	_ktf_debugfs_destroy_test(t);
+	mutex_lock(&ktf_debugfs_lock);
+	/* A test removed before its files were created has none to remove */
+	if (!list_empty(&t->debugfs_pending))
+		list_del_init(&t->debugfs_pending);
+	else
+		_ktf_debugfs_destroy_test(t);
+	mutex_unlock(&ktf_debugfs_lock);
 	/* Release reference now debugfs files are gone. */
 	ktf_test_put(t);
 }
@@ -319,9 +381,78 @@ static const struct file_operations ktf_cov_fops = {
 	.release = ktf_debugfs_release,
 };
 
+#if (KERNEL_VERSION(4, 7, 0) > LINUX_VERSION_CODE)
+#define debugfs_create_file_unsafe debugfs_create_file
+#endif
+
+/* /sys/kernel/debug/ktf/coverage.bin has the same statistics in the binary
+ * format of struct ktf_cov_export_hdr, to be read or mmap'ed:
+ */
+struct ktf_cov_bin {
+	void *buf;
+	size_t size;
+};
+
+static int ktf_cov_bin_open(struct inode *inode, struct file *file)
+{
+	struct ktf_cov_bin *bin;
+
+	if (!try_module_get(THIS_MODULE))
+		return -EIO;
+
+	bin = kzalloc(sizeof(*bin), GFP_KERNEL);
+	if (bin)
+		bin->buf = ktf_cov_export(&bin->size);
+	if (!bin || !bin->buf) {
+		kfree(bin);
+		module_put(THIS_MODULE);
+		return -ENOMEM;
+	}
+	file->private_data = bin;
+	return 0;
+}
+
+static ssize_t ktf_cov_bin_read(struct file *file, char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	struct ktf_cov_bin *bin = file->private_data;
+
+	return simple_read_from_buffer(buf, count, ppos, bin->buf, bin->size);
+}
+
+static int ktf_cov_bin_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct ktf_cov_bin *bin = file->private_data;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	return remap_vmalloc_range(vma, bin->buf, vma->vm_pgoff);
+}
+
+static int ktf_cov_bin_release(struct inode *inode, struct file *file)
+{
+	struct ktf_cov_bin *bin = file->private_data;
+
+	vfree(bin->buf);
+	kfree(bin);
+	module_put(THIS_MODULE);
+	return 0;
+}
+
+static const struct file_operations ktf_cov_bin_fops = {
+	.open = ktf_cov_bin_open,
+	.read = ktf_cov_bin_read,
+	.mmap = ktf_cov_bin_mmap,
+	.llseek = default_llseek,
+	.release = ktf_cov_bin_release,
+};
+
 void ktf_debugfs_cleanup(void)
 {
 	tlog(T_DEBUG, "Removing ktf debugfs dirs...");
+	cancel_work_sync(&ktf_debugfs_work);
+	debugfs_remove(ktf_debugfs_shm_file);
+	debugfs_remove(ktf_debugfs_cov_bin_file);
 	debugfs_remove(ktf_debugfs_cov_file);
 	debugfs_remove(ktf_debugfs_rundir);
 	debugfs_remove(ktf_debugfs_resultsdir);
@@ -347,7 +478,25 @@ void ktf_debugfs_init(void)
 						   ktf_debugfs_rootdir,
 						   NULL,
 						   &ktf_cov_fops);
-	if (ktf_debugfs_cov_file)
+	if (!ktf_debugfs_cov_file)
+		goto err;
+	/* The proxy fops of debugfs_create_file() does not support mmap -
+	 * the buffer of an open file does not depend on the file staying around.
+	 */
+	ktf_debugfs_cov_bin_file = debugfs_create_file_unsafe(KTF_DEBUGFS_COV_BIN,
+							      S_IFREG | 0444,
+							      ktf_debugfs_rootdir,
+							      NULL,
+							      &ktf_cov_bin_fops);
+	if (!ktf_debugfs_cov_bin_file)
+		goto err;
+	/* Shared buffers for hybrid test data, to be mmap'ed - see ktf_shm.h */
+	ktf_debugfs_shm_file = debugfs_create_file_unsafe(KTF_DEBUGFS_SHM,
+							  S_IFREG | 0600,
+							  ktf_debugfs_rootdir,
+							  NULL,
+							  &ktf_shm_fops);
+	if (ktf_debugfs_shm_file)
 		return;
 err:
 	terr("Could not init %s\n", KTF_DEBUGFS_ROOT);
@@ -15,6 +15,8 @@
 #define KTF_DEBUGFS_RUN                         "run"
 #define KTF_DEBUGFS_RESULTS                     "results"
 #define KTF_DEBUGFS_COV				"coverage"
+#define KTF_DEBUGFS_COV_BIN			"coverage.bin"
+#define KTF_DEBUGFS_SHM				"shm"
 #define KTF_DEBUGFS_TESTS_SUFFIX                "-tests"
 
 #define KTF_DEBUGFS_NAMESZ                      256
@@ -24,6 +26,8 @@ struct ktf_case;
 
 void ktf_debugfs_create_test(struct ktf_test *);
 void ktf_debugfs_destroy_test(struct ktf_test *);
+/* Wait for the debugfs files of the tests added so far to be created */
+void ktf_debugfs_flush(void);
 void ktf_debugfs_create_testset(struct ktf_case *);
 void ktf_debugfs_destroy_testset(struct ktf_case *);
 void ktf_debugfs_init(void);
@@ -0,0 +1,174 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_latency.c: Function latency histograms for KTF.
+ */
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/version.h>
+#include "ktf.h"
+#include "ktf_latency.h"
+#include "ktf_compat.h"
+
+#if (KERNEL_VERSION(5, 11, 0) > LINUX_VERSION_CODE)
+#define get_kretprobe(ri) ((ri)->rp)
+#endif
+
+/* Durations below KTF_LAT_SUB ns have a bucket each, above that each
+ * power of 2 has KTF_LAT_SUB buckets.
+ */
+static unsigned int ktf_latency_bucket(u64 ns)
+{
+	unsigned int shift;
+
+	if (ns < KTF_LAT_SUB)
+		return ns;
+	if (ns >> KTF_LAT_MAX_BITS)
+		return KTF_LAT_BUCKETS - 1;
+	shift = fls64(ns) - 1 - KTF_LAT_SUB_BITS;
+	return shift * KTF_LAT_SUB + (ns >> shift);
+}
+
+/* Largest duration counted in bucket i */
+static u64 ktf_latency_bucket_max(unsigned int i)
+{
+	unsigned int shift;
+
+	if (i < KTF_LAT_SUB)
+		return i;
+	shift = i / KTF_LAT_SUB - 1;
+	return ((u64)(i % KTF_LAT_SUB + KTF_LAT_SUB + 1) << shift) - 1;
+}
+
+static int ktf_latency_entry(struct kretprobe_instance *ri, struct pt_regs *regs)
+{
+	*(u64 *)ri->data = ktime_get_ns();
+	return 0;
+}
+
+/* Probe handlers run with preemption disabled and do not nest */
+static int ktf_latency_return(struct kretprobe_instance *ri, struct pt_regs *regs)
+{
+	struct ktf_latency *lat = container_of(get_kretprobe(ri), struct ktf_latency,
+					       kretprobe);
+	struct ktf_latency_hist *h = this_cpu_ptr(lat->hist);
+	u64 ns = ktime_get_ns() - *(u64 *)ri->data;
+
+	h->count++;
+	h->sum_ns += ns;
+	if (ns > h->max_ns)
+		h->max_ns = ns;
+	h->buckets[ktf_latency_bucket(ns)]++;
+	return 0;
+}
+
+int ktf_latency_probe(struct ktf_latency *lat, const char *func)
+{
+	int ret;
+
+#ifndef KTF_PROBE_SUPPORT
+	return ktf_no_probe_support();
+#endif
+	memset(lat, 0, sizeof(*lat));
+	lat->hist = alloc_percpu(struct ktf_latency_hist);
+	if (!lat->hist)
+		return -ENOMEM;
+	lat->kretprobe.kp.symbol_name = func;
+	lat->kretprobe.entry_handler = ktf_latency_entry;
+	lat->kretprobe.handler = ktf_latency_return;
+	lat->kretprobe.data_size = sizeof(u64);
+	/* The function may sleep; allow for more than one call per CPU */
+	lat->kretprobe.maxactive = max_t(int, 64, 4 * num_possible_cpus());
+	ret = register_kretprobe(&lat->kretprobe);
+	if (ret) {
+		tlog(T_DEBUG, "%d: failed to register retprobe for %s", ret, func);
+		free_percpu(lat->hist);
+		lat->hist = NULL;
+	}
+	return ret;
+}
+EXPORT_SYMBOL(ktf_latency_probe);
+
+void ktf_latency_unprobe(struct ktf_latency *lat)
+{
+	if (!lat->hist)
+		return;
+	unregister_kretprobe(&lat->kretprobe);
+	if (lat->kretprobe.nmissed)
+		tlog(T_INFO, "%s: retprobe missed %d.",
+		     lat->kretprobe.kp.symbol_name, lat->kretprobe.nmissed);
+	free_percpu(lat->hist);
+	lat->hist = NULL;
+}
+EXPORT_SYMBOL(ktf_latency_unprobe);
+
+void ktf_latency_reset(struct ktf_latency *lat)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(lat->hist, cpu), 0, sizeof(struct ktf_latency_hist));
+}
+EXPORT_SYMBOL(ktf_latency_reset);
+
+u64 ktf_latency_count(struct ktf_latency *lat)
+{
+	u64 count = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		count += READ_ONCE(per_cpu_ptr(lat->hist, cpu)->count);
+	return count;
+}
+EXPORT_SYMBOL(ktf_latency_count);
+
+u64 ktf_latency_max(struct ktf_latency *lat)
+{
+	u64 max_ns = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		max_ns = max(max_ns, READ_ONCE(per_cpu_ptr(lat->hist, cpu)->max_ns));
+	return max_ns;
+}
+EXPORT_SYMBOL(ktf_latency_max);
+
+u64 ktf_latency_avg(struct ktf_latency *lat)
+{
+	u64 sum_ns = 0, count = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		sum_ns += READ_ONCE(per_cpu_ptr(lat->hist, cpu)->sum_ns);
+		count += READ_ONCE(per_cpu_ptr(lat->hist, cpu)->count);
+	}
+	return count ? div64_u64(sum_ns, count) : 0;
+}
+EXPORT_SYMBOL(ktf_latency_avg);
+
+u64 ktf_latency_percentile(struct ktf_latency *lat, unsigned int permille)
+{
+	u64 count = 0, rank, seen = 0;
+	unsigned int i;
+	int cpu;
+
+	/* Counts only grow while being summed, so the rank is always reached */
+	for (i = 0; i < KTF_LAT_BUCKETS; i++)
+		for_each_possible_cpu(cpu)
+			count += READ_ONCE(per_cpu_ptr(lat->hist, cpu)->buckets[i]);
+	if (!count)
+		return 0;
+	rank = max_t(u64, div64_u64(count * min(permille, 1000U) + 999, 1000), 1);
+
+	for (i = 0; i < KTF_LAT_BUCKETS; i++) {
+		for_each_possible_cpu(cpu)
+			seen += READ_ONCE(per_cpu_ptr(lat->hist, cpu)->buckets[i]);
+		if (seen >= rank)
+			break;
+	}
+	return ktf_latency_bucket_max(min_t(unsigned int, i, KTF_LAT_BUCKETS - 1));
+}
+EXPORT_SYMBOL(ktf_latency_percentile);
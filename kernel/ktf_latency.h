@@ -0,0 +1,77 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_latency.h: Function latency histograms for KTF.
+ *
+ * Time each call to a function from entry to return via a kretprobe, and
+ * count the durations per CPU in a log-linear histogram: Each power of 2
+ * range of nanoseconds is split in KTF_LAT_SUB linear buckets, so that a
+ * percentile is known within 1/KTF_LAT_SUB (about 6%) of its value.
+ * Entry and return are paired per task by the kretprobe instance.
+ */
+#ifndef KTF_LATENCY_H
+#define KTF_LATENCY_H
+#include <linux/kprobes.h>
+#include "ktf.h"
+
+#define KTF_LAT_SUB_BITS	4
+#define KTF_LAT_SUB		(1 << KTF_LAT_SUB_BITS)
+#define KTF_LAT_MAX_BITS	40	/* Durations above ~18 minutes are capped */
+#define KTF_LAT_BUCKETS		((KTF_LAT_MAX_BITS - KTF_LAT_SUB_BITS + 1) * KTF_LAT_SUB)
+
+struct ktf_latency_hist {
+	u64 count;
+	u64 sum_ns;
+	u64 max_ns;
+	u32 buckets[KTF_LAT_BUCKETS];
+};
+
+struct ktf_latency {
+	struct kretprobe kretprobe;
+	struct ktf_latency_hist __percpu *hist;
+};
+
+/* Start timing calls to func (a kernel or module symbol) */
+int ktf_latency_probe(struct ktf_latency *lat, const char *func);
+void ktf_latency_unprobe(struct ktf_latency *lat);
+
+/* Forget the calls timed so far - not exact with calls in progress */
+void ktf_latency_reset(struct ktf_latency *lat);
+
+u64 ktf_latency_count(struct ktf_latency *lat);
+u64 ktf_latency_max(struct ktf_latency *lat);
+u64 ktf_latency_avg(struct ktf_latency *lat);
+
+/* Upper bound in ns of the duration of the given fraction of the calls,
+ * in parts per thousand: 500 is the median, 990 is p99 and 999 p99.9.
+ * 0 if no calls have been timed.
+ */
+u64 ktf_latency_percentile(struct ktf_latency *lat, unsigned int permille);
+
+/* Assert that at least one call was timed, and that the permille
+ * percentile of the durations is within a budget of NS nanoseconds:
+ */
+#define ktf_assert_latency(L, P, NS)					\
+	({ struct ktf_latency *__l = (L); unsigned int __p = (P);	\
+	   u64 __ns = (NS), __v = ktf_latency_percentile(__l, __p);	\
+	   ktf_assert_msg(ktf_latency_count(__l) && __v <= __ns,	\
+		"Latency of %s at p%u.%u is %llu ns (%llu calls), budget %llu ns", \
+		__l->kretprobe.kp.symbol_name, __p / 10, __p % 10,	\
+		(unsigned long long)__v,				\
+		(unsigned long long)ktf_latency_count(__l),		\
+		(unsigned long long)__ns); })
+
+#define EXPECT_LATENCY_LE(L, P, NS) ktf_assert_latency(L, P, NS)
+
+#define ASSERT_LATENCY_LE(L, P, NS) do {	\
+		if (!ktf_assert_latency(L, P, NS))	\
+			return;			\
+	} while (0)
+
+#define ASSERT_LATENCY_LE_GOTO(L, P, NS, _lbl) do {	\
+		if (!ktf_assert_latency(L, P, NS))	\
+			goto _lbl;			\
+	} while (0)
+
+#endif
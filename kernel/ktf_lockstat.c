@@ -0,0 +1,284 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_lockstat.c: Lock contention profiles of test runs.
+ */
+#include <linux/err.h>
+#include <linux/hash.h>
+#include <linux/module.h>
+#include <linux/sched.h>
+#include <linux/sched/clock.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/stacktrace.h>
+#include <linux/tracepoint.h>
+#include <linux/vmalloc.h>
+#include <linux/version.h>
+#include "ktf.h"
+#include "ktf_lockstat.h"
+
+#if defined(CONFIG_TRACEPOINTS) && defined(CONFIG_STACKTRACE) && \
+	(KERNEL_VERSION(5, 19, 0) <= LINUX_VERSION_CODE)
+#define KTF_LOCKSTAT_SUPPORT
+#endif
+
+/* A task waiting for a contended lock, between contention_begin and
+ * contention_end. The task may sleep, and end on another CPU.
+ */
+struct ktf_lock_waiter {
+	struct task_struct *task;	/* NULL if the slot is free */
+	void *lock;
+	u64 start;
+	struct ktf_lock_entry *entry;
+};
+
+struct ktf_lock_entry {
+	unsigned long key;		/* Hash of lock and caller, 0 if unused */
+	void *lock;
+	unsigned long caller[KTF_LOCK_FRAMES];
+	u32 flags;
+	atomic64_t count;
+	atomic64_t wait_ns;
+	atomic64_t max_ns;
+};
+
+struct ktf_lock_tp {
+	const char *name;
+	void *probe;
+	struct tracepoint *tp;
+};
+
+#ifdef KTF_LOCKSTAT_SUPPORT
+/* The probes run inside the lock slow paths, maybe with interrupts off:
+ * The tables are updated lock free, and local_clock() is used since it
+ * takes no locks.
+ */
+static struct ktf_lock_entry *ktf_lock_entry_get(struct ktf_lockstat *ls, void *lock,
+						 unsigned int flags)
+{
+	unsigned long entries[KTF_LOCK_FRAMES + 8];
+	unsigned long caller[KTF_LOCK_FRAMES] = { 0 };
+	struct ktf_lock_entry *e;
+	unsigned int n, i, f = 0, slot;
+	unsigned long key;
+
+	/* Skip the probe, the tracepoint and the locking code */
+	n = stack_trace_save(entries, ARRAY_SIZE(entries), 2);
+	for (i = 0; i < n && f < KTF_LOCK_FRAMES; i++) {
+		if (!f && (in_lock_functions(entries[i]) ||
+			   within_module(entries[i], THIS_MODULE)))
+			continue;
+		caller[f++] = entries[i];
+	}
+	key = hash_ptr(lock, BITS_PER_LONG);
+	for (i = 0; i < KTF_LOCK_FRAMES; i++)
+		key = hash_long(key ^ caller[i], BITS_PER_LONG);
+	key = key ?: 1;
+
+	slot = hash_long(key, ilog2(KTF_LOCK_ENTRIES));
+	for (i = 0; i < KTF_LOCK_ENTRIES; i++) {
+		e = &ls->entries[(slot + i) % KTF_LOCK_ENTRIES];
+		if (READ_ONCE(e->key) == key)
+			return e;
+		if (!READ_ONCE(e->key) && !cmpxchg(&e->key, 0, key)) {
+			/* Only read after the probes are unregistered */
+			e->lock = lock;
+			memcpy(e->caller, caller, sizeof(caller));
+			e->flags = flags;
+			return e;
+		}
+		if (READ_ONCE(e->key) == key)
+			return e;
+	}
+	return NULL;
+}
+
+static void ktf_lock_begin(void *data, void *lock, unsigned int flags)
+{
+	struct ktf_lockstat *ls = data;
+	struct ktf_lock_waiter *w;
+	unsigned int i, slot;
+
+	if (in_nmi())
+		return;
+	slot = hash_ptr(current, ilog2(KTF_LOCK_WAITERS));
+	for (i = 0; i < KTF_LOCK_WAITERS; i++) {
+		w = &ls->waiters[(slot + i) % KTF_LOCK_WAITERS];
+		if (!READ_ONCE(w->task) && !cmpxchg(&w->task, NULL, current)) {
+			w->lock = lock;
+			w->entry = ktf_lock_entry_get(ls, lock, flags);
+			w->start = local_clock();
+			if (!w->entry) {
+				smp_store_release(&w->task, NULL);
+				break;
+			}
+			return;
+		}
+	}
+	atomic64_inc(&ls->dropped);
+}
+
+static void ktf_lock_end(void *data, void *lock, int ret)
+{
+	struct ktf_lockstat *ls = data;
+	struct ktf_lock_waiter *w;
+	unsigned int i, slot;
+	s64 ns, max;
+
+	if (in_nmi())
+		return;
+	slot = hash_ptr(current, ilog2(KTF_LOCK_WAITERS));
+	for (i = 0; i < KTF_LOCK_WAITERS; i++) {
+		w = &ls->waiters[(slot + i) % KTF_LOCK_WAITERS];
+		if (READ_ONCE(w->task) != current || w->lock != lock)
+			continue;
+		ns = max_t(s64, local_clock() - w->start, 0);
+		atomic64_inc(&w->entry->count);
+		atomic64_add(ns, &w->entry->wait_ns);
+		max = atomic64_read(&w->entry->max_ns);
+		while (ns > max) {
+			s64 old = atomic64_cmpxchg(&w->entry->max_ns, max, ns);
+
+			if (old == max)
+				break;
+			max = old;
+		}
+		smp_store_release(&w->task, NULL);
+		return;
+	}
+	/* The contention began before we started, or was dropped */
+}
+
+static void ktf_lock_find_tp(struct tracepoint *tp, void *priv)
+{
+	struct ktf_lock_tp *ltp;
+
+	for (ltp = priv; ltp->name; ltp++)
+		if (!strcmp(tp->name, ltp->name))
+			ltp->tp = tp;
+}
+
+static int ktf_lock_report_cmp(const void *a, const void *b)
+{
+	const struct ktf_lock_report *x = a, *y = b;
+
+	return x->wait_ns > y->wait_ns ? -1 : x->wait_ns < y->wait_ns;
+}
+
+static void ktf_lock_report_fill(struct ktf_lock_report *r, const struct ktf_lock_entry *e)
+{
+	size_t len = 0;
+	int i;
+
+	snprintf(r->lock, sizeof(r->lock), "%pS", e->lock);
+	r->caller[0] = '\0';
+	for (i = 0; i < KTF_LOCK_FRAMES && e->caller[i]; i++)
+		len += scnprintf(r->caller + len, sizeof(r->caller) - len, "%s%pS",
+				 i ? " <- " : "", (void *)e->caller[i]);
+	r->flags = e->flags;
+	r->count = atomic64_read(&e->count);
+	r->wait_ns = atomic64_read(&e->wait_ns);
+	r->max_ns = atomic64_read(&e->max_ns);
+}
+
+/* Each profile registers the probes with itself as data, so concurrent
+ * test runs can each have a profile.
+ */
+static struct ktf_lock_tp ktf_lock_tps[] = {
+	{ .name = "contention_begin", .probe = ktf_lock_begin },
+	{ .name = "contention_end", .probe = ktf_lock_end },
+	{ .name = NULL }
+};
+static DEFINE_MUTEX(ktf_lock_mutex);	/* Serializes the tracepoint lookup */
+#endif
+
+struct ktf_lockstat *ktf_lockstat_start(void)
+{
+#ifdef KTF_LOCKSTAT_SUPPORT
+	struct ktf_lockstat *ls;
+	struct ktf_lock_tp *ltp;
+	int ret = 0;
+
+	ls = kzalloc(sizeof(*ls), GFP_KERNEL);
+	if (!ls)
+		return ERR_PTR(-ENOMEM);
+	ls->waiters = vzalloc(KTF_LOCK_WAITERS * sizeof(*ls->waiters));
+	ls->entries = vzalloc(KTF_LOCK_ENTRIES * sizeof(*ls->entries));
+	if (!ls->waiters || !ls->entries) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	mutex_lock(&ktf_lock_mutex);
+	if (!ktf_lock_tps[0].tp)
+		for_each_kernel_tracepoint(ktf_lock_find_tp, ktf_lock_tps);
+	mutex_unlock(&ktf_lock_mutex);
+	for (ltp = ktf_lock_tps; ltp->name; ltp++) {
+		ret = ltp->tp ? tracepoint_probe_register(ltp->tp, ltp->probe, ls) : -EOPNOTSUPP;
+		if (ret) {
+			while (ltp-- != ktf_lock_tps)
+				tracepoint_probe_unregister(ltp->tp, ltp->probe, ls);
+			tracepoint_synchronize_unregister();
+			goto fail;
+		}
+	}
+	return ls;
+fail:
+	tlog(T_DEBUG, "Unable to profile lock contention: %d", ret);
+	ktf_lockstat_free(ls);
+	return ERR_PTR(ret);
+#else
+	return ERR_PTR(-EOPNOTSUPP);
+#endif
+}
+EXPORT_SYMBOL(ktf_lockstat_start);
+
+void ktf_lockstat_stop(struct ktf_lockstat *ls)
+{
+#ifdef KTF_LOCKSTAT_SUPPORT
+	struct ktf_lock_report *r;
+	struct ktf_lock_tp *ltp;
+	unsigned int i;
+
+	for (ltp = ktf_lock_tps; ltp->name; ltp++)
+		tracepoint_probe_unregister(ltp->tp, ltp->probe, ls);
+	tracepoint_synchronize_unregister();
+
+	/* Keep the KTF_LOCK_TOP entries with the longest waits */
+	r = kmalloc(sizeof(*r), GFP_KERNEL);
+	if (!r)
+		return;
+	ls->nr_top = 0;
+	for (i = 0; i < KTF_LOCK_ENTRIES; i++) {
+		struct ktf_lock_entry *e = &ls->entries[i];
+		u64 wait_ns = atomic64_read(&e->wait_ns);
+
+		if (!e->key || !atomic64_read(&e->count))
+			continue;
+		if (ls->nr_top == KTF_LOCK_TOP &&
+		    wait_ns <= ls->top[KTF_LOCK_TOP - 1].wait_ns)
+			continue;
+		ktf_lock_report_fill(r, e);
+		if (ls->nr_top < KTF_LOCK_TOP)
+			ls->nr_top++;
+		ls->top[ls->nr_top - 1] = *r;
+		sort(ls->top, ls->nr_top, sizeof(*r), ktf_lock_report_cmp, NULL);
+	}
+	kfree(r);
+	if (atomic64_read(&ls->dropped))
+		tlog(T_INFO, "Lock profile full: %lld contentions not recorded",
+		     (long long)atomic64_read(&ls->dropped));
+#endif
+}
+EXPORT_SYMBOL(ktf_lockstat_stop);
+
+void ktf_lockstat_free(struct ktf_lockstat *ls)
+{
+	if (IS_ERR_OR_NULL(ls))
+		return;
+	vfree(ls->waiters);
+	vfree(ls->entries);
+	kfree(ls);
+}
+EXPORT_SYMBOL(ktf_lockstat_free);
@@ -0,0 +1,58 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_lockstat.h: Lock contention profiles of test runs.
+ *
+ * While a run with KTF_PERF_LOCKS requested is in progress, the
+ * contention_begin and contention_end tracepoints are hooked, and the time
+ * spent waiting for contended locks anywhere in the system is summed per
+ * lock and caller.  The locks waited for the longest are reported with the
+ * results of the test.  Locks are identified by address, which resolves
+ * to a symbol for statically allocated locks, and the caller by the first
+ * KTF_LOCK_FRAMES return addresses outside of the locking code.
+ */
+#ifndef KTF_LOCKSTAT_H
+#define KTF_LOCKSTAT_H
+#include <linux/atomic.h>
+#include <linux/types.h>
+
+#define KTF_LOCK_FRAMES		4
+#define KTF_LOCK_WAITERS	1024	/* Contended locks being waited for */
+#define KTF_LOCK_ENTRIES	512	/* Distinct lock and caller pairs */
+#define KTF_LOCK_TOP		8	/* Entries reported */
+#define KTF_LOCK_NAME_LEN	96
+#define KTF_LOCK_CALLER_LEN	256
+
+struct ktf_lock_entry;
+struct ktf_lock_waiter;
+
+/* A reported entry, with the lock and caller resolved to symbols */
+struct ktf_lock_report {
+	char lock[KTF_LOCK_NAME_LEN];
+	char caller[KTF_LOCK_CALLER_LEN];
+	u32 flags;		/* LCB_F_* type of lock */
+	u64 count;		/* Times contended */
+	u64 wait_ns;		/* Total time waited */
+	u64 max_ns;
+};
+
+struct ktf_lockstat {
+	struct ktf_lock_waiter *waiters;
+	struct ktf_lock_entry *entries;
+	atomic64_t dropped;	/* Contentions not recorded: The tables are full */
+	u32 nr_top;
+	struct ktf_lock_report top[KTF_LOCK_TOP]; /* By decreasing wait_ns */
+};
+
+/* Start profiling lock contention. Returns the new profile, or ERR_PTR of
+ * -EOPNOTSUPP if the kernel has no contention tracepoints, or -ENOMEM.
+ */
+struct ktf_lockstat *ktf_lockstat_start(void);
+
+/* Stop profiling, and fill in the top entries */
+void ktf_lockstat_stop(struct ktf_lockstat *ls);
+
+void ktf_lockstat_free(struct ktf_lockstat *ls);
+
+#endif
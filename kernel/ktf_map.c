@@ -7,29 +7,235 @@
  *   (made abstract to allow impl to change)
  */
 
+#include <linux/jhash.h>
+#include <linux/slab.h>
 #include "ktf_map.h"
 #include "ktf.h"
 #include "ktf_compat.h"
 
-void ktf_map_init(struct ktf_map *map, ktf_map_elem_comparefn elem_comparefn,
-		  ktf_map_elem_freefn elem_freefn)
+/* Hash index sizing: Start small, grow to keep the load factor <= 1 */
+#define KTF_MAP_HASH_MIN_BITS	4
+#define KTF_MAP_HASH_MAX_BITS	14
+
+/* An interned string key, shared by all elements with the key */
+struct ktf_map_key {
+	struct hlist_node hnode;	/* Linkage for key_pool */
+	struct rcu_head rcu;		/* Lockless readers may still compare with it */
+	unsigned int users;		/* Elements with the key */
+	u32 hash;			/* jhash() of the key */
+	char str[];
+};
+
+#define KTF_MAP_KEY_BITS	10
+
+static struct hlist_head key_pool[1 << KTF_MAP_KEY_BITS];
+static DEFINE_SPINLOCK(key_pool_lock);
+
+/* Key of elements whose key could not be interned */
+static const char no_key[] = "";
+
+void ktf_map_init_flags(struct ktf_map *map, ktf_map_elem_comparefn elem_comparefn,
+			ktf_map_elem_freefn elem_freefn, unsigned int flags)
 {
 	map->root = RB_ROOT;
 	map->size = 0;
 	map->elem_comparefn = elem_comparefn;
 	map->elem_freefn = elem_freefn;
+	map->flags = flags;
+	map->htab = NULL;
 	spin_lock_init(&map->lock);
+	seqcount_init(&map->seq);
+}
+
+void ktf_map_init(struct ktf_map *map, ktf_map_elem_comparefn elem_comparefn,
+		  ktf_map_elem_freefn elem_freefn)
+{
+	ktf_map_init_flags(map, elem_comparefn, elem_freefn, 0);
+}
+
+static inline bool ktf_map_hashed(struct ktf_map *map)
+{
+	return (map->flags & KTF_MAP_HASHED) && !map->elem_comparefn;
+}
+
+static inline bool ktf_map_rcu(struct ktf_map *map)
+{
+	return map->flags & KTF_MAP_RCU;
+}
+
+/* Consistent with strncmp(.., KTF_MAX_KEY) equality used for the tree */
+static inline u32 ktf_map_hash(const char *key, unsigned int bits)
+{
+	return jhash(key, strnlen(key, KTF_MAX_KEY), 0) >> (32 - bits);
+}
+
+static inline struct hlist_head *ktf_map_bucket(struct ktf_map_htab *htab,
+						const char *key)
+{
+	return &htab->buckets[ktf_map_hash(key, htab->bits)];
+}
+
+static inline struct ktf_map_key *ktf_map_key_of(const char *str)
+{
+	return (struct ktf_map_key *)(str - offsetof(struct ktf_map_key, str));
+}
+
+/* As ktf_map_bucket() for the key of elem, without hashing it again if interned */
+static inline struct hlist_head *ktf_map_elem_bucket(struct ktf_map_htab *htab,
+						     struct ktf_map_elem *elem)
+{
+	if (elem->interned)
+		return &htab->buckets[ktf_map_key_of(elem->key)->hash >> (32 - htab->bits)];
+	return ktf_map_bucket(htab, elem->key);
+}
+
+/* Returns the interned copy of the first (up to) KTF_MAX_NAME characters of
+ * key with a reference taken, or NULL if out of memory.
+ */
+static const char *ktf_map_key_get(const char *key)
+{
+	size_t len = strnlen(key, KTF_MAX_NAME);
+	u32 hash = jhash(key, len, 0);
+	struct hlist_head *head = &key_pool[hash >> (32 - KTF_MAP_KEY_BITS)];
+	struct ktf_map_key *k;
+	unsigned long flags;
+
+	spin_lock_irqsave(&key_pool_lock, flags);
+	hlist_for_each_entry(k, head, hnode)
+		if (k->hash == hash && !strncmp(k->str, key, len) && !k->str[len])
+			goto found;
+	k = kmalloc(sizeof(*k) + len + 1, GFP_ATOMIC | __GFP_NOWARN);
+	if (!k) {
+		spin_unlock_irqrestore(&key_pool_lock, flags);
+		return NULL;
+	}
+	memcpy(k->str, key, len);
+	k->str[len] = '\0';
+	k->hash = hash;
+	k->users = 0;
+	hlist_add_head(&k->hnode, head);
+found:
+	k->users++;
+	spin_unlock_irqrestore(&key_pool_lock, flags);
+	return k->str;
+}
+
+static void ktf_map_key_put(const char *str)
+{
+	struct ktf_map_key *k = ktf_map_key_of(str);
+	unsigned long flags;
+
+	spin_lock_irqsave(&key_pool_lock, flags);
+	if (--k->users) {
+		spin_unlock_irqrestore(&key_pool_lock, flags);
+		return;
+	}
+	hlist_del(&k->hnode);
+	spin_unlock_irqrestore(&key_pool_lock, flags);
+	kfree_rcu(k, rcu);
+}
+
+void ktf_map_cleanup(void)
+{
+	struct ktf_map_key *k;
+	struct hlist_node *tmp;
+	unsigned int i, n = 0;
+
+	/* Elements of KTF_MAP_RCU maps release their keys from RCU callbacks */
+	rcu_barrier();
+	for (i = 0; i < ARRAY_SIZE(key_pool); i++)
+		hlist_for_each_entry_safe(k, tmp, &key_pool[i], hnode) {
+			hlist_del(&k->hnode);
+			kfree(k);
+			n++;
+		}
+	tlog(T_DEBUG, "Freed %u interned keys of elements never released", n);
+}
+
+static void ktf_map_htab_free(struct ktf_map *map, struct ktf_map_htab *htab)
+{
+	if (htab && ktf_map_rcu(map))
+		kfree_rcu(htab, rcu);
+	else
+		kfree(htab);
+}
+
+/* Called with map->lock held: (Re)build the hash index with 2^bits buckets
+ * from the elements in the tree.  On allocation failure we keep the old
+ * index (if any), as it is still complete, only with longer chains.
+ * Lockless readers may miss elements while they are moved to the new
+ * index, but they notice the update via the map's sequence count.
+ */
+static void ktf_map_rehash(struct ktf_map *map, unsigned int bits)
+{
+	struct ktf_map_htab *htab, *old = map->htab;
+	struct rb_node *node;
+
+	htab = kzalloc(sizeof(*htab) + (sizeof(struct hlist_head) << bits),
+		       GFP_ATOMIC | __GFP_NOWARN);
+	if (!htab)
+		return;
+	htab->bits = bits;
+
+	for (node = rb_first(&map->root); node; node = rb_next(node)) {
+		struct ktf_map_elem *elem = container_of(node, struct ktf_map_elem, node);
+
+		hlist_del_init_rcu(&elem->hnode);
+		hlist_add_head_rcu(&elem->hnode, ktf_map_elem_bucket(htab, elem));
+	}
+	rcu_assign_pointer(map->htab, htab);
+	ktf_map_htab_free(map, old);
+}
+
+/* Called with map->lock held after an element has been added to the tree */
+static void ktf_map_hash_insert(struct ktf_map *map, struct ktf_map_elem *elem)
+{
+	struct ktf_map_htab *htab = map->htab;
+
+	if (!htab) {
+		ktf_map_rehash(map, KTF_MAP_HASH_MIN_BITS);
+		return;
+	}
+	hlist_add_head_rcu(&elem->hnode, ktf_map_elem_bucket(htab, elem));
+	if (map->size > (1UL << htab->bits) && htab->bits < KTF_MAP_HASH_MAX_BITS)
+		ktf_map_rehash(map, htab->bits + 1);
+}
+
+/* Called with map->lock held when an element has been removed from the tree */
+static void ktf_map_hash_remove(struct ktf_map *map, struct ktf_map_elem *elem)
+{
+	struct ktf_map_htab *htab = map->htab;
+
+	hlist_del_init_rcu(&elem->hnode);
+	if (!map->size) {
+		RCU_INIT_POINTER(map->htab, NULL);
+		ktf_map_htab_free(map, htab);
+	}
+}
+
+int ktf_map_elem_init_key(struct ktf_map_elem *elem, const void *key, size_t size)
+{
+	elem->key = key;
+	elem->key_size = size;
+	elem->interned = false;
+	RB_CLEAR_NODE(&elem->node);
+	INIT_HLIST_NODE(&elem->hnode);
+	elem->map = NULL;
+	kref_init(&elem->refcount);
+	return 0;
 }
 
 int ktf_map_elem_init(struct ktf_map_elem *elem, const char *key)
 {
-	memcpy(elem->key, key, KTF_MAX_KEY);
-	/* For strings that are too long, ensure truncation at
+	/* For strings that are too long, the interned key is truncated at
 	 * KTF_MAX_NAME == KTF_MAX_KEY - 1 length:
 	 */
-	elem->key[KTF_MAX_NAME] = '\0';
-	elem->map = NULL;
-	kref_init(&elem->refcount);
+	const char *str = ktf_map_key_get(key);
+
+	ktf_map_elem_init_key(elem, str ? str : no_key, 0);
+	if (!str)
+		return -ENOMEM;
+	elem->interned = true;
 	return 0;
 }
 
@@ -45,9 +251,9 @@ int ktf_uint_compare(const char *ac, const char *bc)
 }
 EXPORT_SYMBOL(ktf_uint_compare);
 
-/* Copy "elem"s key representation into "name".  For cases where no
- * compare function is defined - i.e. string keys - just copy string,
- * otherwise name is hexascii of first 8 bytes of key.
+/* Copy "elem"s key representation into "name".  For string keys just
+ * copy the string, otherwise name is hexascii of (up to) the first 8 bytes
+ * of the key.
  */
 char *
 ktf_map_elem_name(struct ktf_map_elem *elem, char *name)
@@ -57,14 +263,30 @@ ktf_map_elem_name(struct ktf_map_elem *elem, char *name)
 
 	if (!elem || !elem->map)
 		(void)strlcpy(name, "<none>", KTF_MAX_NAME);
-	else if (!elem->map->elem_comparefn)
+	else if (!elem->key_size)
 		(void)strlcpy(name, elem->key, KTF_MAX_NAME);
 	else
-		(void)snprintf(name, KTF_MAX_NAME, "'%*ph'", 8, elem->key);
+		(void)snprintf(name, KTF_MAX_NAME, "'%*ph'", min_t(int, elem->key_size, 8),
+			       elem->key);
 
 	return name;
 }
 
+/* Free elem, then its key, as the free function may still use the key */
+static void ktf_map_elem_free(struct ktf_map_elem *elem)
+{
+	const char *key = elem->interned ? elem->key : NULL;
+
+	elem->map->elem_freefn(elem);
+	if (key)
+		ktf_map_key_put(key);
+}
+
+static void ktf_map_elem_free_rcu(struct rcu_head *rcu)
+{
+	ktf_map_elem_free(container_of(rcu, struct ktf_map_elem, rcu));
+}
+
 /* Called when refcount of elem is 0. */
 static void ktf_map_elem_release(struct kref *kref)
 {
@@ -76,8 +298,17 @@ static void ktf_map_elem_release(struct kref *kref)
 	tlog(T_DEBUG_V, "Releasing %s, %s free function",
 	     ktf_map_elem_name(elem, name),
 	     map && map->elem_freefn ? "calling" : "no");
-	if (map && map->elem_freefn)
-		map->elem_freefn(elem);
+	if (!map || !map->elem_freefn) {
+		/* The key itself is only freed after an RCU grace period */
+		if (elem->interned)
+			ktf_map_key_put(elem->key);
+		return;
+	}
+	/* Lockless readers may still be looking at the element */
+	if (ktf_map_rcu(map))
+		call_rcu(&elem->rcu, ktf_map_elem_free_rcu);
+	else
+		ktf_map_elem_free(elem);
 }
 
 void ktf_map_elem_put(struct ktf_map_elem *elem)
@@ -100,36 +331,150 @@ void ktf_map_elem_get(struct ktf_map_elem *elem)
 	kref_get(&elem->refcount);
 }
 
-struct ktf_map_elem *ktf_map_find(struct ktf_map *map, const char *key)
+static inline int ktf_map_compare(struct ktf_map *map, const char *key1,
+				  const char *key2)
+{
+	if (map->elem_comparefn)
+		return map->elem_comparefn(key1, key2);
+	return strncmp(key1, key2, KTF_MAX_KEY);
+}
+
+/* Called with map->lock held or within an RCU read side section.
+ * The tree and hash chains are only modified with RCU safe primitives,
+ * so a lockless walk will terminate, but it may miss elements if it
+ * races with an update.  Callers must check the sequence count to detect
+ * that.
+ */
+static struct ktf_map_elem *__ktf_map_find(struct ktf_map *map, const char *key)
 {
+	struct ktf_map_htab *htab = rcu_dereference_raw(map->htab);
+	struct ktf_map_elem *elem;
 	struct rb_node *node;
-	unsigned long flags;
 
-	/* may be called in interrupt context */
-	spin_lock_irqsave(&map->lock, flags);
-	node = map->root.rb_node;
+	if (htab && ktf_map_hashed(map)) {
+		hlist_for_each_entry_rcu(elem, ktf_map_bucket(htab, key), hnode)
+			if (strncmp(key, elem->key, KTF_MAX_KEY) == 0)
+				return elem;
+		return NULL;
+	}
 
+	node = rcu_dereference_raw(map->root.rb_node);
 	while (node) {
-		struct ktf_map_elem *elem = container_of(node, struct ktf_map_elem, node);
 		int result;
 
-		if (map->elem_comparefn)
-			result = map->elem_comparefn(key, elem->key);
+		elem = container_of(node, struct ktf_map_elem, node);
+		result = ktf_map_compare(map, key, elem->key);
+		if (result < 0)
+			node = rcu_dereference_raw(node->rb_left);
+		else if (result > 0)
+			node = rcu_dereference_raw(node->rb_right);
 		else
-			result = strncmp(key, elem->key, KTF_MAX_KEY);
+			return elem;
+	}
+	return NULL;
+}
 
-		if (result < 0) {
-			node = node->rb_left;
-		} else if (result > 0) {
-			node = node->rb_right;
+/* Leftmost element - as rb_first() but safe for lockless use */
+static struct ktf_map_elem *__ktf_map_first(struct ktf_map *map)
+{
+	struct rb_node *node = rcu_dereference_raw(map->root.rb_node);
+	struct rb_node *left;
+
+	if (!node)
+		return NULL;
+	while ((left = rcu_dereference_raw(node->rb_left)))
+		node = left;
+	return container_of(node, struct ktf_map_elem, node);
+}
+
+/* Element with the smallest key greater than that of 'elem'.  Unlike
+ * rb_next() this only descends the tree, so it is safe for lockless use,
+ * and it works also if 'elem' was removed from the map meanwhile.
+ */
+static struct ktf_map_elem *__ktf_map_next(struct ktf_map *map,
+					   struct ktf_map_elem *elem)
+{
+	struct rb_node *node = rcu_dereference_raw(map->root.rb_node);
+	struct ktf_map_elem *next = NULL;
+
+	while (node) {
+		struct ktf_map_elem *this = container_of(node, struct ktf_map_elem, node);
+
+		if (ktf_map_compare(map, elem->key, this->key) < 0) {
+			next = this;
+			node = rcu_dereference_raw(node->rb_left);
 		} else {
-			ktf_map_elem_get(elem);
-			spin_unlock_irqrestore(&map->lock, flags);
+			node = rcu_dereference_raw(node->rb_right);
+		}
+	}
+	return next;
+}
+
+/* Take a reference to an element found by a lockless walk.  Fails if the
+ * element is being released (it has then been removed from the map).
+ */
+static inline bool ktf_map_elem_tryget(struct ktf_map_elem *elem)
+{
+	return kref_get_unless_zero(&elem->refcount);
+}
+
+/* True if no writer was active or has been since raw_read_seqcount() */
+static inline bool ktf_map_seq_valid(struct ktf_map *map, unsigned int seq)
+{
+	return !(seq & 1) && !read_seqcount_retry(&map->seq, seq);
+}
+
+struct ktf_map_elem *ktf_map_find(struct ktf_map *map, const char *key)
+{
+	struct ktf_map_elem *elem;
+	unsigned long flags;
+
+	if (ktf_map_rcu(map)) {
+		unsigned int seq;
+
+		rcu_read_lock();
+		seq = raw_read_seqcount(&map->seq);
+		elem = __ktf_map_find(map, key);
+		/* A match is always valid, a miss only if the map was stable */
+		if (elem ? ktf_map_elem_tryget(elem) : ktf_map_seq_valid(map, seq)) {
+			rcu_read_unlock();
 			return elem;
 		}
+		rcu_read_unlock();
+		/* Raced with an update, retry with the lock held */
 	}
+
+	/* may be called in interrupt context */
+	spin_lock_irqsave(&map->lock, flags);
+	elem = __ktf_map_find(map, key);
+	if (elem)
+		ktf_map_elem_get(elem);
 	spin_unlock_irqrestore(&map->lock, flags);
-	return NULL;
+	return elem;
+}
+
+/* Lockless iteration step for KTF_MAP_RCU maps: Returns true if 'next'
+ * is the correct result, with a reference taken if non-NULL.
+ */
+static bool ktf_map_iter_rcu(struct ktf_map *map, struct ktf_map_elem *prev,
+			     struct ktf_map_elem **next)
+{
+	struct ktf_map_elem *elem;
+	unsigned int seq;
+	bool valid;
+
+	rcu_read_lock();
+	seq = raw_read_seqcount(&map->seq);
+	elem = prev ? __ktf_map_next(map, prev) : __ktf_map_first(map);
+	valid = !elem || ktf_map_elem_tryget(elem);
+	if (valid && !ktf_map_seq_valid(map, seq)) {
+		if (elem)
+			ktf_map_elem_put(elem);
+		valid = false;
+	}
+	rcu_read_unlock();
+	*next = elem;
+	return valid;
 }
 
 /* Find the first map elem in 'map' */
@@ -139,6 +484,9 @@ struct ktf_map_elem *ktf_map_find_first(struct ktf_map *map)
 	struct rb_node *node;
 	unsigned long flags;
 
+	if (ktf_map_rcu(map) && ktf_map_iter_rcu(map, NULL, &elem))
+		return elem;
+
 	spin_lock_irqsave(&map->lock, flags);
 	node = rb_first(&map->root);
 	if (node) {
@@ -159,8 +507,6 @@ struct ktf_map_elem *ktf_map_find_next(struct ktf_map_elem *elem)
 
 	if (!elem->map)
 		return NULL;
-	spin_lock_irqsave(&map->lock, flags);
-	node = rb_next(&elem->node);
 
 	/* Assumption here - we don't need ref to elem any more.
 	 * Common usage pattern is
@@ -172,6 +518,26 @@ struct ktf_map_elem *ktf_map_find_next(struct ktf_map_elem *elem)
 	 * This assumption allows us to define our _for_each macros
 	 * and still manage refcounts.
 	 */
+	if (ktf_map_rcu(map)) {
+		if (!ktf_map_iter_rcu(map, elem, &next)) {
+			spin_lock_irqsave(&map->lock, flags);
+			next = __ktf_map_next(map, elem);
+			if (next)
+				ktf_map_elem_get(next);
+			spin_unlock_irqrestore(&map->lock, flags);
+		}
+		ktf_map_elem_put(elem);
+		return next;
+	}
+
+	spin_lock_irqsave(&map->lock, flags);
+	if (RB_EMPTY_NODE(&elem->node)) {
+		/* elem was removed meanwhile, continue from its key */
+		next = __ktf_map_next(map, elem);
+		node = next ? &next->node : NULL;
+	} else {
+		node = rb_next(&elem->node);
+	}
 	ktf_map_elem_put(elem);
 
 	if (node) {
@@ -187,16 +553,16 @@ int ktf_map_insert(struct ktf_map *map, struct ktf_map_elem *elem)
 	struct rb_node **newobj, *parent = NULL;
 	unsigned long flags;
 
+	/* The compare function would read an interned string as its own key type */
+	if (WARN_ONCE(map->elem_comparefn && elem->interned,
+		      "ktf: string key \"%s\" in a map with a compare function", elem->key))
+		return -EINVAL;
+
 	spin_lock_irqsave(&map->lock, flags);
 	newobj = &map->root.rb_node;
 	while (*newobj) {
 		struct ktf_map_elem *this = container_of(*newobj, struct ktf_map_elem, node);
-		int result;
-
-		if (map->elem_comparefn)
-			result = map->elem_comparefn(elem->key, this->key);
-		else
-			result = strncmp(elem->key, this->key, KTF_MAX_KEY);
+		int result = ktf_map_compare(map, elem->key, this->key);
 
 		parent = *newobj;
 		if (result < 0) {
@@ -209,35 +575,68 @@ int ktf_map_insert(struct ktf_map *map, struct ktf_map_elem *elem)
 		}
 	}
 
+	write_seqcount_begin(&map->seq);
 	/* Add newobj node and rebalance tree. */
-	rb_link_node(&elem->node, parent, newobj);
+	rb_link_node_rcu(&elem->node, parent, newobj);
 	rb_insert_color(&elem->node, &map->root);
 	elem->map = map;
 	map->size++;
+	if (ktf_map_hashed(map))
+		ktf_map_hash_insert(map, elem);
+	write_seqcount_end(&map->seq);
 	/* Bump reference count for map reference */
 	ktf_map_elem_get(elem);
 	spin_unlock_irqrestore(&map->lock, flags);
 	return 0;
 }
 
+/* Called with map->lock held: Unlink elem from the map, the caller is
+ * responsible for dropping the map's reference if this returns true.
+ */
+static bool __ktf_map_remove_elem(struct ktf_map *map, struct ktf_map_elem *elem)
+{
+	if (RB_EMPTY_NODE(&elem->node))
+		return false;
+	write_seqcount_begin(&map->seq);
+	rb_erase(&elem->node, &map->root);
+	RB_CLEAR_NODE(&elem->node);
+	map->size--;
+	if (ktf_map_hashed(map))
+		ktf_map_hash_remove(map, elem);
+	write_seqcount_end(&map->seq);
+	return true;
+}
+
 void ktf_map_remove_elem(struct ktf_map *map, struct ktf_map_elem *elem)
 {
-	if (elem) {
-		rb_erase(&elem->node, &map->root);
-		map->size--;
+	unsigned long flags;
+	bool removed;
+
+	if (!elem)
+		return;
+	spin_lock_irqsave(&map->lock, flags);
+	removed = __ktf_map_remove_elem(map, elem);
+	spin_unlock_irqrestore(&map->lock, flags);
+	if (removed)
 		ktf_map_elem_put(elem);
-	}
 }
 
 struct ktf_map_elem *ktf_map_remove(struct ktf_map *map, const char *key)
 {
 	struct ktf_map_elem *elem;
 	unsigned long flags;
+	bool removed = false;
 
-	elem = ktf_map_find(map, key);
 	spin_lock_irqsave(&map->lock, flags);
-	ktf_map_remove_elem(map, elem);
+	elem = __ktf_map_find(map, key);
+	if (elem) {
+		ktf_map_elem_get(elem);
+		removed = __ktf_map_remove_elem(map, elem);
+	}
 	spin_unlock_irqrestore(&map->lock, flags);
+	/* Drop the map's reference, caller keeps the one we took */
+	if (removed)
+		ktf_map_elem_put(elem);
 	return elem;
 }
 
@@ -251,9 +650,8 @@ void ktf_map_delete_all(struct ktf_map *map)
 	do {
 		node = rb_first(&(map)->root);
 		if (node) {
-			rb_erase(node, &(map)->root);
-			map->size--;
 			elem = container_of(node, struct ktf_map_elem, node);
+			__ktf_map_remove_elem(map, elem);
 			ktf_map_elem_put(elem);
 		}
 	} while (node);
@@ -12,10 +12,25 @@
 #include <linux/kref.h>
 #include <linux/version.h>
 #include <linux/rbtree.h>
+#include <linux/list.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
 
 #define	KTF_MAX_KEY 64
 #define KTF_MAX_NAME (KTF_MAX_KEY - 1)
 
+/* Optional map features, selected when the map is initialized: */
+#define KTF_MAP_HASHED	0x1	/* Maintain a hash index for O(1) lookups */
+#define KTF_MAP_RCU	0x2	/* Lockless lookups and iteration, see below */
+
+/* Lookups and iteration in KTF_MAP_RCU maps do not take the map lock
+ * unless they race with an update, so they are safe and cheap also in
+ * probe context.  Updates are still serialized by the map lock.
+ * The price is that the free function is called only after an RCU grace
+ * period, so users must call rcu_barrier() before the map or the code of
+ * the free function goes away.
+ */
+
 struct ktf_map_elem;
 
 /* Compare function called to compare element keys - optional and if
@@ -35,40 +50,100 @@ int ktf_uint_compare(const char *a, const char *b);
  */
 typedef void (*ktf_map_elem_freefn)(struct ktf_map_elem *);
 
+/* Hash index of a KTF_MAP_HASHED map.  The rb tree is still maintained
+ * to provide ordered iteration, the hash index only serves point lookups.
+ * It is allocated on demand, grown as the map grows and freed again when
+ * the map becomes empty - if allocation fails lookups just fall back to
+ * the tree.
+ */
+struct ktf_map_htab {
+	struct rcu_head rcu;	     /* For deferred free in KTF_MAP_RCU maps */
+	unsigned int bits;	     /* log2 of number of buckets */
+	struct hlist_head buckets[]; /* The hash chains */
+};
+
 struct ktf_map {
 	struct rb_root root; /* The rb tree holding the map */
 	size_t size;	     /* Current size (number of elements) of the map */
 	spinlock_t lock;     /* held for map lookup etc */
 	ktf_map_elem_comparefn elem_comparefn; /* Key comparison function */
 	ktf_map_elem_freefn elem_freefn; /* Free function */
+	unsigned int flags;  /* KTF_MAP_* features enabled for this map */
+	struct ktf_map_htab *htab; /* Hash index if KTF_MAP_HASHED (or NULL) */
+	seqcount_t seq;	     /* Lets lockless readers detect updates */
 };
 
+/* Elements do not store their keys themselves: String keys given to
+ * ktf_map_elem_init() are interned, so that all elements with the same
+ * key share one reference counted copy of just the key's length, which is
+ * released when the element's refcount drops to 0.  Maps with a compare
+ * function have keys of a fixed size type of their own instead, which
+ * the elements refer to in place, see ktf_map_elem_init_key().
+ */
 struct ktf_map_elem {
 	struct rb_node node;	      /* Linkage for the map */
-	char key[KTF_MAX_KEY+1] __aligned(8);
-		/* Key of the element - must be unique within the same map */
+	struct hlist_node hnode;      /* Linkage for the map's hash index */
+	const char *key;	      /* Key of the element - must be unique within the same map */
 	struct ktf_map *map;  /* owning map */
 	struct kref refcount; /* reference count for element */
+	u16 key_size;	      /* Size of a fixed size key, 0 for string keys */
+	bool interned;	      /* key is an interned string */
+	struct rcu_head rcu;  /* For deferred free in KTF_MAP_RCU maps */
 };
 
-#define __KTF_MAP_INITIALIZER(_mapname, _elem_comparefn, _elem_freefn) \
+#define __KTF_MAP_INITIALIZER_FLAGS(_mapname, _elem_comparefn, _elem_freefn, _flags) \
         { \
 		.root = RB_ROOT, \
 		.size = 0, \
 		.lock = __SPIN_LOCK_UNLOCKED(_mapname), \
 		.elem_comparefn = _elem_comparefn, \
 		.elem_freefn = _elem_freefn, \
+		.flags = _flags, \
+		.htab = NULL, \
+		.seq = SEQCNT_ZERO(_mapname.seq), \
 	}
 
+#define __KTF_MAP_INITIALIZER(_mapname, _elem_comparefn, _elem_freefn) \
+	__KTF_MAP_INITIALIZER_FLAGS(_mapname, _elem_comparefn, _elem_freefn, 0)
+
 #define DEFINE_KTF_MAP(_mapname, _elem_comparefn, _elem_freefn) \
 	struct ktf_map _mapname = __KTF_MAP_INITIALIZER(_mapname, _elem_comparefn, _elem_freefn)
 
+#define DEFINE_KTF_MAP_FLAGS(_mapname, _elem_comparefn, _elem_freefn, _flags) \
+	struct ktf_map _mapname = \
+		__KTF_MAP_INITIALIZER_FLAGS(_mapname, _elem_comparefn, _elem_freefn, _flags)
+
+/* A map with string keys and a hash index for constant time lookups: */
+#define DEFINE_KTF_HASHED_MAP(_mapname, _elem_freefn) \
+	DEFINE_KTF_MAP_FLAGS(_mapname, NULL, _elem_freefn, KTF_MAP_HASHED)
+
 void ktf_map_init(struct ktf_map *map, ktf_map_elem_comparefn elem_comparefn,
 	ktf_map_elem_freefn elem_freefn);
 
-/* returns 0 upon success or -errno upon error */
+/* As ktf_map_init() but with KTF_MAP_* flags to choose map features.
+ * KTF_MAP_HASHED requires string keys (no elem_comparefn) since a custom
+ * compare function need not define equality as equal key bytes.
+ */
+void ktf_map_init_flags(struct ktf_map *map, ktf_map_elem_comparefn elem_comparefn,
+	ktf_map_elem_freefn elem_freefn, unsigned int flags);
+
+/* Initialize elem with a string key, truncated at KTF_MAX_NAME characters.
+ * Returns 0 upon success or -ENOMEM if the key could not be interned.
+ * The element starts with a reference that holds the interned key, which
+ * the caller must put when done, also if the element is never inserted.
+ * Only for maps without a compare function: Binary keys must use
+ * ktf_map_elem_init_key(), ktf_map_insert() fails with -EINVAL otherwise.
+ */
 int ktf_map_elem_init(struct ktf_map_elem *elem, const char *key);
 
+/* Initialize elem with a key of size bytes that is not copied, for maps
+ * with a compare function, such as unsigned int keys for ktf_uint_compare().
+ * A size of 0 means a string key.  The key must stay unchanged in place
+ * for as long as the element is in use, typically as a member of the object
+ * embedding elem.  Returns 0.
+ */
+int ktf_map_elem_init_key(struct ktf_map_elem *elem, const void *key, size_t size);
+
 /* increase/reduce reference count to element.  If count reaches 0, the
  * free function associated with map (if any) is called.
  */
@@ -77,8 +152,9 @@ void ktf_map_elem_put(struct ktf_map_elem *elem);
 
 char *ktf_map_elem_name(struct ktf_map_elem *elem, char *name);
 
-/* Insert a new element in map - return 0 iff 'elem' was inserted or -1 if
- * the key already existed - duplicates are not insterted.
+/* Insert a new element in map - return 0 iff 'elem' was inserted or -EEXIST
+ * if the key already existed - duplicates are not insterted.  Returns -EINVAL
+ * for an interned string key in a map with a compare function.
  */
 int ktf_map_insert(struct ktf_map *map, struct ktf_map_elem *elem);
 
@@ -100,12 +176,16 @@ struct ktf_map_elem *ktf_map_find_next(struct ktf_map_elem *elem);
 struct ktf_map_elem *ktf_map_remove(struct ktf_map *map, const char *key);
 
 /* Remove specific element elem from the map. Refcount is not increased
- * as caller must already have had a reference.
+ * as caller must already have had a reference.  Removing an element that
+ * is not (or no longer) in the map is a no-op.
  */
 void ktf_map_remove_elem(struct ktf_map *map, struct ktf_map_elem *elem);
 
 void ktf_map_delete_all(struct ktf_map *map);
 
+/* Free the interned keys of elements that were never released */
+void ktf_map_cleanup(void);
+
 static inline size_t ktf_map_size(struct ktf_map *map) {
 	return map->size;
 }
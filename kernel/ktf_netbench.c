@@ -0,0 +1,448 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_netbench.c: Network throughput and latency between the nodes of
+ * a network context.
+ */
+#include <linux/delay.h>
+#include <linux/in.h>
+#include <linux/in6.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/net.h>
+#include <linux/slab.h>
+#include <linux/version.h>
+#include <net/sock.h>
+#include <net/inet_sock.h>
+#include "ktf.h"
+#include "ktf_netbench.h"
+#include "ktf_pool.h"
+#include "ktf_compat.h"
+
+#define KTF_NETBENCH_MAGIC	0x6b74666e	/* "ktfn" */
+#define KTF_NETBENCH_RETRY_MS	50
+
+/* Sent by the other ranks on each connection to rank 0 */
+struct ktf_netbench_hello {
+	__be32 magic;
+	__be32 rank;
+	__be32 conn;
+	__be32 kind;
+	__be32 msg_size;
+};
+
+struct ktf_netbench_conn {
+	struct socket *sock;
+	void *buf;
+	short rank;
+	int status;
+	u64 bytes;
+	u64 ops;
+	u64 elapsed_ns;
+	u64 rtt_min_ns;
+	u64 rtt_sum_ns;
+	u64 rtt_max_ns;
+};
+
+struct ktf_netbench_state {
+	struct ktf_netbench_cfg cfg;	/* With the defaults filled in */
+	struct ktf_netbench_conn *conns;
+	unsigned int nr_conns;
+	bool sink;			/* Rank 0 */
+};
+
+static int ktf_netbench_send(struct socket *sock, void *buf, size_t len)
+{
+	struct kvec iov = { .iov_base = buf, .iov_len = len };
+	struct msghdr msg = { .msg_flags = MSG_NOSIGNAL };
+	int ret;
+
+	while (iov.iov_len) {
+		ret = kernel_sendmsg(sock, &msg, &iov, 1, iov.iov_len);
+		if (ret < 0)
+			return ret;
+		if (!ret)
+			return -EPIPE;
+		iov.iov_base = (char *)iov.iov_base + ret;
+		iov.iov_len -= ret;
+	}
+	return 0;
+}
+
+/* Returns the number of bytes received, 0 at end of stream, or -errno */
+static int ktf_netbench_recv(struct socket *sock, void *buf, size_t len, int flags)
+{
+	struct kvec iov = { .iov_base = buf, .iov_len = len };
+	struct msghdr msg = { };
+
+	return kernel_recvmsg(sock, &msg, &iov, 1, len, flags);
+}
+
+/* Exactly len bytes, -ECONNRESET if the stream ends before that */
+static int ktf_netbench_recv_all(struct socket *sock, void *buf, size_t len)
+{
+	int ret = ktf_netbench_recv(sock, buf, len, MSG_WAITALL);
+
+	if (ret < 0)
+		return ret;
+	return ret == len ? 0 : -ECONNRESET;
+}
+
+/* Wait for the peer to close its end, after closing ours */
+static int ktf_netbench_close_wait(struct socket *sock, void *buf, size_t len)
+{
+	int ret = kernel_sock_shutdown(sock, SHUT_WR);
+
+	while (!ret) {
+		ret = ktf_netbench_recv(sock, buf, len, 0);
+		if (!ret)
+			return 0;
+		if (ret > 0)
+			ret = 0;
+	}
+	return ret;
+}
+
+static void ktf_netbench_rtt(struct ktf_netbench_conn *c, u64 ns)
+{
+	if (!c->ops || ns < c->rtt_min_ns)
+		c->rtt_min_ns = ns;
+	if (ns > c->rtt_max_ns)
+		c->rtt_max_ns = ns;
+	c->rtt_sum_ns += ns;
+	c->ops++;
+}
+
+static int ktf_netbench_stream(struct ktf_netbench_state *st, struct ktf_netbench_conn *c)
+{
+	u32 size = st->cfg.msg_size;
+	u64 start, end;
+	int ret;
+
+	if (st->sink) {
+		/* The go byte starts the clock at both ends */
+		ret = ktf_netbench_send(c->sock, c->buf, 1);
+		if (ret)
+			return ret;
+		start = ktime_get_ns();
+		for (;;) {
+			ret = ktf_netbench_recv(c->sock, c->buf, size, 0);
+			if (ret <= 0)
+				break;
+			c->bytes += ret;
+		}
+		c->elapsed_ns = ktime_get_ns() - start;
+		c->ops = div_u64(c->bytes, size);
+		if (ret)
+			return ret;
+		return kernel_sock_shutdown(c->sock, SHUT_WR);
+	}
+
+	ret = ktf_netbench_recv_all(c->sock, c->buf, 1);
+	if (ret)
+		return ret;
+	start = ktime_get_ns();
+	end = start + st->cfg.duration_ns;
+	do {
+		ret = ktf_netbench_send(c->sock, c->buf, size);
+		if (ret)
+			return ret;
+		c->bytes += size;
+		c->ops++;
+	} while (ktime_get_ns() < end);
+	ret = ktf_netbench_close_wait(c->sock, c->buf, size);
+	c->elapsed_ns = ktime_get_ns() - start;
+	return ret;
+}
+
+static int ktf_netbench_rr(struct ktf_netbench_state *st, struct ktf_netbench_conn *c)
+{
+	u32 size = st->cfg.msg_size;
+	u64 start, end, t;
+	int ret;
+
+	if (st->sink) {
+		start = ktime_get_ns();
+		end = start + st->cfg.duration_ns;
+		do {
+			t = ktime_get_ns();
+			ret = ktf_netbench_send(c->sock, c->buf, size);
+			if (!ret)
+				ret = ktf_netbench_recv_all(c->sock, c->buf, size);
+			if (ret)
+				return ret;
+			ktf_netbench_rtt(c, ktime_get_ns() - t);
+			c->bytes += size;
+		} while (ktime_get_ns() < end);
+		c->elapsed_ns = ktime_get_ns() - start;
+		return ktf_netbench_close_wait(c->sock, c->buf, size);
+	}
+
+	start = ktime_get_ns();
+	for (;;) {
+		ret = ktf_netbench_recv(c->sock, c->buf, size, MSG_WAITALL);
+		if (ret <= 0)
+			break;
+		if (ret != size)
+			return -ECONNRESET;
+		ret = ktf_netbench_send(c->sock, c->buf, size);
+		if (ret)
+			return ret;
+		c->bytes += size;
+		c->ops++;
+	}
+	c->elapsed_ns = ktime_get_ns() - start;
+	if (ret)
+		return ret;
+	return kernel_sock_shutdown(c->sock, SHUT_WR);
+}
+
+static void ktf_netbench_worker(struct ktf_thread_pool *pool, unsigned int id,
+				struct ktf_test *self, struct ktf_context *ctx,
+				int _i, u32 _value)
+{
+	struct ktf_netbench_state *st = pool->data;
+	struct ktf_netbench_conn *c = &st->conns[id];
+
+	if (st->cfg.kind == KTF_NETBENCH_RR)
+		c->status = ktf_netbench_rr(st, c);
+	else
+		c->status = ktf_netbench_stream(st, c);
+}
+
+/* Rank 0's address of the context, with the port of the measurement */
+static int ktf_netbench_addr(const struct ktf_addrinfo *ai, u16 port,
+			     struct sockaddr_storage *addr)
+{
+	*addr = ai->a[0].addr;
+	switch (addr->ss_family) {
+	case AF_INET:
+		((struct sockaddr_in *)addr)->sin_port = htons(port);
+		return sizeof(struct sockaddr_in);
+	case AF_INET6:
+		((struct sockaddr_in6 *)addr)->sin6_port = htons(port);
+		return sizeof(struct sockaddr_in6);
+	default:
+		return -EAFNOSUPPORT;
+	}
+}
+
+static int ktf_netbench_socket(struct ktf_netbench_state *st, int family,
+			       struct socket **sockp)
+{
+	long timeo = msecs_to_jiffies(st->cfg.timeout_ms);
+	int ret = sock_create_kern(&init_net, family, SOCK_STREAM, IPPROTO_TCP, sockp);
+
+	if (ret)
+		return ret;
+	(*sockp)->sk->sk_rcvtimeo = timeo;
+	(*sockp)->sk->sk_sndtimeo = timeo;
+	return 0;
+}
+
+static int ktf_netbench_accept(struct ktf_netbench_state *st, const struct ktf_addrinfo *ai)
+{
+	struct ktf_netbench_hello hello;
+	struct sockaddr_storage addr;
+	struct socket *lsock, *sock;
+	unsigned int i, index, rank, conn;
+	int len, ret;
+
+	len = ktf_netbench_addr(ai, st->cfg.port, &addr);
+	if (len < 0)
+		return len;
+	ret = ktf_netbench_socket(st, addr.ss_family, &lsock);
+	if (ret)
+		return ret;
+	lsock->sk->sk_reuse = SK_CAN_REUSE;
+	ret = kernel_bind(lsock, (struct sockaddr *)&addr, len);
+	if (!ret)
+		ret = kernel_listen(lsock, st->nr_conns);
+	if (!ret && st->cfg.listening)
+		st->cfg.listening(st->cfg.listening_data, ntohs(inet_sk(lsock->sk)->inet_sport));
+
+	for (i = 0; !ret && i < st->nr_conns; i++) {
+		ret = kernel_accept(lsock, &sock, 0);
+		if (ret)
+			break;
+		sock->sk->sk_rcvtimeo = lsock->sk->sk_rcvtimeo;
+		sock->sk->sk_sndtimeo = lsock->sk->sk_sndtimeo;
+		ret = ktf_netbench_recv_all(sock, &hello, sizeof(hello));
+		if (ret) {
+			sock_release(sock);
+			break;
+		}
+		rank = ntohl(hello.rank);
+		conn = ntohl(hello.conn);
+		index = (rank - 1) * st->cfg.conns + conn;
+		if (ntohl(hello.magic) != KTF_NETBENCH_MAGIC ||
+		    ntohl(hello.kind) != st->cfg.kind ||
+		    ntohl(hello.msg_size) != st->cfg.msg_size ||
+		    !rank || rank >= ai->n || conn >= st->cfg.conns ||
+		    st->conns[index].sock) {
+			terr("Unexpected connection (rank %u, conn %u) or configuration",
+			     rank, conn);
+			sock_release(sock);
+			ret = -EPROTO;
+			break;
+		}
+		st->conns[index].sock = sock;
+		st->conns[index].rank = rank;
+	}
+	sock_release(lsock);
+	return ret;
+}
+
+static int ktf_netbench_connect(struct ktf_netbench_state *st, const struct ktf_addrinfo *ai)
+{
+	unsigned long deadline = jiffies + msecs_to_jiffies(st->cfg.timeout_ms);
+	struct ktf_netbench_hello hello = {
+		.magic = htonl(KTF_NETBENCH_MAGIC),
+		.rank = htonl(ai->rank),
+		.kind = htonl(st->cfg.kind),
+		.msg_size = htonl(st->cfg.msg_size),
+	};
+	struct sockaddr_storage addr;
+	struct ktf_netbench_conn *c;
+	unsigned int i;
+	int len, ret = 0;
+
+	len = ktf_netbench_addr(ai, st->cfg.port, &addr);
+	if (len < 0)
+		return len;
+
+	for (i = 0; !ret && i < st->nr_conns; i++) {
+		c = &st->conns[i];
+		c->rank = ai->rank;
+		for (;;) {
+			ret = ktf_netbench_socket(st, addr.ss_family, &c->sock);
+			if (ret)
+				return ret;
+			ret = kernel_connect(c->sock, (struct sockaddr *)&addr, len, 0);
+			if (ret != -ECONNREFUSED || time_after(jiffies, deadline))
+				break;
+			/* Rank 0 is not listening yet */
+			sock_release(c->sock);
+			c->sock = NULL;
+			msleep(KTF_NETBENCH_RETRY_MS);
+		}
+		if (!ret) {
+			hello.conn = htonl(i);
+			ret = ktf_netbench_send(c->sock, &hello, sizeof(hello));
+		}
+	}
+	return ret;
+}
+
+static void ktf_netbench_add(struct ktf_netbench_result *r, const struct ktf_netbench_conn *c)
+{
+	if (!r->status)
+		r->status = c->status;
+	if (c->rtt_sum_ns && (!r->rtt_min_ns || c->rtt_min_ns < r->rtt_min_ns))
+		r->rtt_min_ns = c->rtt_min_ns;
+	r->rtt_max_ns = max(r->rtt_max_ns, c->rtt_max_ns);
+	r->rtt_avg_ns += c->rtt_sum_ns;	/* Sum until ktf_netbench_sum */
+	r->bytes += c->bytes;
+	r->ops += c->ops;
+	r->elapsed_ns = max(r->elapsed_ns, c->elapsed_ns);
+}
+
+static void ktf_netbench_sum(struct ktf_netbench_result *r, bool rtt)
+{
+	u64 elapsed_ns = max_t(u64, r->elapsed_ns, 1);
+
+	if (r->bytes <= U64_MAX / NSEC_PER_SEC)
+		r->bytes_per_sec = div64_u64(r->bytes * NSEC_PER_SEC, elapsed_ns);
+	else
+		r->bytes_per_sec = div64_u64(r->bytes, max_t(u64, elapsed_ns / NSEC_PER_MSEC, 1)) *
+			MSEC_PER_SEC;
+	/* Round trips are only timed at rank 0 */
+	if (rtt && r->ops)
+		r->rtt_avg_ns = div64_u64(r->rtt_avg_ns, r->ops);
+	else
+		r->rtt_avg_ns = r->rtt_min_ns = r->rtt_max_ns = 0;
+}
+
+int ktf_netbench_run(const struct ktf_addrinfo *ai, const struct ktf_netbench_cfg *cfg,
+		     struct ktf_netbench_result *results)
+{
+	struct ktf_netbench_state st = { .cfg = *cfg };
+	struct ktf_thread_pool pool;
+	unsigned int i;
+	bool rtt;
+	int ret;
+
+	if (ai->n < 2 || ai->rank < 0 || ai->rank >= ai->n ||
+	    !cfg->msg_size || cfg->msg_size > KTF_NETBENCH_MAX_MSG ||
+	    !cfg->conns || cfg->conns > KTF_NETBENCH_MAX_CONNS ||
+	    (cfg->kind != KTF_NETBENCH_STREAM && cfg->kind != KTF_NETBENCH_RR))
+		return -EINVAL;
+	if (!st.cfg.duration_ns)
+		st.cfg.duration_ns = KTF_NETBENCH_DURATION_NS;
+	st.sink = ai->rank == 0;
+	/* Only rank 0 may listen on a free port */
+	if (!st.sink || st.cfg.port)
+		st.cfg.listening = NULL;
+	if (!st.cfg.port && !st.cfg.listening)
+		st.cfg.port = KTF_NETBENCH_PORT;
+	if (!st.cfg.timeout_ms)
+		st.cfg.timeout_ms = KTF_NETBENCH_TIMEOUT_MS;
+	st.nr_conns = st.sink ? (ai->n - 1) * cfg->conns : cfg->conns;
+
+	st.conns = kcalloc(st.nr_conns, sizeof(*st.conns), GFP_KERNEL);
+	if (!st.conns)
+		return -ENOMEM;
+	for (i = 0; i < st.nr_conns; i++) {
+		st.conns[i].buf = kmalloc(cfg->msg_size, GFP_KERNEL);
+		if (!st.conns[i].buf) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	ret = st.sink ? ktf_netbench_accept(&st, ai) : ktf_netbench_connect(&st, ai);
+	if (ret) {
+		terr("Rank %d: failed to set up %u connections: %d", ai->rank, st.nr_conns, ret);
+		goto out;
+	}
+
+	ret = ktf_thread_pool_init(&pool, "ktf_netbench", ktf_netbench_worker, st.nr_conns,
+				   NULL, NULL, NULL, 0, 0);
+	if (ret)
+		goto out;
+	pool.data = &st;
+	ktf_thread_pool_run(&pool, 0);
+	ktf_thread_pool_destroy(&pool);
+
+	rtt = st.sink && cfg->kind == KTF_NETBENCH_RR;
+	if (st.sink) {
+		memset(results, 0, ai->n * sizeof(*results));
+		for (i = 0; i < ai->n; i++)
+			results[i].rank = i;
+		for (i = 0; i < st.nr_conns; i++) {
+			ktf_netbench_add(&results[st.conns[i].rank], &st.conns[i]);
+			ktf_netbench_add(&results[0], &st.conns[i]);
+		}
+		for (i = 0; i < ai->n; i++)
+			ktf_netbench_sum(&results[i], rtt);
+	} else {
+		memset(&results[ai->rank], 0, sizeof(*results));
+		results[ai->rank].rank = ai->rank;
+		for (i = 0; i < st.nr_conns; i++)
+			ktf_netbench_add(&results[ai->rank], &st.conns[i]);
+		ktf_netbench_sum(&results[ai->rank], rtt);
+	}
+	for (i = 0; i < st.nr_conns && !ret; i++)
+		ret = st.conns[i].status;
+out:
+	for (i = 0; i < st.nr_conns; i++) {
+		if (st.conns[i].sock)
+			sock_release(st.conns[i].sock);
+		kfree(st.conns[i].buf);
+	}
+	kfree(st.conns);
+	return ret;
+}
+EXPORT_SYMBOL(ktf_netbench_run);
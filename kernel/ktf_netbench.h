@@ -0,0 +1,130 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_netbench.h: Network throughput and latency between the nodes of
+ * a network context (see ktf_netctx.h).
+ *
+ * Rank 0 listens on its address of the context, and every other rank
+ * opens cfg->conns TCP connections to it from kernel sockets, with a worker
+ * thread per connection.  Once rank 0 has accepted the connections of all
+ * the other ranks, the workers at each rank are started together:
+ *
+ * KTF_NETBENCH_STREAM: The other ranks send messages of cfg->msg_size bytes
+ *   for cfg->duration_ns, and rank 0 counts what it receives from each.
+ * KTF_NETBENCH_RR: Rank 0 sends requests of cfg->msg_size bytes for
+ *   cfg->duration_ns, which the other ranks send back, and times each
+ *   round trip.
+ *
+ * The measurements are all taken at rank 0, which thereby has the results
+ * of every rank.  The other ranks just report what they sent.
+ */
+#ifndef KTF_NETBENCH_H
+#define KTF_NETBENCH_H
+#include <linux/socket.h>
+#include "ktf.h"
+#include "ktf_netctx.h"
+
+#define KTF_NETBENCH_PORT		7440
+#define KTF_NETBENCH_DURATION_NS	(1000ULL * NSEC_PER_MSEC)
+#define KTF_NETBENCH_TIMEOUT_MS		10000
+#define KTF_NETBENCH_MAX_CONNS		64
+#define KTF_NETBENCH_MAX_MSG		(64 * 1024)
+
+enum ktf_netbench_kind {
+	KTF_NETBENCH_STREAM,
+	KTF_NETBENCH_RR,
+};
+
+struct ktf_netbench_cfg {
+	enum ktf_netbench_kind kind;
+	u32 msg_size;		/* Bytes per message, or per request and response */
+	u32 conns;		/* Connections from each rank to rank 0 */
+	u64 duration_ns;	/* 0 for KTF_NETBENCH_DURATION_NS */
+	u16 port;		/* TCP port at rank 0, 0 for KTF_NETBENCH_PORT */
+	u32 timeout_ms;		/* For connecting and each transfer, 0 for the default */
+	/* If set and port is 0, rank 0 listens on a free port instead, and
+	 * calls listening() with it before it accepts connections, so that it
+	 * can be passed on to the other ranks:
+	 */
+	void (*listening)(void *data, u16 port);
+	void *listening_data;
+};
+
+/* The traffic with one rank, or the total of all connections */
+struct ktf_netbench_result {
+	short rank;
+	int status;		/* 0 or -errno of the first connection that failed */
+	u64 bytes;		/* Bytes received by rank 0 (STREAM) or sent each way (RR) */
+	u64 ops;		/* Messages or round trips */
+	u64 elapsed_ns;		/* Of the slowest connection */
+	u64 bytes_per_sec;
+	u64 rtt_min_ns;		/* Round trip times, for KTF_NETBENCH_RR */
+	u64 rtt_avg_ns;
+	u64 rtt_max_ns;
+};
+
+/* Run a measurement as rank ai->rank of the ai->n nodes in ai, which must
+ * all run it with the same cfg.  results must have room for ai->n entries:
+ * At rank 0, results[r] is set to the traffic with rank r, and results[0]
+ * to the total, at other ranks only results[ai->rank] is set.
+ * Returns 0, or -errno if setting up or any of the connections failed.
+ */
+int ktf_netbench_run(const struct ktf_addrinfo *ai, const struct ktf_netbench_cfg *cfg,
+		     struct ktf_netbench_result *results);
+
+/* Run a measurement between the nodes of a configured network context */
+static inline int ktf_netctx_bench(struct ktf_netctx *nc, const struct ktf_netbench_cfg *cfg,
+				   struct ktf_netbench_result *results)
+{
+	if (!nc->a)
+		return -ENOTCONN;
+	return ktf_netbench_run(nc->a, cfg, results);
+}
+
+/* Assert that a result has no errors and that it reaches at least BPS
+ * bytes per second, or that its average round trip is within NS ns:
+ */
+#define ktf_assert_net_rate(R, BPS)					\
+	({ const struct ktf_netbench_result *__r = (R);			\
+	   u64 __bps = (BPS);						\
+	   ktf_assert_msg(!__r->status && __r->bytes_per_sec >= __bps,	\
+		"Rank %d: %llu bytes/s in %llu ns (status %d), expected at least %llu", \
+		__r->rank, (unsigned long long)__r->bytes_per_sec,	\
+		(unsigned long long)__r->elapsed_ns, __r->status,	\
+		(unsigned long long)__bps); })
+
+#define ktf_assert_net_rtt(R, NS)					\
+	({ const struct ktf_netbench_result *__r = (R);			\
+	   u64 __ns = (NS);						\
+	   ktf_assert_msg(!__r->status && __r->ops && __r->rtt_avg_ns <= __ns, \
+		"Rank %d: average round trip %llu ns (max %llu ns, %llu round trips, status %d), budget %llu ns", \
+		__r->rank, (unsigned long long)__r->rtt_avg_ns,		\
+		(unsigned long long)__r->rtt_max_ns,			\
+		(unsigned long long)__r->ops, __r->status,		\
+		(unsigned long long)__ns); })
+
+#define EXPECT_NET_RATE_GE(R, BPS) ktf_assert_net_rate(R, BPS)
+#define EXPECT_NET_RTT_LE(R, NS) ktf_assert_net_rtt(R, NS)
+
+#define ASSERT_NET_RATE_GE(R, BPS) do {		\
+		if (!ktf_assert_net_rate(R, BPS))	\
+			return;				\
+	} while (0)
+
+#define ASSERT_NET_RTT_LE(R, NS) do {		\
+		if (!ktf_assert_net_rtt(R, NS))		\
+			return;				\
+	} while (0)
+
+#define ASSERT_NET_RATE_GE_GOTO(R, BPS, _lbl) do {	\
+		if (!ktf_assert_net_rate(R, BPS))	\
+			goto _lbl;			\
+	} while (0)
+
+#define ASSERT_NET_RTT_LE_GOTO(R, NS, _lbl) do {	\
+		if (!ktf_assert_net_rtt(R, NS))		\
+			goto _lbl;			\
+	} while (0)
+
+#endif
@@ -15,21 +15,41 @@
 #include "ktf_nl.h"
 #include "ktf.h"
 #include "ktf_cov.h"
+#include "ktf_perf.h"
+#include "ktf_sweep.h"
+#include "ktf_lockstat.h"
+#include "ktf_shm.h"
 #include "ktf_compat.h"
 
 /* Generic netlink support to communicate with user level
  * test framework.
  */
 
+/* Parse the attributes nested in nla, checking their types and sizes */
+#if (KERNEL_VERSION(5, 2, 0) <= LINUX_VERSION_CODE)
+#define ktf_nla_parse_nested(tb, maxtype, nla, policy) \
+	nla_parse_nested_deprecated(tb, maxtype, nla, policy, NULL)
+#elif (KERNEL_VERSION(4, 12, 0) <= LINUX_VERSION_CODE)
+#define ktf_nla_parse_nested(tb, maxtype, nla, policy) \
+	nla_parse_nested(tb, maxtype, nla, policy, NULL)
+#else
+#define ktf_nla_parse_nested(tb, maxtype, nla, policy) \
+	nla_parse_nested(tb, maxtype, nla, policy)
+#endif
+
 /* Callback functions defined below */
 static int ktf_run(struct sk_buff *skb, struct genl_info *info);
+static int ktf_run_batch(struct sk_buff *skb, struct genl_info *info);
 static int ktf_query(struct sk_buff *skb, struct genl_info *info);
+static int ktf_query_dump(struct sk_buff *skb, struct netlink_callback *cb);
+static int ktf_query_dump_done(struct netlink_callback *cb);
 static int ktf_req(struct sk_buff *skb, struct genl_info *info);
 static int ktf_resp(struct sk_buff *skb, struct genl_info *info);
 static int ktf_cov_cmd(enum ktf_cmd_type type, struct sk_buff *skb,
 		       struct genl_info *info);
 static int ktf_ctx_cfg(struct sk_buff *skb, struct genl_info *info);
-static int send_version_only(struct sk_buff *skb, struct genl_info *info);
+static int ktf_ctx_cfg_batch(struct sk_buff *skb, struct genl_info *info);
+static int send_version_only(struct sk_buff *skb, struct genl_info *info, const u32 *gen);
 
 /* operation definition */
 static struct genl_ops ktf_ops[] = {
@@ -40,7 +60,8 @@ static struct genl_ops ktf_ops[] = {
 		.policy = ktf_gnl_policy,
 #endif
 		.doit = ktf_req,
-		.dumpit = NULL,
+		.dumpit = ktf_query_dump,
+		.done = ktf_query_dump_done,
 	},
 	{
 		.cmd = KTF_C_RESP,
@@ -64,6 +85,10 @@ static struct genl_family ktf_gnl_family = {
 	.name = "ktf",
 	.version = 1,
 	.maxattr = KTF_A_MAX + 4,
+#if (KERNEL_VERSION(3, 10, 0) <= LINUX_VERSION_CODE)
+	/* Let test runs from different sockets execute concurrently */
+	.parallel_ops = true,
+#endif
 #if (KERNEL_VERSION(5, 2, 0) <= LINUX_VERSION_CODE)
 	.policy = ktf_gnl_policy,
 #endif
@@ -79,10 +104,17 @@ static struct genl_family ktf_gnl_family = {
  * at the netlink level, but do result in a nonzero return
  * from nl_wait_for_ack() in user space.
  */
+/* Requests are executed in parallel (parallel_ops), but changes to
+ * coverage are serialized amongst themselves. Context configuration is
+ * serialized per handle, by the handle's cfg_sem and ctx_lock:
+ */
+static DEFINE_MUTEX(cov_lock);
+
 static int ktf_req(struct sk_buff *skb, struct genl_info *info)
 {
 	enum ktf_cmd_type type;
 	u64 version;
+	int ret;
 
 	/* Dispatch on type of request */
 
@@ -97,7 +129,7 @@ static int ktf_req(struct sk_buff *skb, struct genl_info *info)
 		 * Respond to it with a version only:
 		 */
 		if (nla_get_u32(info->attrs[KTF_A_TYPE]) == KTF_CT_QUERY)
-			return send_version_only(skb, info);
+			return send_version_only(skb, info, NULL);
 		return -EINVAL;
 	}
 
@@ -107,19 +139,31 @@ static int ktf_req(struct sk_buff *skb, struct genl_info *info)
 		return ktf_query(skb, info);
 	case KTF_CT_RUN:
 		return ktf_run(skb, info);
+	case KTF_CT_RUN_BATCH:
+		return ktf_run_batch(skb, info);
 	case KTF_CT_COV_ENABLE:
 	case KTF_CT_COV_DISABLE:
-		return ktf_cov_cmd(type, skb, info);
+	case KTF_CT_COV_RESET:
+	case KTF_CT_COV_SNAPSHOT:
+	case KTF_CT_COV_DELTA:
+		mutex_lock(&cov_lock);
+		ret = ktf_cov_cmd(type, skb, info);
+		mutex_unlock(&cov_lock);
+		return ret;
 	case KTF_CT_CTX_CFG:
 		return ktf_ctx_cfg(skb, info);
+	case KTF_CT_CTX_CFG_BATCH:
+		return ktf_ctx_cfg_batch(skb, info);
 	default:
 		terr("received netlink msg with invalid type (%d)", type);
 	}
 	return -EINVAL;
 }
 
-/* Reply with just version information to let user space report the issue: */
-static int send_version_only(struct sk_buff *skb, struct genl_info *info)
+/* Reply with just version information to let user space report the issue,
+ * or with the registry generation too if the query is answered by that:
+ */
+static int send_version_only(struct sk_buff *skb, struct genl_info *info, const u32 *gen)
 {
 	struct sk_buff *resp_skb = nlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
 	void *data;
@@ -135,6 +179,8 @@ static int send_version_only(struct sk_buff *skb, struct genl_info *info)
 	}
 	nla_put_u32(resp_skb, KTF_A_TYPE, KTF_CT_QUERY);
 	nla_put_u64_64bit(resp_skb, KTF_A_VERSION, KTF_VERSION_LATEST, 0);
+	if (gen)
+		nla_put_u32(resp_skb, KTF_A_GEN, *gen);
 
 	/* Recompute message header */
 	genlmsg_end(resp_skb, data);
@@ -147,8 +193,32 @@ resp_failure:
 	return retval;
 }
 
+/* Send data about a single test. A test is not valid
+ * if the handle requires a context and none is present.
+ * If ids is set, the client understands KTF_A_ID:
+ */
+static int send_one_test(struct sk_buff *resp_skb, struct ktf_test *t, bool ids)
+{
+	unsigned char *mark = skb_tail_pointer(resp_skb);
+
+	if (t->handle->id) {
+		if (nla_put_u32(resp_skb, KTF_A_HID, t->handle->id))
+			goto fail;
+	} else if (t->handle->require_context) {
+		return 0;
+	}
+	if (nla_put_string(resp_skb, KTF_A_STR, t->name))
+		goto fail;
+	if (ids && t->id && nla_put_u32(resp_skb, KTF_A_ID, t->id))
+		goto fail;
+	return 0;
+fail:
+	nlmsg_trim(resp_skb, mark);
+	return -EMSGSIZE;
+}
+
 /* Send data about one testcase */
-static int send_test_data(struct sk_buff *resp_skb, struct ktf_case *tc)
+static int send_test_data(struct sk_buff *resp_skb, struct ktf_case *tc, bool ids)
 {
 	struct nlattr *nest_attr;
 	struct ktf_test *t;
@@ -162,15 +232,7 @@ static int send_test_data(struct sk_buff *resp_skb, struct ktf_case *tc)
 	nest_attr = nla_nest_start(resp_skb, KTF_A_TEST);
 	ktf_testcase_for_each_test(t, tc) {
 		cnt++;
-		/* A test is not valid if the handle requires a context and none is present */
-		if (t->handle->id) {
-			stat = nla_put_u32(resp_skb, KTF_A_HID, t->handle->id);
-			if (stat)
-				goto fail;
-		} else if (t->handle->require_context) {
-			continue;
-		}
-		stat = nla_put_string(resp_skb, KTF_A_STR, t->name);
+		stat = send_one_test(resp_skb, t, ids);
 		if (stat)
 			goto fail;
 	}
@@ -184,7 +246,8 @@ fail:
 	return stat;
 }
 
-static int send_handle_data(struct sk_buff *resp_skb, struct ktf_handle *handle)
+static int send_handle_data(struct sk_buff *resp_skb, struct ktf_handle *handle,
+			    bool ids)
 {
 	struct ktf_context_type *ct;
 	struct nlattr *nest_attr;
@@ -225,12 +288,234 @@ static int send_handle_data(struct sk_buff *resp_skb, struct ktf_handle *handle)
 			if (stat)
 				return stat;
 		}
+		if (ids && ctx->id) {
+			stat = nla_put_u32(resp_skb, KTF_A_ID, ctx->id);
+			if (stat)
+				return stat;
+		}
 		ctx = ktf_find_next_context(ctx);
 	}
 	nla_nest_end(resp_skb, nest_attr);
 	return 0;
 }
 
+/* Cursor for a paginated query dump, kept in netlink_callback::args
+ * between calls. References are held on the test case and test the next
+ * message continues from, so the dump resumes at the right place even if
+ * test modules are loaded or unloaded meanwhile.
+ */
+struct ktf_query_cursor {
+	long phase;
+	long hidx;		/* Lowest id of the next handle to send */
+	struct ktf_case *tc;	/* Test case to continue from, if set */
+	struct ktf_test *t;	/* Test within tc to continue from, if set */
+	long ids;		/* Client supports numeric ids */
+	long gen;		/* Registry generation when the dump started */
+};
+
+enum ktf_query_phase {
+	KTF_QUERY_START,
+	KTF_QUERY_HANDLES,
+	KTF_QUERY_CASES,
+	KTF_QUERY_DONE
+};
+
+static inline struct ktf_query_cursor *ktf_query_cursor(struct netlink_callback *cb)
+{
+	BUILD_BUG_ON(sizeof(struct ktf_query_cursor) > sizeof(cb->args));
+	return (struct ktf_query_cursor *)cb->args;
+}
+
+/* Send as many handles as fits, starting at handle id cur->hidx.
+ * Returns 0 when all handles have been sent.
+ */
+static int ktf_query_dump_handles(struct sk_buff *skb, struct ktf_query_cursor *cur)
+{
+	long start = cur->hidx;
+	struct ktf_handle *handle;
+	struct nlattr *nest_attr;
+	int hid = start;
+	int stat = 0;
+
+	handle = ktf_handle_next(&hid);
+	if (!handle)
+		return 0;
+
+	nest_attr = nla_nest_start(skb, KTF_A_HLIST);
+	if (!nest_attr)
+		return -EMSGSIZE;
+	for (; handle; hid++, handle = ktf_handle_next(&hid)) {
+		unsigned char *mark = skb_tail_pointer(skb);
+
+		stat = send_handle_data(skb, handle, cur->ids);
+		if (stat) {
+			nlmsg_trim(skb, mark);
+			break;
+		}
+		cur->hidx = hid + 1;
+	}
+	if (stat && cur->hidx == start) {
+		nla_nest_cancel(skb, nest_attr);
+		return -EMSGSIZE;
+	}
+	nla_nest_end(skb, nest_attr);
+	return stat ? -EMSGSIZE : 0;
+}
+
+/* Send as many test cases and tests as fits, continuing from the cursor.
+ * A test case that does not fit is continued in the next message.
+ * Returns 0 when all test cases have been sent.
+ */
+static int ktf_query_dump_cases(struct sk_buff *skb, struct ktf_query_cursor *cur)
+{
+	unsigned char *start = skb_tail_pointer(skb);
+	struct nlattr *list_attr, *test_attr;
+	struct ktf_case *tc = cur->tc;
+	struct ktf_test *t = cur->t;
+
+	if (nla_put_u32(skb, KTF_A_NUM, ktf_case_count()))
+		return -EMSGSIZE;
+	list_attr = nla_nest_start(skb, KTF_A_LIST);
+	if (!list_attr)
+		goto nothing_sent;
+
+	if (!tc)
+		tc = ktf_map_first_entry(&test_cases, struct ktf_case, kmap);
+	for (; tc; tc = ktf_map_next_entry(tc, kmap)) {
+		unsigned char *mark = skb_tail_pointer(skb);
+		int tcnt = 0;
+
+		if (nla_put_string(skb, KTF_A_STR, ktf_case_name(tc)))
+			goto full;
+		test_attr = nla_nest_start(skb, KTF_A_TEST);
+		if (!test_attr) {
+			nlmsg_trim(skb, mark);
+			goto full;
+		}
+		if (!t)
+			t = ktf_map_first_entry(&tc->tests, struct ktf_test, kmap);
+		for (; t; t = ktf_map_next_entry(t, kmap)) {
+			if (send_one_test(skb, t, cur->ids)) {
+				if (!tcnt)
+					nlmsg_trim(skb, mark);
+				else
+					nla_nest_end(skb, test_attr);
+				goto full;
+			}
+			tcnt++;
+		}
+		nla_nest_end(skb, test_attr);
+	}
+	nla_nest_end(skb, list_attr);
+	cur->tc = NULL;
+	cur->t = NULL;
+	return 0;
+full:
+	/* Keep the references to tc and t for the next round */
+	cur->tc = tc;
+	cur->t = t;
+	if (skb_tail_pointer(skb) == (unsigned char *)nla_data(list_attr))
+		goto nothing_sent;
+	nla_nest_end(skb, list_attr);
+	return -EMSGSIZE;
+nothing_sent:
+	nlmsg_trim(skb, start);
+	return -EMSGSIZE;
+}
+
+/* Query as a netlink dump: The response is split over as many messages
+ * as needed, each with type and version, then the handle list (KTF_A_HLIST)
+ * and the test case list (KTF_A_LIST) as in the response from ktf_query,
+ * but the lists may be continued in the next message.
+ */
+static int ktf_query_dump(struct sk_buff *skb, struct netlink_callback *cb)
+{
+	struct ktf_query_cursor *cur = ktf_query_cursor(cb);
+	struct nlattr *type_attr, *version_attr, *gen_attr;
+	bool version_ok = true;
+	unsigned int len;
+	void *hdr;
+	int stat = 0;
+
+	if (cur->phase == KTF_QUERY_DONE)
+		return 0;
+
+	if (cur->phase == KTF_QUERY_START) {
+		type_attr = nlmsg_find_attr(cb->nlh, GENL_HDRLEN, KTF_A_TYPE);
+		version_attr = nlmsg_find_attr(cb->nlh, GENL_HDRLEN, KTF_A_VERSION);
+		if (!type_attr || nla_len(type_attr) < sizeof(u32) ||
+		    !version_attr || nla_len(version_attr) < sizeof(u64)) {
+			terr("received netlink dump request with no type/version!");
+			return -EINVAL;
+		}
+		if (nla_get_u32(type_attr) != KTF_CT_QUERY) {
+			terr("received netlink dump request with invalid type (%d)",
+			     nla_get_u32(type_attr));
+			return -EOPNOTSUPP;
+		}
+		/* Respond with a version only to let user space report the issue */
+		version_ok = !ktf_version_check(nla_get_u64(version_attr));
+		cur->ids = nla_get_u64(version_attr) >= KTF_VERSION_IDS;
+		cur->phase = KTF_QUERY_HANDLES;
+
+		/* The generation is read before anything else, so that a
+		 * change during the dump makes the client query again next time.
+		 * A client that already has this generation gets nothing more:
+		 */
+		cur->gen = ktf_registry_gen();
+		gen_attr = nlmsg_find_attr(cb->nlh, GENL_HDRLEN, KTF_A_GEN);
+		if (gen_attr && nla_len(gen_attr) >= sizeof(u32) &&
+		    nla_get_u32(gen_attr) == (u32)cur->gen)
+			cur->phase = KTF_QUERY_DONE;
+	}
+
+	hdr = genlmsg_put(skb, NETLINK_CB(cb->skb).portid, cb->nlh->nlmsg_seq,
+			  &ktf_gnl_family, NLM_F_MULTI, KTF_C_RESP);
+	if (!hdr)
+		return -EMSGSIZE;
+	if (nla_put_u32(skb, KTF_A_TYPE, KTF_CT_QUERY) ||
+	    nla_put_u64_64bit(skb, KTF_A_VERSION, KTF_VERSION_LATEST, 0) ||
+	    nla_put_u32(skb, KTF_A_GEN, (u32)cur->gen)) {
+		genlmsg_cancel(skb, hdr);
+		return -EMSGSIZE;
+	}
+	len = skb->len;
+
+	if (!version_ok)
+		cur->phase = KTF_QUERY_DONE;
+
+	if (cur->phase == KTF_QUERY_HANDLES) {
+		stat = ktf_query_dump_handles(skb, cur);
+		if (!stat)
+			cur->phase = KTF_QUERY_CASES;
+	}
+	if (cur->phase == KTF_QUERY_CASES && !stat) {
+		stat = ktf_query_dump_cases(skb, cur);
+		if (!stat)
+			cur->phase = KTF_QUERY_DONE;
+	}
+
+	if (stat && skb->len == len) {
+		/* A single entry did not fit in an empty message */
+		twarn("Unable to fit query data into a dump message");
+		genlmsg_cancel(skb, hdr);
+		return stat;
+	}
+	genlmsg_end(skb, hdr);
+	return skb->len;
+}
+
+static int ktf_query_dump_done(struct netlink_callback *cb)
+{
+	struct ktf_query_cursor *cur = ktf_query_cursor(cb);
+
+	if (cur->t)
+		ktf_test_put(cur->t);
+	if (cur->tc)
+		ktf_case_put(cur->tc);
+	return 0;
+}
+
 static int ktf_query(struct sk_buff *skb, struct genl_info *info)
 {
 	struct sk_buff *resp_skb;
@@ -239,8 +524,14 @@ static int ktf_query(struct sk_buff *skb, struct genl_info *info)
 	struct nlattr *nest_attr;
 	struct ktf_handle *handle;
 	struct ktf_case *tc;
+	int hid;
+	bool ids = nla_get_u64(info->attrs[KTF_A_VERSION]) >= KTF_VERSION_IDS;
+	u32 gen = ktf_registry_gen();
+
+	/* The client already has the tests of this generation */
+	if (info->attrs[KTF_A_GEN] && nla_get_u32(info->attrs[KTF_A_GEN]) == gen)
+		return send_version_only(skb, info, &gen);
 
-	/* No options yet, just send a response */
 	resp_skb = nlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
 	if (!resp_skb)
 		return -ENOMEM;
@@ -253,6 +544,7 @@ static int ktf_query(struct sk_buff *skb, struct genl_info *info)
 	}
 
 	nla_put_u64_64bit(resp_skb, KTF_A_VERSION, KTF_VERSION_LATEST, 0);
+	nla_put_u32(resp_skb, KTF_A_GEN, gen);
 
 	/* Add all test sets to the report
 	 *  We send test info as follows:
@@ -261,11 +553,12 @@ static int ktf_query(struct sk_buff *skb, struct genl_info *info)
 	 *  Handle IDs without contexts are not present
 	 */
 	if (!nla_put_u32(resp_skb, KTF_A_TYPE, KTF_CT_QUERY)) {
-		if (!list_empty(&context_handles)) {
-			/* Traverse list of handles with contexts */
+		hid = 0;
+		if (ktf_handle_next(&hid)) {
+			/* Traverse the handles with contexts */
 			nest_attr = nla_nest_start(resp_skb, KTF_A_HLIST);
-			list_for_each_entry(handle, &context_handles, handle_list) {
-				retval = send_handle_data(resp_skb, handle);
+			ktf_for_each_handle(handle, hid) {
+				retval = send_handle_data(resp_skb, handle, ids);
 				if (retval)
 					goto resp_failure;
 			}
@@ -281,7 +574,7 @@ static int ktf_query(struct sk_buff *skb, struct genl_info *info)
 			goto resp_failure;
 		}
 		ktf_for_each_testcase(tc) {
-			retval = send_test_data(resp_skb, tc);
+			retval = send_test_data(resp_skb, tc, ids);
 			if (retval) {
 				retval = -ENOMEM;
 				goto resp_failure;
@@ -303,48 +596,608 @@ resp_failure:
 	return retval;
 }
 
-static int ktf_run_func(struct sk_buff *skb, const char *ctxname,
+/* Room reserved in each result stream part for the genl header, the type
+ * and list attributes and the trailing status/drop count attributes:
+ */
+#define KTF_STREAM_OVERHEAD	(GENL_HDRLEN + NLA_HDRLEN + 3 * nla_total_size(sizeof(u32)))
+#define KTF_STREAM_TRAILER	(2 * nla_total_size(sizeof(u32)))
+
+/* Start a new part of the stream with room for at least a record of size len.
+ * Called with the stream lock held.
+ */
+static int ktf_stream_new_part(struct ktf_result_stream *rs, size_t len)
+{
+	size_t size = max_t(size_t, NLMSG_DEFAULT_SIZE, len + KTF_STREAM_OVERHEAD);
+
+	rs->records = 0;
+	rs->skb = nlmsg_new(size, GFP_ATOMIC);
+	if (!rs->skb)
+		return -ENOMEM;
+
+	rs->hdr = genlmsg_put_reply(rs->skb, rs->info, &ktf_gnl_family,
+				    0, KTF_C_RESP);
+	if (!rs->hdr)
+		goto fail;
+	if (nla_put_u32(rs->skb, KTF_A_TYPE, rs->type))
+		goto fail;
+	rs->nest = nla_nest_start(rs->skb, KTF_A_LIST);
+	if (!rs->nest)
+		goto fail;
+	return 0;
+fail:
+	nlmsg_free(rs->skb);
+	rs->skb = NULL;
+	return -ENOMEM;
+}
+
+/* Queue the current part as one of several in a multipart response */
+static void ktf_stream_flush(struct ktf_result_stream *rs)
+{
+	nla_nest_end(rs->skb, rs->nest);
+	genlmsg_end(rs->skb, rs->hdr);
+	nlmsg_hdr(rs->skb)->nlmsg_flags |= NLM_F_MULTI;
+	skb_queue_tail(&rs->queue, rs->skb);
+	rs->skb = NULL;
+	rs->parts++;
+}
+
+/* Make room for a record of size len, flushing the current part if needed */
+static int ktf_stream_reserve(struct ktf_result_stream *rs, size_t len)
+{
+	if (rs->skb) {
+		if (skb_tailroom(rs->skb) >= len + KTF_STREAM_TRAILER)
+			return 0;
+		ktf_stream_flush(rs);
+	}
+	return ktf_stream_new_part(rs, len);
+}
+
+/* Number of records in a queued part, for accounting if it cannot be sent */
+static u32 ktf_stream_part_records(struct sk_buff *skb)
+{
+	struct nlattr *list = nlmsg_find_attr(nlmsg_hdr(skb), GENL_HDRLEN, KTF_A_LIST);
+	struct nlattr *nla;
+	u32 records = 0;
+	int rem;
+
+	if (!list)
+		return 0;
+	nla_for_each_nested(nla, list, rem)
+		if (nla_type(nla) == KTF_A_STAT || nla_type(nla) == KTF_A_TEST ||
+		    nla_type(nla) == KTF_A_COV || nla_type(nla) == KTF_A_BENCH ||
+		    nla_type(nla) == KTF_A_TIME || nla_type(nla) == KTF_A_PERF ||
+		    nla_type(nla) == KTF_A_SWEEP || nla_type(nla) == KTF_A_LOCKS)
+			records++;
+	return records;
+}
+
+int ktf_stream_start(struct ktf_result_stream *rs, struct genl_info *info, u32 type)
+{
+	unsigned long flags;
+	int ret;
+
+	memset(rs, 0, sizeof(*rs));
+	spin_lock_init(&rs->lock);
+	skb_queue_head_init(&rs->queue);
+	mutex_init(&rs->send_lock);
+	rs->info = info;
+	rs->type = type;
+	if (info->attrs[KTF_A_VERSION])
+		rs->version = nla_get_u64(info->attrs[KTF_A_VERSION]);
+	if (info->attrs[KTF_A_PERFOPT])
+		rs->perf = nla_get_u32(info->attrs[KTF_A_PERFOPT]);
+	spin_lock_irqsave(&rs->lock, flags);
+	ret = ktf_stream_new_part(rs, 0);
+	spin_unlock_irqrestore(&rs->lock, flags);
+	return ret;
+}
+
+int ktf_stream_put_result(struct ktf_result_stream *rs, u32 result,
+			  const char *file, u32 line, const char *report)
+{
+	size_t len = 2 * nla_total_size(sizeof(u32)) +
+		nla_total_size(strlen(file) + 1) +
+		nla_total_size(strlen(report) + 1);
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&rs->lock, flags);
+	ret = ktf_stream_reserve(rs, len);
+	if (!ret) {
+		nla_put_u32(rs->skb, KTF_A_STAT, result);
+		nla_put_string(rs->skb, KTF_A_FILE, file);
+		nla_put_u32(rs->skb, KTF_A_NUM, line);
+		nla_put_string(rs->skb, KTF_A_STR, report);
+		rs->records++;
+	} else {
+		rs->dropped++;
+	}
+	spin_unlock_irqrestore(&rs->lock, flags);
+	return ret;
+}
+
+int ktf_stream_put_count(struct ktf_result_stream *rs, u32 count)
+{
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&rs->lock, flags);
+	ret = ktf_stream_reserve(rs, nla_total_size(sizeof(u32)));
+	if (!ret) {
+		nla_put_u32(rs->skb, KTF_A_STAT, count);
+		rs->records++;
+	} else {
+		rs->dropped++;
+	}
+	spin_unlock_irqrestore(&rs->lock, flags);
+	return ret;
+}
+
+/* Identify the test the preceding results belong to, in a batch run.
+ * For tests requested by id, the id is also included.
+ */
+int ktf_stream_put_test(struct ktf_result_stream *rs, const char *setname,
+			const char *testname, const char *ctxname, u32 stat, u32 id)
+{
+	size_t len = NLA_HDRLEN + nla_total_size(strlen(setname) + 1) +
+		nla_total_size(strlen(testname) + 1) + 2 * nla_total_size(sizeof(u32)) +
+		(ctxname ? nla_total_size(strlen(ctxname) + 1) : 0);
+	struct nlattr *nest_attr;
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&rs->lock, flags);
+	ret = ktf_stream_reserve(rs, len);
+	if (!ret) {
+		nest_attr = nla_nest_start(rs->skb, KTF_A_TEST);
+		nla_put_string(rs->skb, KTF_A_SNAM, setname);
+		nla_put_string(rs->skb, KTF_A_TNAM, testname);
+		if (ctxname)
+			nla_put_string(rs->skb, KTF_A_STR, ctxname);
+		nla_put_u32(rs->skb, KTF_A_STAT, stat);
+		if (id)
+			nla_put_u32(rs->skb, KTF_A_ID, id);
+		nla_nest_end(rs->skb, nest_attr);
+		rs->records++;
+	} else {
+		rs->dropped++;
+	}
+	spin_unlock_irqrestore(&rs->lock, flags);
+	return ret;
+}
+
+/* Number of calls to a function, in total or (for a nonzero test_id)
+ * during a test run.
+ */
+int ktf_stream_put_cov(struct ktf_result_stream *rs, const char *module,
+		       const char *function, u32 hits, u32 test_id)
+{
+	size_t len = NLA_HDRLEN + nla_total_size(strlen(module) + 1) +
+		nla_total_size(strlen(function) + 1) + 2 * nla_total_size(sizeof(u32));
+	struct nlattr *nest_attr;
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&rs->lock, flags);
+	ret = ktf_stream_reserve(rs, len);
+	if (!ret) {
+		nest_attr = nla_nest_start(rs->skb, KTF_A_COV);
+		nla_put_string(rs->skb, KTF_A_MOD, module);
+		nla_put_string(rs->skb, KTF_A_STR, function);
+		nla_put_u32(rs->skb, KTF_A_NUM, hits);
+		if (test_id)
+			nla_put_u32(rs->skb, KTF_A_ID, test_id);
+		nla_nest_end(rs->skb, nest_attr);
+		rs->records++;
+	} else {
+		rs->dropped++;
+	}
+	spin_unlock_irqrestore(&rs->lock, flags);
+	return ret;
+}
+
+/* Statistics of a BENCH() test, reported with the results of the test */
+int ktf_stream_put_bench(struct ktf_result_stream *rs, const struct ktf_bench_stats *bs)
+{
+	size_t len = NLA_HDRLEN + (KTF_B_OPS - KTF_B_PAD) * nla_total_size_64bit(sizeof(u64)) +
+		nla_total_size(sizeof(bs->samples_ps));
+	struct nlattr *nest_attr;
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&rs->lock, flags);
+	ret = ktf_stream_reserve(rs, len);
+	if (!ret) {
+		nest_attr = nla_nest_start(rs->skb, KTF_A_BENCH);
+		nla_put_u64_64bit(rs->skb, KTF_B_ITERS, bs->iterations, KTF_B_PAD);
+		nla_put_u64_64bit(rs->skb, KTF_B_BATCHES, bs->batches, KTF_B_PAD);
+		nla_put_u64_64bit(rs->skb, KTF_B_MIN, bs->min_ps, KTF_B_PAD);
+		nla_put_u64_64bit(rs->skb, KTF_B_MEDIAN, bs->median_ps, KTF_B_PAD);
+		nla_put_u64_64bit(rs->skb, KTF_B_MEAN, bs->mean_ps, KTF_B_PAD);
+		nla_put_u64_64bit(rs->skb, KTF_B_P99, bs->p99_ps, KTF_B_PAD);
+		nla_put_u64_64bit(rs->skb, KTF_B_OPS, bs->ops_per_sec, KTF_B_PAD);
+		nla_put(rs->skb, KTF_B_SAMPLES, sizeof(bs->samples_ps), bs->samples_ps);
+		nla_nest_end(rs->skb, nest_attr);
+		rs->records++;
+	} else {
+		rs->dropped++;
+	}
+	spin_unlock_irqrestore(&rs->lock, flags);
+	return ret;
+}
+
+/* Run time of the test the preceding results belong to.
+ * Requesters older than KTF_VERSION_TIME do not expect it.
+ */
+int ktf_stream_put_time(struct ktf_result_stream *rs, const struct ktf_test_time *tt)
+{
+	size_t len = NLA_HDRLEN + (KTF_T_MAX - 1) * nla_total_size_64bit(sizeof(u64));
+	struct nlattr *nest_attr;
+	unsigned long flags;
+	int ret;
+
+	if (rs->version < KTF_VERSION_TIME)
+		return 0;
+	spin_lock_irqsave(&rs->lock, flags);
+	ret = ktf_stream_reserve(rs, len);
+	if (!ret) {
+		nest_attr = nla_nest_start(rs->skb, KTF_A_TIME);
+		nla_put_u64_64bit(rs->skb, KTF_T_RUN, tt->run_ns, KTF_T_PAD);
+		nla_put_u64_64bit(rs->skb, KTF_T_ITERS, tt->iterations, KTF_T_PAD);
+		nla_put_u64_64bit(rs->skb, KTF_T_ITER_MIN, tt->iter_min_ns, KTF_T_PAD);
+		nla_put_u64_64bit(rs->skb, KTF_T_ITER_MAX, tt->iter_max_ns, KTF_T_PAD);
+		nla_put_u64_64bit(rs->skb, KTF_T_ITER_TOTAL, tt->iter_total_ns, KTF_T_PAD);
+		nla_nest_end(rs->skb, nest_attr);
+		rs->records++;
+	} else {
+		rs->dropped++;
+	}
+	spin_unlock_irqrestore(&rs->lock, flags);
+	return ret;
+}
+
+/* Performance counter totals of the test the preceding results belong to */
+int ktf_stream_put_perf(struct ktf_result_stream *rs, const struct ktf_perf *p)
+{
+	size_t len = NLA_HDRLEN + KTF_PERF_EVENTS * nla_total_size_64bit(sizeof(u64));
+	struct nlattr *nest_attr;
+	unsigned long flags;
+	int i, ret;
+
+	spin_lock_irqsave(&rs->lock, flags);
+	ret = ktf_stream_reserve(rs, len);
+	if (!ret) {
+		nest_attr = nla_nest_start(rs->skb, KTF_A_PERF);
+		for (i = 0; i < KTF_PERF_EVENTS; i++)
+			if (p->mask & (1 << i))
+				nla_put_u64_64bit(rs->skb, KTF_P_CYCLES + i, p->count[i],
+						  KTF_P_PAD);
+		nla_nest_end(rs->skb, nest_attr);
+		rs->records++;
+	} else {
+		rs->dropped++;
+	}
+	spin_unlock_irqrestore(&rs->lock, flags);
+	return ret;
+}
+
+/* Scalability curve of a sweep, reported with the results of the test.
+ * Requesters older than KTF_VERSION_SWEEP do not expect it.
+ */
+int ktf_stream_put_sweep(struct ktf_result_stream *rs, const struct ktf_sweep_stats *ss)
+{
+	size_t len = NLA_HDRLEN + nla_total_size_64bit(sizeof(u64)) + ss->nr_points *
+		(NLA_HDRLEN + nla_total_size(sizeof(u32)) + 4 * nla_total_size_64bit(sizeof(u64)));
+	const struct ktf_sweep_point *pt;
+	struct nlattr *nest_attr, *point;
+	unsigned long flags;
+	unsigned int i;
+	int ret;
+
+	if (rs->version < KTF_VERSION_SWEEP)
+		return 0;
+	spin_lock_irqsave(&rs->lock, flags);
+	ret = ktf_stream_reserve(rs, len);
+	if (!ret) {
+		nest_attr = nla_nest_start(rs->skb, KTF_A_SWEEP);
+		nla_put_u64_64bit(rs->skb, KTF_W_DURATION, ss->duration_ns, KTF_W_PAD);
+		for (i = 0; i < ss->nr_points; i++) {
+			pt = &ss->points[i];
+			point = nla_nest_start(rs->skb, KTF_W_POINT);
+			nla_put_u32(rs->skb, KTF_W_THREADS, pt->threads);
+			nla_put_u64_64bit(rs->skb, KTF_W_OPS, pt->ops, KTF_W_PAD);
+			nla_put_u64_64bit(rs->skb, KTF_W_ELAPSED, pt->elapsed_ns, KTF_W_PAD);
+			nla_put_u64_64bit(rs->skb, KTF_W_RATE, pt->ops_per_sec, KTF_W_PAD);
+			nla_put_u64_64bit(rs->skb, KTF_W_OP_TIME, pt->op_ps, KTF_W_PAD);
+			nla_nest_end(rs->skb, point);
+		}
+		nla_nest_end(rs->skb, nest_attr);
+		rs->records++;
+	} else {
+		rs->dropped++;
+	}
+	spin_unlock_irqrestore(&rs->lock, flags);
+	return ret;
+}
+
+/* Lock contention profile of the test the preceding results belong to */
+int ktf_stream_put_locks(struct ktf_result_stream *rs, const struct ktf_lockstat *ls)
+{
+	size_t len = NLA_HDRLEN + nla_total_size_64bit(sizeof(u64));
+	const struct ktf_lock_report *r;
+	struct nlattr *nest_attr, *entry;
+	unsigned long flags;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < ls->nr_top; i++)
+		len += NLA_HDRLEN + nla_total_size(strlen(ls->top[i].lock) + 1) +
+			nla_total_size(strlen(ls->top[i].caller) + 1) +
+			nla_total_size(sizeof(u32)) + 3 * nla_total_size_64bit(sizeof(u64));
+	spin_lock_irqsave(&rs->lock, flags);
+	ret = ktf_stream_reserve(rs, len);
+	if (!ret) {
+		nest_attr = nla_nest_start(rs->skb, KTF_A_LOCKS);
+		nla_put_u64_64bit(rs->skb, KTF_L_DROPPED, atomic64_read(&ls->dropped),
+				  KTF_L_PAD);
+		for (i = 0; i < ls->nr_top; i++) {
+			r = &ls->top[i];
+			entry = nla_nest_start(rs->skb, KTF_L_ENTRY);
+			nla_put_string(rs->skb, KTF_L_LOCK, r->lock);
+			nla_put_string(rs->skb, KTF_L_CALLER, r->caller);
+			nla_put_u32(rs->skb, KTF_L_FLAGS, r->flags);
+			nla_put_u64_64bit(rs->skb, KTF_L_COUNT, r->count, KTF_L_PAD);
+			nla_put_u64_64bit(rs->skb, KTF_L_WAIT, r->wait_ns, KTF_L_PAD);
+			nla_put_u64_64bit(rs->skb, KTF_L_MAX_WAIT, r->max_ns, KTF_L_PAD);
+			nla_nest_end(rs->skb, entry);
+		}
+		nla_nest_end(rs->skb, nest_attr);
+		rs->records++;
+	} else {
+		rs->dropped++;
+	}
+	spin_unlock_irqrestore(&rs->lock, flags);
+	return ret;
+}
+
+/* Generation of the coverage counts in the stream, see ktf_cov_delta() */
+int ktf_stream_put_gen(struct ktf_result_stream *rs, u32 gen)
+{
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&rs->lock, flags);
+	ret = ktf_stream_reserve(rs, nla_total_size(sizeof(u32)));
+	if (!ret)
+		nla_put_u32(rs->skb, KTF_A_GEN, gen);
+	spin_unlock_irqrestore(&rs->lock, flags);
+	return ret;
+}
+
+/* Send the parts completed so far - must be called from process context */
+void ktf_stream_sync(struct ktf_result_stream *rs)
+{
+	struct sk_buff *skb;
+	unsigned long flags;
+	u32 records;
+	int ret;
+
+	mutex_lock(&rs->send_lock);
+	while ((skb = skb_dequeue(&rs->queue))) {
+		records = ktf_stream_part_records(skb);
+
+		/* genlmsg_reply consumes the skb also on failure */
+		ret = genlmsg_reply(skb, rs->info);
+		if (ret) {
+			twarn("Failed to send result part (%u records) - status %d",
+			      records, ret);
+			spin_lock_irqsave(&rs->lock, flags);
+			rs->dropped += records;
+			spin_unlock_irqrestore(&rs->lock, flags);
+		}
+	}
+	mutex_unlock(&rs->send_lock);
+}
+
+/* Terminate a multipart response */
+static int ktf_stream_done(struct ktf_result_stream *rs)
+{
+	struct sk_buff *skb = nlmsg_new(sizeof(int), GFP_KERNEL);
+	struct nlmsghdr *nlh;
+
+	if (!skb)
+		return -ENOMEM;
+	nlh = nlmsg_put(skb, rs->info->snd_portid, rs->info->snd_seq,
+			NLMSG_DONE, sizeof(int), NLM_F_MULTI);
+	if (!nlh) {
+		nlmsg_free(skb);
+		return -ENOMEM;
+	}
+	memset(nlmsg_data(nlh), 0, sizeof(int));
+	nlmsg_end(skb, nlh);
+	return genlmsg_reply(skb, rs->info);
+}
+
+/* Send the last part of the stream with the overall status.
+ * If more than one part was needed, the last part is also flagged
+ * as NLM_F_MULTI and followed by a NLMSG_DONE.
+ * The test run is complete at this point, so nothing is added concurrently.
+ */
+int ktf_stream_end(struct ktf_result_stream *rs, u32 stat)
+{
+	struct sk_buff *skb;
+	unsigned long flags;
+	int ret = 0;
+
+	ktf_stream_sync(rs);
+
+	spin_lock_irqsave(&rs->lock, flags);
+	if (!rs->skb)
+		ret = ktf_stream_new_part(rs, 0);
+	skb = rs->skb;
+	rs->skb = NULL;
+	spin_unlock_irqrestore(&rs->lock, flags);
+	if (ret)
+		return ret;
+
+	nla_nest_end(skb, rs->nest);
+	nla_put_u32(skb, KTF_A_STAT, stat);
+	if (rs->dropped) {
+		terr("%u test results could not be delivered", rs->dropped);
+		nla_put_u32(skb, KTF_A_NUM, rs->dropped);
+	}
+	genlmsg_end(skb, rs->hdr);
+	if (rs->parts)
+		nlmsg_hdr(skb)->nlmsg_flags |= NLM_F_MULTI;
+
+	ret = genlmsg_reply(skb, rs->info);
+	if (!ret && rs->parts) {
+		tlog(T_DEBUG, "Sent results in %d parts", rs->parts + 1);
+		ret = ktf_stream_done(rs);
+	}
+	return ret;
+}
+
+/* Run a test while keeping the configuration of the contexts of its handle
+ * from changing under it. Requests run in parallel, so tests may run at the
+ * same time as each other, but not with a new configuration being set:
+ */
+static void ktf_run_hook_cfg(struct ktf_result_stream *rs, struct ktf_context *ctx,
+			     struct ktf_test *t, u32 value, void *oob_data, size_t oob_data_sz)
+{
+	down_read(&t->handle->cfg_sem);
+	ktf_run_hook(rs, ctx, t, value, oob_data, oob_data_sz);
+	up_read(&t->handle->cfg_sem);
+}
+
+static int ktf_run_func(struct ktf_result_stream *rs, const char *ctxname,
 			const char *setname, const char *testname,
 			u32 value, void *oob_data, size_t oob_data_sz)
 {
 	struct ktf_case *testset = ktf_case_find(setname);
 	struct ktf_test *t;
-	int tn = 0;
+	int ret = 0;
 
 	if (!testset) {
 		tlog(T_INFO, "No such testset \"%s\"\n", setname);
 		return -EFAULT;
 	}
 
-	/* Execute test functions */
-	ktf_testcase_for_each_test(t, testset) {
-		if (t->fun && strcmp(t->name, testname) == 0) {
-			struct ktf_context *ctx = ktf_find_context(t->handle, ctxname);
+	/* Execute test function */
+	t = ktf_map_find_entry(&testset->tests, testname, struct ktf_test, kmap);
+	if (t && t->fun) {
+		struct ktf_context *ctx = ktf_find_context(t->handle, ctxname);
 
-			ktf_run_hook(skb, ctx, t, value, oob_data, oob_data_sz);
-		} else if (!t->fun) {
-			tlog(T_DEBUG, "** no function for test %s.%s **", t->tclass, t->name);
-		}
-		tn++;
+		ktf_run_hook_cfg(rs, ctx, t, value, oob_data, oob_data_sz);
+	} else if (t) {
+		tlog(T_DEBUG, "** no function for test %s.%s **", t->tclass, t->name);
+	} else {
+		tlog(T_INFO, "No test \"%s\" in testset \"%s\"\n", testname, setname);
+		ret = -ENOENT;
 	}
-	tlog(T_DEBUG, "Set %s contained %d tests", ktf_case_name(testset), tn);
+	if (t)
+		ktf_test_put(t);
+	tlog(T_DEBUG, "Set %s contained %lu tests", ktf_case_name(testset),
+	     (unsigned long)ktf_map_size(&testset->tests));
 	ktf_case_put(testset);
+	return ret;
+}
+
+/* Run a test identified by a numeric id as reported by the query */
+static int ktf_run_id(struct ktf_result_stream *rs, u32 id, u32 value,
+		      void *oob_data, size_t oob_data_sz, struct ktf_test **pt,
+		      struct ktf_context **pctx)
+{
+	struct ktf_test *t = ktf_test_find_id(id, pctx);
+
+	*pt = t;
+	if (!t) {
+		tlog(T_INFO, "No test with id %u (context %u)\n",
+		     KTF_ID_TEST(id), KTF_ID_CTX(id));
+		return -ENOENT;
+	}
+	if (t->fun)
+		ktf_run_hook_cfg(rs, *pctx, t, value, oob_data, oob_data_sz);
+	else
+		tlog(T_DEBUG, "** no function for test %s.%s **", t->tclass, t->name);
 	return 0;
 }
 
+/* Out-of-band data of a request: A copy of KTF_A_DATA, or a range of the
+ * shared buffer given by KTF_A_SHM, which is used in place.
+ */
+struct ktf_oob {
+	void *data;
+	size_t size;
+	struct ktf_shm *shm;	/* Reference to the buffer of data, if shared */
+};
+
+static int ktf_oob_get(struct nlattr *data_attr, struct nlattr *shm_attr,
+		       struct ktf_oob *oob)
+{
+	struct nlattr *tb[KTF_S_MAX];
+	u64 off, len;
+	void *data;
+	int ret;
+
+	memset(oob, 0, sizeof(*oob));
+	if (shm_attr) {
+		ret = ktf_nla_parse_nested(tb, KTF_S_MAX - 1, shm_attr, ktf_shm_policy);
+		if (ret)
+			return ret;
+		if (!tb[KTF_S_ID] || !tb[KTF_S_LEN])
+			return -EINVAL;
+		off = tb[KTF_S_OFF] ? nla_get_u64(tb[KTF_S_OFF]) : 0;
+		len = nla_get_u64(tb[KTF_S_LEN]);
+		/* ktf_shm_get() checks the range against the size of the buffer */
+		if (len > U64_MAX - off)
+			return -ERANGE;
+		data = ktf_shm_get(nla_get_u32(tb[KTF_S_ID]), off, len, &oob->shm);
+		if (IS_ERR(data))
+			return PTR_ERR(data);
+		oob->data = data;
+		oob->size = len;
+		return 0;
+	}
+
+	if (data_attr) {
+		oob->data = nla_memdup(data_attr, GFP_KERNEL);
+		if (!oob->data)
+			return -ENOMEM;
+		oob->size = nla_len(data_attr);
+	}
+	return 0;
+}
+
+static void ktf_oob_put(struct ktf_oob *oob)
+{
+	if (oob->shm)
+		ktf_shm_put(oob->shm);
+	else
+		kfree(oob->data);
+}
+
 static int ktf_run(struct sk_buff *skb, struct genl_info *info)
 {
 	u32 value = 0;
-	struct sk_buff *resp_skb;
-	void *data;
+	struct ktf_result_stream rs;
 	int retval = 0;
-	struct nlattr *nest_attr, *data_attr;
 	char ctxname_store[KTF_MAX_NAME + 1];
 	char *ctxname = ctxname_store;
 	char setname[KTF_MAX_NAME + 1];
 	char testname[KTF_MAX_NAME + 1];
-	void *oob_data = NULL;
-	size_t oob_data_sz = 0;
+	struct ktf_oob oob;
+	struct ktf_context *ctx;
+	struct ktf_test *t;
+	u32 id = 0;
+
+	if (info->attrs[KTF_A_ID]) {
+		/* Test (and context) given by id, names are not needed */
+		id = nla_get_u32(info->attrs[KTF_A_ID]);
+		strcpy(setname, "-");
+		snprintf(testname, sizeof(testname), "%u", id);
+		goto names_done;
+	}
 
 	if (info->attrs[KTF_A_STR])
 		nla_strlcpy(ctxname, info->attrs[KTF_A_STR], KTF_MAX_NAME);
@@ -362,54 +1215,206 @@ static int ktf_run(struct sk_buff *skb, struct genl_info *info)
 		return -EINVAL;
 	}
 	nla_strlcpy(testname, info->attrs[KTF_A_TNAM], KTF_MAX_NAME);
+names_done:
 
 	if (info->attrs[KTF_A_NUM])	{
 		/* Using NUM field as optional u32 input parameter to test */
 		value = nla_get_u32(info->attrs[KTF_A_NUM]);
 	}
 
-	data_attr = info->attrs[KTF_A_DATA];
-	if (data_attr)	{
-		/* User space sends out-of-band data: */
-		oob_data = nla_memdup(data_attr, GFP_KERNEL);
-		oob_data_sz = nla_len(data_attr);
-	}
+	/* User space may send out-of-band data: */
+	retval = ktf_oob_get(info->attrs[KTF_A_DATA], info->attrs[KTF_A_SHM], &oob);
+	if (retval)
+		return retval;
 
 	tlog(T_DEBUG, "Request for testset %s, test %s\n", setname, testname);
 
 	/* Start building a response */
-	resp_skb = nlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
-	if (!resp_skb)
-		return -ENOMEM;
+	retval = ktf_stream_start(&rs, info, KTF_CT_RUN);
+	if (retval)
+		goto out;
 
-	data = genlmsg_put_reply(resp_skb, info, &ktf_gnl_family,
-				 0, KTF_C_RESP);
-	if (!data) {
-		retval = -ENOMEM;
-		goto put_fail;
+	if (id) {
+		retval = ktf_run_id(&rs, id, value, oob.data, oob.size, &t, &ctx);
+		if (t)
+			ktf_test_put(t);
+	} else {
+		retval = ktf_run_func(&rs, ctxname, setname, testname, value,
+				      oob.data, oob.size);
 	}
 
-	nla_put_u32(resp_skb, KTF_A_TYPE, KTF_CT_RUN);
-	nest_attr = nla_nest_start(resp_skb, KTF_A_LIST);
-	retval = ktf_run_func(resp_skb, ctxname, setname, testname, value, oob_data, oob_data_sz);
-	nla_nest_end(resp_skb, nest_attr);
-	nla_put_u32(resp_skb, KTF_A_STAT, retval);
-
-	/* Recompute message header */
-	genlmsg_end(resp_skb, data);
-
-	retval = genlmsg_reply(resp_skb, info);
+	retval = ktf_stream_end(&rs, retval);
 	if (!retval)
 		tlog(T_DEBUG, "Sent reply for test %s.%s\n", setname, testname);
 	else
 		twarn("Failed to send reply for test %s.%s - value %d",
 		      setname, testname, retval);
+out:
+	ktf_oob_put(&oob);
+	return retval;
+}
 
-	kfree(oob_data);
-put_fail:
-	/* Free buffer if failure */
+/* Shell style pattern match supporting '*' and '?' */
+static bool ktf_pattern_match(const char *pat, const char *str)
+{
+	const char *back_pat = NULL, *back_str = NULL;
+
+	while (*str) {
+		if (*pat == '*') {
+			back_pat = ++pat;
+			back_str = str;
+		} else if (*pat == '?' || *pat == *str) {
+			pat++;
+			str++;
+		} else if (back_pat) {
+			pat = back_pat;
+			str = ++back_str;
+		} else {
+			return false;
+		}
+	}
+	while (*pat == '*')
+		pat++;
+	return !*pat;
+}
+
+/* Run all tests, and all contexts of tests, with a name that matches pattern.
+ * Names are matched as "<testset>.<test>" for tests without contexts, and
+ * as "<testset>.<test>_<context>" for tests with contexts.
+ */
+static int ktf_run_pattern(struct ktf_result_stream *rs, const char *pattern)
+{
+	char name[3 * KTF_MAX_KEY + 3];
+	struct ktf_context *ctx;
+	struct ktf_case *tc;
+	struct ktf_test *t;
+	const char *ctxname;
+	int cnt = 0;
+
+	ktf_for_each_testcase(tc) {
+		ktf_testcase_for_each_test(t, tc) {
+			if (!t->fun)
+				continue;
+			/* As for the query: Tests of handles with an id are run
+			 * once for each of the contexts only
+			 */
+			if (!t->handle->id) {
+				if (t->handle->require_context)
+					continue;
+				snprintf(name, sizeof(name), "%s.%s", t->tclass, t->name);
+				if (!ktf_pattern_match(pattern, name))
+					continue;
+				ktf_run_hook_cfg(rs, NULL, t, 0, NULL, 0);
+				ktf_stream_put_test(rs, t->tclass, t->name, NULL, 0, 0);
+				cnt++;
+				continue;
+			}
+			for (ctx = ktf_find_first_context(t->handle); ctx;
+			     ctx = ktf_find_next_context(ctx)) {
+				ctxname = ktf_context_name(ctx);
+				snprintf(name, sizeof(name), "%s.%s_%s", t->tclass, t->name, ctxname);
+				if (!ktf_pattern_match(pattern, name))
+					continue;
+				ktf_run_hook_cfg(rs, ctx, t, 0, NULL, 0);
+				ktf_stream_put_test(rs, t->tclass, t->name, ctxname, 0, 0);
+				cnt++;
+			}
+		}
+	}
+	tlog(T_DEBUG, "Ran %d tests matching \"%s\"", cnt, pattern);
+	return 0;
+}
+
+/* Run each test in a list of KTF_A_TEST entries,
+ * each containing KTF_A_SNAM, KTF_A_TNAM and an optional context in KTF_A_STR
+ */
+static int ktf_run_list(struct ktf_result_stream *rs, struct nlattr *list)
+{
+	char ctxname[KTF_MAX_NAME + 1];
+	char setname[KTF_MAX_NAME + 1];
+	char testname[KTF_MAX_NAME + 1];
+	struct nlattr *entry, *attr;
+	struct ktf_context *ctx;
+	struct ktf_test *t;
+	int rem, rem2, stat;
+	int cnt = 0;
+	u32 id;
+
+	nla_for_each_nested(entry, list, rem) {
+		if (nla_type(entry) != KTF_A_TEST)
+			continue;
+		ctxname[0] = setname[0] = testname[0] = '\0';
+		id = 0;
+		nla_for_each_nested(attr, entry, rem2) {
+			switch (nla_type(attr)) {
+			case KTF_A_ID:
+				id = nla_get_u32(attr);
+				break;
+			case KTF_A_SNAM:
+				nla_strlcpy(setname, attr, KTF_MAX_NAME);
+				break;
+			case KTF_A_TNAM:
+				nla_strlcpy(testname, attr, KTF_MAX_NAME);
+				break;
+			case KTF_A_STR:
+				nla_strlcpy(ctxname, attr, KTF_MAX_NAME);
+				break;
+			}
+		}
+		cnt++;
+		if (id) {
+			stat = ktf_run_id(rs, id, 0, NULL, 0, &t, &ctx);
+			if (t) {
+				ktf_stream_put_test(rs, t->tclass, t->name,
+						    ctx ? ktf_context_name(ctx) : NULL, 0, id);
+				ktf_test_put(t);
+			} else {
+				ktf_stream_put_test(rs, "", "", NULL, stat, id);
+			}
+			continue;
+		}
+		if (!setname[0] || !testname[0]) {
+			terr("received KTF_CT_RUN_BATCH entry without testset/test name!");
+			return -EINVAL;
+		}
+		stat = ktf_run_func(rs, ctxname[0] ? ctxname : NULL, setname, testname,
+				    0, NULL, 0);
+		ktf_stream_put_test(rs, setname, testname, ctxname[0] ? ctxname : NULL, stat, 0);
+	}
+	tlog(T_DEBUG, "Ran a batch of %d tests", cnt);
+	return 0;
+}
+
+/* Run a batch of tests in one request. The tests are given either as a list
+ * (KTF_A_LIST) or as a pattern (KTF_A_STR) to select tests by name.
+ * Results are streamed back as for a single test, with the results for
+ * each test followed by a KTF_A_TEST entry identifying the test.
+ */
+static int ktf_run_batch(struct sk_buff *skb, struct genl_info *info)
+{
+	char pattern[2 * KTF_MAX_NAME + 1];
+	struct ktf_result_stream rs;
+	int retval;
+
+	if (!info->attrs[KTF_A_LIST] && !info->attrs[KTF_A_STR]) {
+		terr("received KTF_CT_RUN_BATCH msg without tests to run!");
+		return -EINVAL;
+	}
+
+	retval = ktf_stream_start(&rs, info, KTF_CT_RUN_BATCH);
 	if (retval)
-		nlmsg_free(resp_skb);
+		return retval;
+
+	if (info->attrs[KTF_A_LIST]) {
+		retval = ktf_run_list(&rs, info->attrs[KTF_A_LIST]);
+	} else {
+		nla_strlcpy(pattern, info->attrs[KTF_A_STR], sizeof(pattern));
+		retval = ktf_run_pattern(&rs, pattern);
+	}
+
+	retval = ktf_stream_end(&rs, retval);
+	if (retval)
+		twarn("Failed to send reply for test batch - value %d", retval);
 	return retval;
 }
 
@@ -420,32 +1425,102 @@ static int ktf_resp(struct sk_buff *skb, struct genl_info *info)
 	return 0;
 }
 
+static int ktf_cov_put_hits(void *data, const char *module,
+			    const char *function, u32 hits, u32 test_id)
+{
+	struct ktf_result_stream *rs = data;
+	int ret = ktf_stream_put_cov(rs, module, function, hits, test_id);
+
+	/* Don't keep more than the part being filled in memory */
+	ktf_stream_sync(rs);
+	return ret;
+}
+
+/* Stream the counts back like the results of a test run.
+ * A delta query only gets the counts changed since its generation,
+ * followed by the new generation.
+ */
+static int ktf_cov_snapshot_reply(enum ktf_cmd_type type, const char *module,
+				  struct genl_info *info)
+{
+	struct ktf_result_stream rs;
+	u32 since = 0, gen;
+	int ret;
+
+	ret = ktf_stream_start(&rs, info, type);
+	if (ret)
+		return ret;
+	if (type == KTF_CT_COV_SNAPSHOT) {
+		ret = ktf_cov_snapshot(module, ktf_cov_put_hits, &rs);
+	} else {
+		if (info->attrs[KTF_A_GEN])
+			since = nla_get_u32(info->attrs[KTF_A_GEN]);
+		ret = ktf_cov_delta(module, since, &gen, ktf_cov_put_hits, &rs);
+		if (!ret)
+			ret = ktf_stream_put_gen(&rs, gen);
+	}
+	return ktf_stream_end(&rs, ret);
+}
+
+static const char *ktf_cov_cmd_name(enum ktf_cmd_type type)
+{
+	switch (type) {
+	case KTF_CT_COV_ENABLE:
+		return "COV_ENABLE";
+	case KTF_CT_COV_DISABLE:
+		return "COV_DISABLE";
+	case KTF_CT_COV_RESET:
+		return "COV_RESET";
+	case KTF_CT_COV_DELTA:
+		return "COV_DELTA";
+	default:
+		return "COV_SNAPSHOT";
+	}
+}
+
 static int ktf_cov_cmd(enum ktf_cmd_type type, struct sk_buff *skb,
 		       struct genl_info *info)
 {
-	char *cmd = type == KTF_CT_COV_ENABLE ? "COV_ENABLE" : "COV_DISABLE";
-	char module[KTF_MAX_NAME + 1];
+	const char *cmd = ktf_cov_cmd_name(type);
 	struct sk_buff *resp_skb;
 	int retval = 0;
+	char *module;
 	void *data;
 	u32 opts = 0;
+	int len;
 
 	if (!info->attrs[KTF_A_MOD])   {
 		terr("received KTF_CT_%s msg without module name!", cmd);
 		return -EINVAL;
 	}
-	nla_strlcpy(module, info->attrs[KTF_A_MOD], KTF_MAX_NAME);
+	/* A list of modules or module name patterns, see ktf_cov_enable() */
+	len = nla_len(info->attrs[KTF_A_MOD]);
+	module = kmalloc(len + 1, GFP_KERNEL);
+	if (!module)
+		return -ENOMEM;
+	nla_strlcpy(module, info->attrs[KTF_A_MOD], len + 1);
 	if (info->attrs[KTF_A_COVOPT])
 		opts = nla_get_u32(info->attrs[KTF_A_COVOPT]);
 
+	if (type == KTF_CT_COV_SNAPSHOT || type == KTF_CT_COV_DELTA) {
+		tlog(T_DEBUG, "%s coverage for %s\n", cmd, module);
+		retval = ktf_cov_snapshot_reply(type, module, info);
+		kfree(module);
+		return retval;
+	}
+
 	/* Start building a response */
 	resp_skb = nlmsg_new(NLMSG_DEFAULT_SIZE, GFP_KERNEL);
-	if (!resp_skb)
+	if (!resp_skb) {
+		kfree(module);
 		return -ENOMEM;
+	}
 
 	tlog(T_DEBUG, "%s coverage for %s\n", cmd, module);
 	if (type == KTF_CT_COV_ENABLE)
 		retval = ktf_cov_enable(module, opts);
+	else if (type == KTF_CT_COV_RESET)
+		ktf_cov_reset(module);
 	else
 		ktf_cov_disable(module);
 
@@ -471,30 +1546,58 @@ put_fail:
 	/* Free buffer if failure */
 	if (retval)
 		nlmsg_free(resp_skb);
+	kfree(module);
 	return retval;
 }
 
+/* Configure context ctxname of type type_name in handle, creating it if
+ * it does not exist yet, with the data in data_attr or shm_attr:
+ */
+static int ktf_ctx_cfg_one(struct ktf_handle *handle, const char *ctxname,
+			   const char *type_name, struct nlattr *data_attr,
+			   struct nlattr *shm_attr)
+{
+	struct ktf_context *ctx;
+	struct ktf_oob oob;
+	int ret;
+
+	if (!data_attr && !shm_attr)
+		return -EINVAL;
+	ret = ktf_oob_get(data_attr, shm_attr, &oob);
+	if (ret)
+		return ret;
+
+	/* Wait for tests of this handle that are running to finish */
+	down_write(&handle->cfg_sem);
+	tlog(T_DEBUG, "Trying to find/create context %s with type %s\n", ctxname, type_name);
+	ctx = ktf_find_create_context(handle, ctxname, type_name);
+	if (!ctx) {
+		ret = -ENODEV;
+		goto out;
+	}
+
+	tlog(T_DEBUG, "Received context configuration for context %s, handle %u\n",
+	     ctxname, handle->id);
+	ret = ktf_context_set_config(ctx, oob.data, oob.size);
+out:
+	up_write(&handle->cfg_sem);
+	ktf_oob_put(&oob);
+	return ret;
+}
+
 /* Process request to configure a configurable context:
  * Expected format:  KTF_CT_CTX_CFG hid type_name context_name data
- * placed in A_HID, A_FILE, A_STR and A_DATA respectively.
+ * placed in A_HID, A_FILE, A_STR and A_DATA (or A_SHM) respectively.
  */
 static int ktf_ctx_cfg(struct sk_buff *skb, struct genl_info *info)
 {
 	char ctxname[KTF_MAX_NAME + 1];
 	char type_name[KTF_MAX_NAME + 1];
-	struct nlattr *data_attr;
-	void *ctx_data = NULL;
-	size_t ctx_data_sz = 0;
-	int hid;
 	struct ktf_handle *handle;
-	struct ktf_context *ctx;
-	int ret;
+	int hid;
 
 	if (!info->attrs[KTF_A_STR] || !info->attrs[KTF_A_HID])
 		return -EINVAL;
-	data_attr = info->attrs[KTF_A_DATA];
-	if (!data_attr)
-		return -EINVAL;
 	hid = nla_get_u32(info->attrs[KTF_A_HID]);
 	handle = ktf_handle_find(hid);
 	if (!handle)
@@ -504,19 +1607,99 @@ static int ktf_ctx_cfg(struct sk_buff *skb, struct genl_info *info)
 	else
 		strcpy(type_name, "default");
 	nla_strlcpy(ctxname, info->attrs[KTF_A_STR], KTF_MAX_NAME);
-	tlog(T_DEBUG, "Trying to find/create context %s with type %s\n", ctxname, type_name);
-	ctx = ktf_find_create_context(handle, ctxname, type_name);
-	if (!ctx)
-		return -ENODEV;
+	return ktf_ctx_cfg_one(handle, ctxname, type_name,
+			       info->attrs[KTF_A_DATA], info->attrs[KTF_A_SHM]);
+}
 
-	tlog(T_DEBUG, "Received context configuration for context %s, handle %d\n",
-	     ctxname, hid);
+/* Room in the reply to a batch configuration for the status of an entry */
+#define KTF_CTX_CFG_REPLY_SZ \
+	(nla_total_size(0) + nla_total_size(KTF_MAX_NAME + 1) + 2 * nla_total_size(sizeof(u32)))
 
-	ctx_data = nla_memdup(data_attr, GFP_KERNEL);
-	ctx_data_sz = nla_len(data_attr);
-	ret = ktf_context_set_config(ctx, ctx_data, ctx_data_sz);
-	kfree(ctx_data);
+/* Configure a list of contexts in one request: Each KTF_A_CTX entry in
+ * KTF_A_LIST has the attributes of a KTF_CT_CTX_CFG request. The reply has
+ * a KTF_A_CTX entry for each, in the same order, with the name (A_STR),
+ * handle id (A_HID) and the status of configuring it (A_STAT).
+ */
+static int ktf_ctx_cfg_batch(struct sk_buff *skb, struct genl_info *info)
+{
+	char ctxname[KTF_MAX_NAME + 1];
+	char type_name[KTF_MAX_NAME + 1];
+	struct nlattr *entry, *list, *rentry;
+	struct nlattr *tb[KTF_A_MAX];
+	struct ktf_handle *handle = NULL;
+	struct sk_buff *resp_skb;
+	int rem, stat, ret;
+	int cnt = 0, failed = 0;
+	u32 hid, handle_hid = 0;
+	void *hdr;
+
+	if (!info->attrs[KTF_A_LIST]) {
+		terr("received KTF_CT_CTX_CFG_BATCH msg without contexts!");
+		return -EINVAL;
+	}
+	nla_for_each_nested(entry, info->attrs[KTF_A_LIST], rem)
+		cnt++;
+
+	resp_skb = nlmsg_new(NLMSG_DEFAULT_SIZE + cnt * KTF_CTX_CFG_REPLY_SZ, GFP_KERNEL);
+	if (!resp_skb)
+		return -ENOMEM;
+	hdr = genlmsg_put_reply(resp_skb, info, &ktf_gnl_family, 0, KTF_C_RESP);
+	if (!hdr || nla_put_u32(resp_skb, KTF_A_TYPE, KTF_CT_CTX_CFG_BATCH))
+		goto put_fail;
+	list = nla_nest_start(resp_skb, KTF_A_LIST);
+	if (!list)
+		goto put_fail;
+
+	cnt = 0;
+	nla_for_each_nested(entry, info->attrs[KTF_A_LIST], rem) {
+		if (nla_type(entry) != KTF_A_CTX)
+			continue;
+		hid = 0;
+		ctxname[0] = '\0';
+		strcpy(type_name, "default");
+		/* Entries without a handle id or context name are rejected */
+		stat = ktf_nla_parse_nested(tb, KTF_A_MAX - 1, entry, ktf_gnl_policy);
+		if (!stat && (!tb[KTF_A_HID] || !tb[KTF_A_STR]))
+			stat = -EINVAL;
+		if (!stat) {
+			hid = nla_get_u32(tb[KTF_A_HID]);
+			nla_strlcpy(ctxname, tb[KTF_A_STR], KTF_MAX_NAME);
+			if (tb[KTF_A_FILE])
+				nla_strlcpy(type_name, tb[KTF_A_FILE], KTF_MAX_NAME);
+			/* Entries usually come grouped by handle */
+			if (!handle || hid != handle_hid) {
+				handle = hid ? ktf_handle_find(hid) : NULL;
+				handle_hid = hid;
+			}
+			if (!handle || !ctxname[0])
+				stat = -EINVAL;
+			else
+				stat = ktf_ctx_cfg_one(handle, ctxname, type_name,
+						       tb[KTF_A_DATA], tb[KTF_A_SHM]);
+		}
+		if (stat)
+			failed++;
+		cnt++;
+
+		rentry = nla_nest_start(resp_skb, KTF_A_CTX);
+		if (!rentry || nla_put_string(resp_skb, KTF_A_STR, ctxname) ||
+		    nla_put_u32(resp_skb, KTF_A_HID, hid) ||
+		    nla_put_u32(resp_skb, KTF_A_STAT, stat))
+			goto put_fail;
+		nla_nest_end(resp_skb, rentry);
+	}
+	nla_nest_end(resp_skb, list);
+	genlmsg_end(resp_skb, hdr);
+
+	tlog(T_DEBUG, "Configured %d contexts, %d failed", cnt, failed);
+	ret = genlmsg_reply(resp_skb, info);
+	if (ret)
+		twarn("Failed to send reply for the configuration of %d contexts - value %d",
+		      cnt, ret);
 	return ret;
+put_fail:
+	nlmsg_free(resp_skb);
+	return -EMSGSIZE;
 }
 
 int ktf_nl_register(void)
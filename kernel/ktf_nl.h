@@ -8,7 +8,59 @@
 #ifndef KTF_NL_H
 #define KTF_NL_H
 
+#include <linux/mutex.h>
+#include <net/genetlink.h>
+
+struct ktf_bench_stats;
+struct ktf_test_time;
+struct ktf_perf;
+struct ktf_sweep_stats;
+struct ktf_lockstat;
+
 int ktf_nl_register(void);
 void ktf_nl_unregister(void);
 
+/* A result stream collects the results of a test run into a sequence of
+ * KTF_C_RESP messages. Whenever the current message fills up, it is queued
+ * to be sent to user space as a partial (NLM_F_MULTI) response and a new one
+ * is started, so the number of results a test can report is not bounded by
+ * the size of a single message. Each result record is kept whole within one
+ * message. A run that fits in a single message is sent exactly as before.
+ *
+ * Results may be added from any context, queued parts are sent from
+ * process context by ktf_stream_sync() and ktf_stream_end().
+ */
+struct ktf_result_stream {
+	struct genl_info *info; /* Request we are responding to */
+	struct sk_buff *skb;	/* Current (unsent) part */
+	void *hdr;		/* genl header of the current part */
+	struct nlattr *nest;	/* KTF_A_LIST nest of the current part */
+	spinlock_t lock;	/* Serializes writers (tests may spawn threads) */
+	struct sk_buff_head queue; /* Completed parts not yet sent */
+	struct mutex send_lock;	/* Keeps parts in order while sending */
+	u32 type;		/* KTF_A_TYPE of each part */
+	int parts;		/* Number of parts sent so far */
+	u32 records;		/* Records in the current part */
+	u32 dropped;		/* Records that could not be delivered */
+	u64 version;		/* KTF version of the requester */
+	u32 perf;		/* KTF_PERF_* events to count, if any */
+};
+
+int ktf_stream_start(struct ktf_result_stream *rs, struct genl_info *info, u32 type);
+int ktf_stream_put_result(struct ktf_result_stream *rs, u32 result,
+			  const char *file, u32 line, const char *report);
+int ktf_stream_put_count(struct ktf_result_stream *rs, u32 count);
+int ktf_stream_put_test(struct ktf_result_stream *rs, const char *setname,
+			const char *testname, const char *ctxname, u32 stat, u32 id);
+int ktf_stream_put_cov(struct ktf_result_stream *rs, const char *module,
+		       const char *function, u32 hits, u32 test_id);
+int ktf_stream_put_gen(struct ktf_result_stream *rs, u32 gen);
+int ktf_stream_put_bench(struct ktf_result_stream *rs, const struct ktf_bench_stats *bs);
+int ktf_stream_put_time(struct ktf_result_stream *rs, const struct ktf_test_time *tt);
+int ktf_stream_put_perf(struct ktf_result_stream *rs, const struct ktf_perf *p);
+int ktf_stream_put_sweep(struct ktf_result_stream *rs, const struct ktf_sweep_stats *ss);
+int ktf_stream_put_locks(struct ktf_result_stream *rs, const struct ktf_lockstat *ls);
+void ktf_stream_sync(struct ktf_result_stream *rs);
+int ktf_stream_end(struct ktf_result_stream *rs, u32 stat);
+
 #endif
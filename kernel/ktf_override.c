@@ -5,11 +5,26 @@
  *
  * ktf_override.c: support for overriding function entry.
  */
+#include <linux/ftrace.h>
 #include <linux/kprobes.h>
 #include <linux/ptrace.h>
+#include <linux/slab.h>
 #include "ktf.h"
 #include "ktf_override.h"
 
+/* Where the function can be traced with ftrace and the regs modified,
+ * overrides run from an ftrace_ops callback at function entry, which is
+ * much cheaper than the breakpoint and single step of a kprobe.
+ * Otherwise, or if ftrace cannot be used for the function, a kprobe is
+ * registered as before. The override handler is the kprobe pre_handler
+ * in both cases. Returning to ktf_just_return_func from the entry of the
+ * function is only known to work on x86_64.
+ */
+#if defined(CONFIG_DYNAMIC_FTRACE_WITH_REGS) && defined(CONFIG_X86_64) && \
+	(KERNEL_VERSION(4, 19, 0) <= LINUX_VERSION_CODE)
+#define KTF_OVERRIDE_FTRACE
+#endif
+
 asmlinkage void ktf_just_return_func(void);
 
 asm(
@@ -62,8 +77,95 @@ void ktf_override_function_with_return(struct pt_regs *regs)
 EXPORT_SYMBOL(ktf_override_function_with_return);
 NOKPROBE_SYMBOL(ktf_override_function_with_return);
 
+#ifdef KTF_OVERRIDE_FTRACE
+#if (KERNEL_VERSION(5, 11, 0) > LINUX_VERSION_CODE)
+#define ftrace_regs pt_regs
+#define ftrace_get_regs(fregs) (fregs)
+#endif
+
+struct ktf_override_ftrace {
+	struct list_head list;
+	struct kprobe *kp;
+	struct ftrace_ops ops;
+};
+
+static LIST_HEAD(ktf_override_ftraces);
+static DEFINE_MUTEX(ktf_override_lock);
+
+static notrace void ktf_override_ftrace_handler(unsigned long ip, unsigned long parent_ip,
+						struct ftrace_ops *op,
+						struct ftrace_regs *fregs)
+{
+	struct ktf_override_ftrace *of = container_of(op, struct ktf_override_ftrace, ops);
+	struct pt_regs *regs = ftrace_get_regs(fregs);
+
+	if (regs)
+		of->kp->pre_handler(of->kp, regs);
+}
+
+static int ktf_override_ftrace_register(struct kprobe *kp)
+{
+	struct ktf_override_ftrace *of;
+	unsigned long addr;
+	int ret;
+
+	if (kp->offset)
+		return -EINVAL;
+	addr = kp->addr ? (unsigned long)kp->addr :
+		(unsigned long)ktf_find_symbol(NULL, kp->symbol_name);
+	if (!addr)
+		return -ENOENT;
+	of = kzalloc(sizeof(*of), GFP_KERNEL);
+	if (!of)
+		return -ENOMEM;
+	of->kp = kp;
+	of->ops.func = ktf_override_ftrace_handler;
+	of->ops.flags = FTRACE_OPS_FL_SAVE_REGS | FTRACE_OPS_FL_IPMODIFY;
+
+	/* Fails unless addr is the start of a traceable function */
+	ret = ftrace_set_filter_ip(&of->ops, addr, 0, 0);
+	if (!ret) {
+		ret = register_ftrace_function(&of->ops);
+	}
+	if (ret) {
+		tlog(T_DEBUG, "%d: Cannot override %s via ftrace - using a kprobe",
+		     ret, kp->symbol_name);
+		ftrace_free_filter(&of->ops);
+		kfree(of);
+		return ret;
+	}
+	mutex_lock(&ktf_override_lock);
+	list_add(&of->list, &ktf_override_ftraces);
+	mutex_unlock(&ktf_override_lock);
+	tlog(T_DEBUG, "Overriding %s via ftrace", kp->symbol_name);
+	return 0;
+}
+
+static bool ktf_override_ftrace_unregister(struct kprobe *kp)
+{
+	struct ktf_override_ftrace *of;
+
+	mutex_lock(&ktf_override_lock);
+	list_for_each_entry(of, &ktf_override_ftraces, list)
+		if (of->kp == kp) {
+			list_del(&of->list);
+			mutex_unlock(&ktf_override_lock);
+			unregister_ftrace_function(&of->ops);
+			ftrace_free_filter(&of->ops);
+			kfree(of);
+			return true;
+		}
+	mutex_unlock(&ktf_override_lock);
+	return false;
+}
+#endif
+
 int ktf_register_override(struct kprobe *kp)
 {
+#ifdef KTF_OVERRIDE_FTRACE
+	if (!ktf_override_ftrace_register(kp))
+		return 0;
+#endif
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(4, 19, 0))
 	/* We can only support override if we can fix current_kprobe setting in
 	 * ktf_override_function_with_return().  To do that we need access to
@@ -77,3 +179,13 @@ int ktf_register_override(struct kprobe *kp)
 	return register_kprobe(kp);
 }
 EXPORT_SYMBOL(ktf_register_override);
+
+void ktf_unregister_override(struct kprobe *kp)
+{
+#ifdef KTF_OVERRIDE_FTRACE
+	if (ktf_override_ftrace_unregister(kp))
+		return;
+#endif
+	unregister_kprobe(kp);
+}
+EXPORT_SYMBOL(ktf_unregister_override);
@@ -11,4 +11,6 @@
 void ktf_post_handler(struct kprobe *kp, struct pt_regs *regs,
 		      unsigned long flags);
 void ktf_override_function_with_return(struct pt_regs *regs);
+/* Override via ftrace where supported, or else via kprobe kp */
 int ktf_register_override(struct kprobe *kp);
+void ktf_unregister_override(struct kprobe *kp);
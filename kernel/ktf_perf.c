@@ -0,0 +1,120 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_perf.c: Hardware performance counters around test runs.
+ */
+#include <linux/err.h>
+#include <linux/module.h>
+#include <linux/sched.h>
+#include "ktf.h"
+#include "ktf_perf.h"
+
+#ifdef CONFIG_PERF_EVENTS
+/* Indexed by the bit number of the KTF_PERF_* event */
+static const u64 ktf_perf_hw_event[KTF_PERF_EVENTS] = {
+	PERF_COUNT_HW_CPU_CYCLES,
+	PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_CACHE_MISSES,
+	PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+static u64 ktf_perf_read(struct perf_event *event)
+{
+	u64 enabled, running;
+
+	return perf_event_read_value(event, &enabled, &running);
+}
+
+int ktf_perf_start(struct ktf_perf *p, u32 mask)
+{
+	struct perf_event_attr attr;
+	struct perf_event *event;
+	int i;
+
+	memset(p, 0, sizeof(*p));
+	for (i = 0; i < KTF_PERF_EVENTS; i++) {
+		if (!(mask & (1 << i)))
+			continue;
+		memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = ktf_perf_hw_event[i];
+		attr.size = sizeof(attr);
+		attr.exclude_hv = 1;
+		event = perf_event_create_kernel_counter(&attr, -1, current, NULL, NULL);
+		if (IS_ERR(event)) {
+			tlog(T_DEBUG, "perf event %llu not available: %ld",
+			     attr.config, PTR_ERR(event));
+			continue;
+		}
+		p->event[i] = event;
+		p->mask |= 1 << i;
+	}
+	return p->mask ? 0 : -EOPNOTSUPP;
+}
+EXPORT_SYMBOL(ktf_perf_start);
+
+void ktf_perf_stop(struct ktf_perf *p)
+{
+	int i;
+
+	for (i = 0; i < KTF_PERF_EVENTS; i++)
+		if (p->event[i]) {
+			perf_event_release_kernel(p->event[i]);
+			p->event[i] = NULL;
+		}
+}
+EXPORT_SYMBOL(ktf_perf_stop);
+
+void ktf_perf_begin(struct ktf_perf *p)
+{
+	int i;
+
+	for (i = 0; i < KTF_PERF_EVENTS; i++)
+		if (p->event[i])
+			p->base[i] = ktf_perf_read(p->event[i]);
+}
+EXPORT_SYMBOL(ktf_perf_begin);
+
+void ktf_perf_end(struct ktf_perf *p)
+{
+	int i;
+
+	for (i = 0; i < KTF_PERF_EVENTS; i++)
+		if (p->event[i])
+			p->count[i] += ktf_perf_read(p->event[i]) - p->base[i];
+}
+EXPORT_SYMBOL(ktf_perf_end);
+#else
+int ktf_perf_start(struct ktf_perf *p, u32 mask)
+{
+	memset(p, 0, sizeof(*p));
+	return -EOPNOTSUPP;
+}
+EXPORT_SYMBOL(ktf_perf_start);
+
+void ktf_perf_stop(struct ktf_perf *p)
+{
+}
+EXPORT_SYMBOL(ktf_perf_stop);
+
+void ktf_perf_begin(struct ktf_perf *p)
+{
+}
+EXPORT_SYMBOL(ktf_perf_begin);
+
+void ktf_perf_end(struct ktf_perf *p)
+{
+}
+EXPORT_SYMBOL(ktf_perf_end);
+#endif
+
+void ktf_perf_add(struct ktf_perf *p, const struct ktf_perf *from)
+{
+	int i;
+
+	for (i = 0; i < KTF_PERF_EVENTS; i++)
+		p->count[i] += from->count[i];
+	p->mask |= from->mask;
+}
+EXPORT_SYMBOL(ktf_perf_add);
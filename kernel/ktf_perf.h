@@ -0,0 +1,40 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_perf.h: Hardware performance counters around test runs.
+ *
+ * When a run is requested with a set of KTF_PERF_* events, the events are
+ * counted for the task running each iteration of the test, from just before
+ * to just after the call to the test function, and the totals for the run
+ * are reported with the results. Events the hardware (or hypervisor) does
+ * not support are left out.
+ */
+#ifndef KTF_PERF_H
+#define KTF_PERF_H
+#include <linux/perf_event.h>
+#include "ktf_unlproto.h"
+
+#define KTF_PERF_EVENTS		4
+
+struct ktf_perf {
+	struct perf_event *event[KTF_PERF_EVENTS];
+	u64 base[KTF_PERF_EVENTS];	/* Counts at ktf_perf_begin() */
+	u64 count[KTF_PERF_EVENTS];	/* Sum over the sections counted */
+	u32 mask;			/* KTF_PERF_* events being counted */
+};
+
+/* Create counters of the events in mask for the current task */
+int ktf_perf_start(struct ktf_perf *p, u32 mask);
+void ktf_perf_stop(struct ktf_perf *p);
+
+/* Count the events between ktf_perf_begin() and ktf_perf_end().
+ * Calling ktf_perf_begin() again discards the counts since the last call.
+ */
+void ktf_perf_begin(struct ktf_perf *p);
+void ktf_perf_end(struct ktf_perf *p);
+
+/* Add the counts of another set of counters for the same events */
+void ktf_perf_add(struct ktf_perf *p, const struct ktf_perf *from);
+
+#endif
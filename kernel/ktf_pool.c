@@ -0,0 +1,130 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_pool.c: Pools of kthreads that run a test function together.
+ */
+#include <linux/module.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include "ktf.h"
+#include "ktf_pool.h"
+
+static int ktf_pool_worker_fn(void *data)
+{
+	struct ktf_pool_worker *w = data;
+	struct ktf_thread_pool *pool = w->pool;
+	struct ktf_test_state *s = &w->thread.state;
+	unsigned long seen = 0;
+
+	complete(&w->thread.started);
+	for (;;) {
+		wait_event_interruptible(pool->wq, READ_ONCE(pool->round) != seen ||
+					 kthread_should_stop());
+		if (kthread_should_stop())
+			break;
+		seen = READ_ONCE(pool->round);
+		smp_rmb();
+
+		/* Spin at the barrier so that all workers are released at once.
+		 * Let workers that share our CPU get to the barrier too.
+		 */
+		atomic_inc(&pool->arrived);
+		while (atomic_read(&pool->arrived) < pool->nr_workers) {
+			cpu_relax();
+			cond_resched();
+		}
+		pool->fun(pool, w->id, s->self, s->ctx, pool->iter, s->value);
+		if (atomic_dec_and_test(&pool->running))
+			complete(&pool->done);
+	}
+	complete(&w->thread.completed);
+	return 0;
+}
+
+int ktf_thread_pool_init(struct ktf_thread_pool *pool, const char *name,
+			 ktf_pool_fun fun, unsigned int n, const struct cpumask *cpus,
+			 struct ktf_test *self, struct ktf_context *ctx,
+			 int iter, u32 value)
+{
+	struct ktf_pool_worker *w;
+	unsigned int i;
+	int cpu = -1;
+
+	if (!cpus)
+		cpus = cpu_online_mask;
+	if (!n || !cpumask_intersects(cpus, cpu_online_mask))
+		return -EINVAL;
+
+	memset(pool, 0, sizeof(*pool));
+	pool->workers = kcalloc(n, sizeof(*pool->workers), GFP_KERNEL);
+	if (!pool->workers)
+		return -ENOMEM;
+	pool->fun = fun;
+	init_waitqueue_head(&pool->wq);
+	init_completion(&pool->done);
+
+	for (i = 0; i < n; i++) {
+		do {
+			cpu = cpumask_next(cpu, cpus);
+			if (cpu >= nr_cpu_ids)
+				cpu = cpumask_first(cpus);
+		} while (!cpu_online(cpu));
+
+		w = &pool->workers[i];
+		w->pool = pool;
+		w->id = i;
+		w->cpu = cpu;
+		w->thread.func = ktf_pool_worker_fn;
+		w->thread.name = name;
+		w->thread.state.self = self;
+		w->thread.state.ctx = ctx;
+		w->thread.state.iter = iter;
+		w->thread.state.value = value;
+		init_completion(&w->thread.started);
+		init_completion(&w->thread.completed);
+		w->thread.task = kthread_create(ktf_pool_worker_fn, w, "%s/%u", name, i);
+		if (IS_ERR(w->thread.task)) {
+			int ret = PTR_ERR(w->thread.task);
+
+			w->thread.task = NULL;
+			tlog(T_DEBUG, "%d: failed to create pool worker %s/%u", ret, name, i);
+			ktf_thread_pool_destroy(pool);
+			return ret;
+		}
+		kthread_bind(w->thread.task, cpu);
+		pool->nr_workers++;
+		wake_up_process(w->thread.task);
+	}
+	for (i = 0; i < n; i++)
+		KTF_THREAD_WAIT_STARTED(&pool->workers[i].thread);
+	return 0;
+}
+EXPORT_SYMBOL(ktf_thread_pool_init);
+
+void ktf_thread_pool_run(struct ktf_thread_pool *pool, int iter)
+{
+	pool->iter = iter;
+	atomic_set(&pool->arrived, 0);
+	atomic_set(&pool->running, pool->nr_workers);
+	init_completion(&pool->done);
+	smp_wmb();
+	WRITE_ONCE(pool->round, pool->round + 1);
+	wake_up_all(&pool->wq);
+	wait_for_completion(&pool->done);
+}
+EXPORT_SYMBOL(ktf_thread_pool_run);
+
+void ktf_thread_pool_destroy(struct ktf_thread_pool *pool)
+{
+	unsigned int i;
+
+	if (!pool->workers)
+		return;
+	for (i = 0; i < pool->nr_workers; i++)
+		KTF_THREAD_STOP(&pool->workers[i].thread);
+	kfree(pool->workers);
+	pool->workers = NULL;
+	pool->nr_workers = 0;
+}
+EXPORT_SYMBOL(ktf_thread_pool_destroy);
@@ -0,0 +1,78 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_pool.h: Pools of kthreads that run a test function together.
+ *
+ * The workers of a pool are created once, each bound to a CPU of a chosen
+ * set, and then run the pool function in rounds: A round wakes all the
+ * workers, which wait at a barrier until every worker has arrived, and
+ * then call the function at (nearly) the same instant.  This gives code
+ * under test reproducible contention without the cost of creating threads
+ * for each round.
+ */
+#ifndef KTF_POOL_H
+#define KTF_POOL_H
+#include <linux/cpumask.h>
+#include <linux/wait.h>
+#include "ktf.h"
+
+struct ktf_thread_pool;
+
+typedef void (*ktf_pool_fun)(struct ktf_thread_pool *pool, unsigned int id,
+			     struct ktf_test *self, struct ktf_context *ctx,
+			     int _i, u32 _value);
+
+struct ktf_pool_worker {
+	struct ktf_thread thread;
+	struct ktf_thread_pool *pool;
+	unsigned int id;
+	int cpu;
+};
+
+struct ktf_thread_pool {
+	ktf_pool_fun fun;
+	struct ktf_pool_worker *workers;
+	unsigned int nr_workers;
+	unsigned long round;	/* Bumped to start a round */
+	int iter;		/* Passed as _i to the workers this round */
+	atomic_t arrived;	/* Workers at the start barrier */
+	atomic_t running;	/* Workers not done with the round */
+	wait_queue_head_t wq;
+	struct completion done;
+	void *data;		/* For use by the test */
+};
+
+/* Create n workers bound round robin to the online CPUs in cpus (all
+ * online CPUs if NULL), with the test state of the caller.
+ */
+int ktf_thread_pool_init(struct ktf_thread_pool *pool, const char *name,
+			 ktf_pool_fun fun, unsigned int n, const struct cpumask *cpus,
+			 struct ktf_test *self, struct ktf_context *ctx,
+			 int iter, u32 value);
+
+/* Run one round with _i = iter, and wait for all the workers to finish it */
+void ktf_thread_pool_run(struct ktf_thread_pool *pool, int iter);
+
+void ktf_thread_pool_destroy(struct ktf_thread_pool *pool);
+
+static inline int ktf_thread_pool_cpu(struct ktf_thread_pool *pool, unsigned int id)
+{
+	return pool->workers[id].cpu;
+}
+
+#define KTF_THREAD_POOL_INIT(pool, fun, n, cpus) \
+	ktf_thread_pool_init(pool, #fun, fun, n, cpus, self, ctx, _i, _value)
+
+#define KTF_THREAD_POOL_RUN(pool, iter)	ktf_thread_pool_run(pool, iter)
+#define KTF_THREAD_POOL_DESTROY(pool)	ktf_thread_pool_destroy(pool)
+
+/* Defines a pool function with the same variables as a test case, plus
+ * _pool and the worker number _id, so assertions work in the workers.
+ */
+#define KTF_POOL_THREAD(name) \
+	static void name(struct ktf_thread_pool *_pool, unsigned int _id, \
+			 struct ktf_test *self, struct ktf_context *ctx, \
+			 int _i, u32 _value)
+
+#endif
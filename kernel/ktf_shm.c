@@ -0,0 +1,173 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_shm.c: Buffers shared with user space for the data of hybrid tests.
+ */
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include "ktf.h"
+#include "ktf_shm.h"
+#include "ktf_unlproto.h"
+
+struct ktf_shm {
+	struct kref ref;	/* One for the open file, one per user of the data */
+	struct mutex lock;	/* Serializes mmap() */
+	u32 id;
+	void *buf;		/* Set with size under shm_lock by the first mmap() */
+	size_t size;
+};
+
+/* Index of the buffers of open files by id. Lookups and removals are done
+ * under shm_lock, and buffers are removed from the index at release.
+ */
+static DEFINE_IDR(shm_idr);
+static DEFINE_SPINLOCK(shm_lock);
+
+static void ktf_shm_free(struct kref *ref)
+{
+	struct ktf_shm *shm = container_of(ref, struct ktf_shm, ref);
+
+	vfree(shm->buf);
+	kfree(shm);
+}
+
+void *ktf_shm_get(u32 id, u64 off, u64 len, struct ktf_shm **pshm)
+{
+	struct ktf_shm *shm;
+	void *buf = NULL;
+	size_t size = 0;
+
+	spin_lock(&shm_lock);
+	shm = idr_find(&shm_idr, id);
+	if (shm) {
+		kref_get(&shm->ref);
+		buf = shm->buf;
+		size = shm->size;
+	}
+	spin_unlock(&shm_lock);
+	if (!shm) {
+		tlog(T_DEBUG, "No shared buffer with id %u", id);
+		return ERR_PTR(-ENOENT);
+	}
+	if (!buf || off > size || len > size - off) {
+		tlog(T_DEBUG, "Range [%llu, +%llu) outside shared buffer %u of %zu bytes",
+		     off, len, id, size);
+		ktf_shm_put(shm);
+		return ERR_PTR(-ERANGE);
+	}
+	*pshm = shm;
+	return buf + off;
+}
+EXPORT_SYMBOL(ktf_shm_get);
+
+void ktf_shm_put(struct ktf_shm *shm)
+{
+	kref_put(&shm->ref, ktf_shm_free);
+}
+EXPORT_SYMBOL(ktf_shm_put);
+
+static int ktf_shm_open(struct inode *inode, struct file *file)
+{
+	struct ktf_shm *shm;
+	int id;
+
+	if (!try_module_get(THIS_MODULE))
+		return -EIO;
+
+	shm = kzalloc(sizeof(*shm), GFP_KERNEL);
+	if (!shm) {
+		module_put(THIS_MODULE);
+		return -ENOMEM;
+	}
+	kref_init(&shm->ref);
+	mutex_init(&shm->lock);
+
+	idr_preload(GFP_KERNEL);
+	spin_lock(&shm_lock);
+	id = idr_alloc(&shm_idr, shm, 1, 0, GFP_NOWAIT);
+	spin_unlock(&shm_lock);
+	idr_preload_end();
+	if (id < 0) {
+		kfree(shm);
+		module_put(THIS_MODULE);
+		return id;
+	}
+	shm->id = id;
+	file->private_data = shm;
+	return 0;
+}
+
+static ssize_t ktf_shm_read(struct file *file, char __user *buf,
+			    size_t count, loff_t *ppos)
+{
+	struct ktf_shm *shm = file->private_data;
+	struct ktf_shm_info info = { .id = shm->id };
+
+	spin_lock(&shm_lock);
+	info.size = shm->size;
+	spin_unlock(&shm_lock);
+	return simple_read_from_buffer(buf, count, ppos, &info, sizeof(info));
+}
+
+static int ktf_shm_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct ktf_shm *shm = file->private_data;
+	size_t size = vma->vm_end - vma->vm_start;
+	void *buf;
+	int ret = 0;
+
+	mutex_lock(&shm->lock);
+	if (!shm->buf) {
+		if (vma->vm_pgoff || size > KTF_SHM_MAX_SIZE) {
+			ret = -EINVAL;
+			goto out;
+		}
+		buf = vmalloc_user(size);
+		if (!buf) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		spin_lock(&shm_lock);
+		shm->buf = buf;
+		shm->size = size;
+		spin_unlock(&shm_lock);
+		tlog(T_DEBUG, "Shared buffer %u: %zu bytes", shm->id, size);
+	}
+	/* Later mappings must be within the buffer */
+	ret = remap_vmalloc_range(vma, shm->buf, vma->vm_pgoff);
+out:
+	mutex_unlock(&shm->lock);
+	return ret;
+}
+
+/* Called when the file is closed and no longer mapped */
+static int ktf_shm_release(struct inode *inode, struct file *file)
+{
+	struct ktf_shm *shm = file->private_data;
+
+	spin_lock(&shm_lock);
+	idr_remove(&shm_idr, shm->id);
+	spin_unlock(&shm_lock);
+	ktf_shm_put(shm);
+	module_put(THIS_MODULE);
+	return 0;
+}
+
+const struct file_operations ktf_shm_fops = {
+	.open = ktf_shm_open,
+	.read = ktf_shm_read,
+	.mmap = ktf_shm_mmap,
+	.llseek = default_llseek,
+	.release = ktf_shm_release,
+};
+
+void ktf_shm_cleanup(void)
+{
+	idr_destroy(&shm_idr);
+}
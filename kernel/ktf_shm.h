@@ -0,0 +1,31 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_shm.h: Buffers shared with user space for the data of hybrid tests.
+ *
+ * Each open of KTF_SHM_FILE in debugfs gets a buffer that user space fills
+ * through an mmap() of the file (see struct ktf_shm_info in ktf_unlproto.h).
+ * A request can then refer to its data by buffer id, offset and length
+ * (KTF_A_SHM), which the kernel uses in place instead of copying it out of
+ * the netlink message.
+ */
+#ifndef KTF_SHM_H
+#define KTF_SHM_H
+#include <linux/fs.h>
+#include <linux/types.h>
+
+struct ktf_shm;
+
+/* Get a pointer to len bytes at offset off of the buffer with this id,
+ * valid until the reference returned in *pshm is put with ktf_shm_put().
+ * Returns an ERR_PTR if there is no such buffer or the range is outside it.
+ */
+void *ktf_shm_get(u32 id, u64 off, u64 len, struct ktf_shm **pshm);
+void ktf_shm_put(struct ktf_shm *shm);
+
+void ktf_shm_cleanup(void);
+
+extern const struct file_operations ktf_shm_fops;
+
+#endif
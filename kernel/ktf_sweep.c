@@ -0,0 +1,147 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_sweep.c: Scalability sweeps for KTF.
+ */
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include "ktf.h"
+#include "ktf_sweep.h"
+#include "ktf_pool.h"
+#include "ktf_nl.h"
+
+/* Shared by the workers of one width */
+struct ktf_sweep_state {
+	ktf_sweep_fun fun;
+	u64 n;			/* Operations per call of the body */
+	u64 duration_ns;
+	u64 *ops;		/* Per worker */
+	u64 *ns;		/* Per worker */
+};
+
+static void ktf_sweep_worker(struct ktf_thread_pool *pool, unsigned int id,
+			     struct ktf_test *self, struct ktf_context *ctx,
+			     int _i, u32 _value)
+{
+	struct ktf_sweep_state *st = pool->data;
+	u64 start = ktime_get_ns(), now, ops = 0;
+
+	do {
+		st->fun(self, ctx, _i, _value, id, st->n);
+		ops += st->n;
+		cond_resched();
+		now = ktime_get_ns();
+	} while (now - start < st->duration_ns);
+	st->ops[id] = ops;
+	st->ns[id] = now - start;
+}
+
+static int ktf_sweep_width(struct ktf_test *self, struct ktf_context *ctx, int _i,
+			   u32 _value, struct ktf_sweep_state *st, unsigned int threads,
+			   struct ktf_sweep_point *pt)
+{
+	struct ktf_thread_pool pool;
+	u64 worker_ns = 0;
+	unsigned int id;
+	int ret;
+
+	ret = ktf_thread_pool_init(&pool, "ktf_sweep", ktf_sweep_worker, threads, NULL,
+				   self, ctx, _i, _value);
+	if (ret)
+		return ret;
+	pool.data = st;
+	ktf_thread_pool_run(&pool, _i);
+	ktf_thread_pool_destroy(&pool);
+
+	memset(pt, 0, sizeof(*pt));
+	pt->threads = threads;
+	for (id = 0; id < threads; id++) {
+		pt->ops += st->ops[id];
+		pt->elapsed_ns = max(pt->elapsed_ns, st->ns[id]);
+		worker_ns += st->ns[id];
+	}
+	if (pt->ops <= U64_MAX / NSEC_PER_SEC)
+		pt->ops_per_sec = div64_u64(pt->ops * NSEC_PER_SEC, max_t(u64, pt->elapsed_ns, 1));
+	else
+		pt->ops_per_sec = div64_u64(pt->ops, max_t(u64, pt->elapsed_ns / NSEC_PER_MSEC, 1)) *
+			MSEC_PER_SEC;
+	pt->op_ps = div64_u64(worker_ns * 1000, max_t(u64, pt->ops, 1));
+	tlog(T_DEBUG, "%s.%s: %u threads: %llu ops/s, %llu ps/op",
+	     self->tclass, self->name, threads, pt->ops_per_sec, pt->op_ps);
+	return 0;
+}
+
+int ktf_sweep_run(struct ktf_test *self, struct ktf_context *ctx, int _i, u32 _value,
+		  ktf_sweep_fun fun, unsigned int max_threads, u64 duration_ns,
+		  struct ktf_sweep_stats *stats)
+{
+	struct ktf_sweep_state st = { .fun = fun, .n = 1 };
+	unsigned int threads = 1;
+	u64 ns;
+	int ret = 0;
+
+	memset(stats, 0, sizeof(*stats));
+	if (!max_threads)
+		max_threads = num_online_cpus();
+	max_threads = min(max_threads, num_online_cpus());
+	stats->duration_ns = duration_ns ? duration_ns : KTF_SWEEP_DURATION_NS;
+	st.duration_ns = stats->duration_ns;
+
+	/* Find the number of operations per call that takes KTF_SWEEP_BATCH_NS,
+	 * so that reading the clock does not distort the results.
+	 */
+	for (;;) {
+		ns = ktime_get_ns();
+		fun(self, ctx, _i, _value, 0, st.n);
+		ns = ktime_get_ns() - ns;
+		if (ns >= KTF_SWEEP_BATCH_NS || st.n >= KTF_BENCH_MAX_N)
+			break;
+		st.n *= 2;
+		if (fatal_signal_pending(current))
+			return -EINTR;
+		cond_resched();
+	}
+
+	st.ops = kcalloc(max_threads, sizeof(u64), GFP_KERNEL);
+	st.ns = kcalloc(max_threads, sizeof(u64), GFP_KERNEL);
+	if (!st.ops || !st.ns) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	while (stats->nr_points < KTF_SWEEP_POINTS) {
+		ret = ktf_sweep_width(self, ctx, _i, _value, &st, threads,
+				      &stats->points[stats->nr_points]);
+		if (ret)
+			goto out;
+		stats->nr_points++;
+		if (threads == max_threads)
+			break;
+		threads = min(threads * 2, max_threads);
+		if (fatal_signal_pending(current)) {
+			ret = -EINTR;
+			goto out;
+		}
+	}
+	if (self->stream)
+		ktf_stream_put_sweep(self->stream, stats);
+out:
+	kfree(st.ops);
+	kfree(st.ns);
+	return ret;
+}
+EXPORT_SYMBOL(ktf_sweep_run);
+
+u32 ktf_sweep_efficiency(const struct ktf_sweep_stats *stats, unsigned int i)
+{
+	const struct ktf_sweep_point *one = &stats->points[0], *pt = &stats->points[i];
+
+	if (i >= stats->nr_points || !one->ops_per_sec)
+		return 0;
+	return div64_u64(pt->ops_per_sec * 100, (u64)pt->threads * one->ops_per_sec);
+}
+EXPORT_SYMBOL(ktf_sweep_efficiency);
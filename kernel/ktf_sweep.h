@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_sweep.h: Scalability sweeps for KTF.
+ *
+ * A sweep runs the same body on 1, 2, 4, ... and finally num_online_cpus()
+ * workers of a thread pool (see ktf_pool.h), bound to distinct CPUs and
+ * released together.  At each width every worker repeats the body for
+ * a fixed duration, and the total throughput and the mean time per
+ * operation seen by a worker are reported to user space as a curve.
+ */
+#ifndef KTF_SWEEP_H
+#define KTF_SWEEP_H
+#include "ktf_test.h"
+
+#define KTF_SWEEP_POINTS	16	/* Widths up to 2^15 CPUs */
+#define KTF_SWEEP_DURATION_NS	(100 * NSEC_PER_MSEC)
+#define KTF_SWEEP_BATCH_NS	(10 * NSEC_PER_USEC)
+
+struct ktf_sweep_point {
+	u32 threads;
+	u64 ops;		/* Total over the workers */
+	u64 elapsed_ns;		/* Of the slowest worker */
+	u64 ops_per_sec;	/* Total over the workers */
+	u64 op_ps;		/* Mean time per operation in a worker */
+};
+
+struct ktf_sweep_stats {
+	u64 duration_ns;	/* Per width */
+	u32 nr_points;
+	struct ktf_sweep_point points[KTF_SWEEP_POINTS];
+};
+
+/* The body runs the operation _n times in worker _id */
+typedef void (*ktf_sweep_fun)(struct ktf_test *, struct ktf_context *, int, u32,
+			      unsigned int, u64);
+
+/* Sweep the body over the widths up to max_threads (num_online_cpus() if 0)
+ * for duration_ns (KTF_SWEEP_DURATION_NS if 0) per width, and report the
+ * curve as a result of the test self.  Returns 0 or -errno.
+ */
+int ktf_sweep_run(struct ktf_test *self, struct ktf_context *ctx, int _i, u32 _value,
+		  ktf_sweep_fun fun, unsigned int max_threads, u64 duration_ns,
+		  struct ktf_sweep_stats *stats);
+
+/* Throughput at point i relative to perfect scaling from one worker,
+ * in percent.
+ */
+u32 ktf_sweep_efficiency(const struct ktf_sweep_stats *stats, unsigned int i);
+
+/* Assert that the sweep has a point, and that the scaling efficiency is
+ * at least PCT percent at all widths:
+ */
+#define ktf_assert_scaling(S, PCT)					\
+	({ const struct ktf_sweep_stats *__s = (S); u32 __pct = (PCT);	\
+	   unsigned int __i = 1;					\
+	   while (__i < __s->nr_points && ktf_sweep_efficiency(__s, __i) >= __pct) \
+		__i++;							\
+	   if (__i >= __s->nr_points)					\
+		__i = 0;						\
+	   ktf_assert_msg(__s->nr_points && !__i,			\
+		"Scaling efficiency at %u threads is %u%%, expected at least %u%%", \
+		__s->nr_points ? __s->points[__i].threads : 0,		\
+		__s->nr_points ? ktf_sweep_efficiency(__s, __i) : 0, __pct); })
+
+#define EXPECT_SCALING_GE(S, PCT) ktf_assert_scaling(S, PCT)
+
+#define ASSERT_SCALING_GE(S, PCT) do {		\
+		if (!ktf_assert_scaling(S, PCT))	\
+			return;				\
+	} while (0)
+
+/* Define a sweep with SWEEP(suite_name,unit_name) and add it with ADD_TEST
+ * like any other test.  The body must run the operation _n times, and may
+ * use the worker number _id to pick the data to operate on:
+ *
+ *	SWEEP(suite, name)
+ *	{
+ *		u64 n;
+ *
+ *		for (n = 0; n < _n; n++)
+ *			<operation>
+ *	}
+ *
+ * To assert scaling, call ktf_sweep_run() from a TEST() instead.
+ */
+#define SWEEP(__testsuite, __testname) \
+	static void __testname##_body(struct ktf_test *, struct ktf_context *, \
+				      int, u32, unsigned int, u64); \
+	static void __testname(struct ktf_test *self, struct ktf_context *ctx, \
+			       int _i, u32 _value) \
+	{ \
+		struct ktf_sweep_stats stats; \
+		ASSERT_INT_EQ(0, ktf_sweep_run(self, ctx, _i, _value, __testname##_body, \
+					       0, 0, &stats)); \
+	} \
+	struct __test_desc __testname##_setup = \
+	{ .tclass = "" # __testsuite "", .name = "" # __testname "", \
+	  .fun = __testname, .file = __FILE__ }; \
+	\
+	static void __testname##_body(struct ktf_test *self, struct ktf_context *ctx, \
+				      int _i, u32 _value, unsigned int _id, u64 _n)
+
+#endif
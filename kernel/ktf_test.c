@@ -7,6 +7,11 @@
  */
 #include <linux/module.h>
 #include <linux/time.h>
+#include <linux/ktime.h>
+#include <linux/idr.h>
+#include <linux/workqueue.h>
+#include <linux/percpu.h>
+#include <asm/local.h>
 #include "ktf_test.h"
 #include <net/netlink.h>
 #include <net/genetlink.h>
@@ -16,8 +21,10 @@
 #include "ktf.h"
 #include "ktf_cov.h"
 #include "ktf_debugfs.h"
-
-#define MAX_PRINTF 4096
+#include "ktf_perf.h"
+#include "ktf_lockstat.h"
+#include "ktf_shm.h"
+#include "ktf_compat.h"
 
 /* Versioning check:
  * For MAJOR or MINOR changes, both sides are required to
@@ -56,7 +63,10 @@ static int ktf_handle_version_check(struct ktf_handle *th)
 static void ktf_case_free(struct ktf_map_elem *elem)
 {
 	struct ktf_case *tc = container_of(elem, struct ktf_case, kmap);
+	struct ktf_case_fixture *cf, *tmp;
 
+	list_for_each_entry_safe(cf, tmp, &tc->fixtures, list)
+		kfree(cf);
 	kfree(tc);
 }
 
@@ -71,7 +81,7 @@ void ktf_case_put(struct ktf_case *tc)
 }
 
 /* The global map from name to ktf_case */
-DEFINE_KTF_MAP(test_cases, NULL, ktf_case_free);
+DEFINE_KTF_HASHED_MAP(test_cases, ktf_case_free);
 
 /* a lock to protect this datastructure */
 static DEFINE_MUTEX(tc_lock);
@@ -82,6 +92,21 @@ size_t ktf_case_count(void)
 	return ktf_map_size(&test_cases);
 }
 
+/* Starts at a different value for every load of ktf, so that a generation
+ * is not reused by a different registry:
+ */
+static atomic_t registry_gen;
+
+u32 ktf_registry_gen(void)
+{
+	return atomic_read(&registry_gen);
+}
+
+void ktf_registry_changed(void)
+{
+	atomic_inc(&registry_gen);
+}
+
 const char *ktf_case_name(struct ktf_case *tc)
 {
 	return tc->kmap.key;
@@ -92,11 +117,75 @@ static size_t ktf_case_test_count(struct ktf_case *tc)
 	return ktf_map_size(&tc->tests);
 }
 
+/* Index of tests by numeric id. Lookups and removals are done under
+ * test_id_lock, and tests are removed from the index before they are freed.
+ */
+static DEFINE_IDR(test_idr);
+static DEFINE_SPINLOCK(test_id_lock);
+
+static void ktf_test_id_alloc(struct ktf_test *t)
+{
+	unsigned long flags;
+	int id;
+
+	idr_preload(GFP_KERNEL);
+	spin_lock_irqsave(&test_id_lock, flags);
+	id = idr_alloc(&test_idr, t, 1, KTF_ID_TEST_MAX + 1, GFP_NOWAIT);
+	spin_unlock_irqrestore(&test_id_lock, flags);
+	idr_preload_end();
+
+	/* Without an id the test can still be run by name */
+	if (id < 0)
+		twarn("No id available for test %s.%s (%d)", t->tclass, t->name, id);
+	else
+		t->id = id;
+}
+
+static void ktf_test_id_free(struct ktf_test *t)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&test_id_lock, flags);
+	idr_remove(&test_idr, t->id);
+	spin_unlock_irqrestore(&test_id_lock, flags);
+}
+
+/* Find a test and (if set) a context from an id as constructed by KTF_ID().
+ * Returns the test with a reference held, or NULL if either was not found:
+ */
+struct ktf_test *ktf_test_find_id(u32 id, struct ktf_context **pctx)
+{
+	struct ktf_test *t;
+	unsigned long flags;
+
+	spin_lock_irqsave(&test_id_lock, flags);
+	t = idr_find(&test_idr, KTF_ID_TEST(id));
+	/* A test with no references left is about to be removed */
+	if (t && !kref_get_unless_zero(&t->kmap.refcount))
+		t = NULL;
+	spin_unlock_irqrestore(&test_id_lock, flags);
+	if (!t)
+		return NULL;
+
+	*pctx = NULL;
+	if (KTF_ID_CTX(id)) {
+		*pctx = ktf_find_context_id(t->handle, KTF_ID_CTX(id));
+		if (!*pctx) {
+			ktf_test_put(t);
+			return NULL;
+		}
+	}
+	return t;
+}
+
 /* Called when test refcount reaches 0. */
 static void ktf_test_free(struct ktf_map_elem *elem)
 {
 	struct ktf_test *t = container_of(elem, struct ktf_test, kmap);
 
+	if (t->id)
+		ktf_test_id_free(t);
+	free_percpu(t->assert_cnt);
 	kfree(t->log);
 	kfree(t);
 }
@@ -120,7 +209,8 @@ static struct ktf_case *ktf_case_create(const char *name)
 		return tc;
 
 	/* Initialize test case map of tests. */
-	ktf_map_init(&tc->tests, NULL, ktf_test_free);
+	ktf_map_init_flags(&tc->tests, NULL, ktf_test_free, KTF_MAP_HASHED);
+	INIT_LIST_HEAD(&tc->fixtures);
 	ret = ktf_map_elem_init(&tc->kmap, name);
 	if (ret) {
 		kfree(tc);
@@ -156,217 +246,833 @@ static struct ktf_case *ktf_case_find_create(const char *name)
 	return tc;
 }
 
-static atomic_t assert_cnt = ATOMIC_INIT(0);
+/* Failed assertions made from a context that cannot sleep - interrupts,
+ * timers and probe handlers of the code under test included - are queued as
+ * fixed size records in a ring per CPU, without taking locks or allocating
+ * memory.  The records are reported to the result stream and log of their
+ * test in process context, by flush_assert_cnt() or by the next failure
+ * reported directly.  An assertion may interrupt another one on the same CPU,
+ * so slots are reserved with local_cmpxchg() and each record is marked ready
+ * once it is written.  Failures that do not fit until the ring is drained
+ * are counted per test and reported as one failure.
+ */
+#define KTF_RING_SIZE	32	/* Records per CPU, a power of 2 */
+#define KTF_RING_MSG	256	/* Longer failure reports are truncated */
 
-void flush_assert_cnt(struct ktf_test *self)
+struct ktf_assert_rec {
+	struct ktf_test *self;
+	const char *file;	/* __FILE__ of the test module */
+	int line;
+	int result;
+	int ready;		/* Set when the record is complete */
+	char report[KTF_RING_MSG];
+};
+
+struct ktf_assert_ring {
+	local_t head;		/* Next slot to reserve, only changed on its CPU */
+	unsigned long tail;	/* Next slot to drain, under assert_drain_lock */
+	struct ktf_assert_rec rec[KTF_RING_SIZE];
+};
+
+static struct ktf_assert_ring __percpu *assert_rings;
+
+/* Serializes draining of the rings, and changes of test streams against it */
+static DEFINE_MUTEX(assert_drain_lock);
+
+static void ktf_assert_queue(struct ktf_test *self, int result, const char *file,
+			     int line, const char *fmt, va_list ap)
 {
-	if (atomic_read(&assert_cnt)) {
-		tlog(T_DEBUG, "update: %d asserts", atomic_read(&assert_cnt));
-		if (self->skb)
-			nla_put_u32(self->skb, KTF_A_STAT, atomic_read(&assert_cnt));
-		atomic_set(&assert_cnt, 0);
+	struct ktf_assert_ring *ring = get_cpu_ptr(assert_rings);
+	struct ktf_assert_rec *rec;
+	long head;
+
+	do {
+		head = local_read(&ring->head);
+		if ((unsigned long)head - smp_load_acquire(&ring->tail) >= KTF_RING_SIZE) {
+			atomic_inc(&self->assert_lost);
+			goto out;
+		}
+	} while (local_cmpxchg(&ring->head, head, head + 1) != head);
+
+	rec = &ring->rec[head & (KTF_RING_SIZE - 1)];
+	rec->self = self;
+	rec->file = file;
+	rec->line = line;
+	rec->result = result;
+	vscnprintf(rec->report, sizeof(rec->report), fmt, ap);
+	smp_store_release(&rec->ready, 1);
+out:
+	put_cpu_ptr(assert_rings);
+}
+
+/* Successful assertions are counted per CPU. The total is only summed up
+ * when reported, which happens at the end of each test iteration and before
+ * each failure report:
+ */
+static u32 ktf_assert_total(struct ktf_test *self)
+{
+	u32 total = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		total += *per_cpu_ptr(self->assert_cnt, cpu);
+	return total;
+}
+
+/* Called with assert_drain_lock held */
+static void ktf_assert_put_count(struct ktf_test *self)
+{
+	u32 total = ktf_assert_total(self);
+	u32 reported = atomic_read(&self->assert_reported);
+
+	if ((int)(total - reported) <= 0)
+		return;
+	atomic_set(&self->assert_reported, total);
+
+	tlog(T_DEBUG, "update: %u asserts", total - reported);
+	if (self->stream)
+		ktf_stream_put_count(self->stream, total - reported);
+}
+
+u32 ktf_test_assertion_count(struct ktf_test *self)
+{
+	return ktf_assert_total(self) - atomic_read(&self->assert_reported);
+}
+EXPORT_SYMBOL(ktf_test_assertion_count);
+
+#define KTF_MIN_LOG	256
+
+/* Append to the log of failures of a test, growing it as needed up to
+ * KTF_MAX_LOG. Called with the log_lock held and interrupts off, so the
+ * allocation must not sleep; if it fails the text is cut short.
+ */
+static void ktf_log_append(struct ktf_test *self, const char *s, size_t len)
+{
+	size_t need = min_t(size_t, self->log_len + len + 1, KTF_MAX_LOG);
+	size_t size;
+	char *log;
+
+	if (need > self->log_size) {
+		size = max_t(size_t, self->log_size, KTF_MIN_LOG);
+		while (size < need)
+			size *= 2;
+		size = min_t(size_t, size, KTF_MAX_LOG);
+		log = krealloc(self->log, size, GFP_ATOMIC | __GFP_NOWARN);
+		if (log) {
+			self->log = log;
+			self->log_size = size;
+		}
 	}
+	if (!self->log_size)
+		return;
+	len = min(len, self->log_size - 1 - self->log_len);
+	memcpy(self->log + self->log_len, s, len);
+	self->log_len += len;
+	self->log[self->log_len] = '\0';
 }
 
-u32 ktf_get_assertion_count(void)
+/* Report a failure to the stream and log of its test.
+ * Called in process context with assert_drain_lock held.
+ */
+static void ktf_assert_report(struct ktf_test *self, int result, const char *file,
+			      int line, const char *report)
 {
-	return atomic_read(&assert_cnt);
+	char prefix[256];
+	int plen;
+
+	ktf_assert_put_count(self);
+	if (self->stream)
+		ktf_stream_put_result(self->stream, result, file, line, report);
+	plen = scnprintf(prefix, sizeof(prefix), "file %s line %d: result %d: ",
+			 file, line, result);
+	terr("%s%s", prefix, report);
+
+	/* Multiple threads may try to update log */
+	spin_lock_irq(&self->log_lock);
+	ktf_log_append(self, prefix, plen);
+	ktf_log_append(self, report, strlen(report));
+	spin_unlock_irq(&self->log_lock);
 }
-EXPORT_SYMBOL(ktf_get_assertion_count);
 
-static DEFINE_SPINLOCK(assert_lock);
+/* Report the failures queued on all CPUs, with assert_drain_lock held */
+static void ktf_assert_drain_rings(void)
+{
+	struct ktf_assert_ring *ring;
+	struct ktf_assert_rec *rec;
+	int cpu;
 
+	for_each_possible_cpu(cpu) {
+		ring = per_cpu_ptr(assert_rings, cpu);
+		for (;;) {
+			rec = &ring->rec[ring->tail & (KTF_RING_SIZE - 1)];
+			if (!smp_load_acquire(&rec->ready))
+				break;
+			ktf_assert_report(rec->self, rec->result, rec->file, rec->line,
+					  rec->report);
+			WRITE_ONCE(rec->ready, 0);
+			/* The slot may be reused once the tail has moved past it */
+			smp_store_release(&ring->tail, ring->tail + 1);
+		}
+	}
+}
+
+/* Report the failures queued on all CPUs, then the assertion count and any
+ * lost failures of self, if set.  Callers must be able to sleep.
+ */
+static void ktf_assert_drain(struct ktf_test *self)
+{
+	char report[64];
+	int lost;
+
+	mutex_lock(&assert_drain_lock);
+	ktf_assert_drain_rings();
+	if (self) {
+		ktf_assert_put_count(self);
+		lost = atomic_xchg(&self->assert_lost, 0);
+		if (lost) {
+			scnprintf(report, sizeof(report),
+				  "%d failed assertions lost - result ring full", lost);
+			ktf_assert_report(self, 0, __FILE__, __LINE__, report);
+		}
+	}
+	mutex_unlock(&assert_drain_lock);
+}
+
+void flush_assert_cnt(struct ktf_test *self)
+{
+	ktf_assert_drain(self);
+}
+
+/* Set the stream a test reports to, also for failures still queued */
+static void ktf_test_set_stream(struct ktf_test *t, struct ktf_result_stream *rs)
+{
+	mutex_lock(&assert_drain_lock);
+	t->stream = rs;
+	mutex_unlock(&assert_drain_lock);
+}
+
+/* Whether a failure can be reported right away, which takes a mutex.
+ * Without a preempt count, only interrupt context and disabled interrupts
+ * can be told apart, so failures from other contexts are reported right
+ * away, as they were before they could be queued, rather than being
+ * limited by the size of the ring.
+ */
+static bool ktf_assert_can_sleep(void)
+{
+#ifdef CONFIG_PREEMPT_COUNT
+	return preemptible() && !rcu_preempt_depth();
+#else
+	return !in_interrupt() && !irqs_disabled();
+#endif
+}
+
+/* Report a failure from a context that can sleep, after the failures
+ * queued before it:
+ */
+static void ktf_assert_report_direct(struct ktf_test *self, int result, const char *file,
+				     int line, const char *fmt, va_list ap)
+{
+	char report[KTF_RING_MSG];
+
+	vscnprintf(report, sizeof(report), fmt, ap);
+	mutex_lock(&assert_drain_lock);
+	ktf_assert_drain_rings();
+	ktf_assert_report(self, result, file, line, report);
+	mutex_unlock(&assert_drain_lock);
+}
+
+/* Safe to call from any context */
 long _ktf_assert(struct ktf_test *self, int result, const char *file,
 		 int line, const char *fmt, ...)
 {
-	int len;
 	va_list ap;
-	char *buf;
-	char bufprefix[256];
-	unsigned long flags;
 
 	if (result) {
-		atomic_inc(&assert_cnt);
+		this_cpu_inc(*self->assert_cnt);
 	} else {
-		flush_assert_cnt(self);
-		buf = kmalloc(MAX_PRINTF, GFP_KERNEL);
-		if (!buf) {
-			terr("file %s line %d: Unable to allocate memory for the error report!",
-			     file, line);
-			goto out;
-		}
 		va_start(ap, fmt);
-		len = vsnprintf(buf, MAX_PRINTF - 1, fmt, ap);
-		buf[len] = 0;
+		if (ktf_assert_can_sleep())
+			ktf_assert_report_direct(self, result, file, line, fmt, ap);
+		else
+			ktf_assert_queue(self, result, file, line, fmt, ap);
 		va_end(ap);
-		if (self->skb) {
-			nla_put_u32(self->skb, KTF_A_STAT, result);
-			nla_put_string(self->skb, KTF_A_FILE, file);
-			nla_put_u32(self->skb, KTF_A_NUM, line);
-			nla_put_string(self->skb, KTF_A_STR, buf);
-		}
-		(void)snprintf(bufprefix, sizeof(bufprefix) - 1,
-				"file %s line %d: result %d: ", file, line,
-				result);
-		terr("%s%s", bufprefix, buf);
-
-		/* Multiple threads may try to update log */
-		spin_lock_irqsave(&assert_lock, flags);
-		(void)strncat(self->log, bufprefix, KTF_MAX_LOG);
-		(void)strncat(self->log, buf, KTF_MAX_LOG);
-		spin_unlock_irqrestore(&assert_lock, flags);
-		kfree(buf);
 	}
-out:
 	return result;
 }
 EXPORT_SYMBOL(_ktf_assert);
 
-/* Add a test to a testcase:
- * Tests are represented by ktf_test objects that are linked into
- * a per-test case map TCase:tests map.
+/* An instance of a shared fixture, for one test case and context.
+ * The tests of the case and handle that use the fixture are numbered by
+ * fixture_idx when added, and the instance is torn down once each of them
+ * has run and none is running.
  */
-void  _ktf_add_test(struct __test_desc td, struct ktf_handle *th,
-		    int _signal, int allowed_exit_value,
-		    int start, int end)
+struct ktf_fixture_inst {
+	struct list_head list; /* Linkage in the fixture's instances */
+	const char *tclass; /* Test case the instance is for */
+	struct ktf_handle *handle; /* Handle of the tests and context */
+	struct ktf_context *ctx; /* Context it is for, or NULL */
+	unsigned int users; /* Tests running with the instance */
+	unsigned int tests; /* Tests of the case that use the fixture */
+	unsigned int ran; /* Number of those that have run */
+	unsigned long *ran_mask; /* Bit by fixture_idx for those that have run */
+	bool ok; /* Setup succeeded */
+	u64 data[]; /* The fixture itself */
+};
+
+/* The number of tests of a case and handle that use a shared fixture.
+ * Counted as the tests are added, and kept until the case is freed, so
+ * that tests still running can look at it.
+ */
+struct ktf_case_fixture {
+	struct list_head list; /* Linkage in the case's fixtures, under tc_lock */
+	struct ktf_handle *handle;
+	struct ktf_shared_fixture *fixture;
+	unsigned int tests; /* Tests added and not yet removed */
+};
+
+/* The count of tests of tc and handle th that use fixture f, created if
+ * needed.  Called with tc_lock held.
+ */
+static struct ktf_case_fixture *ktf_case_fixture_get(struct ktf_case *tc, struct ktf_handle *th,
+						     struct ktf_shared_fixture *f)
 {
-	struct ktf_case *tc = NULL;
+	struct ktf_case_fixture *cf;
+
+	list_for_each_entry(cf, &tc->fixtures, list)
+		if (cf->fixture == f && cf->handle == th)
+			return cf;
+	cf = kzalloc(sizeof(*cf), GFP_KERNEL);
+	if (!cf)
+		return NULL;
+	cf->handle = th;
+	cf->fixture = f;
+	list_add(&cf->list, &tc->fixtures);
+	return cf;
+}
+
+/* Called with the fixture lock held */
+static struct ktf_fixture_inst *ktf_fixture_find(struct ktf_shared_fixture *f,
+						 struct ktf_test *t,
+						 struct ktf_context *ctx)
+{
+	struct ktf_fixture_inst *fi;
+
+	list_for_each_entry(fi, &f->instances, list)
+		if (fi->ctx == ctx && fi->handle == t->handle && !strcmp(fi->tclass, t->tclass))
+			return fi;
+	return NULL;
+}
+
+/* Called with the fixture lock held */
+static void ktf_fixture_destroy(struct ktf_test *self, struct ktf_fixture_inst *fi)
+{
+	list_del(&fi->list);
+	if (fi->ok)
+		self->fixture->teardown(self, fi->data);
+	tlog(T_DEBUG, "Tore down shared fixture of %s.%s", self->tclass, self->name);
+	kfree(fi->ran_mask);
+	kfree(fi);
+}
+
+/* Called with the fixture lock held */
+static void ktf_fixture_done(struct ktf_test *self, struct ktf_fixture_inst *fi)
+{
+	if (self->fixture_idx < fi->tests &&
+	    !__test_and_set_bit(self->fixture_idx, fi->ran_mask))
+		fi->ran++;
+	if (fi->ran >= fi->tests && !fi->users)
+		ktf_fixture_destroy(self, fi);
+}
+
+/* Get the instance of the shared fixture of self for ctx, setting it up
+ * if this is the first test of the set to run.  NULL if setup failed, which
+ * fails self.  The failed instance is dropped, so that the next test of the
+ * set tries to set up the fixture again.
+ */
+void *ktf_fixture_get(struct ktf_test *self, struct ktf_context *ctx)
+{
+	struct ktf_shared_fixture *f = self->fixture;
+	struct ktf_fixture_inst *fi;
+	void *data = NULL;
+
+	mutex_lock(&f->lock);
+	fi = ktf_fixture_find(f, self, ctx);
+	if (!fi) {
+		fi = kzalloc(sizeof(*fi) + f->size, GFP_KERNEL);
+		if (!fi)
+			goto out;
+		fi->tclass = self->tclass;
+		fi->handle = self->handle;
+		fi->ctx = ctx;
+		fi->tests = READ_ONCE(self->fixture_tests->tests);
+		fi->ran_mask = kcalloc(BITS_TO_LONGS(fi->tests), sizeof(long), GFP_KERNEL);
+		if (!fi->ran_mask) {
+			kfree(fi);
+			goto out;
+		}
+		list_add(&fi->list, &f->instances);
+		tlog(T_DEBUG, "Setting up shared fixture for %s.%s", self->tclass, self->name);
+		fi->ok = f->setup(self, ctx, fi->data);
+		if (!fi->ok) {
+			_ktf_assert(self, 0, __FILE__, __LINE__,
+				    "Setup of shared fixture failed for %s.%s",
+				    self->tclass, self->name);
+			list_del(&fi->list);
+			kfree(fi->ran_mask);
+			kfree(fi);
+			goto out;
+		}
+	}
+	fi->users++;
+	data = fi->data;
+out:
+	mutex_unlock(&f->lock);
+	return data;
+}
+EXPORT_SYMBOL(ktf_fixture_get);
+
+void ktf_fixture_put(struct ktf_test *self, void *fixture)
+{
+	struct ktf_fixture_inst *fi = container_of(fixture, struct ktf_fixture_inst, data);
+	struct ktf_shared_fixture *f = self->fixture;
+
+	mutex_lock(&f->lock);
+	fi->users--;
+	if (fi->ran >= fi->tests && !fi->users)
+		ktf_fixture_destroy(self, fi);
+	mutex_unlock(&f->lock);
+}
+EXPORT_SYMBOL(ktf_fixture_put);
+
+/* Called when a run of a test with a shared fixture is complete */
+static void ktf_fixture_run_done(struct ktf_test *t, struct ktf_context *ctx)
+{
+	struct ktf_shared_fixture *f = t->fixture;
+	struct ktf_fixture_inst *fi;
+
+	mutex_lock(&f->lock);
+	fi = ktf_fixture_find(f, t, ctx);
+	if (fi)
+		ktf_fixture_done(t, fi);
+	mutex_unlock(&f->lock);
+}
+
+/* Called with tc_lock held */
+static void __ktf_fixture_cleanup(struct ktf_handle *th)
+{
+	struct ktf_fixture_inst *fi, *tmp;
 	struct ktf_test *t;
-	char *log;
 
-	if (ktf_handle_version_check(th))
-		return;
+	list_for_each_entry(t, &th->test_list, handle_list) {
+		if (!t->fixture)
+			continue;
+		mutex_lock(&t->fixture->lock);
+		list_for_each_entry_safe(fi, tmp, &t->fixture->instances, list)
+			if (fi->handle == th && !strcmp(fi->tclass, t->tclass))
+				ktf_fixture_destroy(t, fi);
+		mutex_unlock(&t->fixture->lock);
+	}
+}
 
-	log = kzalloc(KTF_MAX_LOG, GFP_KERNEL);
-	if (!log)
-		return;
+/* Tear down the shared fixtures of the tests of a handle, while the
+ * contexts they were set up for still exist:
+ */
+void ktf_fixture_cleanup(struct ktf_handle *th)
+{
+	mutex_lock(&tc_lock);
+	__ktf_fixture_cleanup(th);
+	mutex_unlock(&tc_lock);
+}
+EXPORT_SYMBOL(ktf_fixture_cleanup);
+
+static struct ktf_test *ktf_test_create(const struct __test_desc *td,
+				       struct ktf_handle *th,
+				       int start, int end, unsigned int flags)
+{
+	struct ktf_test *t;
 
 	t = kzalloc(sizeof(*t), GFP_KERNEL);
-	if (!t) {
-		kfree(log);
-		return;
+	if (!t)
+		return NULL;
+	t->assert_cnt = alloc_percpu(u32);
+	if (!t->assert_cnt) {
+		kfree(t);
+		return NULL;
 	}
-	t->tclass = td.tclass;
-	t->name = td.name;
-	t->fun = td.fun;
+	t->tclass = td->tclass;
+	t->name = td->name;
+	t->fun = td->fun;
 	t->start = start;
 	t->end = end;
+	t->flags = flags;
 	t->handle = th;
-	t->log = log;
+	mutex_init(&t->run_lock);
+	spin_lock_init(&t->log_lock);
+	INIT_LIST_HEAD(&t->debugfs_pending);
+	return t;
+}
 
-	mutex_lock(&tc_lock);
-	tc = ktf_case_find_create(td.tclass);
-	if (!tc || ktf_map_elem_init(&t->kmap, td.name) ||
+/* Add a test to a testcase:
+ * Tests are represented by ktf_test objects that are linked into
+ * a per-test case map TCase:tests map.
+ * Called with tc_lock held. *ptc caches the test case of the previous
+ * test added, with a reference, to save a lookup per test when adding
+ * several tests of the same case in a row.
+ */
+static int ktf_test_insert(struct ktf_test *t, const struct __test_desc *td,
+			   struct ktf_case **ptc)
+{
+	struct ktf_case *tc = *ptc;
+
+	if (!tc || strcmp(ktf_case_name(tc), td->tclass)) {
+		if (tc)
+			ktf_case_put(tc);
+		tc = *ptc = ktf_case_find_create(td->tclass);
+	}
+	if (tc && td->fixture) {
+		t->fixture_tests = ktf_case_fixture_get(tc, t->handle, td->fixture);
+		t->fixture = td->fixture;
+	}
+	if (!tc || (td->fixture && !t->fixture_tests) ||
+	    ktf_map_elem_init(&t->kmap, td->name) ||
 	    ktf_map_insert(&tc->tests, &t->kmap)) {
 		terr("Failed to add test %s from %s to test case \"%s\"",
-		     td.name, td.file, td.tclass);
+		     td->name, td->file, td->tclass);
 		if (tc)
-			ktf_case_put(tc);
-		mutex_unlock(&tc_lock);
-		kfree(log);
+			ktf_map_elem_put(&t->kmap); /* Releases the key */
+		free_percpu(t->assert_cnt);
 		kfree(t);
-		return;
+		return -ENOMEM;
 	}
 
+	if (t->fixture_tests)
+		t->fixture_idx = t->fixture_tests->tests++;
+	list_add_tail(&t->handle_list, &t->handle->test_list);
+	ktf_test_id_alloc(t);
+	ktf_registry_changed();
+	/* Only queues the test - debugfs files are created in the background */
 	ktf_debugfs_create_test(t);
 
 	tlog(T_LIST, "Added test \"%s.%s\" start = %d, end = %d\n",
-	     td.tclass, td.name, start, end);
+	     td->tclass, td->name, t->start, t->end);
 
-	/* Now since we no longer reference tc/t outside of global map of test
-	 * cases and per-testcase map of tests, drop their refcounts.  This
-	 * is safe to do as refcounts are > 0 due to references for map
-	 * storage and debugfs.
+	/* Now since we no longer reference t outside of the per-testcase
+	 * map of tests, drop its refcount.  This is safe to do as the
+	 * refcount is > 0 due to references for map storage and debugfs.
 	 */
 	ktf_test_put(t);
-	ktf_case_put(tc);
+	return 0;
+}
+
+static void __ktf_add_test(struct __test_desc td, struct ktf_handle *th,
+			   int start, int end, unsigned int flags)
+{
+	struct ktf_case *tc = NULL;
+	struct ktf_test *t;
+
+	if (ktf_handle_version_check(th))
+		return;
+
+	t = ktf_test_create(&td, th, start, end, flags);
+	if (!t)
+		return;
+
+	mutex_lock(&tc_lock);
+	ktf_test_insert(t, &td, &tc);
+	if (tc)
+		ktf_case_put(tc);
 	mutex_unlock(&tc_lock);
 }
+
+void  _ktf_add_test(struct __test_desc td, struct ktf_handle *th,
+		    int _signal, int allowed_exit_value,
+		    int start, int end)
+{
+	__ktf_add_test(td, th, start, end, 0);
+}
 EXPORT_SYMBOL(_ktf_add_test);
 
-void ktf_run_hook(struct sk_buff *skb, struct ktf_context *ctx,
+void _ktf_add_parallel_loop_test(struct __test_desc td, struct ktf_handle *th,
+				 int start, int end)
+{
+	__ktf_add_test(td, th, start, end, KTF_TEST_PARALLEL);
+}
+EXPORT_SYMBOL(_ktf_add_parallel_loop_test);
+
+void _ktf_add_tests(const struct __test_desc *td, size_t n, struct ktf_handle *th)
+{
+	struct ktf_case *tc = NULL;
+	struct ktf_test *t;
+	size_t i;
+
+	if (ktf_handle_version_check(th))
+		return;
+
+	mutex_lock(&tc_lock);
+	for (i = 0; i < n; i++) {
+		t = ktf_test_create(&td[i], th, 0, 0, 0);
+		if (!t) {
+			terr("Failed to add test %s from %s to test case \"%s\"",
+			     td[i].name, td[i].file, td[i].tclass);
+			continue;
+		}
+		ktf_test_insert(t, &td[i], &tc);
+	}
+	if (tc)
+		ktf_case_put(tc);
+	mutex_unlock(&tc_lock);
+	tlog(T_DEBUG, "Added %zu tests", n);
+}
+EXPORT_SYMBOL(_ktf_add_tests);
+
+static void ktf_test_time_add(struct ktf_test_time *tt, u64 ns)
+{
+	if (!tt->iterations || ns < tt->iter_min_ns)
+		tt->iter_min_ns = ns;
+	if (ns > tt->iter_max_ns)
+		tt->iter_max_ns = ns;
+	tt->iter_total_ns += ns;
+	tt->iterations++;
+}
+
+static void ktf_test_time_merge(struct ktf_test_time *tt, const struct ktf_test_time *from)
+{
+	if (!from->iterations)
+		return;
+	if (!tt->iterations || from->iter_min_ns < tt->iter_min_ns)
+		tt->iter_min_ns = from->iter_min_ns;
+	if (from->iter_max_ns > tt->iter_max_ns)
+		tt->iter_max_ns = from->iter_max_ns;
+	tt->iter_total_ns += from->iter_total_ns;
+	tt->iterations += from->iterations;
+}
+
+/* State shared by the work items running a parallel loop test */
+struct ktf_parallel_run {
+	struct ktf_test *t;
+	struct ktf_context *ctx;
+	u32 value;
+	atomic_t next; /* Next iteration to run */
+	spinlock_t lock; /* Protects t->time and perf */
+	u32 events; /* KTF_PERF_* events to count, if any */
+	struct ktf_perf *perf; /* Totals of the events counted */
+};
+
+struct ktf_parallel_work {
+	struct work_struct work;
+	struct ktf_parallel_run *run;
+};
+
+/* Each work item keeps picking the next iteration not yet started,
+ * to even out differences in the time iterations take:
+ */
+static void ktf_parallel_work_fn(struct work_struct *work)
+{
+	struct ktf_parallel_work *pw = container_of(work, struct ktf_parallel_work, work);
+	struct ktf_parallel_run *pr = pw->run;
+	struct ktf_test *t = pr->t;
+	struct ktf_test_time tt = { 0 };
+	struct ktf_perf perf;
+	bool counting = pr->events && !ktf_perf_start(&perf, pr->events);
+	u64 start;
+	int i;
+
+	/* Events are counted per task, so each work item has its own counters */
+	while ((i = atomic_inc_return(&pr->next) - 1) < t->end) {
+		if (counting)
+			ktf_perf_begin(&perf);
+		start = ktime_get_ns();
+		t->fun(t, pr->ctx, i, pr->value);
+		ktf_test_time_add(&tt, ktime_get_ns() - start);
+		if (counting)
+			ktf_perf_end(&perf);
+		if (t->stream)
+			ktf_stream_sync(t->stream);
+	}
+	if (counting)
+		ktf_perf_stop(&perf);
+	spin_lock(&pr->lock);
+	ktf_test_time_merge(&t->time, &tt);
+	if (counting)
+		ktf_perf_add(pr->perf, &perf);
+	spin_unlock(&pr->lock);
+}
+
+/* Run the iterations of t on the unbound workqueue, using up to one work item
+ * per online CPU. Assertion counts and results from all iterations end up
+ * in the test's result stream as usual. Returns false if the work items
+ * could not be allocated, in which case nothing has been run:
+ */
+static bool ktf_run_parallel(struct ktf_test *t, struct ktf_context *ctx, u32 value,
+			     u32 events, struct ktf_perf *perf)
+{
+	int n = min_t(int, num_online_cpus(), t->end - t->start);
+	struct ktf_parallel_run pr = { .t = t, .ctx = ctx, .value = value,
+				       .events = events, .perf = perf };
+	struct ktf_parallel_work *pw;
+	int i;
+
+	pw = kcalloc(n, sizeof(*pw), GFP_KERNEL);
+	if (!pw)
+		return false;
+	atomic_set(&pr.next, t->start);
+	spin_lock_init(&pr.lock);
+	for (i = 0; i < n; i++) {
+		INIT_WORK(&pw[i].work, ktf_parallel_work_fn);
+		pw[i].run = &pr;
+		queue_work(system_unbound_wq, &pw[i].work);
+	}
+	for (i = 0; i < n; i++)
+		flush_work(&pw[i].work);
+	kfree(pw);
+	return true;
+}
+
+void ktf_run_hook(struct ktf_result_stream *rs, struct ktf_context *ctx,
 		  struct ktf_test *t, u32 value,
 		void *oob_data, size_t oob_data_sz)
 {
+	struct ktf_cov_hits *cov_hits;
+	struct ktf_perf perf, *counting = NULL;
+	struct ktf_lockstat *locks = NULL;
+	u64 start;
 	int i;
 
-	t->log[0] = '\0';
-	t->skb = skb;
+	/* Requests may run in parallel, but the per test state below
+	 * only allows one run of a particular test at a time:
+	 */
+	mutex_lock(&t->run_lock);
+	/* Tests of a handle may run concurrently, so which task runs a test
+	 * is kept with the test, not the handle.  Just for debugging.
+	 */
+	t->runner = current;
+	spin_lock_irq(&t->log_lock);
+	t->log_len = 0;
+	if (t->log)
+		t->log[0] = '\0';
+	spin_unlock_irq(&t->log_lock);
+	ktf_test_set_stream(t, rs);
 	t->data = oob_data;
 	t->data_sz = oob_data_sz;
+	memset(&t->time, 0, sizeof(t->time));
+	memset(&perf, 0, sizeof(perf));
+	t->lastrun = ktime_get_ns();
+	/* Attribute coverage to this test, if enabled with KTF_COV_OPT_TEST */
+	cov_hits = ktf_cov_test_start(t->id ? KTF_ID(t->id, ctx ? ctx->id : 0) : 0);
+	if (rs && (rs->perf & KTF_PERF_LOCKS)) {
+		locks = ktf_lockstat_start();
+		if (IS_ERR(locks))
+			locks = NULL;
+	}
+	if ((t->flags & KTF_TEST_PARALLEL) && t->end - t->start > 1 &&
+	    (ctx || !t->handle->require_context)) {
+		tlogs(T_DEBUG,
+		      printk(KERN_INFO "Running parallel test %s.%s", t->tclass, t->name);
+			if (ctx)
+				printk("_%s", ktf_context_name(ctx));
+			printk("[%d:%d]\n", t->start, t->end);
+		);
+		/* The work items count events with counters of their own */
+		if (ktf_run_parallel(t, ctx, value, rs ? rs->perf : 0, &perf)) {
+			flush_assert_cnt(t);
+			if (rs)
+				ktf_stream_sync(rs);
+			goto done;
+		}
+		twarn("Unable to run %s.%s in parallel - running iterations in sequence",
+		      t->tclass, t->name);
+	}
+	/* Only the events the hardware supports are counted */
+	if (rs && rs->perf && !ktf_perf_start(&perf, rs->perf))
+		counting = &perf;
+	t->perf = counting;
 	for (i = t->start; i < t->end; i++) {
 		if (!ctx && t->handle->require_context) {
 			terr("Test %s.%s requires a context, but none configured!",
 			     t->tclass, t->name);
 			continue;
 		}
-		/* No need to bump refcnt, this is just for debugging.  Nothing
-		 * should reference the testcase via the handle's current test
-		 * pointer.
-		 */
-		t->handle->current_test = t;
 		tlogs(T_DEBUG,
 		      printk(KERN_INFO "Running test %s.%s", t->tclass, t->name);
 			if (ctx)
 				printk("_%s", ktf_context_name(ctx));
 			printk("[%d:%d]\n", t->start, t->end);
 		);
-		getnstimeofday(&t->lastrun);
+		if (counting)
+			ktf_perf_begin(counting);
+		start = ktime_get_ns();
 		t->fun(t, ctx, i, value);
+		ktf_test_time_add(&t->time, ktime_get_ns() - start);
+		if (counting)
+			ktf_perf_end(counting);
+		flush_assert_cnt(t);
+		if (rs)
+			ktf_stream_sync(rs);
+	}
+done:
+	if (t->fixture) {
+		ktf_fixture_run_done(t, ctx);
 		flush_assert_cnt(t);
+		if (rs)
+			ktf_stream_sync(rs);
+	}
+	ktf_cov_test_end(cov_hits);
+	t->time.run_ns = ktime_get_ns() - t->lastrun;
+	if (rs)
+		ktf_stream_put_time(rs, &t->time);
+	if (counting) {
+		t->perf = NULL;
+		ktf_perf_stop(counting);
 	}
-	t->handle->current_test = NULL;
+	if (perf.mask)
+		ktf_stream_put_perf(rs, &perf);
+	if (locks) {
+		ktf_lockstat_stop(locks);
+		ktf_stream_put_locks(rs, locks);
+		ktf_lockstat_free(locks);
+	}
+	t->runner = NULL;
+	ktf_test_set_stream(t, NULL);
+	mutex_unlock(&t->run_lock);
 }
 
 /* Clean up all tests associated with a ktf_handle */
 
 void ktf_test_cleanup(struct ktf_handle *th)
 {
-	struct ktf_test *t;
+	struct ktf_test *t, *tmp;
 	struct ktf_case *tc;
 
 	/* Clean up tests which are associated with this handle.
 	 * It's possible multiple modules contribute tests to a test case,
 	 * so we can't just do this on a per-testcase basis.
+	 * Failures still queued refer to the tests, so report them first.
 	 */
+	ktf_assert_drain(NULL);
 	mutex_lock(&tc_lock);
+	__ktf_fixture_cleanup(th);
+
+	if (!list_empty(&th->test_list))
+		ktf_registry_changed();
+	list_for_each_entry_safe(t, tmp, &th->test_list, handle_list) {
+		tc = container_of(t->kmap.map, struct ktf_case, tests);
+		tlog(T_DEBUG, "ktf: delete test %s.%s", t->tclass, t->name);
+		list_del_init(&t->handle_list);
+		if (t->fixture_tests)
+			t->fixture_tests->tests--;
+		/* removes ref for debugfs */
+		ktf_debugfs_destroy_test(t);
+		/* removes ref for testset map of tests, which should
+		 * result in the test being freed.
+		 */
+		ktf_map_remove_elem(&tc->tests, &t->kmap);
 
-	tc = ktf_map_first_entry(&test_cases, struct ktf_case, kmap);
-	while (tc) {
-		/* FIXME - this is inefficient. */
-		t = ktf_map_first_entry(&tc->tests, struct ktf_test, kmap);
-		while (t) {
-			if (t->handle == th) {
-				tlog(T_DEBUG, "ktf: delete test %s.%s",
-				     t->tclass, t->name);
-				/* removes ref for debugfs */
-				ktf_debugfs_destroy_test(t);
-				/* removes ref for testset map of tests */
-				ktf_map_remove_elem(&tc->tests, &t->kmap);
-				/* now remove our reference which we get
-				 * from ktf_map_[first|next]_entry().
-				 * This final reference should result in
-				 * the test being freed.
-				 */
-				ktf_test_put(t);
-				/* Need to reset to root */
-				t = ktf_map_first_entry(&tc->tests,
-							struct ktf_test, kmap);
-			} else {
-				t = ktf_map_next_entry(t, kmap);
-			}
-		}
 		/* If no modules have tests for this test case, we can
 		 * free resources safely.
 		 */
 		if (ktf_case_test_count(tc) == 0) {
 			ktf_debugfs_destroy_testset(tc);
 			ktf_map_remove_elem(&test_cases, &tc->kmap);
-			ktf_case_put(tc);
-			tc = ktf_map_first_entry(&test_cases, struct ktf_case,
-						 kmap);
-		} else {
-			tc = ktf_map_next_entry(tc, kmap);
 		}
 	}
 	mutex_unlock(&tc_lock);
@@ -391,6 +1097,16 @@ int ktf_cleanup(void)
 		return -EBUSY;
 	}
 	ktf_debugfs_cleanup();
+	ktf_shm_cleanup();
+	idr_destroy(&test_idr);
 	mutex_unlock(&tc_lock);
+	free_percpu(assert_rings);
 	return 0;
 }
+
+int ktf_test_init(void)
+{
+	atomic_set(&registry_gen, (u32)ktime_get_real_ns());
+	assert_rings = alloc_percpu(struct ktf_assert_ring);
+	return assert_rings ? 0 : -ENOMEM;
+}
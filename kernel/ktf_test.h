@@ -12,6 +12,8 @@
 
 #include <net/netlink.h>
 #include <linux/version.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
 #include "ktf_map.h"
 #include "ktf_unlproto.h"
 
@@ -22,6 +24,7 @@
 struct ktf_context;
 
 struct ktf_test;
+struct ktf_result_stream;
 
 typedef void (*ktf_test_fun) (struct ktf_test *, struct ktf_context* tdev, int, u32);
 
@@ -32,6 +35,17 @@ struct ktf_debugfs {
         struct dentry *debugfs_run_test;
 };
 
+/* Durations of the last run of a test, in ns from ktime_get_ns() */
+struct ktf_test_time {
+	u64 run_ns;		/* The whole run, including reporting of results */
+	u64 iter_min_ns;
+	u64 iter_max_ns;
+	u64 iter_total_ns;	/* Sum over the iterations run */
+	u32 iterations;		/* Iterations run */
+};
+
+struct ktf_case_fixture;
+
 struct ktf_test {
 	struct ktf_map_elem kmap; /* linkage for test case list */
 	const char* tclass; /* test class name */
@@ -39,19 +53,40 @@ struct ktf_test {
 	ktf_test_fun fun;
 	int start; /* Start and end value to argument to fun */
 	int end;   /* Defines number of iterations */
-	struct sk_buff *skb; /* sk_buff for recording assertion results */
-	char *log; /* per-test log */
+	struct ktf_result_stream *stream; /* stream for reporting assertion results */
+	struct mutex run_lock; /* Serializes runs of this test */
+	struct task_struct *runner; /* Task running the test, under run_lock, for debugging */
+	u32 __percpu *assert_cnt; /* Successful assertions per CPU */
+	atomic_t assert_reported; /* Sum of assert_cnt reported so far */
+	atomic_t assert_lost; /* Failures that did not fit in the result ring */
+	spinlock_t log_lock; /* Protects log, log_len and log_size */
+	unsigned int flags; /* KTF_TEST_* flags */
+	char *log; /* per-test log of failures, NULL until the first one */
+	size_t log_len; /* Length of the log of the last run */
+	size_t log_size; /* Allocated, up to KTF_MAX_LOG */
 	void *data; /* Test specific out-of-band data */
 	size_t data_sz; /* Size of the data element, if set */
-	struct timespec lastrun; /* last time test was run */
+	u64 lastrun; /* ktime_get_ns() at the start of the last run */
+	struct ktf_test_time time; /* Durations of the last run */
+	struct ktf_perf *perf; /* Counters of the current run, if requested */
 	struct ktf_debugfs debugfs; /* debugfs info for test */
+	struct list_head debugfs_pending; /* Linkage while debugfs files are not created yet */
 	struct ktf_handle *handle; /* Handler for owning module */
+	struct list_head handle_list; /* Linkage in handle->test_list */
+	u32 id; /* Numeric id of the test, 0 if none */
+	struct ktf_shared_fixture *fixture; /* Shared fixture of the test, if any */
+	unsigned int fixture_idx; /* Index among the tests of the case and handle using fixture */
+	struct ktf_case_fixture *fixture_tests; /* Count of those tests, kept by the case */
 };
 
+/* Iterations are independent and may run concurrently */
+#define KTF_TEST_PARALLEL	0x1
+
 struct ktf_case {
 	struct ktf_map_elem kmap; /* Linkage for ktf_map */
 	struct ktf_map tests; /* List of tests to run */
 	struct ktf_debugfs debugfs; /* debugfs handles for testset */
+	struct list_head fixtures; /* ktf_case_fixture counts, under tc_lock */
 };
 
 /* Used for tests that spawn kthreads to pass state.  We should probably
@@ -69,6 +104,12 @@ extern struct ktf_map test_cases;
 
 /* Current total number of test cases defined */
 size_t ktf_case_count(void);
+
+/* Generation of the registry of tests, test cases and contexts, as reported
+ * in query responses. Changed whenever any of them are added or removed:
+ */
+u32 ktf_registry_gen(void);
+void ktf_registry_changed(void);
 const char *ktf_case_name(struct ktf_case *);
 /* Manage test case refcount. */
 void ktf_case_get(struct ktf_case *);
@@ -76,7 +117,7 @@ void ktf_case_put(struct ktf_case *);
 
 int ktf_version_check(u64 version);
 
-void ktf_run_hook(struct sk_buff *skb, struct ktf_context *ctx,
+void ktf_run_hook(struct ktf_result_stream *rs, struct ktf_context *ctx,
 		struct ktf_test *t, u32 value,
 		void *oob_data, size_t oob_data_sz);
 void flush_assert_cnt(struct ktf_test *self);
@@ -97,11 +138,17 @@ struct ktf_handle;
 /* Find the handle associated with handle id hid */
 struct ktf_handle *ktf_handle_find(int hid);
 
+/* Iterate over the handles that have contexts, in order of handle id */
+struct ktf_handle *ktf_handle_next(int *hid);
+
+#define ktf_for_each_handle(handle, hid)				\
+	for (hid = 0; (handle = ktf_handle_next(&hid)); hid++)
+
 /* Called upon ktf unload to clean up test cases */
+int ktf_test_init(void);
 int ktf_cleanup(void);
 
-/* The list of handles that have contexts associated with them */
-extern struct list_head context_handles;
+struct ktf_shared_fixture;
 
 struct __test_desc
 {
@@ -109,12 +156,16 @@ struct __test_desc
 	const char* name;   /* Test name */
 	const char* file;   /* File that implements test */
 	ktf_test_fun fun;
+	struct ktf_shared_fixture *fixture; /* Set for tests declared with TEST_SF() */
 };
 
 /* Manage refcount for tests. */
 void ktf_test_get(struct ktf_test *t);
 void ktf_test_put(struct ktf_test *t);
 
+/* Find a test (and context) by id, with a reference held on the test */
+struct ktf_test *ktf_test_find_id(u32 id, struct ktf_context **pctx);
+
 /* Add a test function to a test case for a given handle (macro version) */
 #define ktf_add_test_to(td, __test_handle)					\
 	_ktf_add_test(td##_setup, &__test_handle, 0, 0, 0, 1)
@@ -132,11 +183,25 @@ void ktf_test_put(struct ktf_test *t);
 #define ktf_add_loop_test(td,s,e)				\
 	_ktf_add_test(td##_setup, &__test_handle, 0,0,(s),(e))
 
+/* Add a looping test function where the iterations are independent
+   of each other, to be run concurrently spread over the available CPUs.
+   The order the iterations run in is undefined.
+ */
+#define ktf_add_parallel_loop_test(td,s,e)			\
+	_ktf_add_parallel_loop_test(td##_setup, &__test_handle, (s), (e))
+
 /* Add a test function to a test case
   (function version -- use this when the macro won't work
 */
 void _ktf_add_test(struct __test_desc td, struct ktf_handle *th,
 		int _signal, int allowed_exit_value, int start, int end);
+void _ktf_add_parallel_loop_test(struct __test_desc td, struct ktf_handle *th,
+				 int start, int end);
+
+/* Add n tests at once, taking the test case lock once for all of them.
+ * Consecutive tests of the same test case share one lookup of the case.
+ */
+void _ktf_add_tests(const struct __test_desc *td, size_t n, struct ktf_handle *th);
 
 /* Internal function to mark the start of a test function */
 void ktf_fn_start (const char *fname, const char *file, int line);
@@ -151,6 +216,29 @@ void ktf_fn_start (const char *fname, const char *file, int line);
 #define ADD_LOOP_TEST(__testname, from, to)			\
 	ktf_add_loop_test(__testname, from, to)
 
+#define ADD_PARALLEL_LOOP_TEST(__testname, from, to)		\
+	ktf_add_parallel_loop_test(__testname, from, to)
+
+/* Describe a test created with TEST() as an element of an array of
+ * struct __test_desc, to add all the tests of the array with ADD_TESTS:
+ *
+ *   static const struct __test_desc my_tests[] = {
+ *	KTF_TEST_DESC(mysuite, test_a),
+ *	KTF_TEST_DESC(mysuite, test_b),
+ *   };
+ *   ...
+ *   ADD_TESTS(my_tests);
+ */
+#define KTF_TEST_DESC(__testsuite, __testname)				\
+	{ .tclass = "" # __testsuite "", .name = "" # __testname "",	\
+	  .fun = __testname, .file = __FILE__ }
+
+#define ADD_TESTS(__tests) \
+	_ktf_add_tests(__tests, ARRAY_SIZE(__tests), &__test_handle)
+
+#define ADD_TESTS_TO(__handle, __tests) \
+	_ktf_add_tests(__tests, ARRAY_SIZE(__tests), &__handle)
+
 /* Remove a test previously added with ADD_TEST */
 #define DEL_TEST(__testname)\
 	ktf_del_test(__testname)
@@ -176,27 +264,33 @@ void ktf_fn_start (const char *fname, const char *file, int line);
  */
 
 struct ktf_handle {
-	struct list_head handle_list; /* Linkage for the global list of all handles with context */
+	struct mutex ctx_lock;	      /* Serializes changes to ctx_type_map and ctx_map */
+	struct rw_semaphore cfg_sem;  /* Held for write to configure contexts, read to run tests */
 	struct ktf_map ctx_type_map; /* a map from type_id to ktf_context_type (see ktf_context.c) */
 	struct ktf_map ctx_map;     /* a (possibly empty) map from name to context for this handle */
 	unsigned int id; 	      /* A unique nonzero ID for this handle, set iff contexts */
 	bool require_context;	      /* If set, tests are only valid if a context is provided */
 	u64 version;		      /* version assoc. with handle */
-	struct ktf_test *current_test;/* Current test running */
+	struct list_head test_list;   /* Tests added with this handle, under tc_lock */
 };
 
 void ktf_test_cleanup(struct ktf_handle *th);
+void ktf_fixture_cleanup(struct ktf_handle *th);
 void ktf_handle_cleanup_check(struct ktf_handle *handle);
 void ktf_cleanup_check(void);
 
 #define KTF_HANDLE_INIT_VERSION(__test_handle, __version, __need_ctx)	\
 	struct ktf_handle __test_handle = { \
-		.handle_list = LIST_HEAD_INIT(__test_handle.handle_list), \
-		.ctx_type_map = __KTF_MAP_INITIALIZER(__test_handle, NULL, NULL), \
-		.ctx_map = __KTF_MAP_INITIALIZER(__test_handle, NULL, NULL), \
+		.ctx_lock = __MUTEX_INITIALIZER(__test_handle.ctx_lock), \
+		.cfg_sem = __RWSEM_INITIALIZER(__test_handle.cfg_sem), \
+		.ctx_type_map = __KTF_MAP_INITIALIZER_FLAGS(__test_handle, NULL, NULL, \
+							    KTF_MAP_HASHED), \
+		.ctx_map = __KTF_MAP_INITIALIZER_FLAGS(__test_handle, NULL, NULL, \
+						       KTF_MAP_HASHED), \
 		.id = 0, \
 		.require_context = __need_ctx, \
 		.version = __version, \
+		.test_list = LIST_HEAD_INIT(__test_handle.test_list), \
 	};
 
 #define	KTF_HANDLE_INIT(__test_handle)	\
@@ -211,6 +305,7 @@ void ktf_cleanup_check(void);
 
 #define KTF_HANDLE_CLEANUP(__test_handle)	\
 	do { \
+		ktf_fixture_cleanup(&__test_handle); \
 		ktf_context_remove_all(&__test_handle); \
 		ktf_test_cleanup(&__test_handle); \
 	} while (0)
@@ -298,6 +393,79 @@ void ktf_cleanup_check(void);
 	static void __testname##_body(struct ktf_test *self, struct __fixture *ctx, \
 			int _i, u32 _value)
 
+/* A shared fixture is set up once for each test case and context it is used
+ * with, by the first of its tests to run, and torn down again once all the
+ * tests of the test case and handle that use it have run, or when the handle
+ * is cleaned up.  It is declared with DECLARE_F() as above, but initialized with
+ * INIT_SHARED_F() instead of INIT_F(), and used by tests declared with
+ * TEST_SF() instead of TEST_F():
+ *
+ *      INIT_SHARED_F(fixture_name,setup,teardown);
+ *
+ *      TEST_SF(fixture_name,suite_name,test_name)
+ *      {
+ *             <test code>
+ *      }
+ *
+ *   Tests get the same fixture also when they run concurrently, so
+ *   any changes they make to it need locking of their own.  If setup
+ *   does not set ok, the test that ran it fails and the next test of the
+ *   set to run retries setup.
+ */
+struct ktf_shared_fixture {
+	size_t size; /* Of the fixture struct */
+	bool (*setup)(struct ktf_test *, struct ktf_context *, void *);
+	void (*teardown)(struct ktf_test *, void *);
+	struct mutex lock; /* Serializes setup and teardown of instances */
+	struct list_head instances; /* One per test case and context, under lock */
+};
+
+void *ktf_fixture_get(struct ktf_test *self, struct ktf_context *ctx);
+void ktf_fixture_put(struct ktf_test *self, void *fixture);
+
+#define INIT_SHARED_F(__fixture,__setup,__teardown) \
+	INIT_F(__fixture, __setup, __teardown); \
+	static bool __fixture##_shared_setup(struct ktf_test *self, \
+					     struct ktf_context *ctx, void *f) \
+	{ \
+		struct __fixture *__f = f; \
+		*__f = __fixture##_template; \
+		__setup(self, ctx, __f); \
+		return __f->ok; \
+	} \
+	static void __fixture##_shared_teardown(struct ktf_test *self, void *f) \
+	{ \
+		__teardown(self, f); \
+	} \
+	static struct ktf_shared_fixture __fixture##_shared = { \
+		.size = sizeof(struct __fixture), \
+		.setup = __fixture##_shared_setup, \
+		.teardown = __fixture##_shared_teardown, \
+		.lock = __MUTEX_INITIALIZER(__fixture##_shared.lock), \
+		.instances = LIST_HEAD_INIT(__fixture##_shared.instances), \
+	}
+
+#define TEST_SF(__fixture, __testsuite, __testname) \
+	static void __testname##_body(struct ktf_test *, struct __fixture *, \
+				      int, u32); \
+	static void __testname(struct ktf_test *, struct ktf_context *, int, \
+			       u32); \
+	struct __test_desc __testname##_setup = \
+	{ .tclass = "" # __testsuite "", .name = "" # __testname "", \
+	  .fun = __testname, .file = __FILE__, \
+	  .fixture = &__fixture##_shared }; \
+	\
+	static void __testname(struct ktf_test *self, struct ktf_context* ctx, \
+		int _i, u32 _value) \
+	{ \
+		struct __fixture *f_ctx = ktf_fixture_get(self, ctx); \
+		if (!f_ctx) return; \
+		__testname##_body(self, f_ctx, _i, _value); \
+		ktf_fixture_put(self, f_ctx); \
+	} \
+	static void __testname##_body(struct ktf_test *self, struct __fixture *ctx, \
+			int _i, u32 _value)
+
 /* Fail the test case unless expr is true */
 /* The space before the comma sign before ## is essential to be compatible
    with gcc 2.95.3 and earlier.
@@ -8,6 +8,7 @@
  */
 #ifndef _KTF_UNLPROTO_H
 #define _KTF_UNLPROTO_H
+#include <linux/types.h>
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -19,6 +20,11 @@ enum ktf_cmd_type {
 	KTF_CT_COV_ENABLE,
 	KTF_CT_COV_DISABLE,
 	KTF_CT_CTX_CFG,
+	KTF_CT_RUN_BATCH,
+	KTF_CT_COV_RESET,
+	KTF_CT_COV_SNAPSHOT,
+	KTF_CT_COV_DELTA,
+	KTF_CT_CTX_CFG_BATCH,
 	KTF_CT_MAX,
 };
 
@@ -44,9 +50,98 @@ enum ktf_attr {
 	KTF_A_MOD,    /* module for coverage analysis, also used for context type */
 	KTF_A_COVOPT, /* options for coverage analysis */
 	KTF_A_DATA,   /* Binary data used by a.o. hybrid tests */
+	KTF_A_ID,     /* Numeric id of a test, context or test in a context */
+	KTF_A_COV,    /* Coverage snapshot record: MOD, STR (function), NUM (hits), ID (test) */
+	KTF_A_GEN,    /* Generation of the coverage counts for delta queries, or of the tests */
+	KTF_A_BENCH,  /* Benchmark statistics of a BENCH() test: KTF_B_* attributes */
+	KTF_A_TIME,   /* Run time of a test: KTF_T_* attributes */
+	KTF_A_PERFOPT, /* KTF_PERF_* events to count while running tests */
+	KTF_A_PERF,   /* Performance counter totals of a test run: KTF_P_* attributes */
+	KTF_A_SWEEP,  /* Scalability curve of a sweep: KTF_W_* attributes */
+	KTF_A_LOCKS,  /* Lock contention profile of a test run: KTF_L_* attributes */
+	KTF_A_SHM,    /* Data in a shared buffer instead of KTF_A_DATA: KTF_S_* attributes */
+	KTF_A_CTX,    /* Context in a batch configuration: HID, FILE, STR, DATA or SHM, STAT */
 	KTF_A_MAX
 };
 
+/* Attributes nested in KTF_A_BENCH: Per operation times are in picoseconds */
+enum ktf_bench_attr {
+	KTF_B_PAD,
+	KTF_B_ITERS,  /* Operations per timed batch */
+	KTF_B_BATCHES,
+	KTF_B_MIN,
+	KTF_B_MEDIAN,
+	KTF_B_MEAN,
+	KTF_B_P99,
+	KTF_B_OPS,    /* Operations per second */
+	KTF_B_SAMPLES, /* Binary: __u64 time per operation in each batch, ascending */
+	KTF_B_MAX
+};
+
+/* Attributes nested in KTF_A_TIME: Times are in ns from the monotonic clock */
+enum ktf_time_attr {
+	KTF_T_PAD,
+	KTF_T_RUN,        /* The whole run, including reporting of results */
+	KTF_T_ITERS,      /* Iterations run */
+	KTF_T_ITER_MIN,
+	KTF_T_ITER_MAX,
+	KTF_T_ITER_TOTAL, /* Sum over the iterations */
+	KTF_T_MAX
+};
+
+/* Attributes nested in KTF_A_PERF, one per KTF_PERF_* event counted */
+enum ktf_perf_attr {
+	KTF_P_PAD,
+	KTF_P_CYCLES,
+	KTF_P_INSTRUCTIONS,
+	KTF_P_CACHE_MISSES,
+	KTF_P_BRANCH_MISSES,
+	KTF_P_MAX
+};
+
+/* Attributes nested in KTF_A_SWEEP: A KTF_W_DURATION followed by one
+ * KTF_W_POINT per width, each with the other KTF_W_* attributes nested.
+ */
+enum ktf_sweep_attr {
+	KTF_W_PAD,
+	KTF_W_DURATION, /* ns per width */
+	KTF_W_POINT,
+	KTF_W_THREADS,
+	KTF_W_OPS,      /* Operations, total over the workers */
+	KTF_W_ELAPSED,  /* ns, of the slowest worker */
+	KTF_W_RATE,     /* Operations per second, total over the workers */
+	KTF_W_OP_TIME,  /* Mean time per operation in a worker, in picoseconds */
+	KTF_W_MAX
+};
+
+/* Attributes nested in KTF_A_LOCKS: A KTF_L_DROPPED count followed by one
+ * KTF_L_ENTRY per lock and caller, by decreasing wait time, each with the
+ * other KTF_L_* attributes nested.
+ */
+enum ktf_lock_attr {
+	KTF_L_PAD,
+	KTF_L_DROPPED,  /* Contentions not recorded */
+	KTF_L_ENTRY,
+	KTF_L_LOCK,     /* String: Lock address or symbol */
+	KTF_L_CALLER,   /* String: Return addresses outside of the locking code */
+	KTF_L_FLAGS,    /* LCB_F_* flags of the contention_begin tracepoint */
+	KTF_L_COUNT,    /* Times contended */
+	KTF_L_WAIT,     /* Total ns waited */
+	KTF_L_MAX_WAIT, /* Longest wait in ns */
+	KTF_L_MAX
+};
+
+/* Attributes nested in KTF_A_SHM: The bytes at offset KTF_S_OFF of the
+ * buffer with id KTF_S_ID (see KTF_SHM_FILE) are used in place.
+ */
+enum ktf_shm_attr {
+	KTF_S_PAD,
+	KTF_S_ID,     /* u32 */
+	KTF_S_OFF,    /* u64 */
+	KTF_S_LEN,    /* u64 */
+	KTF_S_MAX
+};
+
 /* attribute policy */
 #ifdef NL_INTERNAL
 static struct nla_policy ktf_gnl_policy[KTF_A_MAX] = {
@@ -65,6 +160,23 @@ static struct nla_policy ktf_gnl_policy[KTF_A_MAX] = {
 	[KTF_A_MOD]   = { .type = NLA_STRING },
 	[KTF_A_COVOPT] = { .type = NLA_U32 },
 	[KTF_A_DATA] = { .type = NLA_BINARY },
+	[KTF_A_ID]    = { .type = NLA_U32 },
+	[KTF_A_COV]   = { .type = NLA_NESTED },
+	[KTF_A_GEN]   = { .type = NLA_U32 },
+	[KTF_A_BENCH] = { .type = NLA_NESTED },
+	[KTF_A_TIME]  = { .type = NLA_NESTED },
+	[KTF_A_PERFOPT] = { .type = NLA_U32 },
+	[KTF_A_PERF]  = { .type = NLA_NESTED },
+	[KTF_A_SWEEP] = { .type = NLA_NESTED },
+	[KTF_A_LOCKS] = { .type = NLA_NESTED },
+	[KTF_A_SHM]   = { .type = NLA_NESTED },
+	[KTF_A_CTX]   = { .type = NLA_NESTED },
+};
+
+static struct nla_policy ktf_shm_policy[KTF_S_MAX] = {
+	[KTF_S_ID]    = { .type = NLA_U32 },
+	[KTF_S_OFF]   = { .type = NLA_U64 },
+	[KTF_S_LEN]   = { .type = NLA_U64 },
 };
 #endif
 
@@ -91,10 +203,102 @@ enum ktf_vshift {
 	((__v & 0xffffULL) << KTF_VSHIFT_##__field)
 
 #define	KTF_VERSION_LATEST	\
-	(KTF_VERSION_SET(MAJOR, 0ULL) | KTF_VERSION_SET(MINOR, 2ULL) | KTF_VERSION_SET(MICRO, 1ULL))
+	(KTF_VERSION_SET(MAJOR, 0ULL) | KTF_VERSION_SET(MINOR, 2ULL) | KTF_VERSION_SET(MICRO, 6ULL))
+
+/* First version that supports numeric test ids (KTF_A_ID) */
+#define	KTF_VERSION_IDS	\
+	(KTF_VERSION_SET(MAJOR, 0ULL) | KTF_VERSION_SET(MINOR, 2ULL) | KTF_VERSION_SET(MICRO, 2ULL))
+
+/* First version that reports the run time of tests (KTF_A_TIME) */
+#define	KTF_VERSION_TIME	\
+	(KTF_VERSION_SET(MAJOR, 0ULL) | KTF_VERSION_SET(MINOR, 2ULL) | KTF_VERSION_SET(MICRO, 3ULL))
+
+/* First version that reports scalability sweeps (KTF_A_SWEEP) */
+#define	KTF_VERSION_SWEEP	\
+	(KTF_VERSION_SET(MAJOR, 0ULL) | KTF_VERSION_SET(MINOR, 2ULL) | KTF_VERSION_SET(MICRO, 4ULL))
+
+/* First version that takes data in shared buffers (KTF_A_SHM) */
+#define	KTF_VERSION_SHM	\
+	(KTF_VERSION_SET(MAJOR, 0ULL) | KTF_VERSION_SET(MINOR, 2ULL) | KTF_VERSION_SET(MICRO, 5ULL))
+
+/* First version that configures lists of contexts (KTF_CT_CTX_CFG_BATCH) */
+#define	KTF_VERSION_CTX_BATCH	\
+	(KTF_VERSION_SET(MAJOR, 0ULL) | KTF_VERSION_SET(MINOR, 2ULL) | KTF_VERSION_SET(MICRO, 6ULL))
+
+/* Numeric test ids: The query reports an id for each test and each context.
+ * A test to run in a given context is identified by the combination of the two,
+ * which remains stable for as long as the test and the context exist.
+ * An id of 0 means no id (for a context: no context).
+ */
+#define	KTF_ID_CTX_SHIFT	20
+#define	KTF_ID_TEST_MAX		((1U << KTF_ID_CTX_SHIFT) - 1)
+#define	KTF_ID_CTX_MAX		((1U << (32 - KTF_ID_CTX_SHIFT)) - 1)
+#define	KTF_ID(test_id, ctx_id)	((test_id) | ((ctx_id) << KTF_ID_CTX_SHIFT))
+#define	KTF_ID_TEST(id)		((id) & KTF_ID_TEST_MAX)
+#define	KTF_ID_CTX(id)		((id) >> KTF_ID_CTX_SHIFT)
 
 /* Coverage options */
 #define	KTF_COV_OPT_MEM		0x1
+#define	KTF_COV_OPT_KPROBE	0x2	/* Use kprobes even if ftrace is available */
+#define	KTF_COV_OPT_TEST	0x4	/* Also count hits per test run */
+#define	KTF_COV_OPT_ALLOC	0x8	/* Profile allocations per function */
+
+/* Performance counter events (KTF_A_PERFOPT): Bit n is KTF_P_* attribute n + 1 */
+#define	KTF_PERF_CYCLES		0x1
+#define	KTF_PERF_INSTRUCTIONS	0x2
+#define	KTF_PERF_CACHE_MISSES	0x4
+#define	KTF_PERF_BRANCH_MISSES	0x8
+/* Not a counter: Profile lock contention during the run (KTF_A_LOCKS) */
+#define	KTF_PERF_LOCKS		0x100
+
+/* Binary coverage export, read or mmap'ed from debugfs (relative to the
+ * debugfs mount point). A snapshot is taken each time the file is opened.
+ * The header is followed by nr_modules module records, nr_functions
+ * function records and a string table of strtab_size bytes that the name
+ * fields are offsets into. Names are NUL terminated.
+ */
+#define	KTF_COV_EXPORT_FILE	"ktf/coverage.bin"
+#define	KTF_COV_EXPORT_MAGIC	0x6b746663	/* "ktfc" */
+#define	KTF_COV_EXPORT_VERSION	1
+
+struct ktf_cov_export_hdr {
+	__u32 magic;
+	__u32 version;
+	__u32 nr_modules;
+	__u32 nr_functions;
+	__u32 strtab_size;
+	__u32 reserved;
+};
+
+struct ktf_cov_export_module {
+	__u32 name;
+	__u32 nr_functions;
+	__u32 nr_called;		/* Number of functions called */
+	__u32 opts;			/* KTF_COV_OPT_* */
+};
+
+struct ktf_cov_export_function {
+	__u64 address;
+	__u32 size;
+	__u32 name;
+	__u32 module;			/* Index of the module record */
+	__u32 hits;			/* Number of calls since last reset */
+};
+
+/* Buffers shared with the kernel for the data of hybrid tests and context
+ * configurations (relative to the debugfs mount point): Each open of the
+ * file gets a new buffer, which the first mmap() allocates with the size
+ * of the mapping, up to KTF_SHM_MAX_SIZE, and which lasts until the file
+ * is closed and unmapped. A read() of the file then returns its id and size.
+ */
+#define	KTF_SHM_FILE		"ktf/shm"
+#define	KTF_SHM_MAX_SIZE	(1ULL << 30)
+
+struct ktf_shm_info {
+	__u32 id;
+	__u32 reserved;
+	__u64 size;
+};
 
 struct nla_policy *ktf_get_gnl_policy(void);
 
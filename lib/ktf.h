@@ -27,6 +27,82 @@ namespace ktf
   /* Function for enabling/disabling coverage for module */
   int set_coverage(std::string module, unsigned int opts, bool enabled);
 
+  /* Set the call counts of the covered functions of module(s) back to 0 */
+  int reset_coverage(std::string module);
+
+  /* Call count of a covered function, either in total or (if test is set)
+   * while the named test was running:
+   */
+  struct cov_hit
+  {
+    std::string module;
+    std::string function;
+    unsigned int hits;
+    std::string test;
+  };
+
+  /* Get the current call counts of the covered functions of module(s) */
+  int coverage_snapshot(std::string module, std::vector<cov_hit>& hits);
+
+  /* Get the current call counts of only the functions whose count changed
+   * since generation gen, and update gen for the next call.  Start with 0:
+   */
+  int coverage_delta(std::string module, unsigned int& gen, std::vector<cov_hit>& hits);
+
+  /* Count hardware performance events while running kernel tests.
+   * events is a comma separated list of cycles, instructions, cache-misses
+   * and branch-misses, or "all" - empty to stop counting. "locks" in
+   * addition profiles lock contention during each run. The default is
+   * taken from the environment variable KTF_PERF.
+   * Returns -EINVAL for unknown events:
+   */
+  int set_perf_events(const std::string& events);
+
+  /* Write the run times and benchmark statistics of the kernel tests to
+   * file at the end of the run. The default is taken from KTF_RESULTS:
+   */
+  void set_results_file(const std::string& file);
+
+  /* Fail tests that run slower than in the results file of an earlier run
+   * by more than tolerance percent. Tests that run for less than KTF_MIN_NS
+   * (default 1 ms) are not compared, and benchmarks only fail if their
+   * batch times are also significantly larger (Mann-Whitney U test).
+   * The defaults are taken from KTF_BASELINE and KTF_TOLERANCE.
+   * Returns 0 or -errno if the file cannot be read:
+   */
+  int set_baseline(const std::string& file, double tolerance = 10.0);
+
+  /* Configure the network context (see kernel/ktf_netctx.h) named context
+   * with nodes, a comma separated list of the addresses or host names of
+   * the nodes, each optionally followed by @ifname, with this host as the
+   * node at index rank. An empty list and a negative rank are taken from
+   * KTF_NET_NODES and KTF_NET_RANK. Returns 0 or -errno:
+   */
+  int configure_netctx(const std::string& context, std::string nodes = "", int rank = -1);
+
+  /* A context configuration for configure_contexts() */
+  struct context_cfg
+  {
+    std::string context;
+    std::string type_name;
+    const void* data;
+    size_t data_sz;
+    int stat; /* Set by configure_contexts(): 0 or -errno */
+  };
+
+  /* Configure a list of contexts in a single request to the kernel, each as
+   * if with KTF_CONTEXT_CFG(). Sets the status of each entry, and returns 0
+   * if all of them were configured, otherwise the first error:
+   */
+  int configure_contexts(std::vector<context_cfg>& cfgs);
+
+  /* Time a full query of the kernel's tests, without changing the tests
+   * known to this program. Sets ns to the time from the request until the
+   * whole response has been parsed, and returns the number of tests the
+   * kernel offers, or a negative error:
+   */
+  int time_query(unsigned long long& ns);
+
   typedef void (*configurator)(void);
 
   // Initialize KTF:
@@ -0,0 +1,370 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktf_baseline.cpp: Performance results of kernel tests, and comparison
+ *  against the results of a previous run (a baseline).
+ *
+ * The results file has one line per test run, with the kind of result,
+ * the test name and a list of key=value pairs:
+ *
+ *   time <set>.<test>[_<ctx>] kernel_ns=<n>
+ *   bench <set>.<test>[_<ctx>] iterations=<n> ... samples_ps=<n>,<n>,...
+ *   sweep <set>.<test>[_<ctx>] duration_ns=<n> threads=<n>,<n>,... ...
+ *
+ * A results file can be used as the baseline of a later run.
+ * Sweeps are kept for plotting scalability curves, and not compared.
+ */
+
+#include "ktf_int.h"
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include "ktf_debug.h"
+
+namespace ktf
+{
+
+/* Benchmarks are slower than the baseline if the median time per operation
+ * is above the tolerance, and the batch times are larger with the
+ * probability 1 - baseline_alpha by a Mann-Whitney U test:
+ */
+static const double baseline_alpha = 0.01;
+
+struct perf_record
+{
+  perf_record() : kernel_ns(0), timed(false), benched(false), swept(false) {}
+
+  unsigned long long kernel_ns;
+  bool timed;
+  bench_stats bench;
+  bool benched;
+  sweep_stats sweep; /* Of the last run */
+  bool swept;
+};
+
+typedef std::map<std::string, perf_record> perf_records;
+
+static struct baseline_state
+{
+  baseline_state() : tolerance(10.0), min_ns(1000000) {}
+
+  std::string results_file;
+  perf_records results; /* Of this run */
+  perf_records baseline;
+  double tolerance; /* Percent */
+  unsigned long long min_ns; /* Test run times below this are just noise */
+} blstate;
+
+void set_results_file(const std::string& file)
+{
+  blstate.results_file = file;
+}
+
+/* Records of the same test are combined: The fastest run time and median
+ * are kept, and the benchmark samples of all runs are used:
+ */
+static void add_time(perf_records& recs, const std::string& test, unsigned long long ns)
+{
+  perf_record& r = recs[test];
+
+  if (!r.timed || ns < r.kernel_ns)
+    r.kernel_ns = ns;
+  r.timed = true;
+}
+
+static void add_bench(perf_records& recs, const std::string& test, const bench_stats& bs)
+{
+  perf_record& r = recs[test];
+  std::vector<unsigned long long> samples;
+
+  if (r.benched)
+    samples.swap(r.bench.samples_ps);
+  if (!r.benched || bs.median_ps < r.bench.median_ps)
+    r.bench = bs;
+  samples.insert(samples.end(), bs.samples_ps.begin(), bs.samples_ps.end());
+  std::sort(samples.begin(), samples.end());
+  r.bench.samples_ps.swap(samples);
+  r.benched = true;
+}
+
+static void add_sweep(perf_records& recs, const std::string& test, const sweep_stats& ss)
+{
+  perf_record& r = recs[test];
+
+  r.sweep = ss;
+  r.swept = true;
+}
+
+static std::vector<unsigned long long> parse_list(const std::string& s)
+{
+  std::vector<unsigned long long> v;
+  std::istringstream ss(s);
+  std::string e;
+
+  while (std::getline(ss, e, ','))
+    v.push_back(strtoull(e.c_str(), NULL, 0));
+  return v;
+}
+
+static bool parse_record(const std::string& line, perf_records& recs)
+{
+  std::istringstream is(line);
+  std::string kind, test, kv;
+  std::map<std::string, std::string> values;
+
+  if (!(is >> kind >> test))
+    return false;
+  while (is >> kv) {
+    size_t eq = kv.find('=');
+    if (eq == std::string::npos)
+      return false;
+    values[kv.substr(0, eq)] = kv.substr(eq + 1);
+  }
+
+  if (kind == "time") {
+    add_time(recs, test, strtoull(values["kernel_ns"].c_str(), NULL, 0));
+    return true;
+  } else if (kind == "bench") {
+    bench_stats bs;
+    bs.iterations = strtoull(values["iterations"].c_str(), NULL, 0);
+    bs.batches = strtoull(values["batches"].c_str(), NULL, 0);
+    bs.min_ps = strtoull(values["min_ps"].c_str(), NULL, 0);
+    bs.median_ps = strtoull(values["median_ps"].c_str(), NULL, 0);
+    bs.mean_ps = strtoull(values["mean_ps"].c_str(), NULL, 0);
+    bs.p99_ps = strtoull(values["p99_ps"].c_str(), NULL, 0);
+    bs.ops_per_sec = strtoull(values["ops_per_sec"].c_str(), NULL, 0);
+    bs.samples_ps = parse_list(values["samples_ps"]);
+    add_bench(recs, test, bs);
+    return true;
+  } else if (kind == "sweep") {
+    std::vector<unsigned long long> threads = parse_list(values["threads"]);
+    std::vector<unsigned long long> ops = parse_list(values["ops"]);
+    std::vector<unsigned long long> elapsed = parse_list(values["elapsed_ns"]);
+    std::vector<unsigned long long> rate = parse_list(values["ops_per_sec"]);
+    std::vector<unsigned long long> op_ps = parse_list(values["op_ps"]);
+    sweep_stats ss;
+    size_t i;
+
+    if (ops.size() != threads.size() || elapsed.size() != threads.size() ||
+	rate.size() != threads.size() || op_ps.size() != threads.size())
+      return false;
+    ss.duration_ns = strtoull(values["duration_ns"].c_str(), NULL, 0);
+    for (i = 0; i < threads.size(); i++) {
+      sweep_point pt;
+      pt.threads = threads[i];
+      pt.ops = ops[i];
+      pt.elapsed_ns = elapsed[i];
+      pt.ops_per_sec = rate[i];
+      pt.op_ps = op_ps[i];
+      ss.points.push_back(pt);
+    }
+    add_sweep(recs, test, ss);
+    return true;
+  }
+  return false;
+}
+
+int set_baseline(const std::string& file, double tolerance)
+{
+  std::ifstream in(file.c_str());
+  std::string line;
+  int lineno = 0;
+
+  if (!in)
+    return errno ? -errno : -EIO;
+  blstate.baseline.clear();
+  blstate.tolerance = tolerance;
+  while (std::getline(in, line)) {
+    lineno++;
+    if (line.empty() || line[0] == '#')
+      continue;
+    if (!parse_record(line, blstate.baseline))
+      fprintf(stderr, "%s:%d: Ignoring malformed result line\n", file.c_str(), lineno);
+  }
+  log(KTF_INFO, "Loaded %lu baseline results from %s\n", blstate.baseline.size(),
+      file.c_str());
+  return 0;
+}
+
+void baseline_init()
+{
+  const char* results = getenv("KTF_RESULTS");
+  const char* baseline = getenv("KTF_BASELINE");
+  const char* tolerance = getenv("KTF_TOLERANCE");
+  const char* min_ns = getenv("KTF_MIN_NS");
+  int ret;
+
+  if (results)
+    set_results_file(results);
+  if (min_ns)
+    blstate.min_ns = strtoull(min_ns, NULL, 0);
+  if (baseline) {
+    ret = set_baseline(baseline, tolerance ? strtod(tolerance, NULL) : 10.0);
+    if (ret)
+      fprintf(stderr, "Unable to read baseline %s: %s\n", baseline, strerror(-ret));
+  }
+}
+
+/* One sided Mann-Whitney U test, by the normal approximation: The probability
+ * of samples in a being this much larger than the samples in b by chance:
+ */
+static double mann_whitney_p(const std::vector<unsigned long long>& a,
+			     const std::vector<unsigned long long>& b)
+{
+  std::vector<std::pair<unsigned long long, int> > all;
+  double n1 = a.size(), n2 = b.size(), r1 = 0;
+  size_t i, j;
+
+  for (i = 0; i < a.size(); i++)
+    all.push_back(std::make_pair(a[i], 0));
+  for (i = 0; i < b.size(); i++)
+    all.push_back(std::make_pair(b[i], 1));
+  std::sort(all.begin(), all.end());
+
+  /* Sum the ranks of a, with the average rank for ties */
+  for (i = 0; i < all.size(); i = j) {
+    int cnt = 0;
+
+    for (j = i; j < all.size() && all[j].first == all[i].first; j++)
+      if (!all[j].second)
+	cnt++;
+    r1 += cnt * (i + 1 + j) / 2.0;
+  }
+
+  double u = r1 - n1 * (n1 + 1) / 2;
+  double sigma = sqrt(n1 * n2 * (n1 + n2 + 1) / 12);
+  double z = (u - n1 * n2 / 2 - 0.5) / sigma;
+
+  return 0.5 * erfc(z / sqrt(2.0));
+}
+
+static bool regressed(unsigned long long cur, unsigned long long base)
+{
+  return cur > base * (1 + blstate.tolerance / 100);
+}
+
+static std::string percent_slower(unsigned long long cur, unsigned long long base)
+{
+  char buf[32];
+
+  snprintf(buf, sizeof(buf), "%.1f%%", 100.0 * cur / base - 100);
+  return buf;
+}
+
+bool baseline_check_time(const std::string& test, const test_time& tt, std::string& msg)
+{
+  add_time(blstate.results, test, tt.run_ns);
+
+  perf_records::iterator it = blstate.baseline.find(test);
+  if (it == blstate.baseline.end() || !it->second.timed)
+    return true;
+
+  unsigned long long base = it->second.kernel_ns;
+  if (base < blstate.min_ns || tt.run_ns < blstate.min_ns || !regressed(tt.run_ns, base))
+    return true;
+
+  std::ostringstream os;
+  os << test << " ran for " << tt.run_ns << " ns in the kernel, "
+     << percent_slower(tt.run_ns, base) << " slower than the baseline of "
+     << base << " ns (tolerance " << blstate.tolerance << "%)";
+  msg = os.str();
+  return false;
+}
+
+bool baseline_check_bench(const std::string& test, const bench_stats& bs, std::string& msg)
+{
+  add_bench(blstate.results, test, bs);
+
+  perf_records::iterator it = blstate.baseline.find(test);
+  if (it == blstate.baseline.end() || !it->second.benched)
+    return true;
+
+  const bench_stats& base = it->second.bench;
+  if (!base.median_ps || !regressed(bs.median_ps, base.median_ps))
+    return true;
+
+  double p = -1;
+  if (bs.samples_ps.size() && base.samples_ps.size()) {
+    p = mann_whitney_p(bs.samples_ps, base.samples_ps);
+    if (p >= baseline_alpha)
+      return true;
+  }
+
+  std::ostringstream os;
+  os << test << ": median " << bs.median_ps << " ps/op is "
+     << percent_slower(bs.median_ps, base.median_ps) << " slower than the baseline of "
+     << base.median_ps << " ps/op (tolerance " << blstate.tolerance << "%";
+  if (p >= 0)
+    os << ", p = " << p;
+  os << ")";
+  msg = os.str();
+  return false;
+}
+
+void baseline_add_sweep(const std::string& test, const sweep_stats& ss)
+{
+  add_sweep(blstate.results, test, ss);
+}
+
+int baseline_write_results()
+{
+  perf_records::iterator it;
+  size_t i;
+
+  if (blstate.results_file.empty())
+    return 0;
+
+  std::ofstream out(blstate.results_file.c_str());
+  if (!out) {
+    int err = errno ? errno : EIO;
+    fprintf(stderr, "Unable to write results to %s: %s\n", blstate.results_file.c_str(),
+	    strerror(err));
+    return -err;
+  }
+  out << "# KTF performance results: <kind> <test> <key>=<value>...\n";
+  for (it = blstate.results.begin(); it != blstate.results.end(); ++it) {
+    const perf_record& r = it->second;
+
+    if (r.timed)
+      out << "time " << it->first << " kernel_ns=" << r.kernel_ns << "\n";
+    if (r.benched) {
+      const bench_stats& bs = r.bench;
+      out << "bench " << it->first << " iterations=" << bs.iterations
+	  << " batches=" << bs.batches << " min_ps=" << bs.min_ps
+	  << " median_ps=" << bs.median_ps << " mean_ps=" << bs.mean_ps
+	  << " p99_ps=" << bs.p99_ps << " ops_per_sec=" << bs.ops_per_sec;
+      for (i = 0; i < bs.samples_ps.size(); i++)
+	out << (i ? "," : " samples_ps=") << bs.samples_ps[i];
+      out << "\n";
+    }
+    if (r.swept && !r.sweep.points.empty()) {
+      const std::vector<sweep_point>& pts = r.sweep.points;
+      out << "sweep " << it->first << " duration_ns=" << r.sweep.duration_ns;
+      for (i = 0; i < pts.size(); i++)
+	out << (i ? "," : " threads=") << pts[i].threads;
+      for (i = 0; i < pts.size(); i++)
+	out << (i ? "," : " ops=") << pts[i].ops;
+      for (i = 0; i < pts.size(); i++)
+	out << (i ? "," : " elapsed_ns=") << pts[i].elapsed_ns;
+      for (i = 0; i < pts.size(); i++)
+	out << (i ? "," : " ops_per_sec=") << pts[i].ops_per_sec;
+      for (i = 0; i < pts.size(); i++)
+	out << (i ? "," : " op_ps=") << pts[i].op_ps;
+      out << "\n";
+    }
+  }
+  out.close();
+  if (!out)
+    return -EIO;
+  log(KTF_INFO, "Wrote %lu results to %s\n", blstate.results.size(),
+      blstate.results_file.c_str());
+  return 0;
+}
+
+} // end namespace ktf
@@ -9,14 +9,22 @@
 #include <netlink/netlink.h>
 #include <netlink/genl/genl.h>
 #include <netlink/genl/ctrl.h>
+#include <netdb.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <unistd.h>
 #include "kernel/ktf_unlproto.h"
+#include "kernel/ktf_netctx.h"
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <deque>
 #include <map>
 #include <set>
 #include <string>
+#include <unordered_map>
 #include "ktf_int.h"
 #include "ktf_debug.h"
 
@@ -35,10 +43,11 @@ namespace ktf
 
 struct nl_sock* sock = NULL;
 int family = -1;
+uint64_t kversion = 0; /* KTF version of the kernel, as reported by the query */
 
 int printed_header = 0;
 
-typedef std::map<std::string, KernelTest*> testmap;
+typedef std::unordered_map<std::string, KernelTest*> testmap;
 typedef std::map<std::string, test_cb*> wrappermap;
 
 class testset
@@ -129,10 +138,21 @@ public:
 
   testset& find_add_set(std::string& setname);
   testset& find_add_test(std::string& setname, std::string& testname);
-  void add_test(const std::string& setname, const char* tname, unsigned int handle_id);
+  void add_test(const std::string& setname, const char* tname, unsigned int handle_id,
+		unsigned int test_id);
   KernelTest* find_test(const std::string&setname, const std::string& testname, std::string* ctx);
+  KernelTest* find_test_id(unsigned int id, std::string* ctx);
+  void add_test_id(unsigned int test_id, KernelTest* kt);
+  void add_context_id(unsigned int hid, const std::string& ctx, unsigned int ctx_id);
+  unsigned int get_context_id(unsigned int hid, const std::string& ctx);
   void add_wrapper(const std::string setname, const std::string testname, test_cb* tcb);
 
+  /* Add the test kt in context ctx, named name as reported to the test framework */
+  void add_instance(const std::string& setname, const std::string& name,
+		    KernelTest* kt, const std::string& ctx);
+  /* Make room for n more test instances */
+  void reserve_instances(size_t n);
+
   stringvec& get_set_names() { return set_names; }
   stringvec get_test_names();
 
@@ -174,10 +194,31 @@ private:
   std::map<unsigned int, stringvec> handle_to_ctxvec;
   std::map<std::string, context_vector> cfg_contexts;
 
+  // Numeric ids as reported by the kernel: A flat table of tests indexed
+  // by test id, and the id of each context per handle id (and reverse):
+  std::vector<KernelTest*> tests_by_id;
+  std::map<unsigned int, std::map<std::string, unsigned int> > ctx_ids;
+  std::map<unsigned int, std::string> ctx_names;
+
   // Context types that allows dynamically created contexts:
   std::map<std::string, std::vector<ContextType*> > ctx_types;
   int next_set;
   name_iter* cur;
+
+  // A flat table of all test instances (test and context) by the name
+  // reported to the test framework, "<set>.<test>[_<context>]", with
+  // context names interned in ctx_table (index 0 is no context):
+  struct instance
+  {
+    KernelTest* kt;
+    unsigned int ctx;
+  };
+  std::vector<instance> instances;
+  std::unordered_map<std::string, unsigned int> instance_index;
+  stringvec ctx_table;
+  std::unordered_map<std::string, unsigned int> ctx_index;
+
+  unsigned int intern_context(const std::string& ctx);
 };
 
 KernelTestMgr::~KernelTestMgr()
@@ -263,7 +304,7 @@ testset& KernelTestMgr::find_add_set(std::string& setname)
 
 
 void KernelTestMgr::add_test(const std::string& setname, const char* tname,
-			     unsigned int handle_id)
+			     unsigned int handle_id, unsigned int test_id)
 {
   log(KTF_INFO_V, "add_test: %s.%s", setname.c_str(),tname);
   logs(KTF_INFO_V,
@@ -272,7 +313,71 @@ void KernelTestMgr::add_test(const std::string& setname, const char* tname,
        else
 	 fprintf(stderr, "\n"));
   std::string name(tname);
-  new KernelTest(setname, tname, handle_id);
+  new KernelTest(setname, tname, handle_id, test_id);
+}
+
+unsigned int KernelTestMgr::intern_context(const std::string& ctx)
+{
+  if (ctx_table.empty()) {
+    ctx_table.push_back(std::string());
+    ctx_index[std::string()] = 0;
+  }
+  std::unordered_map<std::string, unsigned int>::iterator it = ctx_index.find(ctx);
+  if (it != ctx_index.end())
+    return it->second;
+  ctx_index[ctx] = ctx_table.size();
+  ctx_table.push_back(ctx);
+  return ctx_table.size() - 1;
+}
+
+void KernelTestMgr::add_instance(const std::string& setname, const std::string& name,
+				 KernelTest* kt, const std::string& ctx)
+{
+  instance in = { kt, intern_context(ctx) };
+  std::string key(setname);
+
+  key.append(".");
+  key.append(name);
+  instance_index[key] = instances.size();
+  instances.push_back(in);
+}
+
+void KernelTestMgr::reserve_instances(size_t n)
+{
+  instances.reserve(instances.size() + n);
+  instance_index.reserve(instance_index.size() + n);
+}
+
+void KernelTestMgr::add_test_id(unsigned int test_id, KernelTest* kt)
+{
+  if (test_id >= tests_by_id.size())
+    tests_by_id.resize(test_id + 1);
+  tests_by_id[test_id] = kt;
+}
+
+void KernelTestMgr::add_context_id(unsigned int hid, const std::string& ctx, unsigned int ctx_id)
+{
+  ctx_ids[hid][ctx] = ctx_id;
+  ctx_names[ctx_id] = ctx;
+}
+
+unsigned int KernelTestMgr::get_context_id(unsigned int hid, const std::string& ctx)
+{
+  std::map<unsigned int, std::map<std::string, unsigned int> >::iterator hit = ctx_ids.find(hid);
+  if (hit == ctx_ids.end())
+    return 0;
+  std::map<std::string, unsigned int>::iterator it = hit->second.find(ctx);
+  return it == hit->second.end() ? 0 : it->second;
+}
+
+KernelTest* KernelTestMgr::find_test_id(unsigned int id, std::string* pctx)
+{
+  unsigned int test_id = KTF_ID_TEST(id), ctx_id = KTF_ID_CTX(id);
+
+  if (test_id >= tests_by_id.size() || !tests_by_id[test_id])
+    return NULL;
+  *pctx = ctx_id ? ctx_names[ctx_id] : std::string();
+  return tests_by_id[test_id];
 }
 
 
@@ -284,11 +389,27 @@ KernelTest* KernelTestMgr::find_test(const std::string&setname,
   size_t pos;
   log(KTF_DEBUG, "find test %s.%s\n", setname.c_str(), testname.c_str());
 
+  /* Test names as reported to the test framework are all in the instance table */
+  std::string key(setname);
+  key.append(".");
+  key.append(testname);
+  std::unordered_map<std::string, unsigned int>::iterator iit = instance_index.find(key);
+  if (iit != instance_index.end()) {
+    const instance& in = instances[iit->second];
+    *pctx = ctx_table[in.ctx];
+    return in.kt;
+  }
+
+  setmap::iterator sit = sets.find(setname);
+  if (sit == sets.end())
+    return NULL;
+  testmap& tests = sit->second.tests;
+
   /* Try direct lookup first: */
-  KernelTest* kt = sets[setname].tests[testname];
-  if (kt) {
+  testmap::iterator tit = tests.find(testname);
+  if (tit != tests.end()) {
     *pctx = std::string();
-    return kt;
+    return tit->second;
   }
 
   /* If we don't have any contexts set, no need to parse name: */
@@ -296,13 +417,13 @@ KernelTest* KernelTestMgr::find_test(const std::string&setname,
     return NULL;
 
   pos = testname.find_last_of('_');
-  while (pos >= 0) {
+  while (pos != std::string::npos) {
     std::string tname = testname.substr(0,pos);
-    std::string ctx = testname.substr(pos + 1, testname.npos);
-    *pctx = ctx;
-    kt = sets[setname].tests[tname];
-    if (kt)
-      return kt;
+    tit = tests.find(tname);
+    if (tit != tests.end()) {
+      *pctx = testname.substr(pos + 1, testname.npos);
+      return tit->second;
+    }
     /* context name might contain an '_' , iterate on: */
     pos = tname.find_last_of('_');
   }
@@ -344,11 +465,11 @@ void KernelTestMgr::add_wrapper(const std::string setname, const std::string tes
    * (sigh!) either the kernel tests have already been processed or we have to store
    * this object in wrapper for later insertion:
    */
-  KernelTest *kt = ts.tests[testname];
-  if (kt) {
+  testmap::iterator it = ts.tests.find(testname);
+  if (it != ts.tests.end()) {
     log(KTF_DEBUG_V, "Assigning user_test for %s.%s\n",
 	setname.c_str(), testname.c_str());
-    kt->user_test = tcb;
+    it->second->user_test = tcb;
   } else {
     log(KTF_DEBUG_V, "Set wrapper for %s.%s\n",
 	setname.c_str(), testname.c_str());
@@ -426,9 +547,69 @@ std::string ConfigurableContext::str_state()
   }
 }
 
+/* Data of at least this size is passed to the kernel in a shared buffer
+ * instead of being copied through the netlink message:
+ */
+static const size_t shm_min_size = 16384;
+
+bool shm_buf::alloc(size_t sz)
+{
+  if (kversion < KTF_VERSION_SHM || sz > KTF_SHM_MAX_SIZE)
+    return false;
+
+  std::string path = std::string("/sys/kernel/debug/") + KTF_SHM_FILE;
+  fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    log(KTF_INFO, "Cannot open %s (%d), copying data instead\n", path.c_str(), errno);
+    return false;
+  }
+  /* The kernel allocates the buffer with the size of the first mapping */
+  long pagesz = sysconf(_SC_PAGESIZE);
+  size_t map_sz = (sz + pagesz - 1) / pagesz * pagesz;
+  struct ktf_shm_info info;
+  addr = mmap(NULL, map_sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED || read(fd, &info, sizeof(info)) != sizeof(info)) {
+    log(KTF_INFO, "Cannot map %zu bytes of %s (%d), copying data instead\n",
+	map_sz, path.c_str(), errno);
+    if (addr != MAP_FAILED)
+      munmap(addr, map_sz);
+    close(fd);
+    fd = -1;
+    addr = NULL;
+    return false;
+  }
+  id = info.id;
+  size = map_sz;
+  return true;
+}
+
+void shm_buf::free()
+{
+  if (!addr)
+    return;
+  munmap(addr, size);
+  close(fd);
+  fd = -1;
+  addr = NULL;
+  size = 0;
+  id = 0;
+}
+
+/* Refer to len bytes at offset off of a shared buffer in a request */
+static void put_shm(struct nl_msg *msg, const shm_buf& shm, size_t off, size_t len)
+{
+  struct nlattr* nest = nla_nest_start(msg, KTF_A_SHM);
+
+  nla_put_u32(msg, KTF_S_ID, shm.id);
+  nla_put_u64(msg, KTF_S_OFF, off);
+  nla_put_u64(msg, KTF_S_LEN, len);
+  nla_nest_end(msg, nest);
+}
+
 int ConfigurableContext::Configure(void *data, size_t data_sz)
 {
   struct nl_msg *msg = nlmsg_alloc();
+  shm_buf shm;
   int err;
 
   log(KTF_INFO, "%s, data_sz %lu\n", name.c_str(), data_sz);
@@ -439,7 +620,12 @@ int ConfigurableContext::Configure(void *data, size_t data_sz)
   nla_put_string(msg, KTF_A_STR, name.c_str());
   nla_put_u32(msg, KTF_A_HID, handle_id);
   nla_put_string(msg, KTF_A_FILE, type_name.c_str());
-  nla_put(msg, KTF_A_DATA, data_sz, data);
+  /* The kernel is done with the data when it acknowledges the request */
+  if (data_sz >= shm_min_size && shm.alloc(data_sz)) {
+    memcpy(shm.addr, data, data_sz);
+    put_shm(msg, shm, 0, data_sz);
+  } else
+    nla_put(msg, KTF_A_DATA, data_sz, data);
 
   // Send message over netlink socket
   nl_send_auto_complete(sock, msg);
@@ -455,6 +641,7 @@ int ConfigurableContext::Configure(void *data, size_t data_sz)
   // This message receives no response beyond the error code.
   //
   err = nl_wait_for_ack(sock);
+  shm.free();
 
   if (!err && cfg_stat == ENODEV) {
     // Successfully added a new context, update it's state and
@@ -475,25 +662,34 @@ size_t get_priv_sz(KernelTest *kt)
   return kt->user_priv_sz;
 }
 
-int set_coverage(std::string module, unsigned int opts, bool enabled)
+static void send_cov_request(enum ktf_cmd_type type, std::string module,
+			     unsigned int opts, unsigned int gen = 0)
 {
   struct nl_msg *msg;
-  int err;
 
   msg = nlmsg_alloc();
   genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, family, 0, NLM_F_REQUEST,
               KTF_C_REQ, 1);
-  nla_put_u32(msg, KTF_A_TYPE,
-  	      enabled ? KTF_CT_COV_ENABLE : KTF_CT_COV_DISABLE);
+  nla_put_u32(msg, KTF_A_TYPE, type);
   nla_put_u32(msg, KTF_A_COVOPT, opts);
   nla_put_u64(msg, KTF_A_VERSION, KTF_VERSION_LATEST);
   nla_put_string(msg, KTF_A_MOD, module.c_str());
+  if (type == KTF_CT_COV_DELTA)
+    nla_put_u32(msg, KTF_A_GEN, gen);
 
   // Send message over netlink socket
   nl_send_auto_complete(sock, msg);
 
   // Free message
   nlmsg_free(msg);
+}
+
+static int cov_request(enum ktf_cmd_type type, std::string module,
+		       unsigned int opts)
+{
+  int err;
+
+  send_cov_request(type, module, opts);
 
   //Wait for acknowledgement:
   // This function also returns error status if the message
@@ -507,9 +703,67 @@ int set_coverage(std::string module, unsigned int opts, bool enabled)
   return err;
 }
 
-  KernelTest::KernelTest(const std::string& sn, const char* tn, unsigned int handle_id)
+int set_coverage(std::string module, unsigned int opts, bool enabled)
+{
+  return cov_request(enabled ? KTF_CT_COV_ENABLE : KTF_CT_COV_DISABLE,
+		     module, opts);
+}
+
+int reset_coverage(std::string module)
+{
+  return cov_request(KTF_CT_COV_RESET, module, 0);
+}
+
+static struct cov_state
+{
+  cov_state() : hits(NULL), stat(0), dropped(0), gen(0) {}
+
+  std::vector<cov_hit>* hits; /* Receives the records of the current snapshot */
+  int stat;
+  int dropped;
+  unsigned int gen; /* Generation of a delta snapshot */
+} cstate;
+
+static int recv_until_ack(struct nl_sock* s);
+
+static int cov_snapshot(enum ktf_cmd_type type, std::string module,
+			unsigned int gen, std::vector<cov_hit>& hits)
+{
+  int err;
+
+  cstate.hits = &hits;
+  cstate.stat = 0;
+  cstate.dropped = 0;
+  cstate.gen = gen;
+  send_cov_request(type, module, 0, gen);
+  err = recv_until_ack(sock);
+  cstate.hits = NULL;
+  if (cstate.dropped)
+    fprintf(stderr, "%d coverage records were lost on the way from the kernel\n",
+	    cstate.dropped);
+  return err < 0 ? err : cstate.stat;
+}
+
+int coverage_snapshot(std::string module, std::vector<cov_hit>& hits)
+{
+  return cov_snapshot(KTF_CT_COV_SNAPSHOT, module, 0, hits);
+}
+
+int coverage_delta(std::string module, unsigned int& gen, std::vector<cov_hit>& hits)
+{
+  int ret = cov_snapshot(KTF_CT_COV_DELTA, module, gen, hits);
+
+  if (!ret)
+    gen = cstate.gen;
+  return ret;
+}
+
+  KernelTest::KernelTest(const std::string& sn, const char* tn, unsigned int hid,
+			 unsigned int tid)
   : setname(sn),
     testname(tn),
+    handle_id(hid),
+    test_id(tid),
     setnum(0),
     testnum(0),
     user_priv(NULL),
@@ -527,13 +781,25 @@ int set_coverage(std::string module, unsigned int opts, bool enabled)
   setnum = ts.setnum;
   ts.tests[testname] = this;
 
-  if (!handle_id)
+  if (!handle_id) {
     ts.test_names.push_back(testname);
-  else {
+    kmgr().add_instance(setname, testname, this, std::string());
+    if (test_id)
+      ids[std::string()] = test_id;
+  } else {
     stringvec& ctxv = kmgr().get_contexts(handle_id);
-    for (stringvec::iterator it = ctxv.begin(); it != ctxv.end(); ++it)
-      ts.test_names.push_back(testname + "_" + *it);
+    for (stringvec::iterator it = ctxv.begin(); it != ctxv.end(); ++it) {
+      std::string tname = testname + "_" + *it;
+      unsigned int ctx_id = kmgr().get_context_id(handle_id, *it);
+
+      ts.test_names.push_back(tname);
+      kmgr().add_instance(setname, tname, this, *it);
+      if (test_id && ctx_id)
+	ids[*it] = KTF_ID(test_id, ctx_id);
+    }
   }
+  if (test_id)
+    kmgr().add_test_id(test_id, this);
   testnum = ts.tests.size();
 
   wrappermap::iterator hit = ts.wrapper.find(testname);
@@ -551,14 +817,26 @@ int set_coverage(std::string module, unsigned int opts, bool enabled)
 
 KernelTest::~KernelTest()
 {
-  if (user_priv)
+  if (user_shm.addr)
+    user_shm.free();
+  else if (user_priv)
     free(user_priv);
 }
 
+unsigned int KernelTest::get_id(const std::string& ctx)
+{
+  std::map<std::string, unsigned int>::iterator it = ids.find(ctx);
+  return it == ids.end() ? 0 : it->second;
+}
+
 void* KernelTest::get_priv(size_t p_sz)
 {
   if (!user_priv) {
-    user_priv = malloc(p_sz);
+    /* Large data is filled in place in a buffer shared with the kernel */
+    if (p_sz >= shm_min_size && user_shm.alloc(p_sz))
+      user_priv = user_shm.addr;
+    else
+      user_priv = malloc(p_sz);
     if (user_priv)
       user_priv_sz = p_sz;
   }
@@ -569,6 +847,12 @@ static int parse_cb(struct nl_msg *msg, void *arg);
 static int debug_cb(struct nl_msg *msg, void *arg);
 static int error_cb(struct nl_msg *msg, void *arg);
 
+/* Test results may be streamed from the kernel as a multipart response.
+ * The kernel cannot send more parts than fits in our receive buffer
+ * while the test runs, so ask for a generous one:
+ */
+static const int rcvbuf_size = 4 * 1024 * 1024;
+
 int nl_connect(void)
 {
   /* Allocate a new netlink socket */
@@ -592,12 +876,35 @@ int nl_connect(void)
     exit(1);
   }
 
+  if (nl_socket_set_buffer_size(sock, rcvbuf_size, 0) < 0)
+    log(KTF_INFO, "Unable to set receive buffer size to %d\n", rcvbuf_size);
+
   /* Specify the generic callback functions for messages */
   nl_socket_modify_cb(sock, NL_CB_VALID, NL_CB_CUSTOM, parse_cb, NULL);
   nl_socket_modify_cb(sock, NL_CB_INVALID, NL_CB_CUSTOM, error_cb, NULL);
   return 0;
 }
 
+/* Open an additional socket to the (already resolved) ktf family.
+ * Responses on this socket are passed to parse_cb with @arg as argument:
+ */
+static struct nl_sock* nl_open(void* arg)
+{
+  struct nl_sock* s = nl_socket_alloc();
+
+  if (!s)
+    return NULL;
+  if (genl_connect(s)) {
+    nl_socket_free(s);
+    return NULL;
+  }
+  if (nl_socket_set_buffer_size(s, rcvbuf_size, 0) < 0)
+    log(KTF_INFO, "Unable to set receive buffer size to %d\n", rcvbuf_size);
+  nl_socket_modify_cb(s, NL_CB_VALID, NL_CB_CUSTOM, parse_cb, arg);
+  nl_socket_modify_cb(s, NL_CB_INVALID, NL_CB_CUSTOM, error_cb, NULL);
+  return s;
+}
+
 
 void default_test_handler(int result,  const char* file, int line, const char* report)
 {
@@ -610,13 +917,116 @@ void default_test_handler(int result,  const char* file, int line, const char* r
 
 test_handler handle_test = default_test_handler;
 
+void default_bench_handler(const bench_stats& bs)
+{
+  fprintf(stderr, "default_bench_handler: %llu x %llu ops, mean %llu ps/op\n",
+	  bs.batches, bs.iterations, bs.mean_ps);
+}
+
+bench_handler handle_bench = default_bench_handler;
+
+void default_time_handler(const test_time& tt)
+{
+}
+
+time_handler handle_time = default_time_handler;
+
+void default_perf_handler(const perf_counts& pc)
+{
+}
+
+perf_handler handle_perf = default_perf_handler;
+
+void default_sweep_handler(const sweep_stats& ss)
+{
+  fprintf(stderr, "default_sweep_handler: %lu widths\n", ss.points.size());
+}
+
+sweep_handler handle_sweep = default_sweep_handler;
+
+void default_lock_handler(const lock_profile& lp)
+{
+}
+
+lock_handler handle_locks = default_lock_handler;
+
+/* Names of the KTF_PERF_* events, in bit order */
+static const char* perf_event_names[] = {
+  "cycles", "instructions", "cache-misses", "branch-misses"
+};
+
+static const size_t perf_nr_events = sizeof(perf_event_names) / sizeof(perf_event_names[0]);
+
+/* KTF_PERF_* events to count while running tests */
+static unsigned int perf_events = 0;
+
+int set_perf_events(const std::string& events)
+{
+  unsigned int mask = 0;
+  size_t pos = 0, end, i;
+
+  while (pos < events.size()) {
+    end = events.find(',', pos);
+    if (end == std::string::npos)
+      end = events.size();
+    std::string e = events.substr(pos, end - pos);
+    if (e == "all")
+      mask |= (1 << perf_nr_events) - 1;
+    else if (e == "locks")
+      mask |= KTF_PERF_LOCKS;
+    else if (!e.empty()) {
+      for (i = 0; i < perf_nr_events; i++)
+	if (e == perf_event_names[i])
+	  break;
+      if (i == perf_nr_events) {
+	fprintf(stderr, "Unknown performance event \"%s\"\n", e.c_str());
+	return -EINVAL;
+      }
+      mask |= 1 << i;
+    }
+    pos = end + 1;
+  }
+  perf_events = mask;
+  return 0;
+}
+
 bool setup(test_handler ht)
 {
+  const char* perf = getenv("KTF_PERF");
+
   ktf_debug_init();
   handle_test = ht;
+  if (perf)
+    set_perf_events(perf);
+  baseline_init();
   return nl_connect() == 0;
 }
 
+void set_bench_handler(bench_handler hb)
+{
+  handle_bench = hb;
+}
+
+void set_time_handler(time_handler ht)
+{
+  handle_time = ht;
+}
+
+void set_perf_handler(perf_handler hp)
+{
+  handle_perf = hp;
+}
+
+void set_sweep_handler(sweep_handler hs)
+{
+  handle_sweep = hs;
+}
+
+void set_lock_handler(lock_handler hl)
+{
+  handle_locks = hl;
+}
+
 
 configurator do_context_configure = NULL;
 
@@ -625,11 +1035,205 @@ void set_configurator(configurator c)
   do_context_configure = c;
 }
 
+/* A query response may arrive as several parts of a netlink dump.
+ * Context configuration talks to the kernel over the same socket and must
+ * happen before the tests get added, so the list of tests is buffered
+ * until the whole response has been received:
+ */
+struct query_entry
+{
+  std::string setname;
+  std::string testname; /* Empty for the test set entry itself */
+  unsigned int handle_id;
+  unsigned int test_id;
+};
+
+/* Current value of the monotonic clock in ns */
+static unsigned long long monotonic_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct query_state
+{
+  bool seen;            /* Got a query response from the kernel */
+  bool compatible;      /* ..and the kernel version is compatible */
+  bool has_gen;         /* ..and the generation of its tests, gen */
+  unsigned int gen;
+  bool record;          /* Keep the response messages in parts */
+  bool dry;             /* Only parse the response, for time_query() */
+  std::vector<query_entry> entries;
+  std::vector<std::string> parts;
+} qstate;
+
+/* If KTF_QUERY_CACHE names a file, the messages of the last full query
+ * response are kept there, along with the generation of the kernel's tests
+ * they describe. As long as the kernel reports the same generation, its
+ * response is just that generation, and the cached messages are parsed
+ * instead:
+ */
+static const char query_cache_magic[] = "KTFQ";
+
+struct query_cache_hdr
+{
+  char magic[4];
+  uint64_t version;  /* KTF_VERSION_LATEST of the writer */
+  uint32_t gen;
+  uint32_t nparts;
+};
+
+static bool load_query_cache(const char* path, unsigned int& gen, std::vector<std::string>& parts)
+{
+  FILE* f = fopen(path, "r");
+  query_cache_hdr hdr;
+  bool ok;
+
+  if (!f)
+    return false;
+  ok = fread(&hdr, sizeof(hdr), 1, f) == 1 &&
+    !memcmp(hdr.magic, query_cache_magic, sizeof(hdr.magic)) &&
+    hdr.version == KTF_VERSION_LATEST;
+  for (uint32_t i = 0; ok && i < hdr.nparts; i++) {
+    uint32_t len;
+
+    ok = fread(&len, sizeof(len), 1, f) == 1 && len >= NLMSG_HDRLEN;
+    if (ok) {
+      std::string part(len, '\0');
+      ok = fread(&part[0], len, 1, f) == 1;
+      parts.push_back(part);
+    }
+  }
+  fclose(f);
+  if (!ok) {
+    log(KTF_INFO, "Ignoring invalid query cache %s\n", path);
+    parts.clear();
+    return false;
+  }
+  gen = hdr.gen;
+  return true;
+}
+
+static void save_query_cache(const char* path, unsigned int gen, const std::vector<std::string>& parts)
+{
+  std::string tmp = std::string(path) + ".tmp";
+  FILE* f = fopen(tmp.c_str(), "w");
+  query_cache_hdr hdr;
+  bool ok;
+
+  if (!f) {
+    log(KTF_INFO, "Unable to write query cache %s: %s\n", tmp.c_str(), strerror(errno));
+    return;
+  }
+  memcpy(hdr.magic, query_cache_magic, sizeof(hdr.magic));
+  hdr.version = KTF_VERSION_LATEST;
+  hdr.gen = gen;
+  hdr.nparts = parts.size();
+  ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+  for (std::vector<std::string>::const_iterator it = parts.begin(); ok && it != parts.end(); ++it) {
+    uint32_t len = it->size();
+    ok = fwrite(&len, sizeof(len), 1, f) == 1 && fwrite(it->data(), len, 1, f) == 1;
+  }
+  if (fclose(f) || !ok || rename(tmp.c_str(), path)) {
+    log(KTF_INFO, "Unable to write query cache %s\n", path);
+    unlink(tmp.c_str());
+  }
+}
+
+/* Parse the cached response messages as if just received */
+static void replay_query(std::vector<std::string>& parts)
+{
+  std::vector<std::string>::iterator it;
+
+  for (it = parts.begin(); it != parts.end(); ++it) {
+    struct nl_msg* msg = nlmsg_convert((struct nlmsghdr*)&(*it)[0]);
+
+    if (!msg)
+      break;
+    parse_cb(msg, NULL);
+    nlmsg_free(msg);
+  }
+}
+
+static void apply_query()
+{
+  // Now we know enough about contexts and type_ids to actually configure
+  // any contexts that needs to be configured, and this must be
+  // done before the list of tests gets spanned out because addition
+  // of new contexts can lead to more tests being "generated":
+  //
+  if (do_context_configure)
+    do_context_configure();
+
+  /* Each test has at least one instance - more with contexts */
+  kmgr().reserve_instances(qstate.entries.size());
+
+  std::vector<query_entry>::iterator it;
+  for (it = qstate.entries.begin(); it != qstate.entries.end(); ++it) {
+    if (it->testname.empty())
+      kmgr().find_add_set(it->setname);
+    else
+      kmgr().add_test(it->setname, it->testname.c_str(), it->handle_id, it->test_id);
+  }
+  qstate.entries.clear();
+}
+
+/* Query using a dump, which scales to any number of tests.
+ * With a cached generation gen, the kernel only responds with the
+ * tests if it has a different generation:
+ */
+static int query_dump(const unsigned int* gen)
+{
+  struct nl_msg *msg;
+
+  msg = nlmsg_alloc();
+  genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, family, 0, NLM_F_REQUEST | NLM_F_DUMP,
+	      KTF_C_REQ, 1);
+  nla_put_u32(msg, KTF_A_TYPE, KTF_CT_QUERY);
+  nla_put_u64(msg, KTF_A_VERSION, KTF_VERSION_LATEST);
+  if (gen)
+    nla_put_u32(msg, KTF_A_GEN, *gen);
+
+  // Send message over netlink socket
+  nl_send_auto_complete(sock, msg);
+
+  // Free message
+  nlmsg_free(msg);
+
+  // Receive all the parts - a successful dump is not acknowledged,
+  // but kernels without dump support for queries respond with an error:
+  return nl_recvmsgs_default(sock);
+}
+
 /* Query kernel for available tests in index order */
 stringvec& query_testsets()
 {
   struct nl_msg *msg;
   int err;
+  const char* cache = getenv("KTF_QUERY_CACHE");
+  std::vector<std::string> parts;
+  unsigned int gen = 0;
+  bool cached = cache && load_query_cache(cache, gen, parts);
+
+  qstate = query_state();
+  qstate.record = cache != NULL;
+  err = query_dump(cached ? &gen : NULL);
+  if (err >= 0 && qstate.seen) {
+    if (cached && qstate.has_gen && qstate.gen == gen) {
+      log(KTF_INFO, "Using cached query from %s (generation %u)\n", cache, gen);
+      qstate = query_state();
+      replay_query(parts);
+    } else if (cache && qstate.has_gen && qstate.compatible)
+      save_query_cache(cache, qstate.gen, qstate.parts);
+    qstate.parts.clear();
+    if (qstate.compatible)
+      apply_query();
+    return kmgr().get_set_names();
+  }
+  log(KTF_INFO, "Kernel does not support query dump (%d) - using plain query\n", err);
+  qstate = query_state();
 
   msg = nlmsg_alloc();
   genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, family, 0, NLM_F_REQUEST,
@@ -658,6 +1262,26 @@ stringvec& query_testsets()
   return kmgr().get_set_names();
 }
 
+int time_query(unsigned long long& ns)
+{
+  std::vector<query_entry>::iterator it;
+  unsigned long long start;
+  int err, tests = 0;
+
+  qstate = query_state();
+  qstate.dry = true;
+  start = monotonic_ns();
+  err = query_dump(NULL);
+  ns = monotonic_ns() - start;
+  if (err >= 0 && !(qstate.seen && qstate.compatible))
+    err = -EPROTO;
+  for (it = qstate.entries.begin(); it != qstate.entries.end(); ++it)
+    if (!it->testname.empty())
+      tests++;
+  qstate = query_state();
+  return err < 0 ? err : tests;
+}
+
 stringvec get_test_names()
 {
   return kmgr().get_test_names();
@@ -686,53 +1310,528 @@ void run_test(KernelTest* kt, std::string& ctx)
     run(kt, ctx);
 }
 
-/* Run the kernel test */
-void run(KernelTest* kt, std::string context)
+static int ack_handler(struct nl_msg *msg, void *arg)
 {
-  struct nl_msg *msg;
-
-  log(KTF_DEBUG_V, "START kernel test (%ld,%ld): %s\n", kt->setnum,
-		kt->testnum, kt->name.c_str());
-
-  msg = nlmsg_alloc();
-  genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, family, 0, NLM_F_REQUEST,
-	      KTF_C_REQ, 1);
-  nla_put_u32(msg, KTF_A_TYPE, KTF_CT_RUN);
-  nla_put_u64(msg, KTF_A_VERSION, KTF_VERSION_LATEST);
-  nla_put_string(msg, KTF_A_SNAM, kt->setname.c_str());
-  nla_put_string(msg, KTF_A_TNAM, kt->testname.c_str());
-
-  if (!context.empty())
-    nla_put_string(msg, KTF_A_STR, context.c_str());
+  *(bool*)arg = true;
+  return NL_STOP;
+}
 
-  /* Send any test specific out-of-band data */
-  if (kt->user_priv)
-    nla_put(msg, KTF_A_DATA, kt->user_priv_sz, kt->user_priv);
+/* Receive a response, which might come in several parts,
+ * up to and including the final acknowledgement:
+ */
+static int recv_until_ack(struct nl_sock* s)
+{
+  bool acked = false;
+  struct nl_cb *s_cb = nl_socket_get_cb(s);
+  struct nl_cb *cb = nl_cb_clone(s_cb);
+  int err = 0;
+
+  nl_cb_put(s_cb);
+  if (!cb)
+    return -NLE_NOMEM;
+  nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, ack_handler, &acked);
+  while (!acked && err >= 0)
+    err = nl_recvmsgs(s, cb);
+  nl_cb_put(cb);
+  return err;
+}
 
-  // Send message over netlink socket
-  nl_send_auto_complete(sock, msg);
+/* Results from a batch run, kept until each test is run from the framework */
+struct result_record
+{
+  int result;
+  std::string file;
+  int line;
+  std::string report;
+};
 
-  // Free message
-  nlmsg_free(msg);
+struct batch_result
+{
+  int stat;
+  std::vector<result_record> records;
+  std::vector<bench_stats> benches;
+  std::vector<test_time> times;
+  std::vector<perf_counts> perfs;
+  std::vector<sweep_stats> sweeps;
+  std::vector<lock_profile> locks;
+};
 
-  // Wait for acknowledgement - otherwise
-  // nl_recvmsg_default will sometimes take the ack for the next message..
-  int err = nl_wait_for_ack(sock);
-  if (err < 0) {
-    errno = -err;
-    return;
-  }
+static struct batch_state
+{
+  batch_state() : unsupported(false), dropped(0) {}
+
+  std::map<std::string, batch_result> results; /* Indexed by batch_key() */
+  std::vector<result_record> pending; /* Results of the test being parsed */
+  std::vector<bench_stats> pending_benches;
+  std::vector<test_time> pending_times;
+  std::vector<perf_counts> pending_perfs;
+  std::vector<sweep_stats> pending_sweeps;
+  std::vector<lock_profile> pending_locks;
+  stringvec received; /* Keys of the tests received in the current batch */
+  bool unsupported;
+  int dropped;
+} bstate;
+
+/* Run time of the test being run from the main thread, reported by run()
+ * along with the round trip time of the request:
+ */
+static struct run_time_state
+{
+  run_time_state() : valid(false), perf_valid(false) {}
 
-  // Wait for the answer and receive it
-  nl_recvmsgs_default(sock);
+  test_time time;
+  bool valid;
+  perf_counts perf;
+  bool perf_valid;
+} rtstate;
 
-  log(KTF_DEBUG_V, "END   ktf::run_kernel_test %s\n", kt->name.c_str());
+static std::string batch_key(const std::string& setname, const std::string& testname,
+			     const std::string& ctx)
+{
+  std::string key = setname + "." + testname;
+  if (!ctx.empty())
+    key += "_" + ctx;
+  return key;
 }
 
-
-void configure_context(const std::string context, const std::string type_name, void *data, size_t data_sz)
+bool batch_supported()
 {
-  context_vector ct = kmgr().find_contexts(context, type_name);
+  return !bstate.unsupported;
+}
+
+/* Tests run asynchronously from a set of worker threads, each with its own
+ * socket, since the kernel runs a test in the context of the sending thread.
+ * The results are stored with the batch results and reported from the
+ * main thread when the test is run via run_test:
+ */
+struct async_job
+{
+  KernelTest* kt;
+  std::string ctx;
+  run_completion done;
+  void* arg;
+};
+
+struct async_worker
+{
+  struct nl_sock* s;
+  pthread_t thread;
+  batch_result result; /* Results of the test currently running */
+};
+
+static struct async_state
+{
+  async_state() : nsock(0), stopping(false)
+  {
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&queued, NULL);
+    pthread_cond_init(&completed, NULL);
+  }
+
+  ~async_state();
+
+  pthread_mutex_t lock; /* Protects the below and bstate.results */
+  pthread_cond_t queued;
+  pthread_cond_t completed;
+  std::deque<async_job> queue;
+  std::set<std::string> inflight; /* Keys of queued and running tests */
+  std::vector<async_worker*> workers;
+  unsigned int nsock;
+  bool stopping;
+} astate;
+
+async_state::~async_state()
+{
+  pthread_mutex_lock(&lock);
+  stopping = true;
+  pthread_cond_broadcast(&queued);
+  pthread_mutex_unlock(&lock);
+  for (std::vector<async_worker*>::iterator it = workers.begin(); it != workers.end(); ++it) {
+    pthread_join((*it)->thread, NULL);
+    nl_socket_free((*it)->s);
+    delete *it;
+  }
+}
+
+bool has_batch_result(KernelTest* kt, const std::string& ctx)
+{
+  std::string key = batch_key(kt->setname, kt->testname, ctx);
+
+  pthread_mutex_lock(&astate.lock);
+  bool found = bstate.results.count(key) > 0 || astate.inflight.count(key) > 0;
+  pthread_mutex_unlock(&astate.lock);
+  return found;
+}
+
+static int send_batch(struct nl_msg *msg)
+{
+  int err;
+
+  bstate.received.clear();
+  bstate.pending.clear();
+  bstate.pending_benches.clear();
+  bstate.pending_times.clear();
+  bstate.pending_perfs.clear();
+  bstate.pending_sweeps.clear();
+  bstate.pending_locks.clear();
+  bstate.dropped = 0;
+
+  nl_send_auto_complete(sock, msg);
+  nlmsg_free(msg);
+
+  err = recv_until_ack(sock);
+  if (err < 0) {
+    /* Most likely a kernel without batch support - avoid trying again */
+    log(KTF_INFO, "Batch run failed (%d) - running tests one by one\n", err);
+    bstate.unsupported = true;
+  }
+  if (err < 0 || bstate.dropped) {
+    /* We cannot tell which tests lost results, so rather run them again */
+    if (bstate.dropped)
+      fprintf(stderr, "Note: %d results lost in batch run - running tests again\n",
+	      bstate.dropped);
+    pthread_mutex_lock(&astate.lock);
+    for (stringvec::iterator it = bstate.received.begin(); it != bstate.received.end(); ++it)
+      bstate.results.erase(*it);
+    pthread_mutex_unlock(&astate.lock);
+  }
+  bstate.received.clear();
+  return err;
+}
+
+static struct nl_msg *batch_msg(size_t sz)
+{
+  struct nl_msg *msg = nlmsg_alloc_size(sz + 1024);
+
+  if (!msg)
+    return NULL;
+  genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, family, 0, NLM_F_REQUEST,
+	      KTF_C_REQ, 1);
+  nla_put_u32(msg, KTF_A_TYPE, KTF_CT_RUN_BATCH);
+  nla_put_u64(msg, KTF_A_VERSION, KTF_VERSION_LATEST);
+  if (perf_events)
+    nla_put_u32(msg, KTF_A_PERFOPT, perf_events);
+  return msg;
+}
+
+int run_batch(const std::vector<test_instance>& tests)
+{
+  std::vector<test_instance>::const_iterator it;
+  struct nlattr *list, *entry;
+  struct nl_msg *msg;
+  size_t sz = 0;
+
+  for (it = tests.begin(); it != tests.end(); ++it)
+    sz += 4 * NLA_HDRLEN + it->first->setname.size() + it->first->testname.size() +
+      it->second.size() + 12;
+
+  msg = batch_msg(sz);
+  if (!msg)
+    return -NLE_NOMEM;
+  log(KTF_DEBUG, "Running batch of %lu tests\n", tests.size());
+
+  list = nla_nest_start(msg, KTF_A_LIST);
+  for (it = tests.begin(); it != tests.end(); ++it) {
+    unsigned int id = it->first->get_id(it->second);
+
+    entry = nla_nest_start(msg, KTF_A_TEST);
+    if (id)
+      nla_put_u32(msg, KTF_A_ID, id);
+    else {
+      nla_put_string(msg, KTF_A_SNAM, it->first->setname.c_str());
+      nla_put_string(msg, KTF_A_TNAM, it->first->testname.c_str());
+      if (!it->second.empty())
+	nla_put_string(msg, KTF_A_STR, it->second.c_str());
+    }
+    nla_nest_end(msg, entry);
+  }
+  nla_nest_end(msg, list);
+  return send_batch(msg);
+}
+
+int run_batch(const std::string& pattern)
+{
+  struct nl_msg *msg = batch_msg(pattern.size());
+
+  if (!msg)
+    return -NLE_NOMEM;
+  log(KTF_DEBUG, "Running batch of tests matching %s\n", pattern.c_str());
+  nla_put_string(msg, KTF_A_STR, pattern.c_str());
+  return send_batch(msg);
+}
+
+/* Report the results of a test from a previous batch or asynchronous run, if any.
+ * If the test is still running asynchronously, wait for it to complete first:
+ */
+static bool replay_batch_result(KernelTest* kt, const std::string& context)
+{
+  std::map<std::string, batch_result>::iterator bit;
+  std::string key = batch_key(kt->setname, kt->testname, context);
+  batch_result br;
+  bool found = false;
+
+  pthread_mutex_lock(&astate.lock);
+  while (astate.inflight.count(key))
+    pthread_cond_wait(&astate.completed, &astate.lock);
+  bit = bstate.results.find(key);
+  if (bit != bstate.results.end()) {
+    br.stat = bit->second.stat;
+    br.records.swap(bit->second.records);
+    br.benches.swap(bit->second.benches);
+    br.times.swap(bit->second.times);
+    br.perfs.swap(bit->second.perfs);
+    br.sweeps.swap(bit->second.sweeps);
+    br.locks.swap(bit->second.locks);
+    bstate.results.erase(bit);
+    found = true;
+  }
+  pthread_mutex_unlock(&astate.lock);
+  if (!found)
+    return false;
+
+  log(KTF_DEBUG_V, "REPLAY kernel test results: %s\n", kt->name.c_str());
+  std::vector<result_record>::iterator it;
+  for (it = br.records.begin(); it != br.records.end(); ++it)
+    handle_test(it->result, it->file.c_str(), it->line, it->report.c_str());
+  std::vector<bench_stats>::iterator bs;
+  for (bs = br.benches.begin(); bs != br.benches.end(); ++bs)
+    handle_bench(*bs);
+  std::vector<test_time>::iterator tt;
+  for (tt = br.times.begin(); tt != br.times.end(); ++tt)
+    handle_time(*tt);
+  std::vector<perf_counts>::iterator pc;
+  for (pc = br.perfs.begin(); pc != br.perfs.end(); ++pc)
+    handle_perf(*pc);
+  std::vector<sweep_stats>::iterator ss;
+  for (ss = br.sweeps.begin(); ss != br.sweeps.end(); ++ss)
+    handle_sweep(*ss);
+  std::vector<lock_profile>::iterator lp;
+  for (lp = br.locks.begin(); lp != br.locks.end(); ++lp)
+    handle_locks(*lp);
+  if (br.stat)
+    fprintf(stderr, "Failed to execute test in kernel - status %d\n", br.stat);
+  return true;
+}
+
+/* Build a request to run a kernel test */
+static struct nl_msg* run_msg(KernelTest* kt, const std::string& context)
+{
+  struct nl_msg *msg = nlmsg_alloc();
+
+  if (!msg)
+    return NULL;
+  genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, family, 0, NLM_F_REQUEST,
+	      KTF_C_REQ, 1);
+  nla_put_u32(msg, KTF_A_TYPE, KTF_CT_RUN);
+  nla_put_u64(msg, KTF_A_VERSION, KTF_VERSION_LATEST);
+  if (perf_events)
+    nla_put_u32(msg, KTF_A_PERFOPT, perf_events);
+
+  /* Use the numeric id if the kernel gave us one */
+  unsigned int id = kt->get_id(context);
+  if (id)
+    nla_put_u32(msg, KTF_A_ID, id);
+  else {
+    nla_put_string(msg, KTF_A_SNAM, kt->setname.c_str());
+    nla_put_string(msg, KTF_A_TNAM, kt->testname.c_str());
+
+    if (!context.empty())
+      nla_put_string(msg, KTF_A_STR, context.c_str());
+  }
+
+  /* Send any test specific out-of-band data, or where it is */
+  if (kt->user_shm.addr)
+    put_shm(msg, kt->user_shm, 0, kt->user_priv_sz);
+  else if (kt->user_priv)
+    nla_put(msg, KTF_A_DATA, kt->user_priv_sz, kt->user_priv);
+  return msg;
+}
+
+static void* async_run(void* arg)
+{
+  async_worker* w = (async_worker*)arg;
+
+  pthread_mutex_lock(&astate.lock);
+  for (;;) {
+    while (astate.queue.empty() && !astate.stopping)
+      pthread_cond_wait(&astate.queued, &astate.lock);
+    if (astate.stopping)
+      break;
+    async_job job = astate.queue.front();
+    astate.queue.pop_front();
+    pthread_mutex_unlock(&astate.lock);
+
+    log(KTF_DEBUG_V, "START async kernel test: %s\n", job.kt->name.c_str());
+    w->result.stat = 0;
+    w->result.records.clear();
+    w->result.benches.clear();
+    w->result.times.clear();
+    w->result.perfs.clear();
+    w->result.sweeps.clear();
+    w->result.locks.clear();
+    struct nl_msg *msg = run_msg(job.kt, job.ctx);
+    int err = msg ? nl_send_auto_complete(w->s, msg) : -NLE_NOMEM;
+    if (msg)
+      nlmsg_free(msg);
+    if (err >= 0)
+      err = recv_until_ack(w->s);
+    if (err < 0 && !w->result.stat)
+      w->result.stat = err;
+    log(KTF_DEBUG_V, "END   async kernel test: %s\n", job.kt->name.c_str());
+
+    std::string key = batch_key(job.kt->setname, job.kt->testname, job.ctx);
+    pthread_mutex_lock(&astate.lock);
+    batch_result& br = bstate.results[key];
+    br.stat = w->result.stat;
+    br.records.swap(w->result.records);
+    br.benches.swap(w->result.benches);
+    br.times.swap(w->result.times);
+    br.perfs.swap(w->result.perfs);
+    br.sweeps.swap(w->result.sweeps);
+    br.locks.swap(w->result.locks);
+    astate.inflight.erase(key);
+    pthread_cond_broadcast(&astate.completed);
+    pthread_mutex_unlock(&astate.lock);
+
+    if (job.done)
+      job.done(job.kt, job.ctx, w->result.stat, job.arg);
+    pthread_mutex_lock(&astate.lock);
+  }
+  pthread_mutex_unlock(&astate.lock);
+  return NULL;
+}
+
+/* Start the worker threads on first use. Called with astate.lock held */
+static bool async_start()
+{
+  if (!astate.workers.empty())
+    return true;
+  if (astate.nsock < 1)
+    return false;
+  for (unsigned int i = 0; i < astate.nsock; i++) {
+    async_worker* w = new async_worker();
+
+    w->s = nl_open(&w->result);
+    if (!w->s) {
+      delete w;
+      break;
+    }
+    if (pthread_create(&w->thread, NULL, async_run, w)) {
+      nl_socket_free(w->s);
+      delete w;
+      break;
+    }
+    astate.workers.push_back(w);
+  }
+  log(KTF_INFO, "Running tests asynchronously on %lu sockets\n", astate.workers.size());
+  if (astate.workers.empty())
+    astate.nsock = 0;
+  return !astate.workers.empty();
+}
+
+void set_async_sockets(unsigned int n)
+{
+  pthread_mutex_lock(&astate.lock);
+  if (astate.workers.empty())
+    astate.nsock = n;
+  pthread_mutex_unlock(&astate.lock);
+}
+
+int run_async(KernelTest* kt, const std::string& ctx, run_completion done, void* arg)
+{
+  std::string key = batch_key(kt->setname, kt->testname, ctx);
+  async_job job;
+  int ret = 0;
+
+  /* Same restriction as for batches: Tests with a user level part
+   * or out-of-band data must be run from the test framework:
+   */
+  if (kt->user_test || kt->user_priv)
+    return -EINVAL;
+
+  job.kt = kt;
+  job.ctx = ctx;
+  job.done = done;
+  job.arg = arg;
+
+  pthread_mutex_lock(&astate.lock);
+  if (!async_start())
+    ret = -ENOTCONN;
+  else if (astate.inflight.count(key) || bstate.results.count(key))
+    ret = -EBUSY;
+  else {
+    astate.queue.push_back(job);
+    astate.inflight.insert(key);
+    pthread_cond_signal(&astate.queued);
+  }
+  pthread_mutex_unlock(&astate.lock);
+  return ret;
+}
+
+size_t async_pending()
+{
+  pthread_mutex_lock(&astate.lock);
+  size_t n = astate.inflight.size();
+  pthread_mutex_unlock(&astate.lock);
+  return n;
+}
+
+void run_wait()
+{
+  pthread_mutex_lock(&astate.lock);
+  while (!astate.inflight.empty())
+    pthread_cond_wait(&astate.completed, &astate.lock);
+  pthread_mutex_unlock(&astate.lock);
+}
+
+/* Run the kernel test */
+void run(KernelTest* kt, std::string context)
+{
+  unsigned long long start;
+  struct nl_msg *msg;
+
+  /* Tests with out-of-band data are never part of a batch */
+  if (!kt->user_priv && replay_batch_result(kt, context))
+    return;
+
+  log(KTF_DEBUG_V, "START kernel test (%ld,%ld): %s\n", kt->setnum,
+		kt->testnum, kt->name.c_str());
+
+  msg = run_msg(kt, context);
+  if (!msg) {
+    errno = ENOMEM;
+    return;
+  }
+
+  // Send message over netlink socket
+  rtstate.valid = rtstate.perf_valid = false;
+  start = monotonic_ns();
+  nl_send_auto_complete(sock, msg);
+
+  // Free message
+  nlmsg_free(msg);
+
+  // Receive all parts of the answer, and the final ack - otherwise
+  // a later receive will sometimes take the ack for the next message..
+  int err = recv_until_ack(sock);
+  if (err < 0) {
+    errno = -err;
+    return;
+  }
+  if (rtstate.valid) {
+    rtstate.time.request_ns = monotonic_ns() - start;
+    handle_time(rtstate.time);
+  }
+  if (rtstate.perf_valid)
+    handle_perf(rtstate.perf);
+
+  log(KTF_DEBUG_V, "END   ktf::run_kernel_test %s\n", kt->name.c_str());
+}
+
+
+void configure_context(const std::string context, const std::string type_name, void *data, size_t data_sz)
+{
+  context_vector ct = kmgr().find_contexts(context, type_name);
   ASSERT_GE(ct.size(), 1UL) << " - no context found named " << context;
   ASSERT_EQ(ct.size(), 1UL) << " - More than one context named " << context
 			  << " - use KTF_CONTEXT_CFG_FOR_TEST to uniquely identify context.";
@@ -740,6 +1839,187 @@ void configure_context(const std::string context, const std::string type_name, v
   ASSERT_EQ(ct[0]->Configure(data, data_sz), 0);
 }
 
+/* State of a batch configuration while the reply is parsed */
+static struct ctx_cfg_state
+{
+  ctx_cfg_state() : cfgs(NULL), next(0) {}
+
+  std::vector<context_cfg>* cfgs;
+  std::vector<size_t> sent; /* Index in cfgs of each entry of the request */
+  context_vector contexts;  /* The context of each entry of the request */
+  size_t next; /* Entry of the next status in the reply */
+} ccstate;
+
+static int recv_until_ack(struct nl_sock* s);
+
+static struct nl_msg* ctx_cfg_batch_msg(std::vector<context_cfg>& cfgs, shm_buf& shm)
+{
+  size_t sz = 0, shm_sz = 0;
+
+  for (size_t i = 0; i < ccstate.sent.size(); i++) {
+    context_cfg& c = cfgs[ccstate.sent[i]];
+    ConfigurableContext* ctx = ccstate.contexts[i];
+
+    sz += 8 * NLA_HDRLEN + ctx->name.size() + ctx->type_name.size() + 32;
+    if (c.data_sz >= shm_min_size)
+      shm_sz += c.data_sz;
+    else
+      sz += c.data_sz;
+  }
+  /* Large data goes in a buffer shared by the entries */
+  if (shm_sz && !shm.alloc(shm_sz)) {
+    sz += shm_sz;
+    shm_sz = 0;
+  }
+
+  struct nl_msg *msg = nlmsg_alloc_size(sz + 1024);
+  if (!msg)
+    return NULL;
+  genlmsg_put(msg, NL_AUTO_PID, NL_AUTO_SEQ, family, 0, NLM_F_REQUEST,
+	      KTF_C_REQ, 1);
+  nla_put_u32(msg, KTF_A_TYPE, KTF_CT_CTX_CFG_BATCH);
+  nla_put_u64(msg, KTF_A_VERSION, KTF_VERSION_LATEST);
+
+  struct nlattr* list = nla_nest_start(msg, KTF_A_LIST);
+  size_t off = 0;
+  for (size_t i = 0; i < ccstate.sent.size(); i++) {
+    context_cfg& c = cfgs[ccstate.sent[i]];
+    ConfigurableContext* ctx = ccstate.contexts[i];
+    struct nlattr* entry = nla_nest_start(msg, KTF_A_CTX);
+
+    nla_put_u32(msg, KTF_A_HID, ctx->handle_id);
+    nla_put_string(msg, KTF_A_FILE, ctx->type_name.c_str());
+    nla_put_string(msg, KTF_A_STR, ctx->name.c_str());
+    if (shm_sz && c.data_sz >= shm_min_size) {
+      memcpy((char*)shm.addr + off, c.data, c.data_sz);
+      put_shm(msg, shm, off, c.data_sz);
+      off += c.data_sz;
+    } else
+      nla_put(msg, KTF_A_DATA, c.data_sz, c.data);
+    nla_nest_end(msg, entry);
+  }
+  nla_nest_end(msg, list);
+  return msg;
+}
+
+int configure_contexts(std::vector<context_cfg>& cfgs)
+{
+  bool batch = kversion >= KTF_VERSION_CTX_BATCH;
+  int ret = 0;
+
+  ccstate.sent.clear();
+  ccstate.contexts.clear();
+  for (size_t i = 0; i < cfgs.size(); i++) {
+    context_cfg& c = cfgs[i];
+    context_vector ct = kmgr().find_contexts(c.context, c.type_name);
+
+    if (ct.size() != 1 || ct[0]->Type() != c.type_name) {
+      fprintf(stderr, "configure_contexts: found %zu contexts named %s of type %s\n",
+	      ct.size(), c.context.c_str(), c.type_name.c_str());
+      c.stat = ct.size() > 1 ? -EEXIST : -ENOENT;
+      continue;
+    }
+    /* Kernels without batches get a request per context */
+    if (!batch) {
+      c.stat = ct[0]->Configure((void*)c.data, c.data_sz);
+      continue;
+    }
+    c.stat = -EIO; /* Until the reply says otherwise */
+    ccstate.sent.push_back(i);
+    ccstate.contexts.push_back(ct[0]);
+  }
+
+  if (!ccstate.sent.empty()) {
+    shm_buf shm;
+    struct nl_msg *msg = ctx_cfg_batch_msg(cfgs, shm);
+    int err = -NLE_NOMEM;
+
+    if (msg) {
+      ccstate.cfgs = &cfgs;
+      ccstate.next = 0;
+      nl_send_auto_complete(sock, msg);
+      nlmsg_free(msg);
+      err = recv_until_ack(sock);
+      ccstate.cfgs = NULL;
+    }
+    /* The kernel is done with the shared data when it has replied */
+    shm.free();
+    if (err < 0) {
+      fprintf(stderr, "configure_contexts: request failed with %d\n", err);
+      for (size_t i = ccstate.next; i < ccstate.sent.size(); i++)
+	cfgs[ccstate.sent[i]].stat = err;
+    }
+  }
+
+  for (size_t i = 0; i < cfgs.size() && !ret; i++)
+    ret = cfgs[i].stat;
+  return ret;
+}
+
+int configure_netctx(const std::string& context, std::string nodes, int rank)
+{
+  const char* env;
+  if (nodes.empty() && (env = getenv("KTF_NET_NODES")))
+    nodes = env;
+  if (rank < 0 && (env = getenv("KTF_NET_RANK")))
+    rank = atoi(env);
+
+  stringvec addrs;
+  size_t pos = 0, end;
+  while (pos <= nodes.size()) {
+    end = nodes.find(',', pos);
+    if (end == std::string::npos)
+      end = nodes.size();
+    if (end > pos)
+      addrs.push_back(nodes.substr(pos, end - pos));
+    pos = end + 1;
+  }
+  if (addrs.size() < 2 || addrs.size() > SHRT_MAX || rank < 0 || rank >= (int)addrs.size()) {
+    fprintf(stderr, "configure_netctx: need at least 2 nodes and a rank among them"
+	    " (got %zu nodes, rank %d)\n", addrs.size(), rank);
+    return -EINVAL;
+  }
+
+  /* struct ktf_addrinfo has room for 2 addresses, the kernel expects n */
+  size_t sz = sizeof(struct ktf_addrinfo) + (addrs.size() - 2) * sizeof(struct ktf_peer_address);
+  std::vector<char> buf(sz);
+  struct ktf_addrinfo* ai = (struct ktf_addrinfo*)&buf[0];
+  ai->n = addrs.size();
+  ai->rank = rank;
+
+  for (size_t i = 0; i < addrs.size(); i++) {
+    std::string host = addrs[i], ifname;
+    size_t at = host.find('@');
+    if (at != std::string::npos) {
+      ifname = host.substr(at + 1);
+      host.erase(at);
+    }
+    if (ifname.size() >= IFNAMSZ) {
+      fprintf(stderr, "configure_netctx: interface name %s too long\n", ifname.c_str());
+      return -EINVAL;
+    }
+
+    struct addrinfo hints = {}, *res;
+    hints.ai_socktype = SOCK_STREAM;
+    int ret = getaddrinfo(host.c_str(), NULL, &hints, &res);
+    if (ret) {
+      fprintf(stderr, "configure_netctx: %s: %s\n", host.c_str(), gai_strerror(ret));
+      return -ENOENT;
+    }
+    memcpy(&ai->a[i].addr, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    strncpy(ai->a[i].ifname, ifname.c_str(), IFNAMSZ - 1);
+  }
+
+  context_vector ct = kmgr().find_contexts(context, "netctx");
+  if (ct.size() != 1) {
+    fprintf(stderr, "configure_netctx: found %zu network contexts named %s\n",
+	    ct.size(), context.c_str());
+    return ct.empty() ? -ENOENT : -EEXIST;
+  }
+  return ct[0]->Configure(ai, sz);
+}
+
 void configure_context_for_test(const std::string& setname, const std::string& testname,
 				const std::string& type_name, void *data, size_t data_sz)
 {
@@ -761,8 +2041,7 @@ void configure_context_for_test(const std::string& setname, const std::string& t
 }
 
 
-static nl_cb_action parse_one_set(std::string& setname,
-				  std::string& testname, struct nlattr* attr)
+static nl_cb_action parse_one_set(std::string& setname, struct nlattr* attr)
 {
   int rem = 0;
   struct nlattr *nla;
@@ -776,9 +2055,17 @@ static nl_cb_action parse_one_set(std::string& setname,
       break;
     case KTF_A_STR:
       msg = nla_get_string(nla);
-      kmgr().add_test(setname, msg, handle_id);
+      qstate.entries.push_back(query_entry());
+      qstate.entries.back().setname = setname;
+      qstate.entries.back().testname = msg;
+      qstate.entries.back().handle_id = handle_id;
+      qstate.entries.back().test_id = 0;
       handle_id = 0;
       break;
+    case KTF_A_ID:
+      if (!qstate.entries.empty())
+	qstate.entries.back().test_id = nla_get_u32(nla);
+      break;
     default:
       fprintf(stderr,"parse_result: Unexpected attribute type %d\n", nla_type(nla));
       return NL_SKIP;
@@ -788,18 +2075,14 @@ static nl_cb_action parse_one_set(std::string& setname,
 }
 
 
-
-static int parse_query(struct nl_msg *msg, struct nlattr** attrs)
+static bool check_kernel_version(struct nlattr** attrs)
 {
-  int alloc = 0, rem = 0, rem2 = 0, cfg_stat;
-  nl_cb_action stat;
-  std::string setname,testname,ctx;
-
   /* Version 0.1.0.0 did not report version back from the kernel */
   uint64_t kernel_version = (KTF_VERSION_SET(MAJOR, 0ULL) | KTF_VERSION_SET(MINOR, 1ULL));
 
   if (attrs[KTF_A_VERSION])
     kernel_version = nla_get_u64(attrs[KTF_A_VERSION]);
+  kversion = kernel_version;
 
   /* We only got here if we were compatible enough, log that we had differences */
   if (kernel_version != KTF_VERSION_LATEST)
@@ -822,11 +2105,39 @@ static int parse_query(struct nl_msg *msg, struct nlattr** attrs)
 	    KTF_VERSION(MINOR, kernel_version),
 	    KTF_VERSION(MICRO, kernel_version),
 	    KTF_VERSION(BUILD, kernel_version));
-    if (!is_compatible)
-      return NL_SKIP;
+    return is_compatible;
   }
+  return true;
+}
+
 
-  if (attrs[KTF_A_HLIST]) {
+/* Parse a query response, or a part of one if it is a dump (NLM_F_MULTI).
+ * Each part may contain a continuation of the handle list and/or the list of
+ * test sets, where the tests of a set may be split over several parts.
+ */
+static int parse_query(struct nl_msg *msg, struct nlattr** attrs)
+{
+  int alloc = 0, rem = 0, rem2 = 0, cfg_stat;
+  bool multipart = nlmsg_hdr(msg)->nlmsg_flags & NLM_F_MULTI;
+  nl_cb_action stat;
+  std::string setname,ctx;
+
+  if (!qstate.seen) {
+    qstate.seen = true;
+    qstate.compatible = check_kernel_version(attrs);
+  }
+  if (attrs[KTF_A_GEN]) {
+    qstate.has_gen = true;
+    qstate.gen = nla_get_u32(attrs[KTF_A_GEN]);
+  }
+  if (qstate.record) {
+    struct nlmsghdr *nlh = nlmsg_hdr(msg);
+    qstate.parts.push_back(std::string((const char*)nlh, nlh->nlmsg_len));
+  }
+  if (!qstate.compatible)
+    return NL_SKIP;
+
+  if (attrs[KTF_A_HLIST] && !qstate.dry) {
     struct nlattr *nla, *nla2;
     stringvec contexts;
     unsigned int handle_id = 0;
@@ -859,6 +2170,9 @@ static int parse_query(struct nl_msg *msg, struct nlattr** attrs)
 	    cfg_stat = nla_get_u32(nla2);
 	    kmgr().add_configurable_context(ctx, type_name, handle_id, cfg_stat);
 	    break;
+	  case KTF_A_ID:
+	    kmgr().add_context_id(handle_id, ctx, nla_get_u32(nla2));
+	    break;
 	  }
 	}
 	/* Add this set of contexts for the handle_id */
@@ -873,18 +2187,10 @@ static int parse_query(struct nl_msg *msg, struct nlattr** attrs)
     }
   }
 
-  // Now we know enough about contexts and type_ids to actually configure
-  // any contexts that needs to be configured, and this must be
-  // done before the list of tests gets spanned out because addition
-  // of new contexts can lead to more tests being "generated":
-  //
-  if (do_context_configure)
-    do_context_configure();
-
   if (attrs[KTF_A_NUM]) {
     alloc = nla_get_u32(attrs[KTF_A_NUM]);
     log(KTF_DEBUG, "Kernel offers %d test sets:\n", alloc);
-  } else {
+  } else if (!multipart) {
     fprintf(stderr,"No test set count in kernel response??\n");
     return -1;
   }
@@ -897,9 +2203,14 @@ static int parse_query(struct nl_msg *msg, struct nlattr** attrs)
       switch (nla_type(nla)) {
       case KTF_A_STR:
 	setname = nla_get_string(nla);
+	/* Just to make sure empty sets are also added */
+	qstate.entries.push_back(query_entry());
+	qstate.entries.back().setname = setname;
+	qstate.entries.back().handle_id = 0;
+	qstate.entries.back().test_id = 0;
 	break;
       case KTF_A_TEST:
-	stat = parse_one_set(setname, testname, nla);
+	stat = parse_one_set(setname, nla);
 	if (stat != NL_OK)
 	  return stat;
 	break;
@@ -907,27 +2218,286 @@ static int parse_query(struct nl_msg *msg, struct nlattr** attrs)
 	fprintf(stderr,"parse_query[LIST]: Unexpected attribute type %d\n", nla_type(nla));
 	return NL_SKIP;
       }
-      kmgr().find_add_set(setname); /* Just to make sure empty sets are also added */
     }
   }
 
+  /* A single message response is complete, otherwise wait for the rest */
+  if (!multipart)
+    apply_query();
   return NL_OK;
 }
 
 
-static enum nl_cb_action parse_result(struct nl_msg *msg, struct nlattr** attrs)
+/* Results may arrive as several parts (NLM_F_MULTI) of a single response.
+ * Each part holds a sequence of complete result records, and only the last
+ * part carries the test status, so each part can be handled on its own:
+ */
+/* Report a result to the test framework, or if @br is set,
+ * keep it to report later from the main thread:
+ */
+static void report_result(batch_result* br, int result, const char* file, int line,
+			  const char* report)
+{
+  if (!br) {
+    handle_test(result, file, line, report);
+    return;
+  }
+  br->records.push_back(result_record());
+  br->records.back().result = result;
+  br->records.back().file = file;
+  br->records.back().line = line;
+  br->records.back().report = report;
+}
+
+/* Parse the KTF_B_* attributes of a KTF_A_BENCH entry */
+static bench_stats parse_bench(struct nlattr* nla)
+{
+  struct nlattr *nla2;
+  bench_stats bs;
+  int rem = 0;
+  size_t i;
+
+  nla_for_each_nested(nla2, nla, rem) {
+    switch (nla_type(nla2)) {
+    case KTF_B_ITERS:
+      bs.iterations = nla_get_u64(nla2);
+      break;
+    case KTF_B_BATCHES:
+      bs.batches = nla_get_u64(nla2);
+      break;
+    case KTF_B_MIN:
+      bs.min_ps = nla_get_u64(nla2);
+      break;
+    case KTF_B_MEDIAN:
+      bs.median_ps = nla_get_u64(nla2);
+      break;
+    case KTF_B_MEAN:
+      bs.mean_ps = nla_get_u64(nla2);
+      break;
+    case KTF_B_P99:
+      bs.p99_ps = nla_get_u64(nla2);
+      break;
+    case KTF_B_OPS:
+      bs.ops_per_sec = nla_get_u64(nla2);
+      break;
+    case KTF_B_SAMPLES:
+      bs.samples_ps.resize(nla_len(nla2) / sizeof(uint64_t));
+      for (i = 0; i < bs.samples_ps.size(); i++) {
+	uint64_t v;
+	memcpy(&v, (char*)nla_data(nla2) + i * sizeof(v), sizeof(v));
+	bs.samples_ps[i] = v;
+      }
+      break;
+    }
+  }
+  return bs;
+}
+
+/* Report benchmark statistics, or keep them with @br as for results */
+static void report_bench(batch_result* br, const bench_stats& bs)
+{
+  if (!br)
+    handle_bench(bs);
+  else
+    br->benches.push_back(bs);
+}
+
+/* Parse the KTF_T_* attributes of a KTF_A_TIME entry */
+static test_time parse_time(struct nlattr* nla)
+{
+  struct nlattr *nla2;
+  test_time tt;
+  int rem = 0;
+
+  memset(&tt, 0, sizeof(tt));
+  nla_for_each_nested(nla2, nla, rem) {
+    switch (nla_type(nla2)) {
+    case KTF_T_RUN:
+      tt.run_ns = nla_get_u64(nla2);
+      break;
+    case KTF_T_ITERS:
+      tt.iterations = nla_get_u64(nla2);
+      break;
+    case KTF_T_ITER_MIN:
+      tt.iter_min_ns = nla_get_u64(nla2);
+      break;
+    case KTF_T_ITER_MAX:
+      tt.iter_max_ns = nla_get_u64(nla2);
+      break;
+    case KTF_T_ITER_TOTAL:
+      tt.iter_total_ns = nla_get_u64(nla2);
+      break;
+    }
+  }
+  return tt;
+}
+
+/* Parse the KTF_P_* attributes of a KTF_A_PERF entry */
+static perf_counts parse_perf(struct nlattr* nla)
+{
+  struct nlattr *nla2;
+  perf_counts pc;
+  int rem = 0;
+
+  nla_for_each_nested(nla2, nla, rem) {
+    size_t e = nla_type(nla2) - KTF_P_CYCLES;
+
+    if (nla_type(nla2) >= KTF_P_CYCLES && e < perf_nr_events)
+      pc[perf_event_names[e]] = nla_get_u64(nla2);
+  }
+  return pc;
+}
+
+static void report_perf(batch_result* br, const perf_counts& pc)
+{
+  if (!br) {
+    rtstate.perf = pc;
+    rtstate.perf_valid = true;
+  } else
+    br->perfs.push_back(pc);
+}
+
+/* Parse the KTF_W_* attributes of a KTF_A_SWEEP entry */
+static sweep_stats parse_sweep(struct nlattr* nla)
+{
+  struct nlattr *nla2, *nla3;
+  sweep_stats ss;
+  int rem = 0, rem2 = 0;
+
+  nla_for_each_nested(nla2, nla, rem) {
+    switch (nla_type(nla2)) {
+    case KTF_W_DURATION:
+      ss.duration_ns = nla_get_u64(nla2);
+      break;
+    case KTF_W_POINT: {
+      sweep_point pt;
+
+      memset(&pt, 0, sizeof(pt));
+      nla_for_each_nested(nla3, nla2, rem2) {
+	switch (nla_type(nla3)) {
+	case KTF_W_THREADS:
+	  pt.threads = nla_get_u32(nla3);
+	  break;
+	case KTF_W_OPS:
+	  pt.ops = nla_get_u64(nla3);
+	  break;
+	case KTF_W_ELAPSED:
+	  pt.elapsed_ns = nla_get_u64(nla3);
+	  break;
+	case KTF_W_RATE:
+	  pt.ops_per_sec = nla_get_u64(nla3);
+	  break;
+	case KTF_W_OP_TIME:
+	  pt.op_ps = nla_get_u64(nla3);
+	  break;
+	}
+      }
+      ss.points.push_back(pt);
+      break;
+    }
+    }
+  }
+  return ss;
+}
+
+static void report_sweep(batch_result* br, const sweep_stats& ss)
+{
+  if (!br)
+    handle_sweep(ss);
+  else
+    br->sweeps.push_back(ss);
+}
+
+/* Parse the KTF_L_* attributes of a KTF_A_LOCKS entry */
+static lock_profile parse_locks(struct nlattr* nla)
+{
+  struct nlattr *nla2, *nla3;
+  lock_profile lp;
+  int rem = 0, rem2 = 0;
+
+  nla_for_each_nested(nla2, nla, rem) {
+    switch (nla_type(nla2)) {
+    case KTF_L_DROPPED:
+      lp.dropped = nla_get_u64(nla2);
+      break;
+    case KTF_L_ENTRY: {
+      lock_contention lc;
+
+      lc.flags = 0;
+      lc.count = lc.wait_ns = lc.max_ns = 0;
+      nla_for_each_nested(nla3, nla2, rem2) {
+	switch (nla_type(nla3)) {
+	case KTF_L_LOCK:
+	  lc.lock = nla_get_string(nla3);
+	  break;
+	case KTF_L_CALLER:
+	  lc.caller = nla_get_string(nla3);
+	  break;
+	case KTF_L_FLAGS:
+	  lc.flags = nla_get_u32(nla3);
+	  break;
+	case KTF_L_COUNT:
+	  lc.count = nla_get_u64(nla3);
+	  break;
+	case KTF_L_WAIT:
+	  lc.wait_ns = nla_get_u64(nla3);
+	  break;
+	case KTF_L_MAX_WAIT:
+	  lc.max_ns = nla_get_u64(nla3);
+	  break;
+	}
+      }
+      lp.entries.push_back(lc);
+      break;
+    }
+    }
+  }
+  return lp;
+}
+
+static void report_locks(batch_result* br, const lock_profile& lp)
+{
+  if (!br)
+    handle_locks(lp);
+  else
+    br->locks.push_back(lp);
+}
+
+static void report_time(batch_result* br, const test_time& tt)
+{
+  if (!br) {
+    rtstate.time = tt;
+    rtstate.valid = true;
+  } else
+    br->times.push_back(tt);
+}
+
+static enum nl_cb_action parse_result(struct nl_msg *msg, struct nlattr** attrs,
+				      batch_result* br)
 {
   int assert_cnt = 0, fail_cnt = 0;
   int rem = 0, stat;
   const char *file = "no_file",*report = "no_report";
 
+  if (nlmsg_hdr(msg)->nlmsg_flags & NLM_F_MULTI)
+    log(KTF_DEBUG, "parsing partial test result\n");
+
   if (attrs[KTF_A_STAT]) {
     stat = nla_get_u32(attrs[KTF_A_STAT]);
     log(KTF_DEBUG, "parsed test status %d\n", stat);
-    if (stat) {
+    if (br)
+      br->stat = stat;
+    else if (stat) {
       fprintf(stderr, "Failed to execute test in kernel - status %d\n", stat);
     }
   }
+  if (attrs[KTF_A_NUM]) {
+    /* The kernel was unable to deliver some of the results to us */
+    char tmp[100];
+    int dropped = nla_get_u32(attrs[KTF_A_NUM]);
+    sprintf(tmp, "%d test results were lost on the way from the kernel", dropped);
+    report_result(br, 0, "ktf", 0, tmp);
+  }
   if (attrs[KTF_A_LIST]) {
     /* Parse list of test results */
     struct nlattr *nla;
@@ -936,7 +2506,7 @@ static enum nl_cb_action parse_result(struct nl_msg *msg, struct nlattr** attrs)
       switch (nla_type(nla)) {
       case KTF_A_STAT:
 	/* Flush previous test, if any */
-	handle_test(result,file,line,report);
+	report_result(br, result, file, line, report);
 	result = nla_get_u32(nla);
 	/* Our own count and report since check does such a lousy
 	 * job in counting individual checks */
@@ -960,22 +2530,150 @@ static enum nl_cb_action parse_result(struct nl_msg *msg, struct nlattr** attrs)
 	if (!report)
 	  report = "no_report";
 	break;
+      case KTF_A_BENCH:
+	report_bench(br, parse_bench(nla));
+	break;
+      case KTF_A_TIME:
+	report_time(br, parse_time(nla));
+	break;
+      case KTF_A_PERF:
+	report_perf(br, parse_perf(nla));
+	break;
+      case KTF_A_SWEEP:
+	report_sweep(br, parse_sweep(nla));
+	break;
+      case KTF_A_LOCKS:
+	report_locks(br, parse_locks(nla));
+	break;
       default:
 	fprintf(stderr,"parse_result: Unexpected attribute type %d\n", nla_type(nla));
 	return NL_SKIP;
       }
     }
     /* Handle last test */
-    handle_test(result,file,line,report);
+    report_result(br, result, file, line, report);
   }
 
   return NL_OK;
 }
 
+/* Parse (a part of) the results from a batch run: Each test's results
+ * are followed by a KTF_A_TEST entry identifying the test.
+ */
+static enum nl_cb_action parse_batch_result(struct nl_msg *msg, struct nlattr** attrs)
+{
+  int rem = 0, rem2 = 0;
+  struct nlattr *nla, *nla2;
+
+  if (attrs[KTF_A_STAT] && nla_get_u32(attrs[KTF_A_STAT]))
+    fprintf(stderr, "Failed to execute test batch in kernel - status %d\n",
+	    nla_get_u32(attrs[KTF_A_STAT]));
+  if (attrs[KTF_A_NUM])
+    bstate.dropped += nla_get_u32(attrs[KTF_A_NUM]);
+  if (!attrs[KTF_A_LIST])
+    return NL_OK;
+
+  nla_for_each_nested(nla, attrs[KTF_A_LIST], rem) {
+    switch (nla_type(nla)) {
+    case KTF_A_STAT:
+      bstate.pending.push_back(result_record());
+      bstate.pending.back().result = nla_get_u32(nla);
+      bstate.pending.back().file = "no_file";
+      bstate.pending.back().line = 0;
+      bstate.pending.back().report = "no_report";
+      break;
+    case KTF_A_FILE:
+      if (!bstate.pending.empty())
+	bstate.pending.back().file = nla_get_string(nla);
+      break;
+    case KTF_A_NUM:
+      if (!bstate.pending.empty())
+	bstate.pending.back().line = nla_get_u32(nla);
+      break;
+    case KTF_A_STR:
+      if (!bstate.pending.empty())
+	bstate.pending.back().report = nla_get_string(nla);
+      break;
+    case KTF_A_BENCH:
+      bstate.pending_benches.push_back(parse_bench(nla));
+      break;
+    case KTF_A_TIME:
+      bstate.pending_times.push_back(parse_time(nla));
+      break;
+    case KTF_A_PERF:
+      bstate.pending_perfs.push_back(parse_perf(nla));
+      break;
+    case KTF_A_SWEEP:
+      bstate.pending_sweeps.push_back(parse_sweep(nla));
+      break;
+    case KTF_A_LOCKS:
+      bstate.pending_locks.push_back(parse_locks(nla));
+      break;
+    case KTF_A_TEST: {
+      std::string setname, testname, ctx;
+      unsigned int id = 0;
+      int stat = 0;
+
+      nla_for_each_nested(nla2, nla, rem2) {
+	switch (nla_type(nla2)) {
+	case KTF_A_SNAM:
+	  setname = nla_get_string(nla2);
+	  break;
+	case KTF_A_TNAM:
+	  testname = nla_get_string(nla2);
+	  break;
+	case KTF_A_STR:
+	  ctx = nla_get_string(nla2);
+	  break;
+	case KTF_A_STAT:
+	  stat = nla_get_u32(nla2);
+	  break;
+	case KTF_A_ID:
+	  id = nla_get_u32(nla2);
+	  break;
+	}
+      }
+      if (setname.empty() && id) {
+	/* The kernel did not find the test, identify it from the id */
+	KernelTest* kt = kmgr().find_test_id(id, &ctx);
+	if (kt) {
+	  setname = kt->setname;
+	  testname = kt->testname;
+	}
+      }
+      std::string key = batch_key(setname, testname, ctx);
+      pthread_mutex_lock(&astate.lock);
+      batch_result& br = bstate.results[key];
+      br.stat = stat;
+      br.records.swap(bstate.pending);
+      br.benches.swap(bstate.pending_benches);
+      br.times.swap(bstate.pending_times);
+      br.perfs.swap(bstate.pending_perfs);
+      br.sweeps.swap(bstate.pending_sweeps);
+      br.locks.swap(bstate.pending_locks);
+      pthread_mutex_unlock(&astate.lock);
+      bstate.pending.clear();
+      bstate.pending_benches.clear();
+      bstate.pending_times.clear();
+      bstate.pending_perfs.clear();
+      bstate.pending_sweeps.clear();
+      bstate.pending_locks.clear();
+      bstate.received.push_back(key);
+      break;
+    }
+    default:
+      fprintf(stderr,"parse_batch_result: Unexpected attribute type %d\n", nla_type(nla));
+      return NL_SKIP;
+    }
+  }
+  return NL_OK;
+}
+
 static enum nl_cb_action parse_cov_endis(struct nl_msg *msg, struct nlattr** attrs)
 {
   enum ktf_cmd_type type = (ktf_cmd_type)nla_get_u32(attrs[KTF_A_TYPE]);
-  const char *cmd = type == KTF_CT_COV_ENABLE ? "enable" : "disable";
+  const char *cmd = type == KTF_CT_COV_ENABLE ? "enable" :
+    (type == KTF_CT_COV_RESET ? "reset" : "disable");
   int retval = nla_get_u32(attrs[KTF_A_STAT]);
 
   if (retval)
@@ -983,6 +2681,100 @@ static enum nl_cb_action parse_cov_endis(struct nl_msg *msg, struct nlattr** att
   return NL_OK;
 }
 
+/* Parse (a part of) a coverage snapshot: Each KTF_A_COV entry holds the
+ * count for one function, attributed to a test if it has a KTF_A_ID.
+ */
+static enum nl_cb_action parse_cov_snapshot(struct nl_msg *msg, struct nlattr** attrs)
+{
+  int rem = 0, rem2 = 0;
+  struct nlattr *nla, *nla2;
+
+  if (attrs[KTF_A_STAT] && (cstate.stat = nla_get_u32(attrs[KTF_A_STAT])))
+    fprintf(stderr, "Coverage snapshot failed with status %d\n", cstate.stat);
+  if (attrs[KTF_A_NUM])
+    cstate.dropped += nla_get_u32(attrs[KTF_A_NUM]);
+  if (!attrs[KTF_A_LIST] || !cstate.hits)
+    return NL_OK;
+
+  nla_for_each_nested(nla, attrs[KTF_A_LIST], rem) {
+    if (nla_type(nla) == KTF_A_GEN) {
+      cstate.gen = nla_get_u32(nla);
+      continue;
+    }
+    if (nla_type(nla) != KTF_A_COV) {
+      fprintf(stderr,"parse_cov_snapshot: Unexpected attribute type %d\n", nla_type(nla));
+      return NL_SKIP;
+    }
+    cov_hit hit;
+    unsigned int id = 0;
+
+    hit.hits = 0;
+    nla_for_each_nested(nla2, nla, rem2) {
+      switch (nla_type(nla2)) {
+      case KTF_A_MOD:
+	hit.module = nla_get_string(nla2);
+	break;
+      case KTF_A_STR:
+	hit.function = nla_get_string(nla2);
+	break;
+      case KTF_A_NUM:
+	hit.hits = nla_get_u32(nla2);
+	break;
+      case KTF_A_ID:
+	id = nla_get_u32(nla2);
+	break;
+      }
+    }
+    if (id) {
+      std::string ctx;
+      KernelTest* kt = kmgr().find_test_id(id, &ctx);
+      if (kt) {
+	hit.test = batch_key(kt->setname, kt->testname, ctx);
+      } else {
+	char tmp[32];
+	sprintf(tmp, "#%u", id);
+	hit.test = tmp;
+      }
+    }
+    cstate.hits->push_back(hit);
+  }
+  return NL_OK;
+}
+
+/* Parse the status of each context of a batch configuration, in the order
+ * of the request:
+ */
+static enum nl_cb_action parse_ctx_cfg_batch(struct nl_msg *msg, struct nlattr** attrs)
+{
+  int rem = 0, rem2 = 0;
+  struct nlattr *nla, *nla2;
+
+  if (!attrs[KTF_A_LIST] || !ccstate.cfgs)
+    return NL_OK;
+
+  nla_for_each_nested(nla, attrs[KTF_A_LIST], rem) {
+    if (nla_type(nla) != KTF_A_CTX || ccstate.next >= ccstate.sent.size()) {
+      fprintf(stderr,"parse_ctx_cfg_batch: Unexpected attribute type %d\n", nla_type(nla));
+      return NL_SKIP;
+    }
+    int stat = -EIO;
+    nla_for_each_nested(nla2, nla, rem2)
+      if (nla_type(nla2) == KTF_A_STAT)
+	stat = nla_get_u32(nla2);
+
+    ConfigurableContext* ctx = ccstate.contexts[ccstate.next];
+    (*ccstate.cfgs)[ccstate.sent[ccstate.next]].stat = stat;
+    if (!stat && ctx->cfg_stat == ENODEV) {
+      // Successfully added a new context, update it's state and
+      // tell kmgr() about it:
+      kmgr().add_context(ctx->handle_id, ctx->name);
+      ctx->cfg_stat = 0;
+    }
+    ccstate.next++;
+  }
+  return NL_OK;
+}
+
 static int parse_cb(struct nl_msg *msg, void *arg)
 {
   struct nlmsghdr *nlh = nlmsg_hdr(msg);
@@ -1006,10 +2798,18 @@ static int parse_cb(struct nl_msg *msg, void *arg)
   case KTF_CT_QUERY:
     return parse_query(msg, attrs);
   case KTF_CT_RUN:
-    return parse_result(msg, attrs);
+    return parse_result(msg, attrs, (batch_result*)arg);
+  case KTF_CT_RUN_BATCH:
+    return parse_batch_result(msg, attrs);
   case KTF_CT_COV_ENABLE:
   case KTF_CT_COV_DISABLE:
+  case KTF_CT_COV_RESET:
     return parse_cov_endis(msg, attrs);
+  case KTF_CT_COV_SNAPSHOT:
+  case KTF_CT_COV_DELTA:
+    return parse_cov_snapshot(msg, attrs);
+  case KTF_CT_CTX_CFG_BATCH:
+    return parse_ctx_cfg_batch(msg, attrs);
   default:
     debug_cb(msg, attrs);
   }
@@ -13,6 +13,7 @@
 
 #ifndef KTF_INT_H
 #define KTF_INT_H
+#include <map>
 #include <string>
 #include <vector>
 #include "ktf.h"
@@ -25,21 +26,134 @@ namespace ktf
   /* A callback handler to be called for each assertion result */
   typedef void (*test_handler)(int result,  const char* file, int line, const char* report);
 
+  /* Statistics of a run of a BENCH() kernel test. Times are per operation,
+   * in picoseconds:
+   */
+  struct bench_stats
+  {
+    bench_stats() : iterations(0), batches(0), min_ps(0), median_ps(0), mean_ps(0),
+		    p99_ps(0), ops_per_sec(0) {}
+
+    unsigned long long iterations; /* Operations per timed batch */
+    unsigned long long batches;
+    unsigned long long min_ps;
+    unsigned long long median_ps;
+    unsigned long long mean_ps;
+    unsigned long long p99_ps;
+    unsigned long long ops_per_sec;
+    std::vector<unsigned long long> samples_ps; /* Per batch, ascending */
+  };
+
+  /* A callback handler to be called for each benchmark result */
+  typedef void (*bench_handler)(const bench_stats& stats);
+
+  /* Time a kernel test took to run, as measured by the kernel with the
+   * monotonic clock, in nanoseconds:
+   */
+  struct test_time
+  {
+    unsigned long long run_ns; /* The whole run, including reporting of results */
+    unsigned long long iterations;
+    unsigned long long iter_min_ns;
+    unsigned long long iter_max_ns;
+    unsigned long long iter_total_ns; /* Sum over the iterations */
+    unsigned long long request_ns; /* Round trip of the request, 0 if batched */
+  };
+
+  /* A callback handler to be called with the run time of each kernel test */
+  typedef void (*time_handler)(const test_time& time);
+
+  /* Totals of the performance events counted during a kernel test run,
+   * by event name (see set_perf_events):
+   */
+  typedef std::map<std::string, unsigned long long> perf_counts;
+
+  /* A callback handler to be called with the event counts of each kernel test */
+  typedef void (*perf_handler)(const perf_counts& counts);
+
+  /* One width of a scalability sweep of a kernel test */
+  struct sweep_point
+  {
+    unsigned int threads;
+    unsigned long long ops; /* Total over the workers */
+    unsigned long long elapsed_ns; /* Of the slowest worker */
+    unsigned long long ops_per_sec; /* Total over the workers */
+    unsigned long long op_ps; /* Mean time per operation in a worker */
+  };
+
+  /* The scalability curve of a sweep, by increasing number of threads */
+  struct sweep_stats
+  {
+    sweep_stats() : duration_ns(0) {}
+
+    unsigned long long duration_ns; /* Per width */
+    std::vector<sweep_point> points;
+  };
+
+  /* A callback handler to be called for each sweep result */
+  typedef void (*sweep_handler)(const sweep_stats& stats);
+
+  /* A lock and caller that was contended during a kernel test run */
+  struct lock_contention
+  {
+    std::string lock; /* Symbol or address */
+    std::string caller; /* Return addresses outside of the locking code */
+    unsigned int flags; /* LCB_F_* type of lock from the kernel */
+    unsigned long long count;
+    unsigned long long wait_ns; /* Total */
+    unsigned long long max_ns;
+  };
+
+  /* The locks waited for the longest during a kernel test run */
+  struct lock_profile
+  {
+    lock_profile() : dropped(0) {}
+
+    unsigned long long dropped; /* Contentions the kernel could not record */
+    std::vector<lock_contention> entries; /* By decreasing wait_ns */
+  };
+
+  /* A callback handler to be called with the lock profile of a kernel test */
+  typedef void (*lock_handler)(const lock_profile& profile);
+
+  /* A buffer shared with the kernel (see kernel/ktf_shm.h), mapped at addr */
+  struct shm_buf
+  {
+    shm_buf() : fd(-1), addr(NULL), size(0), id(0) {}
+
+    /* Map a new buffer of at least sz bytes. Returns false if the kernel
+     * does not support shared buffers or the buffer cannot be set up:
+     */
+    bool alloc(size_t sz);
+    void free();
+
+    int fd;
+    void* addr;
+    size_t size; /* Mapped, rounded up to whole pages */
+    unsigned int id; /* As known by the kernel */
+  };
+
   class KernelTest
   {
   public:
-    KernelTest(const std::string& setname, const char* testname, unsigned int handle_id);
+    KernelTest(const std::string& setname, const char* testname, unsigned int handle_id,
+	       unsigned int test_id);
     ~KernelTest();
     void* get_priv(size_t priv_sz);
     size_t get_priv_sz(KernelTest *kt);
+    /* Numeric id to run this test in context ctx, or 0 if the kernel has none */
+    unsigned int get_id(const std::string& ctx);
     std::string setname;
     std::string testname;
     unsigned int handle_id;
+    unsigned int test_id; /* Numeric id of the test from the kernel, or 0 */
+    std::map<std::string, unsigned int> ids; /* Numeric id per context */
     std::string name;
     size_t setnum;  /* This test belongs to this set in the kernel */
     size_t testnum; /* This test's index (test number) in the kernel */
     void* user_priv;  /* Optional private data for the test */
     size_t user_priv_sz; /* Size of the user_priv data if used */
+    shm_buf user_shm; /* Shared buffer at user_priv, if not malloc'ed */
     test_cb* user_test;  /* Optional user level wrapper function for the kernel test */
     char* file;
     int line;
@@ -51,6 +165,40 @@ namespace ktf
   // @handle_test contains the test framework's handling code for test assertions */
   bool setup(test_handler handle_test);
 
+  // Set the test framework's handling code for benchmark results:
+  void set_bench_handler(bench_handler handle_bench);
+
+  // Set the test framework's handling code for test run times:
+  void set_time_handler(time_handler handle_time);
+
+  // Set the test framework's handling code for performance event counts:
+  void set_perf_handler(perf_handler handle_perf);
+
+  // Set the test framework's handling code for scalability sweeps:
+  void set_sweep_handler(sweep_handler handle_sweep);
+
+  // Set the test framework's handling code for lock contention profiles:
+  void set_lock_handler(lock_handler handle_locks);
+
+  /* Performance results and baselines (ktf_baseline.cpp):
+   * Keep the run time of a test, or the statistics of a benchmark, for the
+   * results file. Returns false with a description in msg if the test is
+   * slower than in the baseline:
+   */
+  bool baseline_check_time(const std::string& test, const test_time& tt, std::string& msg);
+  bool baseline_check_bench(const std::string& test, const bench_stats& bs, std::string& msg);
+
+  /* Keep the curve of a sweep for the results file */
+  void baseline_add_sweep(const std::string& test, const sweep_stats& ss);
+
+  /* Write the results file, if any. Returns 0 or -errno */
+  int baseline_write_results();
+
+  /* Set up from the environment (KTF_RESULTS, KTF_BASELINE, KTF_TOLERANCE
+   * and KTF_MIN_NS)
+   */
+  void baseline_init();
+
   void set_configurator(configurator c);
 
   // Parse command line args (call after gtest arg parsing)
@@ -68,6 +216,50 @@ namespace ktf
 
   /* "private" - only run from gtest framework */
   void run_test(KernelTest* test, std::string& ctx);
+
+  /* A kernel test and the context to run it in */
+  typedef std::pair<KernelTest*, std::string> test_instance;
+
+  /* Run a batch of kernel tests in a single request to the kernel.
+   * The results are kept and reported when each test is run via run_test:
+   */
+  int run_batch(const std::vector<test_instance>& tests);
+
+  /* Run all kernel tests with a name ([setname].[testname][_context])
+   * matching a pattern with '*' and '?' wildcards as a batch:
+   */
+  int run_batch(const std::string& pattern);
+
+  /* True if a batch or asynchronous result is waiting (or, for a test
+   * still running asynchronously, about to be) reported for this test:
+   */
+  bool has_batch_result(KernelTest* kt, const std::string& ctx);
+
+  /* Called from a worker thread when an asynchronous run has completed */
+  typedef void (*run_completion)(KernelTest* kt, const std::string& ctx, int stat, void* arg);
+
+  /* Set the number of sockets (each served by a worker thread) used to run
+   * tests asynchronously. Must be set before the first call to run_async:
+   */
+  void set_async_sockets(unsigned int n);
+
+  /* Queue a kernel test to run on one of the async sockets, concurrently with
+   * other tests. The results are reported when the test is run via run_test,
+   * which waits for the async run to complete if needed.
+   * Returns 0 if queued, -EBUSY if already queued or run, -ENOTCONN if
+   * async sockets are not enabled, or -EINVAL for tests with a user part:
+   */
+  int run_async(KernelTest* kt, const std::string& ctx, run_completion done = NULL,
+		void* arg = NULL);
+
+  /* Number of asynchronous runs queued or in progress */
+  size_t async_pending();
+
+  /* Wait for all queued asynchronous runs to complete */
+  void run_wait();
+
+  /* Turns false if the kernel failed to run a batch */
+  bool batch_supported();
 } // end namespace ktf
 
 
@@ -12,6 +12,9 @@
 #include "ktf_int.h"
 #include <assert.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <set>
 #include "ktf_debug.h"
 
 namespace ktf
@@ -99,6 +102,11 @@ public:
 testing::internal::ParamGenerator<Kernel::ParamType> gtest_query_tests(void);
 std::string gtest_name_from_info(const testing::TestParamInfo<Kernel::ParamType>&);
 void gtest_handle_test(int result,  const char* file, int line, const char* report);
+void gtest_handle_bench(const bench_stats& stats);
+void gtest_handle_time(const test_time& time);
+void gtest_handle_perf(const perf_counts& counts);
+void gtest_handle_sweep(const sweep_stats& stats);
+void gtest_handle_locks(const lock_profile& profile);
 
 #ifndef INSTANTIATE_TEST_SUITE_P
 /* This rename happens in Googletest commit 3a460a26b7.
@@ -107,9 +115,45 @@ void gtest_handle_test(int result,  const char* file, int line, const char* repo
 #define AddTestSuiteInstantiation AddTestCaseInstantiation
 #endif
 
+/* Writes the performance results file, if any, when all tests have run */
+class ResultsWriter : public ::testing::EmptyTestEventListener
+{
+public:
+  virtual void OnTestProgramEnd(const ::testing::UnitTest& ut)
+  {
+    baseline_write_results();
+  }
+};
+
+static void prefetch(KernelTest* ukt, const std::string& ctx);
+
+/* Runs the batch a kernel test starts, if any, before gtest times the test */
+class BatchPrefetcher : public ::testing::EmptyTestEventListener
+{
+public:
+  virtual void OnTestStart(const ::testing::TestInfo& ti)
+  {
+    std::string ctx;
+    KernelTest* kt;
+
+    if (!ti.value_param())
+      return;
+    kt = find_test(ti.test_case_name(), ti.name(), &ctx);
+    if (kt)
+      prefetch(kt, ctx);
+  }
+};
+
 int Kernel::AddToRegistry()
 {
   if (!ktf::setup(ktf::gtest_handle_test)) return 1;
+  ktf::set_bench_handler(ktf::gtest_handle_bench);
+  ktf::set_time_handler(ktf::gtest_handle_time);
+  ktf::set_perf_handler(ktf::gtest_handle_perf);
+  ktf::set_sweep_handler(ktf::gtest_handle_sweep);
+  ktf::set_lock_handler(ktf::gtest_handle_locks);
+  ::testing::UnitTest::GetInstance()->listeners().Append(new ResultsWriter());
+  ::testing::UnitTest::GetInstance()->listeners().Append(new BatchPrefetcher());
 
   /* Run query against kernel to figure out which tests that exists: */
   stringvec& t = ktf::query_testsets();
@@ -135,6 +179,101 @@ void setup(configurator c)
 }
 
 
+/* Max number of tests to run in the kernel per batch request */
+static const size_t batch_size = 128;
+
+/* Number of sockets to run tests asynchronously on, from KTF_ASYNC */
+static unsigned int async_sockets()
+{
+  const char* s = getenv("KTF_ASYNC");
+  unsigned int n = s ? strtoul(s, NULL, 0) : 0;
+
+  if (n > 1)
+    set_async_sockets(n);
+  return n > 1 ? n : 0;
+}
+
+/* gtest runs the tests in the order they are registered in, unless shuffled */
+static bool shuffled()
+{
+#ifdef GTEST_FLAG_GET
+  return GTEST_FLAG_GET(shuffle);
+#else
+  return ::testing::GTEST_FLAG(shuffle);
+#endif
+}
+
+/* Kernel tests are run in batches, unless KTF_NO_BATCH is set in the
+ * environment: Running a test that has no result from a previous batch
+ * also runs the next tests gtest has selected to run, in one request to
+ * the kernel. Those tests then just report their results when run.
+ * Only the kernel tests up to the next test with a user level part are
+ * batched, so that the order of the tests against those stays the same.
+ * The batch is run before gtest starts timing the test that triggers it.
+ *
+ * If KTF_ASYNC is set to a number of sockets > 1, the next tests are
+ * instead queued to run concurrently on that many sockets, and the queue
+ * is topped up whenever it runs low:
+ */
+static void prefetch(KernelTest* ukt, const std::string& ctx)
+{
+  static bool disabled = getenv("KTF_NO_BATCH") != NULL || shuffled();
+  static unsigned int nasync = async_sockets();
+
+  if (disabled || ukt->user_test)
+    return;
+  if (nasync) {
+    if (async_pending() > batch_size / 2)
+      return;
+  } else if (!batch_supported() || has_batch_result(ukt, ctx))
+    return;
+
+  stringvec sets = get_testsets();
+  std::set<std::string> kernel_sets(sets.begin(), sets.end());
+  std::vector<test_instance> batch;
+  ::testing::UnitTest* ut = ::testing::UnitTest::GetInstance();
+  bool found = false, stop = false;
+
+  for (int i = 0; i < ut->total_test_case_count() && batch.size() < batch_size && !stop; i++) {
+    const ::testing::TestCase* tc = ut->GetTestCase(i);
+    bool kernel_set = kernel_sets.count(tc->name());
+
+    for (int j = 0; j < tc->total_test_count() && batch.size() < batch_size; j++) {
+      const ::testing::TestInfo* ti = tc->GetTestInfo(j);
+      std::string c;
+      KernelTest* kt = NULL;
+
+      if (!ti->should_run())
+	continue;
+      if (kernel_set && ti->value_param())
+	kt = find_test(tc->name(), ti->name(), &c);
+      if (!found) {
+	if (kt != ukt || c != ctx)
+	  continue;
+	found = true;
+      }
+      /* Any other test, or one with a user level part, ends the batch */
+      if (!kt || kt->user_test) {
+	stop = true;
+	break;
+      }
+      batch.push_back(test_instance(kt, c));
+    }
+  }
+  if (nasync) {
+    std::vector<test_instance>::iterator it;
+    for (it = batch.begin(); it != batch.end(); ++it)
+      if (run_async(it->first, it->second) == -ENOTCONN) {
+	nasync = 0;
+	break;
+      }
+    if (nasync)
+      return;
+  }
+  if (batch.size() > 1 && batch_supported() && !has_batch_result(ukt, ctx))
+    run_batch(batch);
+}
+
 void Kernel::TestBody()
 {
   run_test(ukt, ctx);
@@ -163,6 +302,152 @@ void gtest_handle_test(int result,  const char* file, int line, const char* repo
   }
 }
 
+static std::string u64_str(unsigned long long v)
+{
+  char buf[32];
+
+  snprintf(buf, sizeof(buf), "%llu", v);
+  return buf;
+}
+
+/* Format a time in picoseconds as nanoseconds */
+static std::string ps_to_ns(unsigned long long ps)
+{
+  char buf[32];
+
+  snprintf(buf, sizeof(buf), "%llu.%03llu", ps / 1000, ps % 1000);
+  return buf;
+}
+
+/* Name of the running test as used in the kernel, <set>.<test>[_<ctx>] */
+static std::string current_test_name()
+{
+  const ::testing::TestInfo* ti = ::testing::UnitTest::GetInstance()->current_test_info();
+
+  return ti ? std::string(ti->test_case_name()) + "." + ti->name() : "";
+}
+
+/* Benchmark statistics are recorded as properties of the test, so they
+ * end up in the XML/JSON output, and are summarized on stdout:
+ */
+void gtest_handle_bench(const bench_stats& bs)
+{
+  const ::testing::TestInfo* ti = ::testing::UnitTest::GetInstance()->current_test_info();
+  std::string msg;
+
+  ::testing::Test::RecordProperty("bench_iterations", u64_str(bs.iterations));
+  ::testing::Test::RecordProperty("bench_batches", u64_str(bs.batches));
+  ::testing::Test::RecordProperty("bench_min_ns", ps_to_ns(bs.min_ps));
+  ::testing::Test::RecordProperty("bench_median_ns", ps_to_ns(bs.median_ps));
+  ::testing::Test::RecordProperty("bench_mean_ns", ps_to_ns(bs.mean_ps));
+  ::testing::Test::RecordProperty("bench_p99_ns", ps_to_ns(bs.p99_ps));
+  ::testing::Test::RecordProperty("bench_ops_per_sec", u64_str(bs.ops_per_sec));
+  printf("[  BENCH   ] %s: %s ns/op (min %s, median %s, p99 %s), %llu ops/s\n",
+	 ti ? ti->name() : "", ps_to_ns(bs.mean_ps).c_str(), ps_to_ns(bs.min_ps).c_str(),
+	 ps_to_ns(bs.median_ps).c_str(), ps_to_ns(bs.p99_ps).c_str(), bs.ops_per_sec);
+  if (!baseline_check_bench(current_test_name(), bs, msg))
+    ADD_FAILURE() << "Performance regression: " << msg;
+}
+
+/* The run time of the test in the kernel is recorded as properties of the
+ * test, and the round trip time of the request too unless it was batched:
+ */
+void gtest_handle_time(const test_time& tt)
+{
+  std::string msg;
+
+  ::testing::Test::RecordProperty("kernel_ns", u64_str(tt.run_ns));
+  ::testing::Test::RecordProperty("kernel_iterations", u64_str(tt.iterations));
+  ::testing::Test::RecordProperty("kernel_iter_max_ns", u64_str(tt.iter_max_ns));
+  if (tt.request_ns)
+    ::testing::Test::RecordProperty("request_ns", u64_str(tt.request_ns));
+  if (!baseline_check_time(current_test_name(), tt, msg))
+    ADD_FAILURE() << "Performance regression: " << msg;
+}
+
+/* Event counts are recorded as properties perf_<event>, eg. perf_cache_misses */
+void gtest_handle_perf(const perf_counts& pc)
+{
+  perf_counts::const_iterator it;
+
+  for (it = pc.begin(); it != pc.end(); ++it) {
+    std::string key = "perf_" + it->first;
+    std::replace(key.begin(), key.end(), '-', '_');
+    ::testing::Test::RecordProperty(key, u64_str(it->second));
+  }
+}
+
+/* The curve of a sweep is recorded as comma separated lists per width,
+ * and printed with the scaling efficiency relative to one thread:
+ */
+void gtest_handle_sweep(const sweep_stats& ss)
+{
+  const ::testing::TestInfo* ti = ::testing::UnitTest::GetInstance()->current_test_info();
+  std::string threads, rate, op_ns;
+  size_t i;
+
+  for (i = 0; i < ss.points.size(); i++) {
+    const sweep_point& pt = ss.points[i];
+    const char* sep = i ? "," : "";
+    double eff = 0;
+
+    threads += sep + u64_str(pt.threads);
+    rate += sep + u64_str(pt.ops_per_sec);
+    op_ns += sep + ps_to_ns(pt.op_ps);
+    if (ss.points[0].ops_per_sec && pt.threads)
+      eff = 100.0 * pt.ops_per_sec / pt.threads / ss.points[0].ops_per_sec;
+    printf("[  SWEEP   ] %s: %u threads: %llu ops/s, %s ns/op, %.0f%% efficiency\n",
+	   ti ? ti->name() : "", pt.threads, pt.ops_per_sec, ps_to_ns(pt.op_ps).c_str(), eff);
+  }
+  ::testing::Test::RecordProperty("sweep_threads", threads);
+  ::testing::Test::RecordProperty("sweep_ops_per_sec", rate);
+  ::testing::Test::RecordProperty("sweep_op_ns", op_ns);
+  baseline_add_sweep(current_test_name(), ss);
+}
+
+/* LCB_F_* flags of the kernel's contention_begin tracepoint, in bit order */
+static const char* lock_type_names[] = { "spin", "read", "write", "rt", "percpu", "mutex" };
+
+static std::string lock_type(unsigned int flags)
+{
+  std::string s;
+  size_t i;
+
+  for (i = 0; i < sizeof(lock_type_names) / sizeof(lock_type_names[0]); i++)
+    if (flags & (1 << i))
+      s += (s.empty() ? "" : ",") + std::string(lock_type_names[i]);
+  return s.empty() ? "lock" : s;
+}
+
+/* The locks waited for the longest are printed, and recorded as the
+ * properties lock_<n>, with the totals as lock_contentions and lock_wait_ns:
+ */
+void gtest_handle_locks(const lock_profile& lp)
+{
+  const ::testing::TestInfo* ti = ::testing::UnitTest::GetInstance()->current_test_info();
+  unsigned long long count = 0, wait_ns = 0;
+  char key[32];
+  size_t i;
+
+  for (i = 0; i < lp.entries.size(); i++) {
+    const lock_contention& lc = lp.entries[i];
+    std::string desc = lc.lock + " (" + lock_type(lc.flags) + ") from " + lc.caller +
+      ": " + u64_str(lc.count) + " waits, " + u64_str(lc.wait_ns) + " ns, max " +
+      u64_str(lc.max_ns) + " ns";
+
+    count += lc.count;
+    wait_ns += lc.wait_ns;
+    snprintf(key, sizeof(key), "lock_%lu", (unsigned long)i);
+    ::testing::Test::RecordProperty(key, desc);
+    printf("[  LOCKS   ] %s: %s\n", ti ? ti->name() : "", desc.c_str());
+  }
+  ::testing::Test::RecordProperty("lock_contentions", u64_str(count));
+  ::testing::Test::RecordProperty("lock_wait_ns", u64_str(wait_ns));
+  if (lp.dropped)
+    printf("[  LOCKS   ] %s: %llu contentions not recorded\n", ti ? ti->name() : "",
+	   lp.dropped);
+}
+
 testing::internal::ParamGenerator<Kernel::ParamType> gtest_query_tests()
 {
   return testing::ValuesIn(ktf::get_test_names());
@@ -27,7 +27,36 @@ TEST(selftest, msg)
 	EXPECT_LONG_EQ(data->val, HYBRID_MSG_VAL);
 }
 
+/* The same with a parameter block that user space fills in place in a
+ * shared buffer, which the kernel side reads without copying:
+ */
+TEST(selftest, msg_large)
+{
+	KTF_USERDATA(self, hybrid_large_params, data);
+	size_t i;
+
+	EXPECT_LONG_EQ(data->val, HYBRID_LARGE_VAL);
+	for (i = 0; i < HYBRID_LARGE_SIZE; i++)
+		if (data->block[i] != HYBRID_LARGE_BYTE(i))
+			break;
+	EXPECT_LONG_EQ(HYBRID_LARGE_SIZE, i);
+}
+
+/* Fail as many assertions as user space asks for, which checks that each
+ * of them is reported:
+ */
+TEST(selftest, many_failures)
+{
+	KTF_USERDATA(self, hybrid_failure_params, data);
+	unsigned long i;
+
+	for (i = 0; i < data->failures; i++)
+		EXPECT_LONG_EQ(data->failures, i);
+}
+
 void add_hybrid_tests(void)
 {
 	ADD_TEST(msg);
+	ADD_TEST(msg_large);
+	ADD_TEST(many_failures);
 }
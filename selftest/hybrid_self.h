@@ -23,4 +23,27 @@ struct hybrid_self_params
 #define HYBRID_MSG "a little test string"
 #define HYBRID_MSG_VAL  0xffUL
 
+/* Constants for the selftest.msg_large test: Too large for a netlink
+ * attribute, so it needs a buffer shared with the kernel.
+ */
+#define HYBRID_LARGE_SIZE (1024 * 1024)
+#define HYBRID_LARGE_VAL  0x5a5aUL
+#define HYBRID_LARGE_BYTE(i) ((unsigned char)((i) * 31 + 7))
+
+struct hybrid_large_params
+{
+	unsigned long val;
+	unsigned char block[HYBRID_LARGE_SIZE];
+};
+
+/* Constants for the selftest.many_failures test: More failures in one
+ * iteration than the queue of failed assertions of a CPU holds.
+ */
+#define HYBRID_FAILURES 100
+
+struct hybrid_failure_params
+{
+	unsigned long failures;
+};
+
 #endif
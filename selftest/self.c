@@ -8,11 +8,23 @@
 #include <linux/mm_types.h>
 #include <linux/slab.h>
 #include <linux/slab_def.h>
+#include <linux/vmalloc.h>
+#include <linux/delay.h>
+#include <linux/in.h>
+#include <linux/kthread.h>
+#include <linux/smp.h>
 
 #include "ktf.h"
 #include "ktf_map.h"
 #include "ktf_cov.h"
+#include "ktf_latency.h"
+#include "ktf_perf.h"
+#include "ktf_pool.h"
+#include "ktf_sweep.h"
+#include "ktf_lockstat.h"
+#include "ktf_netbench.h"
 #include "ktf_syms.h"
+#include "ktf_debugfs.h"
 
 #include "hybrid.h"
 #include "context.h"
@@ -55,6 +67,7 @@ TEST(selftest, simplemap)
 	int i;
 	const int nelems = 3;
 	struct map_test_ctx *mctx = to_mctx(ctx);
+	struct ktf_map_elem *elem;
 	struct ktf_map tm;
 	struct myelem e[nelems];
 
@@ -79,7 +92,12 @@ TEST(selftest, simplemap)
 
 	for (i = 0; i < nelems; i++) {
 		EXPECT_LONG_EQ(nelems - i, ktf_map_size(&tm));
-		EXPECT_ADDR_EQ(&e[i].foo, ktf_map_remove(&tm, e[i].foo.key));
+		elem = ktf_map_remove(&tm, e[i].foo.key);
+		EXPECT_ADDR_EQ(&e[i].foo, elem);
+		if (elem)
+			ktf_map_elem_put(elem);
+		/* Drop our initial reference, which releases the key */
+		ktf_map_elem_put(&e[i].foo);
 	}
 	EXPECT_LONG_EQ(0, ktf_map_size(&tm));
 }
@@ -130,6 +148,122 @@ TEST(selftest, mapref)
 	EXPECT_LONG_EQ(0, ktf_map_size(&tm));
 }
 
+/* --- Hashed map test: lookups via hash index, iteration still ordered --- */
+
+TEST(selftest, hashedmap)
+{
+	int i;
+	const int nelems = 200;
+	struct myelem *e, *ep, *prev = NULL;
+	struct ktf_map_elem *elem;
+	struct ktf_map tm;
+	char key[KTF_MAX_KEY];
+
+	e = kcalloc(nelems, sizeof(*e), GFP_KERNEL);
+	ASSERT_OK_ADDR(e);
+
+	ktf_map_init_flags(&tm, NULL, NULL, KTF_MAP_HASHED);
+	for (i = 0; i < nelems; i++) {
+		sprintf(key, "elem%d", i);
+		EXPECT_INT_EQ(0, ktf_map_elem_init(&e[i].foo, key));
+		EXPECT_INT_EQ(0, ktf_map_insert(&tm, &e[i].foo));
+	}
+	EXPECT_LONG_EQ(nelems, ktf_map_size(&tm));
+	/* Duplicates are still detected */
+	EXPECT_INT_EQ(-EEXIST, ktf_map_insert(&tm, &e[0].foo));
+
+	for (i = 0; i < nelems; i++) {
+		ep = ktf_map_find_entry(&tm, e[i].foo.key, struct myelem, foo);
+		EXPECT_ADDR_EQ(&e[i], ep);
+		if (ep)
+			ktf_map_elem_put(&ep->foo);
+	}
+	EXPECT_FALSE(ktf_map_find(&tm, "nosuchelem"));
+
+	/* Iteration order is that of the keys, as for an unhashed map */
+	i = 0;
+	ktf_map_for_each_entry(ep, &tm, foo) {
+		if (prev)
+			EXPECT_TRUE(strcmp(prev->foo.key, ep->foo.key) < 0);
+		prev = ep;
+		i++;
+	}
+	EXPECT_INT_EQ(nelems, i);
+
+	/* Remove every other element and make sure the rest is still found */
+	for (i = 0; i < nelems; i += 2) {
+		elem = ktf_map_remove(&tm, e[i].foo.key);
+		EXPECT_ADDR_EQ(&e[i].foo, elem);
+		if (elem)
+			ktf_map_elem_put(elem);
+	}
+	for (i = 0; i < nelems; i++) {
+		ep = ktf_map_find_entry(&tm, e[i].foo.key, struct myelem, foo);
+		EXPECT_ADDR_EQ(i & 1 ? &e[i] : NULL, ep);
+		if (ep)
+			ktf_map_elem_put(&ep->foo);
+	}
+
+	ktf_map_delete_all(&tm);
+	EXPECT_LONG_EQ(0, ktf_map_size(&tm));
+	EXPECT_FALSE(tm.htab);
+	for (i = 0; i < nelems; i++)
+		ktf_map_elem_put(&e[i].foo);
+	kfree(e);
+}
+
+/* --- RCU map test: lockless lookups, deferred free --- */
+
+TEST(selftest, rcumap)
+{
+	int i;
+	const int nelems = 3;
+	struct myelem e[nelems], *ep;
+	struct ktf_map tm;
+	struct ktf_map_elem *elem;
+
+	ktf_map_init_flags(&tm, NULL, myelem_free, KTF_MAP_RCU | KTF_MAP_HASHED);
+	EXPECT_INT_EQ(0, ktf_map_elem_init(&e[0].foo, "foo"));
+	EXPECT_INT_EQ(0, ktf_map_elem_init(&e[1].foo, "bar"));
+	EXPECT_INT_EQ(0, ktf_map_elem_init(&e[2].foo, "zax"));
+
+	for (i = 0; i < nelems; i++) {
+		e[i].freed = 0;
+		EXPECT_INT_EQ(0, ktf_map_insert(&tm, &e[i].foo));
+		ktf_map_elem_put(&e[i].foo);
+	}
+
+	for (i = 0; i < nelems; i++) {
+		elem = ktf_map_find(&tm, e[i].foo.key);
+		EXPECT_ADDR_EQ(&e[i].foo, elem);
+		if (elem)
+			ktf_map_elem_put(elem);
+	}
+
+	/* Iteration continues past an element removed under our feet */
+	i = 0;
+	ktf_map_for_each_entry(ep, &tm, foo) {
+		if (ep == &e[0])
+			ktf_map_remove_elem(&tm, &ep->foo);
+		i++;
+	}
+	EXPECT_INT_EQ(nelems, i);
+	EXPECT_LONG_EQ(nelems - 1, ktf_map_size(&tm));
+	EXPECT_FALSE(ktf_map_find(&tm, "foo"));
+
+	/* Removing it again is a no-op */
+	ktf_map_remove_elem(&tm, &e[0].foo);
+	EXPECT_LONG_EQ(nelems - 1, ktf_map_size(&tm));
+
+	ktf_map_delete_all(&tm);
+	EXPECT_LONG_EQ(0, ktf_map_size(&tm));
+
+	/* The free function is only called after a grace period */
+	rcu_barrier();
+	for (i = 0; i < nelems; i++)
+		EXPECT_INT_EQ(1, e[i].freed);
+}
+
 /* --- Test that the expect macros work as if-then-else single statement */
 TEST(selftest, statements)
 {
@@ -177,18 +311,14 @@ TEST(selftest, mapcmpfunc)
 	struct ktf_map tm;
 
 	ktf_map_init(&tm, myelem_cmp, NULL);
-	/* Init map elems with keys "foo" "bar" "zax" */
-	EXPECT_INT_EQ(0, ktf_map_elem_init(&e[0].foo, "foo"));
-	EXPECT_INT_EQ(0, ktf_map_elem_init(&e[1].foo, "bar"));
-	EXPECT_INT_EQ(0, ktf_map_elem_init(&e[2].foo, "zax"));
 
-	/* Insert elems with order values 3, 2, 1. Ensure we see order
+	/* Insert elems with order values 3, 2, 1 as keys. Ensure we see order
 	 * 1, 2, 3 on retrieval.
 	 */
 	for (i = 0; i < nelems; i++) {
 		e[i].order = nelems - i;
-		EXPECT_INT_EQ(0, ktf_map_elem_init(&e[i].foo,
-						   (char *)&e[i].order));
+		EXPECT_INT_EQ(0, ktf_map_elem_init_key(&e[i].foo, &e[i].order,
+						       sizeof(e[i].order)));
 		EXPECT_INT_EQ(0, ktf_map_insert(&tm, &e[i].foo));
 	}
 	i = 1;
@@ -198,6 +328,8 @@ TEST(selftest, mapcmpfunc)
 
 	ktf_map_delete_all(&tm);
 	EXPECT_LONG_EQ(0, ktf_map_size(&tm));
+	for (i = 0; i < nelems; i++)
+		ktf_map_elem_put(&e[i].foo);
 }
 
 /* --- Verify that key name is truncated at KTF_MAX_NAME length --- */
@@ -215,6 +347,25 @@ TEST(selftest, map_keyoverflow)
 	jumbokey_truncated[KTF_MAX_NAME] = '\0';
 	EXPECT_INT_EQ(0, ktf_map_elem_init(&e.foo, jumbokey));
 	EXPECT_TRUE(strcmp(e.foo.key, jumbokey_truncated) == 0);
+	ktf_map_elem_put(&e.foo);
+}
+
+/* --- Verify that elements with the same string key share one copy --- */
+
+TEST(selftest, map_internkey)
+{
+	struct myelem e[2];
+	char key[KTF_MAX_KEY];
+
+	strcpy(key, "interned");
+	EXPECT_INT_EQ(0, ktf_map_elem_init(&e[0].foo, key));
+	EXPECT_INT_EQ(0, ktf_map_elem_init(&e[1].foo, "interned"));
+	EXPECT_ADDR_EQ(e[0].foo.key, e[1].foo.key);
+	/* The key is copied, not referenced in place */
+	strcpy(key, "changed");
+	EXPECT_STREQ("interned", e[0].foo.key);
+	ktf_map_elem_put(&e[0].foo);
+	ktf_map_elem_put(&e[1].foo);
 }
 
 struct mykey {
@@ -257,8 +408,8 @@ TEST(selftest, map_customkey)
 		baseaddr += (i << 2);
 		keys[i].address = baseaddr;
 		keys[i].size = (i + 1) << 2;
-		ASSERT_INT_EQ_GOTO(ktf_map_elem_init(&elems[i].foo,
-						     (char *)&keys[i]),
+		ASSERT_INT_EQ_GOTO(ktf_map_elem_init_key(&elems[i].foo, &keys[i],
+							 sizeof(keys[i])),
 				   0, done);
 		ASSERT_INT_EQ_GOTO(ktf_map_insert(&cm, &elems[i].foo), 0, done);
 	}
@@ -303,8 +454,11 @@ static void add_map_tests(void)
 	ADD_LOOP_TEST(statements, 0, 2);
 	ADD_TEST_TO(dual_handle, simplemap);
 	ADD_TEST_TO(dual_handle, mapref);
+	ADD_TEST(hashedmap);
+	ADD_TEST(rcumap);
 	ADD_TEST_TO(dual_handle, mapcmpfunc);
 	ADD_TEST(map_keyoverflow);
+	ADD_TEST(map_internkey);
 	ADD_TEST(map_customkey);
 
 	terr("-- version check test: --");
@@ -386,6 +540,25 @@ done:
 	KTF_UNREGISTER_OVERRIDE(myfunc, myfunc_override);
 }
 
+/* Overrides can be registered again, and are cheap enough for hot paths */
+TEST(selftest, override_repeat)
+{
+	int i, pass;
+
+	for (pass = 0; pass < 2; pass++) {
+		override_failed = 0;
+		ASSERT_INT_EQ(KTF_REGISTER_OVERRIDE(myfunc, myfunc_override), 0);
+		for (i = 1; i <= 10000; i++)
+			if (myfunc(i))
+				break;
+		KTF_UNREGISTER_OVERRIDE(myfunc, myfunc_override);
+		EXPECT_INT_EQ(10001, i);
+		EXPECT_INT_EQ(0, override_failed);
+	}
+	/* And the original function runs again when unregistered */
+	EXPECT_INT_EQ(5, myfunc(5));
+}
+
 noinline int probesum(int a, int b)
 {
 	tlog(T_INFO, "Adding %d + %d", a, b);
@@ -429,11 +602,38 @@ done:
 	KTF_UNREGISTER_RETURN_PROBE(probesum, probesumhandler);
 }
 
+noinline void latency_measured(void)
+{
+	udelay(10);
+}
+
+TEST(selftest, latency)
+{
+	struct ktf_latency lat;
+	int i;
+
+	ASSERT_INT_EQ(0, ktf_latency_probe(&lat, "latency_measured"));
+	for (i = 0; i < 100; i++)
+		latency_measured();
+	EXPECT_LONG_EQ(100, ktf_latency_count(&lat));
+	EXPECT_LONG_GE(ktf_latency_max(&lat), 10000);
+	/* Percentiles are upper bounds of the histogram buckets */
+	EXPECT_LONG_GE(ktf_latency_percentile(&lat, 500), 10000);
+	EXPECT_LONG_GE(ktf_latency_percentile(&lat, 990),
+		       ktf_latency_percentile(&lat, 500));
+	EXPECT_LATENCY_LE(&lat, 990, 100 * NSEC_PER_MSEC);
+	ktf_latency_reset(&lat);
+	EXPECT_LONG_EQ(0, ktf_latency_count(&lat));
+	ktf_latency_unprobe(&lat);
+}
+
 static void add_probe_tests(void)
 {
 	ADD_TEST(probeentry);
 	ADD_TEST(probereturn);
 	ADD_TEST(override);
+	ADD_TEST(override_repeat);
+	ADD_TEST(latency);
 }
 
 noinline void cov_counted(void)
@@ -457,6 +657,105 @@ TEST(selftest, acov)
 	ktf_cov_disable((THIS_MODULE)->name);
 }
 
+static int cov_snapshot_hits(void *data, const char *module,
+			     const char *function, u32 hits, u32 test_id)
+{
+	if (!test_id && strcmp(function, "cov_counted") == 0)
+		*(u32 *)data = hits;
+	return 0;
+}
+
+TEST(selftest, cov_reset)
+{
+	struct ktf_cov_entry *e;
+	u32 hits = 0, gen;
+
+	ASSERT_INT_EQ(0, ktf_cov_enable((THIS_MODULE)->name, 0));
+	cov_counted();
+	ktf_cov_reset((THIS_MODULE)->name);
+	e = ktf_cov_entry_find((unsigned long)cov_counted, 0);
+	if (e) {
+		EXPECT_INT_EQ(0, ktf_cov_entry_count(e));
+		cov_counted();
+		EXPECT_INT_EQ(1, ktf_cov_entry_count(e));
+		ktf_cov_entry_put(e);
+		EXPECT_INT_EQ(0, ktf_cov_snapshot((THIS_MODULE)->name,
+						  cov_snapshot_hits, &hits));
+		EXPECT_INT_EQ(1, hits);
+
+		/* Only changed counts are reported from a delta query */
+		EXPECT_INT_EQ(0, ktf_cov_delta((THIS_MODULE)->name, 0, &gen,
+					       cov_snapshot_hits, &hits));
+		hits = 0;
+		EXPECT_INT_EQ(0, ktf_cov_delta((THIS_MODULE)->name, gen, &gen,
+					       cov_snapshot_hits, &hits));
+		EXPECT_INT_EQ(0, hits);
+		cov_counted();
+		EXPECT_INT_EQ(0, ktf_cov_delta((THIS_MODULE)->name, gen, &gen,
+					       cov_snapshot_hits, &hits));
+		EXPECT_INT_EQ(2, hits);
+	}
+	ktf_cov_disable((THIS_MODULE)->name);
+}
+
+TEST(selftest, cov_export)
+{
+	struct ktf_cov_export_function *f;
+	struct ktf_cov_export_module *m;
+	struct ktf_cov_export_hdr *hdr;
+	const char *strtab;
+	bool found = false;
+	size_t size;
+	u32 i;
+
+	ASSERT_INT_EQ(0, ktf_cov_enable((THIS_MODULE)->name, 0));
+	cov_counted();
+	hdr = ktf_cov_export(&size);
+	EXPECT_TRUE(hdr);
+	if (hdr) {
+		EXPECT_INT_EQ(KTF_COV_EXPORT_MAGIC, hdr->magic);
+		EXPECT_INT_EQ(size, sizeof(*hdr) + hdr->nr_modules * sizeof(*m) +
+			      hdr->nr_functions * sizeof(*f) + hdr->strtab_size);
+		m = (void *)(hdr + 1);
+		f = (void *)(m + hdr->nr_modules);
+		strtab = (const char *)(f + hdr->nr_functions);
+		for (i = 0; i < hdr->nr_functions; i++) {
+			if (strcmp(strtab + f[i].name, "cov_counted"))
+				continue;
+			EXPECT_STREQ((THIS_MODULE)->name,
+				     strtab + m[f[i].module].name);
+			EXPECT_INT_GE(f[i].hits, 1);
+			found = true;
+		}
+		EXPECT_TRUE(found);
+		vfree(hdr);
+	}
+	ktf_cov_disable((THIS_MODULE)->name);
+}
+
+TEST(selftest, cov_alloc)
+{
+	struct ktf_cov_alloc_stats stats;
+	struct ktf_cov_entry *e;
+	void *p;
+
+	ASSERT_INT_EQ(0, ktf_cov_enable((THIS_MODULE)->name, KTF_COV_OPT_ALLOC));
+	p = doalloc(NULL, 100);
+	kfree(p);
+	e = ktf_cov_entry_find((unsigned long)doalloc, 0);
+	if (e) {
+		EXPECT_TRUE(ktf_cov_entry_alloc_stats(e, &stats));
+		/* The allocation is only seen if kmalloc() calls __kmalloc() */
+		if (stats.count) {
+			EXPECT_INT_GE(stats.bytes, 100);
+			EXPECT_INT_GE(stats.hist[ilog2(100)], 1);
+			EXPECT_INT_GE(stats.latency_ns, stats.max_latency_ns);
+		}
+		ktf_cov_entry_put(e);
+	}
+	ktf_cov_disable((THIS_MODULE)->name);
+}
+
 TEST(selftest, cov)
 {
 	int foundp1 = 0, foundp2 = 0, foundp3 = 0, foundp4 = 0;
@@ -477,13 +776,13 @@ TEST(selftest, cov)
 
 	e = ktf_cov_entry_find((unsigned long)cov_counted, 0);
 	ASSERT_ADDR_NE_GOTO(e, NULL, done);
-	oldcount = e->count;
+	oldcount = ktf_cov_entry_count(e);
 	ktf_cov_entry_put(e);
 	cov_counted();
 	e = ktf_cov_entry_find((unsigned long)cov_counted, 0);
 	ASSERT_ADDR_NE_GOTO(e, NULL, done);
 	if (e) {
-		ASSERT_INT_EQ(e->count, oldcount + 1);
+		ASSERT_INT_EQ(ktf_cov_entry_count(e), oldcount + 1);
 		ktf_cov_entry_put(e);
 	}
 
@@ -547,6 +846,9 @@ done:
 static void add_cov_tests(void)
 {
 	ADD_TEST(acov);
+	ADD_TEST(cov_reset);
+	ADD_TEST(cov_export);
+	ADD_TEST(cov_alloc);
 	/* We still seem to have some subtle issues with the memory coverage test feature,
 	 * as sometimes allocations made by the coverage framework itself,
 	 * for this particular test survives the cleanup function.
@@ -583,9 +885,129 @@ TEST(selftest, thread)
 	ASSERT_INT_EQ(assertions, NUM_TEST_THREADS);
 }
 
+#define NUM_POOL_WORKERS 4
+#define POOL_ROUNDS 100
+
+static atomic_t pool_calls;
+
+KTF_POOL_THREAD(test_pool_thread)
+{
+	/* Released from the barrier only when all workers have arrived */
+	EXPECT_INT_EQ(NUM_POOL_WORKERS, atomic_read(&_pool->arrived));
+	EXPECT_INT_EQ(ktf_thread_pool_cpu(_pool, _id), raw_smp_processor_id());
+	atomic_inc(&pool_calls);
+}
+
+TEST(selftest, thread_pool)
+{
+	struct ktf_thread_pool pool;
+	int i;
+
+	atomic_set(&pool_calls, 0);
+	ASSERT_INT_EQ(0, KTF_THREAD_POOL_INIT(&pool, test_pool_thread, NUM_POOL_WORKERS,
+					      NULL));
+	/* The same workers run every round, and the round is over on return */
+	for (i = 0; i < POOL_ROUNDS; i++) {
+		KTF_THREAD_POOL_RUN(&pool, i);
+		EXPECT_INT_EQ((i + 1) * NUM_POOL_WORKERS, atomic_read(&pool_calls));
+	}
+	KTF_THREAD_POOL_DESTROY(&pool);
+}
+
+#define PARALLEL_ITERATIONS 256
+
+static DECLARE_BITMAP(parallel_running, PARALLEL_ITERATIONS);
+
+/* Counts the runs of each iteration, checked once the loop has finished */
+DECLARE_F(parallel_fixture)
+	atomic_t runs[PARALLEL_ITERATIONS];
+};
+
+SETUP_F(parallel_fixture, parallel_setup)
+{
+	parallel_fixture->ok = true;
+}
+
+TEARDOWN_F(parallel_fixture, parallel_teardown)
+{
+	int i;
+
+	/* Every iteration of the range was run, and only once */
+	for (i = 0; i < PARALLEL_ITERATIONS; i++)
+		EXPECT_INT_EQ(1, atomic_read(&parallel_fixture->runs[i]));
+}
+
+INIT_SHARED_F(parallel_fixture, parallel_setup, parallel_teardown);
+
+TEST_SF(parallel_fixture, selftest, parallel_loop)
+{
+	ASSERT_TRUE(_i >= 0 && _i < PARALLEL_ITERATIONS);
+	atomic_inc(&ctx->runs[_i]);
+	/* Each iteration must be run by one work item only */
+	ASSERT_INT_EQ(0, test_and_set_bit(_i, parallel_running));
+	clear_bit(_i, parallel_running);
+}
+
+/* Assertions from interrupt context are queued and reported by the test */
+static void irq_assert_fn(void *info)
+{
+	struct ktf_test *self = info;
+
+	EXPECT_TRUE(irqs_disabled());
+}
+
+TEST(selftest, irq_assert)
+{
+	on_each_cpu(irq_assert_fn, self, 1);
+	EXPECT_INT_EQ(num_online_cpus(), (int)ktf_get_assertion_count());
+}
+
+static atomic_t shared_setups;
+static int shared_gen;
+
+DECLARE_F(shared_fixture)
+	struct ktf_context *ctx;
+	int gen; /* Setups done when this one was */
+};
+
+SETUP_F(shared_fixture, shared_setup)
+{
+	shared_fixture->ctx = ctx;
+	shared_fixture->gen = atomic_inc_return(&shared_setups);
+	shared_fixture->ok = true;
+}
+
+TEARDOWN_F(shared_fixture, shared_teardown)
+{
+	EXPECT_TRUE(shared_fixture->gen > 0);
+}
+
+INIT_SHARED_F(shared_fixture, shared_setup, shared_teardown);
+
+/* All the iterations share the fixture set up by the first one */
+TEST_SF(shared_fixture, selftest, shared_loop)
+{
+	if (_i == 0)
+		shared_gen = ctx->gen;
+	EXPECT_INT_EQ(shared_gen, ctx->gen);
+	EXPECT_TRUE(!ctx->ctx);
+}
+
+/* Each context has a shared fixture of its own */
+TEST_SF(shared_fixture, selftest, shared_ctx)
+{
+	ASSERT_TRUE(ctx->ctx != NULL);
+	EXPECT_TRUE(ctx->ctx == &s_mctx[1].k || ctx->ctx == &s_mctx[2].k);
+}
+
 static void add_thread_tests(void)
 {
 	ADD_TEST(thread);
+	ADD_TEST(thread_pool);
+	ADD_TEST(irq_assert);
+	ADD_LOOP_TEST(shared_loop, 0, 4);
+	ADD_TEST_TO(dual_handle, shared_ctx);
+	ADD_PARALLEL_LOOP_TEST(parallel_loop, 0, PARALLEL_ITERATIONS);
 }
 
 static int selftest_module_var;
@@ -609,9 +1031,283 @@ TEST(selftest, symbol)
 		       &selftest_module_var);
 }
 
+/* Added along with symbol by ADD_TESTS */
+TEST(selftest, bulk_add)
+{
+	EXPECT_ADDR_EQ(self->handle, &__test_handle);
+	EXPECT_STREQ(self->tclass, "selftest");
+	EXPECT_TRUE(self->id != 0);
+	/* The debugfs files are created in the background */
+	ktf_debugfs_flush();
+	EXPECT_ADDR_NE(self->debugfs.debugfs_run_test, NULL);
+	EXPECT_ADDR_NE(self->debugfs.debugfs_results_test, NULL);
+}
+
+static const struct __test_desc symbol_tests[] = {
+	KTF_TEST_DESC(selftest, symbol),
+	KTF_TEST_DESC(selftest, bulk_add),
+};
+
 static void add_symbol_tests(void)
 {
-	ADD_TEST(symbol);
+	ADD_TESTS(symbol_tests);
+}
+
+static DEFINE_SPINLOCK(bench_lock);
+
+BENCH(selftest, bench_spinlock)
+{
+	u64 n;
+
+	for (n = 0; n < _n; n++) {
+		spin_lock(&bench_lock);
+		spin_unlock(&bench_lock);
+	}
+}
+
+static void bench_udelay(struct ktf_test *self, struct ktf_context *ctx, int _i,
+			 u32 _value, u64 _n)
+{
+	u64 n;
+
+	for (n = 0; n < _n; n++)
+		udelay(10);
+}
+
+TEST(selftest, bench)
+{
+	struct ktf_bench_stats stats;
+
+	ASSERT_INT_EQ(0, ktf_bench_run(self, ctx, _i, _value, bench_udelay, &stats));
+	EXPECT_LONG_EQ(KTF_BENCH_BATCHES, stats.batches);
+	/* About KTF_BENCH_BATCH_NS worth of 10us delays per batch */
+	EXPECT_TRUE(stats.iterations > 0 && stats.iterations <= 200);
+	EXPECT_TRUE(stats.min_ps >= 10000000ULL);
+	EXPECT_TRUE(stats.min_ps <= stats.median_ps);
+	EXPECT_TRUE(stats.median_ps <= stats.p99_ps);
+	EXPECT_TRUE(stats.min_ps <= stats.mean_ps && stats.mean_ps <= stats.p99_ps);
+	EXPECT_TRUE(stats.ops_per_sec > 0 && stats.ops_per_sec <= 100000);
+}
+
+static noinline u64 perf_workload(u64 n)
+{
+	u64 i, sum = 0;
+
+	for (i = 0; i < n; i++)
+		sum += READ_ONCE(i);
+	return sum;
+}
+
+TEST(selftest, perf)
+{
+	struct ktf_perf perf;
+	int ret = ktf_perf_start(&perf, KTF_PERF_INSTRUCTIONS | KTF_PERF_CYCLES);
+
+	if (ret == -EOPNOTSUPP) {
+		tlog(T_INFO, "No hardware performance counters - skipping");
+		return;
+	}
+	ASSERT_INT_EQ(0, ret);
+	ktf_perf_begin(&perf);
+	perf_workload(100000);
+	ktf_perf_end(&perf);
+	ktf_perf_stop(&perf);
+	/* At least one instruction per loop iteration */
+	if (perf.mask & KTF_PERF_INSTRUCTIONS)
+		EXPECT_TRUE(perf.count[ilog2(KTF_PERF_INSTRUCTIONS)] >= 100000);
+	if (perf.mask & KTF_PERF_CYCLES)
+		EXPECT_TRUE(perf.count[ilog2(KTF_PERF_CYCLES)] > 0);
+}
+
+SWEEP(selftest, sweep_spinlock)
+{
+	u64 n;
+
+	for (n = 0; n < _n; n++) {
+		spin_lock(&bench_lock);
+		spin_unlock(&bench_lock);
+	}
+}
+
+static void sweep_local(struct ktf_test *self, struct ktf_context *ctx, int _i,
+			u32 _value, unsigned int _id, u64 _n)
+{
+	perf_workload(_n);
+}
+
+TEST(selftest, sweep)
+{
+	struct ktf_sweep_stats stats;
+	unsigned int i;
+
+	ASSERT_INT_EQ(0, ktf_sweep_run(self, ctx, _i, _value, sweep_local, 0,
+				       10 * NSEC_PER_MSEC, &stats));
+	ASSERT_TRUE(stats.nr_points > 0);
+	EXPECT_INT_EQ(1, stats.points[0].threads);
+	EXPECT_INT_EQ(num_online_cpus(), stats.points[stats.nr_points - 1].threads);
+	for (i = 0; i < stats.nr_points; i++) {
+		EXPECT_TRUE(stats.points[i].ops > 0);
+		EXPECT_TRUE(stats.points[i].elapsed_ns >= 10 * NSEC_PER_MSEC);
+		if (i)
+			EXPECT_TRUE(stats.points[i].threads > stats.points[i - 1].threads);
+	}
+	EXPECT_INT_EQ(100, ktf_sweep_efficiency(&stats, 0));
+	/* Workers that share nothing should scale, even on a busy host */
+	EXPECT_SCALING_GE(&stats, 1);
+}
+
+static DEFINE_MUTEX(lockstat_mutex);
+
+KTF_POOL_THREAD(lockstat_thread)
+{
+	int i;
+
+	for (i = 0; i < 1000; i++) {
+		mutex_lock(&lockstat_mutex);
+		udelay(2);
+		mutex_unlock(&lockstat_mutex);
+	}
+}
+
+TEST(selftest, lockstat)
+{
+	struct ktf_thread_pool pool;
+	struct ktf_lockstat *ls;
+	u64 count = 0;
+	unsigned int i;
+	int ret;
+
+	if (num_online_cpus() < 2) {
+		tlog(T_INFO, "lockstat: Needs 2 CPUs to contend - skipping");
+		return;
+	}
+	ls = ktf_lockstat_start();
+	if (PTR_ERR_OR_ZERO(ls) == -EOPNOTSUPP) {
+		tlog(T_INFO, "lockstat: No contention tracepoints - skipping");
+		return;
+	}
+	ASSERT_FALSE(IS_ERR(ls));
+	ret = KTF_THREAD_POOL_INIT(&pool, lockstat_thread, 2, NULL);
+	if (!ret) {
+		KTF_THREAD_POOL_RUN(&pool, 0);
+		KTF_THREAD_POOL_DESTROY(&pool);
+	}
+	ktf_lockstat_stop(ls);
+	ASSERT_INT_EQ_GOTO(0, ret, out);
+
+	for (i = 0; i < ls->nr_top; i++) {
+		count += ls->top[i].count;
+		if (i)
+			EXPECT_TRUE(ls->top[i].wait_ns <= ls->top[i - 1].wait_ns);
+	}
+	EXPECT_TRUE(count > 0);
+out:
+	ktf_lockstat_free(ls);
+}
+
+/* Both ranks run over loopback in this host, rank 1 in a kthread.
+ * Rank 0 listens on a free port, so that runs do not collide, and starts
+ * rank 1 with it once it is listening.
+ */
+struct netbench_peer {
+	struct ktf_addrinfo ai;
+	struct ktf_netbench_cfg cfg;
+	struct ktf_netbench_result results[2];
+	struct task_struct *task;
+	struct completion done;
+	int ret;
+};
+
+static int netbench_peer_thread(void *data)
+{
+	struct netbench_peer *peer = data;
+
+	peer->ret = ktf_netbench_run(&peer->ai, &peer->cfg, peer->results);
+	complete(&peer->done);
+	return 0;
+}
+
+static void netbench_listening(void *data, u16 port)
+{
+	struct netbench_peer *peer = data;
+
+	peer->cfg.port = port;
+	peer->task = kthread_run(netbench_peer_thread, peer, "netbench_peer");
+}
+
+static void netbench_loopback(struct ktf_test *self, enum ktf_netbench_kind kind,
+			      struct ktf_netbench_result *results,
+			      struct netbench_peer *peer)
+{
+	struct ktf_netbench_cfg cfg = {
+		.kind = kind,
+		.msg_size = 4096,
+		.conns = 2,
+		.duration_ns = 100 * NSEC_PER_MSEC,
+		.listening = netbench_listening,
+		.listening_data = peer,
+	};
+	struct ktf_addrinfo ai = { .n = 2, .rank = 0 };
+	struct sockaddr_in *sin;
+	int i;
+
+	memset(results, 0, 2 * sizeof(*results));
+	memset(peer, 0, sizeof(*peer));
+	for (i = 0; i < 2; i++) {
+		sin = (struct sockaddr_in *)&ai.a[i].addr;
+		sin->sin_family = AF_INET;
+		sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		strcpy(ai.a[i].ifname, "lo");
+	}
+	peer->ai = ai;
+	peer->ai.rank = 1;
+	peer->cfg = cfg;
+	peer->cfg.listening = NULL;
+	init_completion(&peer->done);
+	EXPECT_INT_EQ(0, ktf_netbench_run(&ai, &cfg, results));
+	/* Rank 1 only runs if rank 0 got to listen */
+	ASSERT_ADDR_NE(NULL, peer->task);
+	ASSERT_FALSE(IS_ERR(peer->task));
+	wait_for_completion(&peer->done);
+	EXPECT_INT_EQ(0, peer->ret);
+	EXPECT_INT_EQ(1, peer->results[1].rank);
+}
+
+TEST(selftest, netbench_stream)
+{
+	struct ktf_netbench_result results[2];
+	struct netbench_peer peer;
+
+	netbench_loopback(self, KTF_NETBENCH_STREAM, results, &peer);
+	EXPECT_NET_RATE_GE(&results[1], 1);
+	EXPECT_LONG_EQ(results[0].bytes, results[1].bytes);
+	/* Everything sent by rank 1 was received and counted at rank 0 */
+	EXPECT_LONG_EQ(peer.results[1].bytes, results[1].bytes);
+	EXPECT_LONG_EQ(0, results[0].rtt_max_ns);
+}
+
+TEST(selftest, netbench_rr)
+{
+	struct ktf_netbench_result results[2];
+	struct netbench_peer peer;
+
+	netbench_loopback(self, KTF_NETBENCH_RR, results, &peer);
+	EXPECT_NET_RTT_LE(&results[1], NSEC_PER_SEC);
+	EXPECT_LONG_EQ(peer.results[1].ops, results[1].ops);
+	EXPECT_TRUE(results[1].rtt_min_ns <= results[1].rtt_avg_ns);
+	EXPECT_TRUE(results[1].rtt_avg_ns <= results[1].rtt_max_ns);
+}
+
+static void add_bench_tests(void)
+{
+	ADD_TEST(bench_spinlock);
+	ADD_TEST(bench);
+	ADD_TEST(perf);
+	ADD_TEST(sweep_spinlock);
+	ADD_TEST(sweep);
+	ADD_TEST(lockstat);
+	ADD_TEST(netbench_stream);
+	ADD_TEST(netbench_rr);
 }
 
 static int __init selftest_init(void)
@@ -639,6 +1335,7 @@ static int __init selftest_init(void)
 	add_hybrid_tests();
 	add_context_tests();
 	add_symbol_tests();
+	add_bench_tests();
 	tlog(T_INFO, "selftest: loaded");
 	return 0;
 fail:
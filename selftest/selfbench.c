@@ -0,0 +1,305 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+ *
+ * selfbench.c: Benchmarks of the overhead of KTF itself, to be run with
+ *   user/ktfbench, which also times the requests from user space.
+ */
+#include <linux/module.h>
+#include <linux/vmalloc.h>
+
+#include "ktf.h"
+#include "ktf_map.h"
+#include "ktf_cov.h"
+#include "ktf_sweep.h"
+#include "ktf_syms.h"
+#include "selfbench.h"
+
+MODULE_LICENSE("GPL");
+
+KTF_INIT();
+
+/* The empty tests added by selfbench.query have a handle of their own */
+static KTF_HANDLE_INIT(query_handle);
+
+static int bench_sink;
+
+/* Maps of various sizes and kinds, one at a time */
+struct bench_elem {
+	struct ktf_map_elem elem;
+};
+
+static struct ktf_map bench_map;
+static struct bench_elem *bench_elems; /* bench_size in the map, and one spare */
+static u32 bench_size;
+
+static int map_bench_setup(u32 size, unsigned int flags)
+{
+	char key[KTF_MAX_KEY] = { 0 };
+	u32 i;
+
+	bench_elems = vzalloc((size + 1) * sizeof(*bench_elems));
+	if (!bench_elems)
+		return -ENOMEM;
+	ktf_map_init_flags(&bench_map, NULL, NULL, flags);
+	for (i = 0; i <= size; i++) {
+		snprintf(key, sizeof(key), "key%u", i);
+		if (ktf_map_elem_init(&bench_elems[i].elem, key))
+			goto fail;
+	}
+	for (i = 0; i < size; i++)
+		ktf_map_insert(&bench_map, &bench_elems[i].elem);
+	bench_size = size;
+	return 0;
+fail:
+	/* Release the keys of the elements initialized so far */
+	while (i--)
+		ktf_map_elem_put(&bench_elems[i].elem);
+	vfree(bench_elems);
+	bench_elems = NULL;
+	return -ENOMEM;
+}
+
+static void map_bench_cleanup(unsigned int flags)
+{
+	u32 i;
+
+	ktf_map_delete_all(&bench_map);
+	/* Drop the references from map_bench_setup, the spare's included */
+	for (i = 0; i <= bench_size; i++)
+		ktf_map_elem_put(&bench_elems[i].elem);
+	if (flags & KTF_MAP_RCU)
+		rcu_barrier();
+	vfree(bench_elems);
+	bench_elems = NULL;
+}
+
+/* Look up the elements in an order that jumps around in the map */
+static void map_find_body(struct ktf_test *self, struct ktf_context *ctx, int _i,
+			  u32 _value, u64 _n)
+{
+	struct ktf_map_elem *elem;
+	u32 j = 0;
+	u64 n;
+
+	for (n = 0; n < _n; n++) {
+		elem = ktf_map_find(&bench_map, bench_elems[j].elem.key);
+		if (elem)
+			ktf_map_elem_put(elem);
+		j = (j + 7919) % bench_size;
+	}
+}
+
+/* Insert and remove the spare element */
+static void map_update_body(struct ktf_test *self, struct ktf_context *ctx, int _i,
+			    u32 _value, u64 _n)
+{
+	struct ktf_map_elem *spare = &bench_elems[bench_size].elem;
+	u64 n;
+
+	for (n = 0; n < _n; n++) {
+		ktf_map_insert(&bench_map, spare);
+		ktf_map_remove_elem(&bench_map, spare);
+	}
+}
+
+/* Walk the whole map */
+static void map_iterate_body(struct ktf_test *self, struct ktf_context *ctx, int _i,
+			     u32 _value, u64 _n)
+{
+	struct ktf_map_elem *elem;
+	int cnt = 0;
+	u64 n;
+
+	for (n = 0; n < _n; n++)
+		ktf_map_for_each(elem, &bench_map)
+			cnt++;
+	WRITE_ONCE(bench_sink, cnt);
+}
+
+static void map_bench(struct ktf_test *self, struct ktf_context *ctx, int _i, u32 _value,
+		      ktf_bench_fun fun, u32 size, unsigned int flags)
+{
+	struct ktf_bench_stats stats;
+
+	ASSERT_INT_EQ(0, map_bench_setup(size, flags));
+	ktf_bench_run(self, ctx, _i, _value, fun, &stats);
+	map_bench_cleanup(flags);
+}
+
+/* map_ are plain maps, hmap_ hashed maps and rmap_ hashed maps with RCU lookups */
+#define MAP_BENCH(__testname, __fun, __size, __flags)			\
+	TEST(selfbench, __testname)					\
+	{								\
+		map_bench(self, ctx, _i, _value, __fun, __size, __flags); \
+	}
+
+MAP_BENCH(map_find_16, map_find_body, 16, 0)
+MAP_BENCH(map_find_16384, map_find_body, 16384, 0)
+MAP_BENCH(hmap_find_16, map_find_body, 16, KTF_MAP_HASHED)
+MAP_BENCH(hmap_find_16384, map_find_body, 16384, KTF_MAP_HASHED)
+MAP_BENCH(rmap_find_16384, map_find_body, 16384, KTF_MAP_HASHED | KTF_MAP_RCU)
+MAP_BENCH(map_update_16, map_update_body, 16, 0)
+MAP_BENCH(map_update_16384, map_update_body, 16384, 0)
+MAP_BENCH(hmap_update_16384, map_update_body, 16384, KTF_MAP_HASHED)
+MAP_BENCH(map_iterate_16, map_iterate_body, 16, 0)
+MAP_BENCH(map_iterate_1024, map_iterate_body, 1024, 0)
+MAP_BENCH(rmap_iterate_1024, map_iterate_body, 1024, KTF_MAP_HASHED | KTF_MAP_RCU)
+
+/* Successful assertions, from one thread and from all CPUs at once */
+BENCH(selfbench, assert_pass)
+{
+	u64 n;
+
+	for (n = 0; n < _n; n++)
+		EXPECT_TRUE(n < _n);
+}
+
+SWEEP(selfbench, assert_sweep)
+{
+	u64 n;
+
+	for (n = 0; n < _n; n++)
+		EXPECT_TRUE(n < _n);
+}
+
+/* A function call, plain, while counted by coverage and while overridden */
+noinline int selfbench_callee(int i)
+{
+	return i + 1;
+}
+
+KTF_OVERRIDE(selfbench_callee, selfbench_callee_override)
+{
+	KTF_SET_RETURN_VALUE(1);
+	KTF_OVERRIDE_RETURN;
+}
+
+static void call_body(struct ktf_test *self, struct ktf_context *ctx, int _i,
+		      u32 _value, u64 _n)
+{
+	int sum = 0;
+	u64 n;
+
+	for (n = 0; n < _n; n++)
+		sum += selfbench_callee(n);
+	WRITE_ONCE(bench_sink, sum);
+}
+
+TEST(selfbench, call)
+{
+	struct ktf_bench_stats stats;
+
+	ktf_bench_run(self, ctx, _i, _value, call_body, &stats);
+}
+
+TEST(selfbench, call_cov)
+{
+	struct ktf_bench_stats stats;
+
+	ASSERT_INT_EQ(0, ktf_cov_enable((THIS_MODULE)->name, 0));
+	ktf_bench_run(self, ctx, _i, _value, call_body, &stats);
+	ktf_cov_disable((THIS_MODULE)->name);
+}
+
+TEST(selfbench, call_override)
+{
+	struct ktf_bench_stats stats;
+
+	ASSERT_INT_EQ(0, KTF_REGISTER_OVERRIDE(selfbench_callee, selfbench_callee_override));
+	ktf_bench_run(self, ctx, _i, _value, call_body, &stats);
+	KTF_UNREGISTER_OVERRIDE(selfbench_callee, selfbench_callee_override);
+}
+
+/* Does nothing, so that user space can time the requests to run it */
+TEST(selfbench, run_rtt)
+{
+}
+
+/* Empty tests for timing queries with many tests.  The names are kept
+ * until the module is unloaded, since tests removed again may still be
+ * referenced for a while.
+ */
+static struct __test_desc *query_descs;
+static char (*query_names)[16];
+static unsigned int query_tests;
+
+static void query_dummy(struct ktf_test *self, struct ktf_context *ctx, int _i, u32 _value)
+{
+}
+
+/* Replace the empty tests with the number user space asks for */
+TEST(selfbench, query)
+{
+	KTF_USERDATA(self, selfbench_query_params, data);
+	unsigned int i;
+
+	ASSERT_TRUE(data->tests <= SELFBENCH_QUERY_MAX);
+	if (query_tests)
+		ktf_test_cleanup(&query_handle);
+	query_tests = 0;
+	if (!data->tests)
+		return;
+
+	if (!query_descs) {
+		query_descs = vzalloc(SELFBENCH_QUERY_MAX * sizeof(*query_descs));
+		query_names = vzalloc(SELFBENCH_QUERY_MAX * sizeof(*query_names));
+		if (!query_descs || !query_names) {
+			vfree(query_descs);
+			vfree(query_names);
+			query_descs = NULL;
+			query_names = NULL;
+		}
+		ASSERT_ADDR_NE(NULL, query_descs);
+		for (i = 0; i < SELFBENCH_QUERY_MAX; i++) {
+			snprintf(query_names[i], sizeof(query_names[i]), "q%05u", i);
+			query_descs[i].tclass = SELFBENCH_QUERY_SET;
+			query_descs[i].name = query_names[i];
+			query_descs[i].file = __FILE__;
+			query_descs[i].fun = query_dummy;
+		}
+	}
+	_ktf_add_tests(query_descs, data->tests, &query_handle);
+	query_tests = data->tests;
+}
+
+static const struct __test_desc selfbench_tests[] = {
+	KTF_TEST_DESC(selfbench, map_find_16),
+	KTF_TEST_DESC(selfbench, map_find_16384),
+	KTF_TEST_DESC(selfbench, hmap_find_16),
+	KTF_TEST_DESC(selfbench, hmap_find_16384),
+	KTF_TEST_DESC(selfbench, rmap_find_16384),
+	KTF_TEST_DESC(selfbench, map_update_16),
+	KTF_TEST_DESC(selfbench, map_update_16384),
+	KTF_TEST_DESC(selfbench, hmap_update_16384),
+	KTF_TEST_DESC(selfbench, map_iterate_16),
+	KTF_TEST_DESC(selfbench, map_iterate_1024),
+	KTF_TEST_DESC(selfbench, rmap_iterate_1024),
+	KTF_TEST_DESC(selfbench, assert_pass),
+	KTF_TEST_DESC(selfbench, assert_sweep),
+	KTF_TEST_DESC(selfbench, call),
+	KTF_TEST_DESC(selfbench, call_cov),
+	KTF_TEST_DESC(selfbench, call_override),
+	KTF_TEST_DESC(selfbench, run_rtt),
+	KTF_TEST_DESC(selfbench, query),
+};
+
+static int __init selfbench_init(void)
+{
+	ktf_resolve_symbols();
+	ADD_TESTS(selfbench_tests);
+	tlog(T_INFO, "selfbench: loaded");
+	return 0;
+}
+
+static void __exit selfbench_exit(void)
+{
+	KTF_HANDLE_CLEANUP(query_handle);
+	KTF_CLEANUP();
+	vfree(query_descs);
+	vfree(query_names);
+	tlog(T_INFO, "selfbench: unloaded");
+}
+
+module_init(selfbench_init);
+module_exit(selfbench_exit);
@@ -0,0 +1,23 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+ *
+ * selfbench.h: The data structure passed between user level and kernel for the
+ *  hybrid KTF self benchmarks. Included both from user space and kernel space and
+ *  needs to be a C struct.
+ */
+
+#ifndef KTF_SELFBENCH_H
+#define KTF_SELFBENCH_H
+
+/* Test case of the empty tests added for timing queries */
+#define SELFBENCH_QUERY_SET "selfbench_query"
+#define SELFBENCH_QUERY_MAX 20000
+
+/* For selfbench.query: Have this many empty tests in SELFBENCH_QUERY_SET */
+struct selfbench_query_params
+{
+	unsigned int tests;
+};
+
+#endif
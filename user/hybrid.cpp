@@ -9,6 +9,7 @@
 
 #include "ktf.h"
 #include <string.h>
+#include <gtest/gtest-spi.h>
 
 extern "C" {
 #include "../selftest/hybrid_self.h"
@@ -37,3 +38,40 @@ HTEST(selftest, msg)
   /* and here.. */
   EXPECT_TRUE(true);
 }
+
+/* A parameter block too large to send through netlink - it is filled in
+ * a buffer shared with the kernel, which reads it in place:
+ */
+HTEST(selftest, msg_large)
+{
+  KTF_USERDATA(self, hybrid_large_params, data);
+
+  data->val = HYBRID_LARGE_VAL;
+  for (size_t i = 0; i < HYBRID_LARGE_SIZE; i++)
+    data->block[i] = HYBRID_LARGE_BYTE(i);
+
+  ktf::run(self);
+}
+
+/* The kernel side fails more assertions than it can queue per CPU, and
+ * each failure must still be reported:
+ */
+HTEST(selftest, many_failures)
+{
+  KTF_USERDATA(self, hybrid_failure_params, data);
+  ::testing::TestPartResultArray results;
+  int failed = 0;
+
+  data->failures = HYBRID_FAILURES;
+  {
+    ::testing::ScopedFakeTestPartResultReporter
+      reporter(::testing::ScopedFakeTestPartResultReporter::INTERCEPT_ALL_THREADS,
+	       &results);
+
+    ktf::run(self);
+  }
+  for (int i = 0; i < results.size(); i++)
+    if (results.GetTestPartResult(i).failed())
+      failed++;
+  EXPECT_EQ(HYBRID_FAILURES, failed);
+}
@@ -0,0 +1,100 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+ *
+ * ktfbench.cpp: Runs the KTF self benchmarks in selftest/selfbench.ko,
+ *   and times the requests to the kernel for the ones with a user part.
+ *   Use --gtest_filter=selfbench.* to only run the benchmarks.
+ */
+#include <stdio.h>
+#include <time.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <ktf.h>
+
+extern "C" {
+#include "../selftest/selfbench.h"
+}
+
+static const int rtt_rounds = 1000;
+static const int query_rounds = 10;
+
+static unsigned long long now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Print the spread of times in ns, and record it with the current test */
+static void report_times(const std::string& what, std::vector<unsigned long long>& t)
+{
+  unsigned long long min, median, p99;
+
+  if (t.empty())
+    return;
+  std::sort(t.begin(), t.end());
+  min = t[0];
+  median = t[t.size() / 2];
+  p99 = t[t.size() * 99 / 100];
+  printf("%-20s %8zu rounds: min %llu ns, median %llu ns, p99 %llu ns\n",
+	 what.c_str(), t.size(), min, median, p99);
+  ::testing::Test::RecordProperty(what + "_min_ns", std::to_string(min));
+  ::testing::Test::RecordProperty(what + "_median_ns", std::to_string(median));
+  ::testing::Test::RecordProperty(what + "_p99_ns", std::to_string(p99));
+}
+
+/* Round trips of requests to run a kernel test that does nothing */
+HTEST(selfbench, run_rtt)
+{
+  std::vector<unsigned long long> times;
+
+  for (int i = 0; i < rtt_rounds; i++) {
+    unsigned long long start = now_ns();
+
+    ktf::run(self);
+    times.push_back(now_ns() - start);
+  }
+  report_times("run_rtt", times);
+}
+
+/* Queries of the kernel's tests, with more and more empty tests added */
+HTEST(selfbench, query)
+{
+  KTF_USERDATA(self, selfbench_query_params, data);
+  static const unsigned int counts[] = { 0, 1000, 10000 };
+  int base = 0;
+
+  for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+    std::vector<unsigned long long> times;
+
+    data->tests = counts[i];
+    ktf::run(self);
+    for (int j = 0; j < query_rounds; j++) {
+      unsigned long long ns;
+      int tests = ktf::time_query(ns);
+
+      ASSERT_LE(0, tests);
+      if (!i)
+	base = tests;
+      else
+	EXPECT_EQ(base + (int)counts[i], tests);
+      times.push_back(ns);
+    }
+    report_times("query_" + std::to_string(counts[i]), times);
+  }
+
+  /* Leave the kernel with just its own tests again */
+  data->tests = 0;
+  ktf::run(self);
+}
+
+int main (int argc, char** argv)
+{
+  ktf::setup();
+  testing::InitGoogleTest(&argc,argv);
+
+  return RUN_ALL_TESTS();
+}
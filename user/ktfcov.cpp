@@ -10,6 +10,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <algorithm>
+#include <map>
 #include "ktf.h"
 #include "../kernel/ktf_unlproto.h"
 
@@ -18,7 +24,181 @@ using namespace std;
 void
 usage(char *progname)
 {
-	cerr << "Usage: " << progname << " [-e module[-m]] [-d module]\n";
+	cerr << "Usage: " << progname << " [-e modules[-m][-a][-k][-t]] [-d modules] [-r modules] [-s modules]\n"
+	     << "       [-l modules] [-g modules] [-w modules [-i seconds] [-n lines]]\n"
+	     << "  modules: comma separated list of module names, may contain '*' and '?'\n"
+	     << "  -r: reset call counts, -s: show call counts\n"
+	     << "  -l: write call counts as an lcov tracefile, -g: summary per module\n"
+	     << "  -t: also count calls per test (with -e)\n"
+	     << "  -a: profile allocations per function (with -e)\n"
+	     << "  -w: show the most called functions every -i seconds (default 1),\n"
+	     << "      -n lines (default 20)\n";
+}
+
+static int
+show_coverage(std::string modname)
+{
+  std::vector<ktf::cov_hit> hits;
+  int ret = ktf::coverage_snapshot(modname, hits);
+
+  for (std::vector<ktf::cov_hit>::iterator it = hits.begin(); it != hits.end(); ++it) {
+	if (it->test.empty())
+		printf("%-20s %-40s %10u\n", it->module.c_str(), it->function.c_str(),
+		       it->hits);
+	else
+		printf("%-20s %-40s %10u %s\n", it->module.c_str(), it->function.c_str(),
+		       it->hits, it->test.c_str());
+  }
+  return ret;
+}
+
+struct cov_rate
+{
+  double rate;
+  const ktf::cov_hit* hit;
+};
+
+static bool
+by_rate(const cov_rate& a, const cov_rate& b)
+{
+  return a.rate > b.rate;
+}
+
+/* Poll for the counts that changed since the previous poll only, to keep
+ * the overhead low enough to leave running:
+ */
+static int
+monitor_coverage(std::string modname, unsigned int interval, unsigned int lines)
+{
+  std::map<std::string, unsigned int> last; /* Count by module/function */
+  struct timespec prev, now;
+  unsigned int gen = 0;
+  bool first = true; /* The first poll gets all counts since enable */
+  int ret;
+
+  clock_gettime(CLOCK_MONOTONIC, &prev);
+  for (;;) {
+	std::vector<ktf::cov_hit> hits;
+	std::vector<cov_rate> rates;
+
+	ret = ktf::coverage_delta(modname, gen, hits);
+	if (ret)
+		return ret;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double elapsed = (now.tv_sec - prev.tv_sec) + (now.tv_nsec - prev.tv_nsec) / 1e9;
+	prev = now;
+	for (std::vector<ktf::cov_hit>::iterator it = hits.begin(); it != hits.end(); ++it) {
+		unsigned int& count = last[it->module + "/" + it->function];
+		/* Counts start over from 0 after a reset */
+		unsigned int calls = it->hits >= count ? it->hits - count : it->hits;
+		cov_rate r = { calls / elapsed, &*it };
+
+		count = it->hits;
+		if (calls)
+			rates.push_back(r);
+	}
+	if (!first) {
+		std::sort(rates.begin(), rates.end(), by_rate);
+		printf("\033[H\033[2J%u functions called in the last %.1fs (generation %u)\n\n",
+		       (unsigned int)rates.size(), elapsed, gen);
+		printf("%-20s %-40s %12s %10s\n", "MODULE", "FUNCTION", "CALLS/S", "COUNT");
+		for (unsigned int i = 0; i < rates.size() && i < lines; i++)
+			printf("%-20s %-40s %12.1f %10u\n", rates[i].hit->module.c_str(),
+			       rates[i].hit->function.c_str(), rates[i].rate, rates[i].hit->hits);
+		fflush(stdout);
+	}
+	first = false;
+	sleep(interval);
+  }
+  return 0;
+}
+
+static bool
+match_module(const std::string& modnames, const char* module)
+{
+  size_t pos = 0, end;
+
+  do {
+	end = modnames.find(',', pos);
+	std::string pat = modnames.substr(pos, end == std::string::npos ? end : end - pos);
+	if (fnmatch(pat.c_str(), module, 0) == 0)
+		return true;
+	pos = end + 1;
+  } while (end != std::string::npos);
+  return false;
+}
+
+/* Map the binary coverage export - cheap enough to poll: */
+static struct ktf_cov_export_hdr*
+map_export(size_t* size)
+{
+  std::string path = std::string("/sys/kernel/debug/") + KTF_COV_EXPORT_FILE;
+  struct ktf_cov_export_hdr hdr, *map;
+  int fd = open(path.c_str(), O_RDONLY);
+
+  if (fd < 0) {
+	perror(path.c_str());
+	return NULL;
+  }
+  /* The whole snapshot is taken at open, the header tells the size */
+  if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+      hdr.magic != KTF_COV_EXPORT_MAGIC || hdr.version != KTF_COV_EXPORT_VERSION) {
+	cerr << path << ": Unsupported coverage format\n";
+	close(fd);
+	return NULL;
+  }
+  *size = sizeof(hdr) + hdr.nr_modules * sizeof(struct ktf_cov_export_module) +
+	hdr.nr_functions * sizeof(struct ktf_cov_export_function) + hdr.strtab_size;
+  map = (struct ktf_cov_export_hdr*)mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+	perror("mmap");
+	return NULL;
+  }
+  return map;
+}
+
+static int
+export_coverage(std::string modname, bool lcov)
+{
+  size_t size;
+  struct ktf_cov_export_hdr* hdr = map_export(&size);
+
+  if (!hdr)
+	return -1;
+
+  struct ktf_cov_export_module* mods = (struct ktf_cov_export_module*)(hdr + 1);
+  struct ktf_cov_export_function* funcs =
+	(struct ktf_cov_export_function*)(mods + hdr->nr_modules);
+  const char* strtab = (const char*)(funcs + hdr->nr_functions);
+
+  for (unsigned int m = 0; m < hdr->nr_modules; m++) {
+	const char* module = strtab + mods[m].name;
+	unsigned int called = 0;
+
+	if (!match_module(modname, module))
+		continue;
+	if (lcov)
+		printf("TN:\nSF:%s\n", module);
+	/* No line information, but lcov needs a FN record for each FNDA */
+	for (unsigned int f = 0; f < hdr->nr_functions; f++) {
+		if (funcs[f].module != m)
+			continue;
+		if (funcs[f].hits)
+			called++;
+		if (lcov)
+			printf("FN:0,%s\nFNDA:%u,%s\n", strtab + funcs[f].name,
+			       funcs[f].hits, strtab + funcs[f].name);
+	}
+	if (lcov)
+		printf("FNF:%u\nFNH:%u\nend_of_record\n", mods[m].nr_functions, called);
+	else
+		printf("%s: Functions executed:%.2f%% of %u\n", module,
+		       mods[m].nr_functions ? 100.0 * called / mods[m].nr_functions : 0.0,
+		       mods[m].nr_functions);
+  }
+  munmap(hdr, size);
+  return 0;
 }
 
 int main (int argc, char** argv)
@@ -27,6 +207,8 @@ int main (int argc, char** argv)
   unsigned int cov_opts = 0;
   std::string modname = std::string();
   bool enable = false;
+  char action = 0;
+  unsigned int interval = 1, lines = 20;
 
   ktf::setup();
   testing::InitGoogleTest(&argc,argv);
@@ -36,32 +218,57 @@ int main (int argc, char** argv)
 	return -1;
   }
 
-  while ((opt = getopt(argc, argv, "e:d:m")) != -1) {
+  while ((opt = getopt(argc, argv, "e:d:r:s:l:g:w:i:n:makt")) != -1) {
 	switch (opt) {
 	case 'e':
-		nopts++;
-		enable = true;
-		modname = optarg;
-		break;
 	case 'd':
+	case 'r':
+	case 's':
+	case 'l':
+	case 'g':
+	case 'w':
 		nopts++;
-		enable = false;
+		action = opt;
+		enable = opt == 'e';
 		modname = optarg;
 		break;
 	case 'm':
 		cov_opts |= KTF_COV_OPT_MEM;
 		break;
+	case 'a':
+		cov_opts |= KTF_COV_OPT_ALLOC;
+		break;
+	case 'k':
+		cov_opts |= KTF_COV_OPT_KPROBE;
+		break;
+	case 't':
+		cov_opts |= KTF_COV_OPT_TEST;
+		break;
+	case 'i':
+		interval = atoi(optarg);
+		break;
+	case 'n':
+		lines = atoi(optarg);
+		break;
 	default:
 		cerr << "Unknown option '" << char(optopt) << "'";
 		return -1;
 	}
   }
-  /* Either enable or disable must be specified, and -m is only valid
-   * for enable.
+  /* Exactly one of enable, disable, reset, show or export must be specified,
+   * and -m/-a/-k/-t are only valid for enable.
    */
   if (modname.size() == 0 || nopts != 1 || (cov_opts && !enable)) {
 	usage(argv[0]);
 	return -1;
   }
+  if (action == 'r')
+	return ktf::reset_coverage(modname);
+  if (action == 's')
+	return show_coverage(modname);
+  if (action == 'l' || action == 'g')
+	return export_coverage(modname, action == 'l');
+  if (action == 'w')
+	return monitor_coverage(modname, interval ? interval : 1, lines);
   return ktf::set_coverage(modname, cov_opts, enable);
 }
@@ -8,12 +8,115 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
 #include <ktf.h>
 
+/* With KTF_SLOWEST=n in the environment, list the n tests that took longest
+ * to run in the kernel at the end, with the time spent outside the kernel
+ * for tests that were not run as part of a batch:
+ */
+class SlowestTests : public ::testing::EmptyTestEventListener
+{
+public:
+  SlowestTests(size_t n) : n(n) {}
+
+  virtual void OnTestEnd(const ::testing::TestInfo& ti)
+  {
+    const ::testing::TestResult* r = ti.result();
+    timed t;
+
+    t.kernel_ns = t.request_ns = 0;
+    for (int i = 0; i < r->test_property_count(); i++) {
+      const ::testing::TestProperty& p = r->GetTestProperty(i);
+      if (!strcmp(p.key(), "kernel_ns"))
+	t.kernel_ns = strtoull(p.value(), NULL, 0);
+      else if (!strcmp(p.key(), "request_ns"))
+	t.request_ns = strtoull(p.value(), NULL, 0);
+    }
+    if (!t.kernel_ns)
+      return;
+    t.name = std::string(ti.test_case_name()) + "." + ti.name();
+    tests.push_back(t);
+  }
+
+  virtual void OnTestProgramEnd(const ::testing::UnitTest& ut)
+  {
+    std::vector<timed>::iterator it;
+
+    std::sort(tests.begin(), tests.end(), by_kernel_time);
+    if (tests.size() > n)
+      tests.resize(n);
+    if (tests.empty())
+      return;
+    printf("Slowest %zu kernel tests:\n%12s %12s  %s\n", tests.size(),
+	   "kernel us", "overhead us", "test");
+    for (it = tests.begin(); it != tests.end(); ++it) {
+      if (it->request_ns > it->kernel_ns)
+	printf("%12.1f %12.1f  %s\n", it->kernel_ns / 1000.0,
+	       (it->request_ns - it->kernel_ns) / 1000.0, it->name.c_str());
+      else
+	printf("%12.1f %12s  %s\n", it->kernel_ns / 1000.0, "-", it->name.c_str());
+    }
+  }
+
+private:
+  struct timed
+  {
+    std::string name;
+    unsigned long long kernel_ns;
+    unsigned long long request_ns;
+  };
+
+  static bool by_kernel_time(const timed& a, const timed& b)
+  {
+    return a.kernel_ns > b.kernel_ns;
+  }
+
+  size_t n;
+  std::vector<timed> tests;
+};
+
 int main (int argc, char** argv)
 {
+  const char* slowest = getenv("KTF_SLOWEST");
+  const char* baseline = NULL;
+  double tolerance = getenv("KTF_TOLERANCE") ? strtod(getenv("KTF_TOLERANCE"), NULL) : 10.0;
+
   ktf::setup();
   testing::InitGoogleTest(&argc,argv);
 
+  /* These options override the corresponding environment variables:
+   *   --ktf_perf=<events>     KTF_PERF, see ktf::set_perf_events
+   *   --ktf_results=<file>    KTF_RESULTS, see ktf::set_results_file
+   *   --ktf_baseline=<file>   KTF_BASELINE, see ktf::set_baseline
+   *   --ktf_tolerance=<pct>   KTF_TOLERANCE
+   */
+  for (int i = 1; i < argc; i++) {
+    if (!strncmp(argv[i], "--ktf_perf=", 11) && ktf::set_perf_events(argv[i] + 11))
+      return 1;
+    else if (!strncmp(argv[i], "--ktf_results=", 14))
+      ktf::set_results_file(argv[i] + 14);
+    else if (!strncmp(argv[i], "--ktf_baseline=", 15))
+      baseline = argv[i] + 15;
+    else if (!strncmp(argv[i], "--ktf_tolerance=", 16)) {
+      tolerance = strtod(argv[i] + 16, NULL);
+      if (!baseline)
+	baseline = getenv("KTF_BASELINE");
+    }
+  }
+  if (baseline) {
+    int ret = ktf::set_baseline(baseline, tolerance);
+    if (ret) {
+      fprintf(stderr, "Unable to read baseline %s: %s\n", baseline, strerror(-ret));
+      return 1;
+    }
+  }
+
+  if (slowest && strtoul(slowest, NULL, 0) > 0)
+    ::testing::UnitTest::GetInstance()->listeners().Append(
+	new SlowestTests(strtoul(slowest, NULL, 0)));
   return RUN_ALL_TESTS();
 }
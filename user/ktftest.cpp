@@ -23,16 +23,28 @@ void selftest_configure()
   /* First configure two contexts provided by the kernel part: */
   p.magic = CONTEXT_MAGIC1;
   KTF_CONTEXT_CFG("context1", "context_type_1", test_parameter_block, &p);
-  p.magic = CONTEXT_MAGIC2;
-  KTF_CONTEXT_CFG("context2", "context_type_2", test_parameter_block, &p);
 
-  /* Configure a 3rd, dynamically created context, using CONTEXT3_TYPE_ID
-   * which the kernel part has enabled for dynamic creation of contexts
-   * from user space (see kernel/context.c: add_context_tests()
-   * for details of setup)
+  /* The second one together with a 3rd, dynamically created context in a
+   * single request. The 3rd uses CONTEXT3_TYPE_ID, which the kernel part
+   * has enabled for dynamic creation of contexts from user space
+   * (see kernel/context.c: add_context_tests() for details of setup)
    */
-  p.magic = CONTEXT_MAGIC3;
-  KTF_CONTEXT_CFG("context3", "context_type_3", test_parameter_block, &p);
+  struct test_parameter_block p2 = p, p3 = p;
+  p2.magic = CONTEXT_MAGIC2;
+  p3.magic = CONTEXT_MAGIC3;
+
+  std::vector<ktf::context_cfg> cfgs(2);
+  cfgs[0].context = "context2";
+  cfgs[0].type_name = "context_type_2";
+  cfgs[0].data = &p2;
+  cfgs[0].data_sz = sizeof(p2);
+  cfgs[1].context = "context3";
+  cfgs[1].type_name = "context_type_3";
+  cfgs[1].data = &p3;
+  cfgs[1].data_sz = sizeof(p3);
+  EXPECT_EQ(0, ktf::configure_contexts(cfgs));
+  EXPECT_EQ(0, cfgs[0].stat);
+  EXPECT_EQ(0, cfgs[1].stat);
 }
 
 